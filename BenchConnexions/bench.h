@@ -0,0 +1,80 @@
+//
+//  bench.h
+//  BenchConnexions
+//
+//  Created by Alex Nichol on 12/4/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef BenchConnexions_bench_h
+#define BenchConnexions_bench_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../ClientConnexions/ksockets.h"
+
+#define BENCH_SERVER_ECHO 0
+#define BENCH_SERVER_SINK 1
+#define BENCH_SERVER_HOLD 2 // accept and keep idle connections until the peer closes
+#define BENCH_SERVER_STALL 3 // like HOLD, but never read, so the peer's writes back up
+#define BENCH_SERVER_SOURCE 4 // write as fast as the peer reads until it closes
+
+typedef struct {
+    int fd;
+    uint16_t port;
+    int mode;
+    pthread_t thread;
+    volatile int stopping;
+} bench_server_t;
+
+typedef struct {
+    uint64_t * samples;
+    size_t count;
+    size_t alloc;
+} bench_samples_t;
+
+// benchmarks
+int bench_churn_main(int argc, const char * argv[]);
+int bench_eyeballs_main(int argc, const char * argv[]);
+int bench_ring_main(int argc, const char * argv[]);
+int bench_capture_main(int argc, const char * argv[]);
+int bench_replay_main(int argc, const char * argv[]);
+int bench_contention_main(int argc, const char * argv[]);
+int bench_unload_main(int argc, const char * argv[]);
+int bench_fairness_main(int argc, const char * argv[]);
+int bench_codec_main(int argc, const char * argv[]);
+int bench_sendfile_main(int argc, const char * argv[]);
+int bench_ttfb_main(int argc, const char * argv[]);
+
+// loopback server
+int bench_server_start(bench_server_t * server, int mode);
+void bench_server_stop(bench_server_t * server);
+
+// both ends of every loopback connection live in this process
+int bench_raise_fd_limit(int needed);
+
+// timing and samples
+uint64_t bench_now_ns();
+void bench_samples_init(bench_samples_t * samples);
+void bench_samples_add(bench_samples_t * samples, uint64_t value);
+void bench_samples_merge(bench_samples_t * samples, const bench_samples_t * other);
+uint64_t bench_samples_percentile(bench_samples_t * samples, double percentile); // sorts in place
+void bench_samples_free(bench_samples_t * samples);
+
+// ksocket helpers
+extern int bench_ksocket_mode; // KSOCKET_MODE_STREAM unless -m says otherwise
+extern int bench_ksocket_rings; // attach shared rings to every ksocket (-m ring)
+extern int bench_ksocket_timestamps; // stamp every frame for per-stage latency (-T)
+int bench_ksocket_open(uint16_t port);
+int bench_ksocket_read_exact(int fd, size_t length);
+
+// the pipeline benchmark's connections: ksockets, or plain TCP with -m tcp
+extern int bench_plain_tcp;
+int bench_conn_open(uint16_t port);
+int bench_conn_send(int fd, const void * buff, size_t length);
+int bench_conn_read_exact(int fd, size_t length);
+void bench_conn_close(int fd);
+
+#endif
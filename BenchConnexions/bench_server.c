@@ -0,0 +1,212 @@
+//
+//  bench_server.c
+//  BenchConnexions
+//
+//  Created by Alex Nichol on 12/4/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "bench.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+
+typedef struct {
+    int fd;
+    int mode;
+} bench_client_t;
+
+static void * bench_server_main(void * arg);
+static void * bench_server_hold_main(void * arg);
+static void * bench_client_main(void * arg);
+static int bench_read_fully(int fd, void * buff, size_t len);
+static int bench_write_fully(int fd, const void * buff, size_t len);
+
+int bench_server_start(bench_server_t * server, int mode) {
+    bzero(server, sizeof(bench_server_t));
+    server->mode = mode;
+    server->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->fd < 0) return -1;
+
+    int yes = 1;
+    setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(server->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(server->fd);
+        return -1;
+    }
+    if (listen(server->fd, 1024)) {
+        close(server->fd);
+        return -1;
+    }
+#ifdef TCP_FASTOPEN
+    if (mode == BENCH_SERVER_ECHO) {
+        // where the system allows it, SYNs from connexionsd carry early data
+        int queue = 1024;
+        setsockopt(server->fd, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue));
+    }
+#endif
+    socklen_t addrLen = sizeof(addr);
+    if (getsockname(server->fd, (struct sockaddr *)&addr, &addrLen)) {
+        close(server->fd);
+        return -1;
+    }
+    server->port = ntohs(addr.sin_port);
+
+    int holds = mode == BENCH_SERVER_HOLD || mode == BENCH_SERVER_STALL;
+    void * (*main)(void *) = holds ? bench_server_hold_main : bench_server_main;
+    if (pthread_create(&server->thread, NULL, main, server)) {
+        close(server->fd);
+        return -1;
+    }
+    return 0;
+}
+
+void bench_server_stop(bench_server_t * server) {
+    server->stopping = 1;
+    pthread_join(server->thread, NULL);
+    close(server->fd);
+}
+
+#pragma mark - Private -
+
+static void * bench_server_main(void * arg) {
+    bench_server_t * server = (bench_server_t *)arg;
+    while (!server->stopping) {
+        struct pollfd pfd;
+        pfd.fd = server->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) <= 0) continue;
+
+        int fd = accept(server->fd, NULL, NULL);
+        if (fd < 0) continue;
+        int yes = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+        bench_client_t * client = (bench_client_t *)malloc(sizeof(bench_client_t));
+        client->fd = fd;
+        client->mode = server->mode;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, bench_client_main, client)) {
+            close(fd);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+static void * bench_server_hold_main(void * arg) {
+    // a single poll() loop holds every idle connection, since a thread per
+    // connection won't scale to 50k of them
+    bench_server_t * server = (bench_server_t *)arg;
+    fcntl(server->fd, F_SETFL, fcntl(server->fd, F_GETFL) | O_NONBLOCK);
+    size_t count = 1, alloc = 1024;
+    struct pollfd * fds = (struct pollfd *)malloc(sizeof(struct pollfd) * alloc);
+    fds[0].fd = server->fd;
+    fds[0].events = POLLIN;
+    while (!server->stopping) {
+        if (poll(fds, (nfds_t)count, 100) <= 0) continue;
+        for (size_t i = count - 1; i > 0; i--) {
+            if (!fds[i].revents) continue;
+            char buff[512];
+            // stalled connections only hear about errors and hangups
+            if (server->mode == BENCH_SERVER_HOLD && read(fds[i].fd, buff, sizeof(buff)) > 0) continue;
+            close(fds[i].fd);
+            fds[i] = fds[--count];
+        }
+        while (fds[0].revents & POLLIN) {
+            int fd = accept(server->fd, NULL, NULL);
+            if (fd < 0) break;
+            if (count == alloc) {
+                alloc *= 2;
+                fds = (struct pollfd *)realloc(fds, sizeof(struct pollfd) * alloc);
+            }
+            if (server->mode == BENCH_SERVER_STALL) {
+                // fill up after a few segments instead of megabytes
+                int size = 4096;
+                setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+            }
+            fds[count].fd = fd;
+            fds[count].events = server->mode == BENCH_SERVER_STALL ? 0 : POLLIN;
+            fds[count].revents = 0;
+            count++;
+        }
+    }
+    for (size_t i = 1; i < count; i++) {
+        close(fds[i].fd);
+    }
+    free(fds);
+    return NULL;
+}
+
+static void * bench_client_main(void * arg) {
+    bench_client_t * client = (bench_client_t *)arg;
+    char * buff = (char *)malloc(65536);
+    if (client->mode == BENCH_SERVER_ECHO) {
+        while (1) {
+            ssize_t got = read(client->fd, buff, 65536);
+            if (got <= 0) break;
+            if (bench_write_fully(client->fd, buff, got)) break;
+        }
+    } else if (client->mode == BENCH_SERVER_SOURCE) {
+        // the peer closing is the only way this ends
+#ifdef SO_NOSIGPIPE
+        int yes = 1;
+        setsockopt(client->fd, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+        memset(buff, 'k', 65536);
+        while (!bench_write_fully(client->fd, buff, 65536));
+    } else {
+        // sink: an 8-byte big endian length, the payload, then a 1-byte ack
+        while (1) {
+            uint32_t lengthBig[2];
+            if (bench_read_fully(client->fd, lengthBig, 8)) break;
+            uint64_t remaining = ((uint64_t)ntohl(lengthBig[0]) << 32) | ntohl(lengthBig[1]);
+            while (remaining > 0) {
+                size_t chunk = remaining > 65536 ? 65536 : (size_t)remaining;
+                ssize_t got = read(client->fd, buff, chunk);
+                if (got <= 0) break;
+                remaining -= got;
+            }
+            if (remaining > 0) break;
+            char ack = 1;
+            if (bench_write_fully(client->fd, &ack, 1)) break;
+        }
+    }
+    free(buff);
+    close(client->fd);
+    free(client);
+    return NULL;
+}
+
+static int bench_read_fully(int fd, void * buff, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t got = read(fd, &((char *)buff)[off], len - off);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return -1;
+        off += got;
+    }
+    return 0;
+}
+
+static int bench_write_fully(int fd, const void * buff, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t sent = write(fd, &((const char *)buff)[off], len - off);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return -1;
+        off += sent;
+    }
+    return 0;
+}
@@ -0,0 +1,176 @@
+//
+//  bench_util.c
+//  BenchConnexions
+//
+//  Created by Alex Nichol on 12/4/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "bench.h"
+#include <arpa/inet.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+static int bench_compare_samples(const void * a, const void * b);
+
+uint64_t bench_now_ns() {
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) mach_timebase_info(&timebase);
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+#pragma mark - Samples -
+
+void bench_samples_init(bench_samples_t * samples) {
+    samples->count = 0;
+    samples->alloc = 1024;
+    samples->samples = (uint64_t *)malloc(sizeof(uint64_t) * samples->alloc);
+}
+
+void bench_samples_add(bench_samples_t * samples, uint64_t value) {
+    if (samples->count == samples->alloc) {
+        samples->alloc *= 2;
+        samples->samples = (uint64_t *)realloc(samples->samples, sizeof(uint64_t) * samples->alloc);
+    }
+    samples->samples[samples->count++] = value;
+}
+
+void bench_samples_merge(bench_samples_t * samples, const bench_samples_t * other) {
+    for (size_t i = 0; i < other->count; i++) {
+        bench_samples_add(samples, other->samples[i]);
+    }
+}
+
+uint64_t bench_samples_percentile(bench_samples_t * samples, double percentile) {
+    if (samples->count == 0) return 0;
+    qsort(samples->samples, samples->count, sizeof(uint64_t), bench_compare_samples);
+    size_t index = (size_t)(percentile * (samples->count - 1) + 0.5);
+    if (index >= samples->count) index = samples->count - 1;
+    return samples->samples[index];
+}
+
+void bench_samples_free(bench_samples_t * samples) {
+    free(samples->samples);
+    samples->samples = NULL;
+    samples->count = 0;
+    samples->alloc = 0;
+}
+
+#pragma mark - ksockets -
+
+int bench_ksocket_mode = KSOCKET_MODE_STREAM;
+int bench_ksocket_rings = 0;
+int bench_ksocket_timestamps = 0;
+
+int bench_ksocket_open(uint16_t port) {
+    int fd = ksocket_init_mode(bench_ksocket_mode);
+    if (fd < 0) return -1;
+    if (bench_ksocket_rings && ksocket_ring_attach(fd, 0)) {
+        ksocket_close(fd);
+        return -1;
+    }
+    if (bench_ksocket_timestamps && ksocket_set_timestamps(fd, 1)) {
+        ksocket_close(fd);
+        return -1;
+    }
+    struct in_addr loopback;
+    loopback.s_addr = htonl(INADDR_LOOPBACK);
+    if (ksocket_connect_ipv4(fd, &loopback, port)) {
+        ksocket_close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int bench_ksocket_read_exact(int fd, size_t length) {
+    size_t got = 0;
+    while (got < length) {
+        void * buff = NULL;
+        int len = ksocket_read(fd, &buff);
+        if (len <= 0) return -1;
+        free(buff);
+        got += len;
+    }
+    return got == length ? 0 : -1;
+}
+
+#pragma mark - Connections -
+
+int bench_plain_tcp = 0;
+
+int bench_conn_open(uint16_t port) {
+    if (!bench_plain_tcp) return bench_ksocket_open(port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    // the kext and connexionsd both write whole frames without Nagle
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int bench_conn_send(int fd, const void * buff, size_t length) {
+    if (!bench_plain_tcp) return ksocket_send(fd, buff, (int)length);
+    size_t off = 0;
+    while (off < length) {
+        ssize_t sent = write(fd, &((const char *)buff)[off], length - off);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return -1;
+        off += sent;
+    }
+    return 0;
+}
+
+int bench_conn_read_exact(int fd, size_t length) {
+    if (!bench_plain_tcp) return bench_ksocket_read_exact(fd, length);
+    char buff[65536];
+    size_t got = 0;
+    while (got < length) {
+        size_t chunk = length - got > sizeof(buff) ? sizeof(buff) : length - got;
+        ssize_t res = read(fd, buff, chunk);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return -1;
+        got += res;
+    }
+    return 0;
+}
+
+void bench_conn_close(int fd) {
+    if (bench_plain_tcp) close(fd);
+    else ksocket_close(fd);
+}
+
+int bench_raise_fd_limit(int needed) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit)) return -1;
+    if (limit.rlim_cur >= (rlim_t)needed) return 0;
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < (rlim_t)needed) return -1;
+    limit.rlim_cur = needed;
+    return setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+#pragma mark - Private -
+
+static int bench_compare_samples(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
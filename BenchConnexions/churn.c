@@ -0,0 +1,197 @@
+//
+//  churn.c
+//  BenchConnexions
+//
+//  Created by Alex Nichol on 12/4/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "bench.h"
+
+#define CHURN_MAX_LEVELS 16
+
+typedef struct {
+    int concurrency;
+    double connectsPerSec;
+    double closesPerSec;
+    double cyclesPerSec; // open + close with `concurrency` connections idle
+    double bytesPerConnection; // kext pool memory held per idle connection
+    uint64_t connectP99;
+    uint64_t cycleP99;
+} churn_result_t;
+
+static int churn_run_level(int probe, uint16_t port, int concurrency, int cycles, churn_result_t * result);
+static int churn_bytes_held(int probe, uint64_t * bytes);
+static int churn_parse_list(const char * str, int * values, int max);
+
+int bench_churn_main(int argc, const char * argv[]) {
+    int levels[CHURN_MAX_LEVELS] = {1000, 10000, 50000};
+    int levelCount = 3;
+    int cycles = 1000;
+    double factor = 2.0; // per-operation cost growth that counts as superlinear
+    FILE * output = stdout;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            levelCount = churn_parse_list(argv[++i], levels, CHURN_MAX_LEVELS);
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            cycles = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-x") && i + 1 < argc) {
+            factor = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = fopen(argv[++i], "w");
+            if (!output) {
+                perror("fopen");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [-c 1000,10000,50000] [-n cycles] [-x factor] [-o output.json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bench_server_t server;
+    if (bench_server_start(&server, BENCH_SERVER_HOLD)) {
+        fprintf(stderr, "failed to start loopback listener\n");
+        return 1;
+    }
+    // a control with no TCP connection, used to read the kext's stats
+    int probe = ksocket_init();
+    if (probe < 0) {
+        fprintf(stderr, "ksocket_init failed: is the KernelConnexions kext loaded?\n");
+        bench_server_stop(&server);
+        return 1;
+    }
+
+    churn_result_t results[CHURN_MAX_LEVELS];
+    int superlinear = 0;
+    int failed = 0;
+    fprintf(output, "{\"benchmark\": \"churn\", \"results\": [\n");
+    for (int i = 0; i < levelCount; i++) {
+        if (bench_raise_fd_limit(levels[i] * 2 + 64)) {
+            fprintf(stderr, "cannot raise the descriptor limit for %d connections; skipping\n", levels[i]);
+            fprintf(output, "%s  {\"concurrency\": %d, \"skipped\": true}", i ? ",\n" : "", levels[i]);
+            results[i].concurrency = 0;
+            continue;
+        }
+        if (churn_run_level(probe, server.port, levels[i], cycles, &results[i])) {
+            failed = 1;
+            break;
+        }
+        churn_result_t * r = &results[i];
+
+        // compare per-operation cost against the smallest level that ran;
+        // linear work per operation keeps these ratios near 1
+        churn_result_t * base = NULL;
+        for (int j = 0; j < i; j++) {
+            if (results[j].concurrency) {
+                base = &results[j];
+                break;
+            }
+        }
+        double connectGrowth = base ? base->connectsPerSec / r->connectsPerSec : 1;
+        double closeGrowth = base ? base->closesPerSec / r->closesPerSec : 1;
+        double cycleGrowth = base ? base->cyclesPerSec / r->cyclesPerSec : 1;
+        int flagged = connectGrowth > factor || closeGrowth > factor || cycleGrowth > factor;
+        superlinear |= flagged;
+
+        fprintf(output, "%s  {\"concurrency\": %d, \"connects_per_sec\": %.1f, \"closes_per_sec\": %.1f, "
+                "\"churn_cycles_per_sec\": %.1f, \"connect_p99_us\": %.2f, \"cycle_p99_us\": %.2f, "
+                "\"kext_bytes_per_connection\": %.1f, \"connect_cost_growth\": %.2f, \"close_cost_growth\": %.2f, "
+                "\"cycle_cost_growth\": %.2f, \"superlinear\": %s}",
+                i ? ",\n" : "", r->concurrency, r->connectsPerSec, r->closesPerSec, r->cyclesPerSec,
+                r->connectP99 / 1000.0, r->cycleP99 / 1000.0, r->bytesPerConnection,
+                connectGrowth, closeGrowth, cycleGrowth, flagged ? "true" : "false");
+        fprintf(stderr, "concurrency=%-6d connect=%.0f/s close=%.0f/s churn=%.0f/s mem=%.0fB/conn%s\n",
+                r->concurrency, r->connectsPerSec, r->closesPerSec, r->cyclesPerSec,
+                r->bytesPerConnection, flagged ? "  ** superlinear **" : "");
+    }
+    fprintf(output, "\n], \"superlinear\": %s}\n", superlinear ? "true" : "false");
+    if (output != stdout) fclose(output);
+
+    ksocket_close(probe);
+    bench_server_stop(&server);
+    if (failed) {
+        fprintf(stderr, "benchmark aborted\n");
+        return 1;
+    }
+    return superlinear ? 2 : 0;
+}
+
+#pragma mark - Private -
+
+static int churn_run_level(int probe, uint16_t port, int concurrency, int cycles, churn_result_t * result) {
+    int * fds = (int *)malloc(sizeof(int) * concurrency);
+    bench_samples_t connectSamples, cycleSamples;
+    bench_samples_init(&connectSamples);
+    bench_samples_init(&cycleSamples);
+    bzero(result, sizeof(churn_result_t));
+    result->concurrency = concurrency;
+
+    uint64_t bytesBefore = 0, bytesAfter = 0;
+    churn_bytes_held(probe, &bytesBefore);
+
+    int opened = 0;
+    uint64_t start = bench_now_ns();
+    for (; opened < concurrency; opened++) {
+        uint64_t connectStart = bench_now_ns();
+        fds[opened] = bench_ksocket_open(port);
+        if (fds[opened] < 0) {
+            fprintf(stderr, "connect %d of %d failed: %s\n", opened + 1, concurrency, strerror(errno));
+            break;
+        }
+        bench_samples_add(&connectSamples, bench_now_ns() - connectStart);
+    }
+    uint64_t connectTime = bench_now_ns() - start;
+
+    if (opened == concurrency) {
+        churn_bytes_held(probe, &bytesAfter);
+        result->bytesPerConnection = (double)(int64_t)(bytesAfter - bytesBefore) / concurrency;
+
+        // open and close short-lived connections while the others sit idle
+        start = bench_now_ns();
+        for (int i = 0; i < cycles; i++) {
+            uint64_t cycleStart = bench_now_ns();
+            int fd = bench_ksocket_open(port);
+            if (fd < 0) break;
+            ksocket_close(fd);
+            bench_samples_add(&cycleSamples, bench_now_ns() - cycleStart);
+        }
+        uint64_t cycleTime = bench_now_ns() - start;
+        result->cyclesPerSec = cycleSamples.count / ((double)cycleTime / 1e9);
+    }
+
+    start = bench_now_ns();
+    for (int i = 0; i < opened; i++) {
+        ksocket_close(fds[i]);
+    }
+    uint64_t closeTime = bench_now_ns() - start;
+
+    result->connectsPerSec = opened / ((double)connectTime / 1e9);
+    result->closesPerSec = opened / ((double)closeTime / 1e9);
+    result->connectP99 = bench_samples_percentile(&connectSamples, 0.99);
+    result->cycleP99 = bench_samples_percentile(&cycleSamples, 0.99);
+    bench_samples_free(&connectSamples);
+    bench_samples_free(&cycleSamples);
+    free(fds);
+    return opened == concurrency ? 0 : -1;
+}
+
+static int churn_bytes_held(int probe, uint64_t * bytes) {
+    ksocket_pool_stats_t stats;
+    if (ksocket_get_pool_stats(probe, &stats)) return -1;
+    *bytes = stats.bytesHeld;
+    return 0;
+}
+
+static int churn_parse_list(const char * str, int * values, int max) {
+    int count = 0;
+    const char * p = str;
+    while (*p && count < max) {
+        char * end = NULL;
+        values[count++] = (int)strtol(p, &end, 10);
+        if (end == p) break;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return count;
+}
@@ -0,0 +1,238 @@
+//
+//  codec.c
+//  BenchConnexions
+//
+//  Created by Alex Nichol on 12/18/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "bench.h"
+#include <arpa/inet.h>
+
+// times the protocol.h codecs on their own, so it runs without the kext or
+// connexionsd; frame lengths vary so the decode walk can't be predicted
+
+#define CODEC_FRAMES 4096 // distinct frames in the stream that gets walked
+#define CODEC_SLOTS 4096 // fixed-size bodies encoded and decoded in turn
+
+typedef struct {
+    uint8_t * stream; // CODEC_FRAMES frames back to back
+    size_t streamLength;
+    uint32_t offsets[CODEC_FRAMES];
+    uint16_t lengths[CODEC_FRAMES];
+    uint8_t * slots; // CODEC_SLOTS bodies of KC_CONNECT_MULTI_MIN_SIZE + 4 candidates
+} codec_data_t;
+
+typedef uint64_t (* codec_test_f)(codec_data_t * data, uint64_t count);
+
+typedef struct {
+    const char * name;
+    codec_test_f test;
+} codec_test_t;
+
+#define CODEC_SLOT_SIZE (KC_CONNECT_MULTI_MIN_SIZE + 4 * KC_CANDIDATE_MAX_SIZE)
+
+static uint64_t codec_header_encode(codec_data_t * data, uint64_t count);
+static uint64_t codec_header_decode(codec_data_t * data, uint64_t count);
+static uint64_t codec_header_decode_ntohs(codec_data_t * data, uint64_t count);
+static uint64_t codec_connect_encode(codec_data_t * data, uint64_t count);
+static uint64_t codec_connect_decode(codec_data_t * data, uint64_t count);
+static uint64_t codec_multi_encode(codec_data_t * data, uint64_t count);
+static uint64_t codec_multi_decode(codec_data_t * data, uint64_t count);
+static uint64_t codec_status_encode(codec_data_t * data, uint64_t count);
+static uint64_t codec_status_decode(codec_data_t * data, uint64_t count);
+
+static const codec_test_t codecTests[] = {
+    {"header_encode", codec_header_encode},
+    {"header_decode", codec_header_decode},
+    {"header_decode_ntohs", codec_header_decode_ntohs}, // the memcpy() and ntohs() it replaced
+    {"connect_encode", codec_connect_encode},
+    {"connect_decode", codec_connect_decode},
+    {"connect_multi_encode", codec_multi_encode},
+    {"connect_multi_decode", codec_multi_decode},
+    {"status_encode", codec_status_encode},
+    {"status_decode", codec_status_decode}
+};
+
+static volatile uint64_t codecSink; // keeps the compiler from dropping the work
+
+int bench_codec_main(int argc, const char * argv[]) {
+    uint64_t count = 10000000;
+    int rounds = 5;
+    FILE * output = stdout;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            count = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = fopen(argv[++i], "w");
+            if (!output) {
+                perror("fopen");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [-n operations] [-r rounds] [-o output.json]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (count < 1 || rounds < 1) {
+        fprintf(stderr, "operations and rounds must be positive\n");
+        return 1;
+    }
+
+    // mostly small control and SEND frames with the odd large one, as a
+    // chatty client would write them
+    codec_data_t data;
+    bzero(&data, sizeof(data));
+    uint32_t seed = 0x4b43;
+    for (int i = 0; i < CODEC_FRAMES; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint16_t length = (seed >> 16) % 8 ? (seed >> 8) % 256 : (seed >> 4) % 4096;
+        data.offsets[i] = (uint32_t)data.streamLength;
+        data.lengths[i] = length;
+        data.streamLength += KC_FRAME_HEADER_SIZE + length;
+    }
+    data.stream = (uint8_t *)calloc(data.streamLength, 1);
+    data.slots = (uint8_t *)calloc(CODEC_SLOTS, CODEC_SLOT_SIZE);
+    if (!data.stream || !data.slots) {
+        fprintf(stderr, "failed to allocate test data\n");
+        return 1;
+    }
+    codec_header_encode(&data, CODEC_FRAMES);
+
+    size_t testCount = sizeof(codecTests) / sizeof(codecTests[0]);
+    fprintf(output, "{\"benchmark\": \"codec\", \"operations\": %llu, \"rounds\": %d, \"results\": [\n",
+            (unsigned long long)count, rounds);
+    for (size_t i = 0; i < testCount; i++) {
+        // the decoders read what the matching encoder left behind
+        uint64_t best = UINT64_MAX;
+        for (int round = 0; round < rounds; round++) {
+            uint64_t start = bench_now_ns();
+            codecSink += codecTests[i].test(&data, count);
+            uint64_t elapsed = bench_now_ns() - start;
+            if (elapsed < best) best = elapsed;
+        }
+        double nsPerOp = (double)best / count;
+        fprintf(output, "%s  {\"test\": \"%s\", \"ns_per_op\": %.3f, \"mops_per_sec\": %.2f}",
+                i ? ",\n" : "", codecTests[i].name, nsPerOp, 1000.0 / nsPerOp);
+        fprintf(stderr, "%-22s %7.2f ns/op %9.2f Mops/s\n", codecTests[i].name, nsPerOp, 1000.0 / nsPerOp);
+    }
+    fprintf(output, "\n]}\n");
+    if (output != stdout) fclose(output);
+    free(data.stream);
+    free(data.slots);
+    return 0;
+}
+
+#pragma mark - Headers -
+
+static uint64_t codec_header_encode(codec_data_t * data, uint64_t count) {
+    uint32_t index = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        kc_frame_put_header(&data->stream[data->offsets[index]], CONTROL_PACKET_SEND, data->lengths[index]);
+        index = (index + 1) % CODEC_FRAMES;
+    }
+    return index;
+}
+
+static uint64_t codec_header_decode(codec_data_t * data, uint64_t count) {
+    // each header says where the next one is, like reassembling a stream
+    uint64_t sum = 0;
+    size_t offset = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        const uint8_t * frame = &data->stream[offset];
+        sum += kc_frame_type(frame);
+        offset += KC_FRAME_HEADER_SIZE + kc_frame_length(frame);
+        if (offset == data->streamLength) offset = 0;
+    }
+    return sum + offset;
+}
+
+static uint64_t codec_header_decode_ntohs(codec_data_t * data, uint64_t count) {
+    uint64_t sum = 0;
+    size_t offset = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        const uint8_t * frame = &data->stream[offset];
+        uint16_t lengthBig;
+        memcpy(&lengthBig, &frame[1], 2);
+        sum += frame[0];
+        offset += KC_FRAME_HEADER_SIZE + ntohs(lengthBig);
+        if (offset == data->streamLength) offset = 0;
+    }
+    return sum + offset;
+}
+
+#pragma mark - Bodies -
+
+static uint64_t codec_connect_encode(codec_data_t * data, uint64_t count) {
+    static const uint8_t address[16] = {0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        uint8_t * body = &data->slots[(i % CODEC_SLOTS) * CODEC_SLOT_SIZE];
+        sum += kc_connect_encode(body, (uint16_t)i, address, (int)(i & 1));
+    }
+    return sum;
+}
+
+static uint64_t codec_connect_decode(codec_data_t * data, uint64_t count) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        const uint8_t * body = &data->slots[(i % CODEC_SLOTS) * CODEC_SLOT_SIZE];
+        uint16_t port;
+        const void * address;
+        int version = kc_connect_decode(body, (i & 1) ? KC_CONNECT_IPV6_SIZE : KC_CONNECT_IPV4_SIZE, &port, &address);
+        sum += version + port + ((const uint8_t *)address)[0];
+    }
+    return sum;
+}
+
+static uint64_t codec_multi_encode(codec_data_t * data, uint64_t count) {
+    static const uint8_t address4[4] = {127, 0, 0, 1};
+    static const uint8_t address6[16] = {0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        uint8_t * body = &data->slots[(i % CODEC_SLOTS) * CODEC_SLOT_SIZE];
+        uint16_t length = kc_connect_multi_encode(body, (uint16_t)i, 250);
+        length = kc_candidate_encode(body, length, 6, address6);
+        length = kc_candidate_encode(body, length, 4, address4);
+        length = kc_candidate_encode(body, length, 6, address6);
+        length = kc_candidate_encode(body, length, 4, address4);
+        sum += length;
+    }
+    return sum;
+}
+
+static uint64_t codec_multi_decode(codec_data_t * data, uint64_t count) {
+    uint16_t length = KC_CONNECT_MULTI_MIN_SIZE + 2 * (1 + 16) + 2 * (1 + 4);
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        const uint8_t * body = &data->slots[(i % CODEC_SLOTS) * CODEC_SLOT_SIZE];
+        uint16_t port, stagger;
+        kc_connect_multi_decode(body, &port, &stagger);
+        uint16_t offset = KC_CONNECT_MULTI_MIN_SIZE;
+        const void * address;
+        int version;
+        while ((version = kc_candidate_decode(body, length, &offset, &address))) {
+            sum += version + ((const uint8_t *)address)[0];
+        }
+        sum += port + stagger;
+    }
+    return sum;
+}
+
+static uint64_t codec_status_encode(codec_data_t * data, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        kc_status_encode(&data->slots[(i % CODEC_SLOTS) * CODEC_SLOT_SIZE], (uint32_t)i);
+    }
+    return count;
+}
+
+static uint64_t codec_status_decode(codec_data_t * data, uint64_t count) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        sum += kc_status_decode(&data->slots[(i % CODEC_SLOTS) * CODEC_SLOT_SIZE], KC_STATUS_SIZE);
+    }
+    return sum;
+}
@@ -0,0 +1,249 @@
+//
+//  contention.c
+//  BenchConnexions
+//
+//  Created by Alex Nichol on 12/14/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "bench.h"
+#include <sys/types.h>
+#include <sys/sysctl.h>
+
+#define CONTENTION_MAX_SITES 512
+#define CONTENTION_SUMMARY_ROWS 15
+
+typedef struct {
+    char group[32];
+    char site[96];
+    long long acquisitions;
+    long long contended;
+    long long waitUs;
+    long long waitMaxUs;
+    long long holdUs;
+    long long holdMaxUs;
+} contention_row_t;
+
+typedef struct {
+    uint16_t port;
+    size_t size;
+    int reconnect; // round trips between reconnects; 0 keeps one connection
+    uint64_t deadline;
+    uint64_t roundTrips;
+    uint64_t reconnects;
+    int failed;
+} contention_worker_t;
+
+static void * contention_worker_main(void * arg);
+static int contention_read_profile(contention_row_t * rows, int max);
+static int contention_compare(const void * a, const void * b);
+
+int bench_contention_main(int argc, const char * argv[]) {
+    int connections = 32;
+    int seconds = 5;
+    size_t size = 64;
+    int reconnect = 50;
+    FILE * output = stdout;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            connections = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            size = (size_t)atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            reconnect = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = fopen(argv[++i], "w");
+            if (!output) {
+                perror("fopen");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [-c connections] [-t seconds] [-s size] [-r reconnect-every] [-o output.json]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (connections < 1 || seconds < 1 || size < 1 || size > 0xFFFF) {
+        fprintf(stderr, "connections, seconds and size must be positive, and size at most 65535\n");
+        return 1;
+    }
+
+    int reset = 1;
+    if (sysctlbyname("net.kernelconnexions.lock_profile_reset", NULL, NULL, &reset, sizeof(reset))) {
+        fprintf(stderr, "no lock profile: build the kext with KC_LOCK_PROFILING defined and load it\n");
+        return 1;
+    }
+
+    bench_server_t echo;
+    if (bench_server_start(&echo, BENCH_SERVER_ECHO)) {
+        fprintf(stderr, "failed to start loopback server\n");
+        return 1;
+    }
+    contention_worker_t * workers = (contention_worker_t *)calloc(connections, sizeof(contention_worker_t));
+    pthread_t * threads = (pthread_t *)calloc(connections, sizeof(pthread_t));
+    uint64_t start = bench_now_ns();
+    int started = 0;
+    for (; started < connections; started++) {
+        workers[started].port = echo.port;
+        workers[started].size = size;
+        workers[started].reconnect = reconnect;
+        workers[started].deadline = start + (uint64_t)seconds * 1000000000ull;
+        if (pthread_create(&threads[started], NULL, contention_worker_main, &workers[started])) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    uint64_t roundTrips = 0, reconnects = 0;
+    int failed = started < connections;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        roundTrips += workers[i].roundTrips;
+        reconnects += workers[i].reconnects;
+        failed |= workers[i].failed;
+    }
+    double elapsed = (bench_now_ns() - start) / 1e9;
+    bench_server_stop(&echo);
+    free(threads);
+    free(workers);
+
+    contention_row_t * rows = (contention_row_t *)calloc(CONTENTION_MAX_SITES, sizeof(contention_row_t));
+    int count = contention_read_profile(rows, CONTENTION_MAX_SITES);
+    if (count < 0) {
+        free(rows);
+        return 1;
+    }
+    qsort(rows, count, sizeof(contention_row_t), contention_compare);
+
+    // per group, so the lock that limits scaling stands out
+    const char * groups[] = {"connections", "connection", "controls", "control", "queue"};
+    const int groupCount = sizeof(groups) / sizeof(groups[0]);
+    long long groupWait[sizeof(groups) / sizeof(groups[0])] = {0};
+    long long groupHold[sizeof(groups) / sizeof(groups[0])] = {0};
+    long long groupAcquisitions[sizeof(groups) / sizeof(groups[0])] = {0};
+    long long groupContended[sizeof(groups) / sizeof(groups[0])] = {0};
+    for (int i = 0; i < count; i++) {
+        for (int g = 0; g < groupCount; g++) {
+            if (strcmp(rows[i].group, groups[g])) continue;
+            groupWait[g] += rows[i].waitUs;
+            groupHold[g] += rows[i].holdUs;
+            groupAcquisitions[g] += rows[i].acquisitions;
+            groupContended[g] += rows[i].contended;
+        }
+    }
+    int hottest = 0;
+    for (int g = 1; g < groupCount; g++) {
+        if (groupWait[g] > groupWait[hottest]) hottest = g;
+    }
+
+    fprintf(output, "{\"benchmark\": \"contention\", \"connections\": %d, \"seconds\": %.3f, \"size\": %zu, "
+            "\"reconnect_every\": %d, \"round_trips\": %llu, \"reconnects\": %llu, \"hottest_group\": \"%s\", \"groups\": [\n",
+            connections, elapsed, size, reconnect, (unsigned long long)roundTrips, (unsigned long long)reconnects,
+            groupWait[hottest] ? groups[hottest] : "");
+    for (int g = 0; g < groupCount; g++) {
+        fprintf(output, "%s  {\"group\": \"%s\", \"acquisitions\": %lld, \"contended\": %lld, "
+                "\"wait_us\": %lld, \"hold_us\": %lld}", g ? ",\n" : "", groups[g],
+                groupAcquisitions[g], groupContended[g], groupWait[g], groupHold[g]);
+    }
+    fprintf(output, "\n], \"sites\": [\n");
+    for (int i = 0; i < count; i++) {
+        contention_row_t * row = &rows[i];
+        fprintf(output, "%s  {\"group\": \"%s\", \"site\": \"%s\", \"acquisitions\": %lld, \"contended\": %lld, "
+                "\"contended_pct\": %.2f, \"wait_us\": %lld, \"wait_max_us\": %lld, \"hold_us\": %lld, \"hold_max_us\": %lld}",
+                i ? ",\n" : "", row->group, row->site, row->acquisitions, row->contended,
+                row->acquisitions ? 100.0 * row->contended / row->acquisitions : 0.0,
+                row->waitUs, row->waitMaxUs, row->holdUs, row->holdMaxUs);
+    }
+    fprintf(output, "\n]}\n");
+    if (output != stdout) fclose(output);
+
+    fprintf(stderr, "%llu round trips, %llu reconnects over %d connections in %.2fs\n",
+            (unsigned long long)roundTrips, (unsigned long long)reconnects, connections, elapsed);
+    fprintf(stderr, "%-12s %-36s %12s %10s %12s %12s\n", "group", "site", "acquisitions", "contended", "wait_us", "hold_us");
+    for (int i = 0; i < count && i < CONTENTION_SUMMARY_ROWS; i++) {
+        contention_row_t * row = &rows[i];
+        fprintf(stderr, "%-12s %-36s %12lld %10lld %12lld %12lld\n", row->group, row->site,
+                row->acquisitions, row->contended, row->waitUs, row->holdUs);
+    }
+    if (groupWait[hottest]) {
+        fprintf(stderr, "most time waiting: %s (%lldus)\n", groups[hottest], groupWait[hottest]);
+    }
+    free(rows);
+    if (failed) {
+        fprintf(stderr, "some workers failed; the profile only covers what ran\n");
+        return 1;
+    }
+    return 0;
+}
+
+#pragma mark - Private -
+
+static void * contention_worker_main(void * arg) {
+    contention_worker_t * worker = (contention_worker_t *)arg;
+    char * message = (char *)malloc(worker->size);
+    memset(message, 'k', worker->size);
+    int fd = -1;
+    int sinceReconnect = 0;
+    while (bench_now_ns() < worker->deadline) {
+        if (fd >= 0 && worker->reconnect && sinceReconnect == worker->reconnect) {
+            ksocket_close(fd);
+            fd = -1;
+            worker->reconnects++;
+        }
+        if (fd < 0) {
+            if ((fd = bench_ksocket_open(worker->port)) < 0) {
+                worker->failed = 1;
+                break;
+            }
+            sinceReconnect = 0;
+        }
+        if (ksocket_send(fd, message, (int)worker->size) || bench_ksocket_read_exact(fd, worker->size)) {
+            worker->failed = 1;
+            break;
+        }
+        worker->roundTrips++;
+        sinceReconnect++;
+    }
+    if (fd >= 0) ksocket_close(fd);
+    free(message);
+    return NULL;
+}
+
+static int contention_read_profile(contention_row_t * rows, int max) {
+    size_t size = 0;
+    if (sysctlbyname("net.kernelconnexions.lock_profile", NULL, &size, NULL, 0)) {
+        perror("sysctl net.kernelconnexions.lock_profile");
+        return -1;
+    }
+    size += 4096; // sites that show up in between
+    char * text = (char *)malloc(size);
+    if (sysctlbyname("net.kernelconnexions.lock_profile", text, &size, NULL, 0)) {
+        perror("sysctl net.kernelconnexions.lock_profile");
+        free(text);
+        return -1;
+    }
+    text[size ? size - 1 : 0] = 0;
+
+    int count = 0;
+    char * line = strchr(text, '\n'); // skip the header
+    while (line && *++line && count < max) {
+        contention_row_t * row = &rows[count];
+        if (sscanf(line, "%31s %95s %lld %lld %lld %lld %lld %lld", row->group, row->site,
+                   &row->acquisitions, &row->contended, &row->waitUs, &row->waitMaxUs,
+                   &row->holdUs, &row->holdMaxUs) == 8) {
+            count++;
+        }
+        line = strchr(line, '\n');
+    }
+    free(text);
+    return count;
+}
+
+static int contention_compare(const void * a, const void * b) {
+    const contention_row_t * x = (const contention_row_t *)a;
+    const contention_row_t * y = (const contention_row_t *)b;
+    if (x->waitUs != y->waitUs) return x->waitUs > y->waitUs ? -1 : 1;
+    if (x->contended != y->contended) return x->contended > y->contended ? -1 : 1;
+    return 0;
+}
@@ -0,0 +1,123 @@
+//
+//  eyeballs.c
+//  BenchConnexions
+//
+//  Created by Alex Nichol on 12/8/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "bench.h"
+#include <arpa/inet.h>
+
+typedef struct {
+    const char * name;
+    int blackholeFirst; // -1: loopback only, 0: loopback first, 1: blackhole first
+} eyeballs_case_t;
+
+static int eyeballs_run_case(const eyeballs_case_t * test, struct in_addr blackhole, uint16_t port,
+                             uint16_t stagger, int iterations, bench_samples_t * samples);
+
+int bench_eyeballs_main(int argc, const char * argv[]) {
+    const char * blackholeStr = "192.0.2.1"; // TEST-NET-1, which nothing answers
+    int iterations = 50;
+    uint16_t stagger = 0;
+    FILE * output = stdout;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-a") && i + 1 < argc) {
+            blackholeStr = argv[++i];
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            stagger = (uint16_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = fopen(argv[++i], "w");
+            if (!output) {
+                perror("fopen");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [-a blackhole-ipv4] [-n iterations] [-t stagger-ms] [-o output.json]\n", argv[0]);
+            return 1;
+        }
+    }
+    struct in_addr blackhole;
+    if (inet_pton(AF_INET, blackholeStr, &blackhole) != 1) {
+        fprintf(stderr, "invalid blackhole address: %s\n", blackholeStr);
+        return 1;
+    }
+
+    bench_server_t server;
+    if (bench_server_start(&server, BENCH_SERVER_HOLD)) {
+        fprintf(stderr, "failed to start loopback listener\n");
+        return 1;
+    }
+
+    // connecting to the blackhole alone would take a full TCP timeout, which
+    // is what a single-address connect pays when the first address is dead
+    eyeballs_case_t cases[] = {
+        {"loopback_only", -1},
+        {"loopback_then_blackhole", 0},
+        {"blackhole_then_loopback", 1}
+    };
+    int failed = 0;
+    fprintf(output, "{\"benchmark\": \"eyeballs\", \"blackhole\": \"%s\", \"stagger_ms\": %d, \"results\": [\n",
+            blackholeStr, (int)stagger);
+    for (int i = 0; i < 3; i++) {
+        bench_samples_t samples;
+        bench_samples_init(&samples);
+        if (eyeballs_run_case(&cases[i], blackhole, server.port, stagger, iterations, &samples)) {
+            failed = 1;
+        }
+        uint64_t p50 = bench_samples_percentile(&samples, 0.5);
+        uint64_t p99 = bench_samples_percentile(&samples, 0.99);
+        uint64_t max = bench_samples_percentile(&samples, 1.0);
+        fprintf(output, "%s  {\"case\": \"%s\", \"connects\": %zu, \"connect_p50_ms\": %.3f, "
+                "\"connect_p99_ms\": %.3f, \"connect_max_ms\": %.3f}",
+                i ? ",\n" : "", cases[i].name, samples.count, p50 / 1e6, p99 / 1e6, max / 1e6);
+        fprintf(stderr, "%-24s p50=%.2fms p99=%.2fms max=%.2fms\n", cases[i].name, p50 / 1e6, p99 / 1e6, max / 1e6);
+        bench_samples_free(&samples);
+        if (failed) break;
+    }
+    fprintf(output, "\n]}\n");
+    if (output != stdout) fclose(output);
+    bench_server_stop(&server);
+    return failed ? 1 : 0;
+}
+
+#pragma mark - Private -
+
+static int eyeballs_run_case(const eyeballs_case_t * test, struct in_addr blackhole, uint16_t port,
+                             uint16_t stagger, int iterations, bench_samples_t * samples) {
+    ksocket_candidate_t candidates[2];
+    struct in_addr loopback;
+    loopback.s_addr = htonl(INADDR_LOOPBACK);
+    int count = 0;
+    if (test->blackholeFirst == 1) {
+        candidates[count].family = AF_INET;
+        memcpy(candidates[count++].addr, &blackhole, 4);
+    }
+    candidates[count].family = AF_INET;
+    memcpy(candidates[count++].addr, &loopback, 4);
+    if (test->blackholeFirst == 0) {
+        candidates[count].family = AF_INET;
+        memcpy(candidates[count++].addr, &blackhole, 4);
+    }
+
+    for (int i = 0; i < iterations; i++) {
+        int fd = ksocket_init();
+        if (fd < 0) {
+            fprintf(stderr, "ksocket_init failed: is the KernelConnexions kext loaded?\n");
+            return -1;
+        }
+        uint64_t start = bench_now_ns();
+        if (ksocket_connect_multi(fd, candidates, count, port, stagger)) {
+            fprintf(stderr, "%s: connect failed: %s\n", test->name, strerror(errno));
+            ksocket_close(fd);
+            return -1;
+        }
+        bench_samples_add(samples, bench_now_ns() - start);
+        ksocket_close(fd);
+    }
+    return 0;
+}
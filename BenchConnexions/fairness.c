@@ -0,0 +1,276 @@
+//
+//  fairness.c
+//  BenchConnexions
+//
+//  Created by Alex Nichol on 12/16/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "bench.h"
+#include <sys/types.h>
+#include <sys/sysctl.h>
+#include <poll.h>
+
+typedef struct {
+    uint16_t port;
+    size_t size;
+    uint32_t weight; // 0 leaves the kext's default
+    uint64_t deadline;
+    bench_samples_t samples;
+    int failed;
+} fairness_small_t;
+
+typedef struct {
+    uint16_t port;
+    uint32_t weight;
+    volatile int stopping;
+    volatile int ready;
+    uint64_t bytes;
+    int failed;
+} fairness_bulk_t;
+
+typedef struct {
+    size_t roundTrips;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    double bulkMegabytes;
+    uint64_t yields;
+    int failed;
+} fairness_phase_t;
+
+static int fairness_run_phase(fairness_phase_t * phase, uint16_t echoPort, uint16_t sourcePort,
+                              int smallCount, int bulkCount, int seconds, size_t size,
+                              uint32_t smallWeight, uint32_t bulkWeight);
+static void * fairness_small_main(void * arg);
+static void * fairness_bulk_main(void * arg);
+static uint64_t fairness_read_yields();
+
+int bench_fairness_main(int argc, const char * argv[]) {
+    int smallCount = 4;
+    int bulkCount = 1;
+    int seconds = 5;
+    size_t size = 64;
+    uint32_t bulkWeight = 0;
+    uint32_t smallWeight = 0;
+    FILE * output = stdout;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            smallCount = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+            bulkCount = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            size = (size_t)atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            bulkWeight = (uint32_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-W") && i + 1 < argc) {
+            smallWeight = (uint32_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = fopen(argv[++i], "w");
+            if (!output) {
+                perror("fopen");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [-c small-connections] [-b bulk-connections] [-t seconds] [-s size] "
+                    "[-w bulk-weight] [-W small-weight] [-o output.json]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (smallCount < 1 || bulkCount < 1 || seconds < 1 || size < 1 || size > 0xFFFF) {
+        fprintf(stderr, "connections, seconds and size must be positive, and size at most 65535\n");
+        return 1;
+    }
+    if (bulkWeight > KSOCKET_MAX_WEIGHT || smallWeight > KSOCKET_MAX_WEIGHT) {
+        fprintf(stderr, "weights are at most %d\n", KSOCKET_MAX_WEIGHT);
+        return 1;
+    }
+
+    bench_server_t echo, source;
+    if (bench_server_start(&echo, BENCH_SERVER_ECHO)) {
+        fprintf(stderr, "failed to start loopback servers\n");
+        return 1;
+    }
+    if (bench_server_start(&source, BENCH_SERVER_SOURCE)) {
+        fprintf(stderr, "failed to start loopback servers\n");
+        bench_server_stop(&echo);
+        return 1;
+    }
+
+    // the same small flows, alone and then next to bulk readers that keep
+    // the dispatch thread busy for as long as they run
+    fairness_phase_t baseline, loaded;
+    fairness_run_phase(&baseline, echo.port, source.port, smallCount, 0, seconds, size, smallWeight, bulkWeight);
+    if (!baseline.failed) {
+        fairness_run_phase(&loaded, echo.port, source.port, smallCount, bulkCount, seconds, size, smallWeight, bulkWeight);
+    } else {
+        bzero(&loaded, sizeof(loaded));
+    }
+    bench_server_stop(&source);
+    bench_server_stop(&echo);
+    if (baseline.failed || loaded.failed) {
+        fprintf(stderr, "benchmark aborted: is the KernelConnexions kext loaded?\n");
+        return 1;
+    }
+
+    fairness_phase_t * phases[] = {&baseline, &loaded};
+    const char * names[] = {"baseline", "loaded"};
+    fprintf(output, "{\"benchmark\": \"fairness\", \"small_connections\": %d, \"bulk_connections\": %d, "
+            "\"seconds\": %d, \"size\": %zu, \"small_weight\": %u, \"bulk_weight\": %u, \"phases\": [\n",
+            smallCount, bulkCount, seconds, size, smallWeight, bulkWeight);
+    for (int i = 0; i < 2; i++) {
+        fairness_phase_t * phase = phases[i];
+        fprintf(output, "%s  {\"phase\": \"%s\", \"round_trips\": %zu, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+                "\"p999_us\": %.2f, \"bulk_mb_per_sec\": %.3f, \"dispatch_yields\": %llu}",
+                i ? ",\n" : "", names[i], phase->roundTrips, phase->p50 / 1000.0, phase->p99 / 1000.0,
+                phase->p999 / 1000.0, phase->bulkMegabytes / seconds, (unsigned long long)phase->yields);
+        fprintf(stderr, "%-8s round_trips=%-8zu p50=%.1fus p99=%.1fus p999=%.1fus bulk=%.2f MB/s yields=%llu\n",
+                names[i], phase->roundTrips, phase->p50 / 1000.0, phase->p99 / 1000.0, phase->p999 / 1000.0,
+                phase->bulkMegabytes / seconds, (unsigned long long)phase->yields);
+    }
+    double inflation = baseline.p99 ? (double)loaded.p99 / baseline.p99 : 0;
+    fprintf(output, "\n], \"p99_inflation\": %.3f}\n", inflation);
+    if (output != stdout) fclose(output);
+    fprintf(stderr, "small-flow p99 is %.2fx its baseline next to %d bulk connection%s\n",
+            inflation, bulkCount, bulkCount == 1 ? "" : "s");
+    return 0;
+}
+
+#pragma mark - Private -
+
+static int fairness_run_phase(fairness_phase_t * phase, uint16_t echoPort, uint16_t sourcePort,
+                              int smallCount, int bulkCount, int seconds, size_t size,
+                              uint32_t smallWeight, uint32_t bulkWeight) {
+    bzero(phase, sizeof(fairness_phase_t));
+    fairness_bulk_t * bulks = (fairness_bulk_t *)calloc(bulkCount ? bulkCount : 1, sizeof(fairness_bulk_t));
+    pthread_t * bulkThreads = (pthread_t *)calloc(bulkCount ? bulkCount : 1, sizeof(pthread_t));
+    int bulkStarted = 0;
+    for (; bulkStarted < bulkCount; bulkStarted++) {
+        bulks[bulkStarted].port = sourcePort;
+        bulks[bulkStarted].weight = bulkWeight;
+        if (pthread_create(&bulkThreads[bulkStarted], NULL, fairness_bulk_main, &bulks[bulkStarted])) {
+            perror("pthread_create");
+            phase->failed = 1;
+            break;
+        }
+    }
+    // let the bulk flows fill the pipe before measuring anything
+    for (int i = 0; i < bulkStarted; i++) {
+        while (!bulks[i].ready && !bulks[i].failed) usleep(1000);
+        phase->failed |= bulks[i].failed;
+    }
+    if (bulkStarted) usleep(200000);
+
+    uint64_t yields = fairness_read_yields();
+    uint64_t bulkBytes = 0;
+    for (int i = 0; i < bulkStarted; i++) bulkBytes += __atomic_load_n(&bulks[i].bytes, __ATOMIC_RELAXED);
+
+    fairness_small_t * smalls = (fairness_small_t *)calloc(smallCount, sizeof(fairness_small_t));
+    pthread_t * smallThreads = (pthread_t *)calloc(smallCount, sizeof(pthread_t));
+    uint64_t deadline = bench_now_ns() + (uint64_t)seconds * 1000000000ull;
+    int smallStarted = 0;
+    for (; !phase->failed && smallStarted < smallCount; smallStarted++) {
+        smalls[smallStarted].port = echoPort;
+        smalls[smallStarted].size = size;
+        smalls[smallStarted].weight = smallWeight;
+        smalls[smallStarted].deadline = deadline;
+        bench_samples_init(&smalls[smallStarted].samples);
+        if (pthread_create(&smallThreads[smallStarted], NULL, fairness_small_main, &smalls[smallStarted])) {
+            perror("pthread_create");
+            bench_samples_free(&smalls[smallStarted].samples);
+            phase->failed = 1;
+            break;
+        }
+    }
+    bench_samples_t all;
+    bench_samples_init(&all);
+    for (int i = 0; i < smallStarted; i++) {
+        pthread_join(smallThreads[i], NULL);
+        phase->failed |= smalls[i].failed;
+        bench_samples_merge(&all, &smalls[i].samples);
+        bench_samples_free(&smalls[i].samples);
+    }
+    free(smallThreads);
+    free(smalls);
+
+    uint64_t bulkEnd = 0;
+    for (int i = 0; i < bulkStarted; i++) bulkEnd += __atomic_load_n(&bulks[i].bytes, __ATOMIC_RELAXED);
+    phase->yields = fairness_read_yields() - yields;
+    for (int i = 0; i < bulkStarted; i++) bulks[i].stopping = 1;
+    for (int i = 0; i < bulkStarted; i++) {
+        pthread_join(bulkThreads[i], NULL);
+        phase->failed |= bulks[i].failed;
+    }
+    free(bulkThreads);
+    free(bulks);
+
+    phase->roundTrips = all.count;
+    phase->bulkMegabytes = (double)(bulkEnd - bulkBytes) / (1024.0 * 1024.0);
+    phase->p50 = bench_samples_percentile(&all, 0.50);
+    phase->p99 = bench_samples_percentile(&all, 0.99);
+    phase->p999 = bench_samples_percentile(&all, 0.999);
+    bench_samples_free(&all);
+    return phase->failed ? -1 : 0;
+}
+
+static void * fairness_small_main(void * arg) {
+    fairness_small_t * worker = (fairness_small_t *)arg;
+    int fd = bench_ksocket_open(worker->port);
+    if (fd < 0 || (worker->weight && ksocket_set_weight(fd, worker->weight))) {
+        if (fd >= 0) ksocket_close(fd);
+        worker->failed = 1;
+        return NULL;
+    }
+    char * message = (char *)malloc(worker->size);
+    memset(message, 'k', worker->size);
+    while (bench_now_ns() < worker->deadline) {
+        uint64_t start = bench_now_ns();
+        if (ksocket_send(fd, message, (int)worker->size) || bench_ksocket_read_exact(fd, worker->size)) {
+            worker->failed = 1;
+            break;
+        }
+        bench_samples_add(&worker->samples, bench_now_ns() - start);
+    }
+    free(message);
+    ksocket_close(fd);
+    return NULL;
+}
+
+static void * fairness_bulk_main(void * arg) {
+    fairness_bulk_t * worker = (fairness_bulk_t *)arg;
+    int fd = bench_ksocket_open(worker->port);
+    if (fd < 0 || (worker->weight && ksocket_set_weight(fd, worker->weight))) {
+        if (fd >= 0) ksocket_close(fd);
+        worker->failed = 1;
+        return NULL;
+    }
+    worker->ready = 1;
+    while (!worker->stopping) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) <= 0) continue;
+        void * buff = NULL;
+        int res = ksocket_read(fd, &buff);
+        if (res <= 0) {
+            worker->failed = 1;
+            break;
+        }
+        free(buff);
+        __atomic_fetch_add(&worker->bytes, (uint64_t)res, __ATOMIC_RELAXED);
+    }
+    ksocket_close(fd);
+    return NULL;
+}
+
+static uint64_t fairness_read_yields() {
+    // missing on kexts from before fair scheduling; report 0 rather than fail
+    uint64_t yields = 0;
+    size_t size = sizeof(yields);
+    if (sysctlbyname("net.kernelconnexions.dispatch_yields", &yields, &size, NULL, 0)) return 0;
+    return yields;
+}
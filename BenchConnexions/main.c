@@ -0,0 +1,394 @@
+//
+//  main.c
+//  BenchConnexions
+//
+//  Created by Alex Nichol on 12/4/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "bench.h"
+#include <arpa/inet.h>
+#include <signal.h>
+
+#define BENCH_MAX_LIST 16
+
+typedef struct {
+    size_t sizes[BENCH_MAX_LIST];
+    int sizeCount;
+    int connections[BENCH_MAX_LIST];
+    int connectionCount;
+    int iterations; // round trips per connection
+    uint64_t bytes; // bytes sent per connection for throughput
+    FILE * output;
+} bench_options_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int open;
+} bench_gate_t;
+
+typedef struct {
+    int fd;
+    size_t size;
+    int iterations;
+    uint64_t bytes;
+    bench_gate_t * gate;
+    bench_samples_t samples;
+    int failed;
+} bench_worker_t;
+
+static int bench_parse_list(const char * str, long * values, int max);
+static void bench_usage(const char * name);
+static int bench_run_latency(bench_options_t * options, uint16_t port, size_t size, int connections, int * first);
+static int bench_run_throughput(bench_options_t * options, uint16_t port, size_t size, int connections, int * first);
+static int bench_run_workers(uint16_t port, int connections, bench_worker_t * workers, void * (*main)(void *));
+static void * bench_latency_main(void * arg);
+static void * bench_throughput_main(void * arg);
+static void bench_gate_wait(bench_gate_t * gate);
+static void bench_print_stages(FILE * output);
+
+int main(int argc, const char * argv[]) {
+    // the loopback servers may write to clients that just went away
+    signal(SIGPIPE, SIG_IGN);
+#ifdef __APPLE__
+    if (argc > 1 && !strcmp(argv[1], "churn")) {
+        return bench_churn_main(argc - 1, &argv[1]);
+    }
+    if (argc > 1 && !strcmp(argv[1], "eyeballs")) {
+        return bench_eyeballs_main(argc - 1, &argv[1]);
+    }
+    if (argc > 1 && !strcmp(argv[1], "capture")) {
+        return bench_capture_main(argc - 1, &argv[1]);
+    }
+    if (argc > 1 && !strcmp(argv[1], "replay")) {
+        return bench_replay_main(argc - 1, &argv[1]);
+    }
+    if (argc > 1 && !strcmp(argv[1], "contention")) {
+        return bench_contention_main(argc - 1, &argv[1]);
+    }
+    if (argc > 1 && !strcmp(argv[1], "unload")) {
+        return bench_unload_main(argc - 1, &argv[1]);
+    }
+    if (argc > 1 && !strcmp(argv[1], "fairness")) {
+        return bench_fairness_main(argc - 1, &argv[1]);
+    }
+#endif
+    if (argc > 1 && !strcmp(argv[1], "ring")) {
+        return bench_ring_main(argc - 1, &argv[1]);
+    }
+    if (argc > 1 && !strcmp(argv[1], "codec")) {
+        return bench_codec_main(argc - 1, &argv[1]);
+    }
+    if (argc > 1 && !strcmp(argv[1], "sendfile")) {
+        return bench_sendfile_main(argc - 1, &argv[1]);
+    }
+    if (argc > 1 && !strcmp(argv[1], "ttfb")) {
+        return bench_ttfb_main(argc - 1, &argv[1]);
+    }
+    
+    bench_options_t options;
+    bzero(&options, sizeof(options));
+    size_t defaultSizes[] = {16, 256, 4096, 65535};
+    int defaultConnections[] = {1, 4, 16};
+    memcpy(options.sizes, defaultSizes, sizeof(defaultSizes));
+    options.sizeCount = 4;
+    memcpy(options.connections, defaultConnections, sizeof(defaultConnections));
+    options.connectionCount = 3;
+    options.iterations = 2000;
+    options.bytes = 16 * 1024 * 1024;
+    options.output = stdout;
+
+    for (int i = 1; i < argc; i++) {
+        long values[BENCH_MAX_LIST];
+        if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            options.sizeCount = bench_parse_list(argv[++i], values, BENCH_MAX_LIST);
+            for (int j = 0; j < options.sizeCount; j++) options.sizes[j] = (size_t)values[j];
+        } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            options.connectionCount = bench_parse_list(argv[++i], values, BENCH_MAX_LIST);
+            for (int j = 0; j < options.connectionCount; j++) options.connections[j] = (int)values[j];
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            options.iterations = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+            options.bytes = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            const char * mode = argv[++i];
+            if (!strcmp(mode, "datagram")) {
+                bench_ksocket_mode = KSOCKET_MODE_DATAGRAM;
+            } else if (!strcmp(mode, "ring")) {
+                bench_ksocket_rings = 1;
+            } else if (!strcmp(mode, "tcp")) {
+                bench_plain_tcp = 1;
+            } else if (strcmp(mode, "stream")) {
+                bench_usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-T")) {
+            bench_ksocket_timestamps = 1;
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            options.output = fopen(argv[++i], "w");
+            if (!options.output) {
+                perror("fopen");
+                return 1;
+            }
+        } else {
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    bench_server_t echo, sink;
+    if (bench_server_start(&echo, BENCH_SERVER_ECHO) || bench_server_start(&sink, BENCH_SERVER_SINK)) {
+        fprintf(stderr, "failed to start loopback servers\n");
+        return 1;
+    }
+
+    int first = 1;
+    int failed = 0;
+    fprintf(options.output, "{\"benchmark\": \"pipeline\", \"mode\": \"%s\", \"results\": [\n",
+            bench_plain_tcp ? "tcp" : (bench_ksocket_rings ? "ring" :
+                                       (bench_ksocket_mode == KSOCKET_MODE_DATAGRAM ? "datagram" : "stream")));
+    for (int c = 0; c < options.connectionCount && !failed; c++) {
+        for (int s = 0; s < options.sizeCount && !failed; s++) {
+            failed |= bench_run_latency(&options, echo.port, options.sizes[s], options.connections[c], &first);
+            failed |= bench_run_throughput(&options, sink.port, options.sizes[s], options.connections[c], &first);
+        }
+    }
+    fprintf(options.output, "\n]");
+    if (bench_ksocket_timestamps) bench_print_stages(options.output);
+    fprintf(options.output, "}\n");
+    if (options.output != stdout) fclose(options.output);
+
+    bench_server_stop(&echo);
+    bench_server_stop(&sink);
+#ifdef __APPLE__
+    if (failed) fprintf(stderr, "benchmark aborted: is the KernelConnexions kext loaded?\n");
+#else
+    if (failed) fprintf(stderr, "benchmark aborted: is connexionsd running?\n");
+#endif
+    return failed ? 1 : 0;
+}
+
+#pragma mark - Runs -
+
+static int bench_run_latency(bench_options_t * options, uint16_t port, size_t size, int connections, int * first) {
+    bench_worker_t * workers = (bench_worker_t *)calloc(connections, sizeof(bench_worker_t));
+    for (int i = 0; i < connections; i++) {
+        workers[i].size = size;
+        workers[i].iterations = options->iterations;
+        bench_samples_init(&workers[i].samples);
+    }
+    uint64_t start = bench_now_ns();
+    int failed = bench_run_workers(port, connections, workers, bench_latency_main);
+    uint64_t elapsed = bench_now_ns() - start;
+
+    bench_samples_t all;
+    bench_samples_init(&all);
+    for (int i = 0; i < connections; i++) {
+        bench_samples_merge(&all, &workers[i].samples);
+        bench_samples_free(&workers[i].samples);
+    }
+    free(workers);
+    if (failed) {
+        bench_samples_free(&all);
+        return -1;
+    }
+
+    double seconds = (double)elapsed / 1e9;
+    double megabytes = (double)all.count * size * 2 / (1024.0 * 1024.0);
+    uint64_t p50 = bench_samples_percentile(&all, 0.50);
+    uint64_t p99 = bench_samples_percentile(&all, 0.99);
+    uint64_t p999 = bench_samples_percentile(&all, 0.999);
+    fprintf(options->output, "%s  {\"test\": \"latency\", \"size\": %zu, \"connections\": %d, "
+            "\"round_trips\": %zu, \"mb_per_sec\": %.3f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}",
+            *first ? "" : ",\n", size, connections, all.count, megabytes / seconds,
+            p50 / 1000.0, p99 / 1000.0, p999 / 1000.0);
+    *first = 0;
+    fprintf(stderr, "latency    size=%-6zu conns=%-4d p50=%.1fus p99=%.1fus p999=%.1fus\n",
+            size, connections, p50 / 1000.0, p99 / 1000.0, p999 / 1000.0);
+    bench_samples_free(&all);
+    return 0;
+}
+
+static int bench_run_throughput(bench_options_t * options, uint16_t port, size_t size, int connections, int * first) {
+    bench_worker_t * workers = (bench_worker_t *)calloc(connections, sizeof(bench_worker_t));
+    for (int i = 0; i < connections; i++) {
+        workers[i].size = size;
+        workers[i].bytes = options->bytes - options->bytes % size;
+        bench_samples_init(&workers[i].samples);
+    }
+    uint64_t start = bench_now_ns();
+    int failed = bench_run_workers(port, connections, workers, bench_throughput_main);
+    uint64_t elapsed = bench_now_ns() - start;
+
+    uint64_t total = 0;
+    for (int i = 0; i < connections; i++) {
+        total += workers[i].bytes;
+        bench_samples_free(&workers[i].samples);
+    }
+    free(workers);
+    if (failed) return -1;
+
+    double megabytes = (double)total / (1024.0 * 1024.0);
+    double seconds = (double)elapsed / 1e9;
+    fprintf(options->output, "%s  {\"test\": \"throughput\", \"size\": %zu, \"connections\": %d, "
+            "\"bytes\": %llu, \"seconds\": %.6f, \"mb_per_sec\": %.3f}",
+            *first ? "" : ",\n", size, connections, (unsigned long long)total, seconds, megabytes / seconds);
+    *first = 0;
+    fprintf(stderr, "throughput size=%-6zu conns=%-4d %.2f MB/s\n", size, connections, megabytes / seconds);
+    return 0;
+}
+
+static int bench_run_workers(uint16_t port, int connections, bench_worker_t * workers, void * (*main)(void *)) {
+    bench_gate_t gate;
+    pthread_mutex_init(&gate.lock, NULL);
+    pthread_cond_init(&gate.cond, NULL);
+    gate.open = 0;
+
+    pthread_t * threads = (pthread_t *)calloc(connections, sizeof(pthread_t));
+    int started = 0;
+    int failed = 0;
+    for (int i = 0; i < connections; i++) {
+        workers[i].gate = &gate;
+        workers[i].fd = bench_conn_open(port);
+        if (workers[i].fd < 0) {
+            failed = 1;
+            break;
+        }
+        if (pthread_create(&threads[i], NULL, main, &workers[i])) {
+            bench_conn_close(workers[i].fd);
+            failed = 1;
+            break;
+        }
+        started++;
+    }
+
+    pthread_mutex_lock(&gate.lock);
+    gate.open = failed ? -1 : 1;
+    pthread_cond_broadcast(&gate.cond);
+    pthread_mutex_unlock(&gate.lock);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        bench_conn_close(workers[i].fd);
+        failed |= workers[i].failed;
+    }
+    free(threads);
+    pthread_cond_destroy(&gate.cond);
+    pthread_mutex_destroy(&gate.lock);
+    return failed;
+}
+
+#pragma mark - Workers -
+
+static void * bench_latency_main(void * arg) {
+    bench_worker_t * worker = (bench_worker_t *)arg;
+    char * message = (char *)malloc(worker->size);
+    memset(message, 'k', worker->size);
+    bench_gate_wait(worker->gate);
+    if (worker->gate->open < 0) worker->iterations = 0;
+
+    for (int i = 0; i < worker->iterations; i++) {
+        uint64_t start = bench_now_ns();
+        if (bench_conn_send(worker->fd, message, worker->size)) {
+            worker->failed = 1;
+            break;
+        }
+        if (bench_conn_read_exact(worker->fd, worker->size)) {
+            worker->failed = 1;
+            break;
+        }
+        bench_samples_add(&worker->samples, bench_now_ns() - start);
+    }
+    free(message);
+    return NULL;
+}
+
+static void * bench_throughput_main(void * arg) {
+    bench_worker_t * worker = (bench_worker_t *)arg;
+    char * message = (char *)malloc(worker->size);
+    memset(message, 'k', worker->size);
+    bench_gate_wait(worker->gate);
+    if (worker->gate->open < 0) {
+        free(message);
+        worker->bytes = 0;
+        return NULL;
+    }
+
+    uint32_t lengthBig[2] = {htonl((uint32_t)(worker->bytes >> 32)), htonl((uint32_t)worker->bytes)};
+    if (bench_conn_send(worker->fd, lengthBig, 8)) {
+        worker->failed = 1;
+    }
+    for (uint64_t sent = 0; sent < worker->bytes && !worker->failed; sent += worker->size) {
+        if (bench_conn_send(worker->fd, message, worker->size)) {
+            worker->failed = 1;
+        }
+    }
+    // the sink acks once every byte has made it through the pipeline
+    if (!worker->failed && bench_conn_read_exact(worker->fd, 1)) {
+        worker->failed = 1;
+    }
+    free(message);
+    return NULL;
+}
+
+#pragma mark - Private -
+
+static void bench_gate_wait(bench_gate_t * gate) {
+    pthread_mutex_lock(&gate->lock);
+    while (!gate->open) {
+        pthread_cond_wait(&gate->cond, &gate->lock);
+    }
+    pthread_mutex_unlock(&gate->lock);
+}
+
+static void bench_print_stages(FILE * output) {
+    // every run above lands in the same histograms
+    ksocket_stage_histogram_t histograms[KSOCKET_STAGE_COUNT];
+    ksocket_get_stage_histograms(histograms);
+    fprintf(output, ", \"stages\": [\n");
+    for (int i = 0; i < KSOCKET_STAGE_COUNT; i++) {
+        ksocket_stage_histogram_t * histogram = &histograms[i];
+        double mean = histogram->samples ? (double)histogram->totalNs / histogram->samples / 1000.0 : 0.0;
+        double p50 = ksocket_stage_percentile(histogram, 0.50) / 1000.0;
+        double p99 = ksocket_stage_percentile(histogram, 0.99) / 1000.0;
+        fprintf(output, "%s  {\"stage\": \"%s\", \"samples\": %llu, \"mean_us\": %.2f, "
+                "\"p50_us\": %.0f, \"p99_us\": %.0f, \"max_us\": %.2f}", i ? ",\n" : "",
+                ksocket_stage_name(i), (unsigned long long)histogram->samples, mean, p50, p99,
+                histogram->maxNs / 1000.0);
+        fprintf(stderr, "stage %-15s samples=%-9llu mean=%.1fus p50<=%.0fus p99<=%.0fus\n", ksocket_stage_name(i),
+                (unsigned long long)histogram->samples, mean, p50, p99);
+    }
+    fprintf(output, "\n]");
+}
+
+static int bench_parse_list(const char * str, long * values, int max) {
+    int count = 0;
+    const char * p = str;
+    while (*p && count < max) {
+        char * end = NULL;
+        values[count++] = strtol(p, &end, 10);
+        if (end == p) break;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return count;
+}
+
+static void bench_usage(const char * name) {
+    fprintf(stderr, "Usage: %s [-s sizes] [-c connections] [-n round trips] [-b bytes] [-m stream|datagram|ring|tcp] [-T] [-o output.json]\n"
+            "       %s churn [-c concurrency] [-n cycles] [-x factor] [-o output.json]\n"
+            "       %s eyeballs [-a blackhole-ipv4] [-n iterations] [-t stagger-ms] [-o output.json]\n"
+            "       %s ring [-r ring-size] [-n frames] [-s max-frame] [-b budget] [-o output.json]\n"
+            "       %s capture [-w capture.kcc] [-n records]\n"
+            "       %s replay -i capture.kcc [-x speed] [-m stream|datagram|ring] [-o output.json]\n"
+            "       %s contention [-c connections] [-t seconds] [-s size] [-r reconnect-every] [-o output.json]\n"
+            "       %s unload [-c connections] [-w queued-bytes-each] [-t drain-timeout-ms] [-o output.json]\n"
+            "       %s fairness [-c small-connections] [-b bulk-connections] [-t seconds] [-s size] [-w bulk-weight] [-W small-weight] [-o output.json]\n"
+            "       %s codec [-n operations] [-r rounds] [-o output.json]\n"
+            "       %s sendfile [-s megabytes] [-n runs] [-f file] [-o output.json]\n"
+            "       %s ttfb [-n exchanges] [-s request-bytes] [-o output.json]\n"
+            "  sizes and connections are comma separated lists, e.g. -s 16,4096 -c 1,8\n"
+            "  -m tcp runs the same traffic over plain sockets, as a baseline\n"
+            "  -T stamps every frame and adds per-stage latency histograms to the results\n"
+            "  results are written as JSON; a summary goes to stderr\n", name, name, name, name, name, name, name, name, name, name, name, name);
+}
@@ -0,0 +1,412 @@
+//
+//  replay.c
+//  BenchConnexions
+//
+//  Created by Alex Nichol on 12/13/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "bench.h"
+#include <arpa/inet.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/sysctl.h>
+
+#define REPLAY_MAGIC 0x4b434350 // "KCCP"
+#define REPLAY_VERSION 1
+#define REPLAY_MAX_CONTROLS 1024
+
+#define REPLAY_TO_KEXT 0
+#define REPLAY_TO_CLIENT 1
+
+#define REPLAY_OP_CONNECT 0
+#define REPLAY_OP_SEND 1
+#define REPLAY_OP_CLOSE 2
+#define REPLAY_OP_COUNT 3
+
+// mirrors KCCaptureRecord in the kext
+typedef struct {
+    uint64_t time;
+    uint32_t control;
+    uint16_t length;
+    uint8_t type;
+    uint8_t direction;
+} replay_record_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+    uint64_t dropped; // the capture filled up and missed this many frames
+} replay_file_header_t;
+
+typedef struct {
+    const replay_record_t * records; // this control's frames to the kext, oldest first
+    size_t count;
+    uint16_t port;
+    double speed; // 0 replays as fast as possible
+    const char * payload;
+    volatile uint64_t * start;
+    bench_samples_t samples[REPLAY_OP_COUNT]; // completion minus scheduled time
+    uint64_t bytes;
+    uint64_t skipped; // SENDs with no connection to go on
+    int failed;
+} replay_worker_t;
+
+static int replay_load(const char * path, replay_record_t ** records, size_t * count, uint64_t * dropped);
+static size_t replay_split(replay_record_t * records, size_t count, replay_worker_t * workers, int * controls);
+static int replay_compare(const void * a, const void * b);
+static void * replay_worker_main(void * arg);
+static void replay_sleep_until(uint64_t deadline);
+
+#pragma mark - Capture -
+
+int bench_capture_main(int argc, const char * argv[]) {
+    long records = -1;
+    const char * path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            records = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            path = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [-w capture.kcc] [-n records]\n"
+                    "  -w saves what the kext has captured so far; -n then starts over (0 stops)\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!path && records < 0) records = 100000;
+
+    if (path) {
+        size_t size = 0;
+        if (sysctlbyname("net.kernelconnexions.capture", NULL, &size, NULL, 0)) {
+            perror("sysctl net.kernelconnexions.capture");
+            return 1;
+        }
+        // the capture may grow between asking and reading
+        size += 4096 * sizeof(replay_record_t);
+        replay_record_t * buffer = (replay_record_t *)malloc(size);
+        if (sysctlbyname("net.kernelconnexions.capture", buffer, &size, NULL, 0)) {
+            perror("sysctl net.kernelconnexions.capture");
+            free(buffer);
+            return 1;
+        }
+        replay_file_header_t header;
+        header.magic = REPLAY_MAGIC;
+        header.version = REPLAY_VERSION;
+        header.count = size / sizeof(replay_record_t);
+        header.dropped = 0;
+        size_t droppedSize = sizeof(header.dropped);
+        sysctlbyname("net.kernelconnexions.capture_dropped", &header.dropped, &droppedSize, NULL, 0);
+
+        FILE * file = fopen(path, "wb");
+        if (!file) {
+            perror("fopen");
+            free(buffer);
+            return 1;
+        }
+        int failed = fwrite(&header, sizeof(header), 1, file) != 1;
+        if (header.count) {
+            failed |= fwrite(buffer, sizeof(replay_record_t), header.count, file) != header.count;
+        }
+        failed |= fclose(file) != 0;
+        free(buffer);
+        if (failed) {
+            fprintf(stderr, "failed to write %s\n", path);
+            return 1;
+        }
+        fprintf(stderr, "saved %llu frames to %s", (unsigned long long)header.count, path);
+        if (header.dropped) fprintf(stderr, " (%llu more were missed)", (unsigned long long)header.dropped);
+        fprintf(stderr, "\n");
+    }
+
+    if (records >= 0) {
+        int value = (int)records;
+        if (sysctlbyname("net.kernelconnexions.capture_records", NULL, NULL, &value, sizeof(value))) {
+            perror("sysctl net.kernelconnexions.capture_records");
+            return 1;
+        }
+        if (value) fprintf(stderr, "capturing up to %d frames\n", value);
+    }
+    return 0;
+}
+
+#pragma mark - Replay -
+
+int bench_replay_main(int argc, const char * argv[]) {
+    const char * path = NULL;
+    double speed = 1;
+    FILE * output = stdout;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+            path = argv[++i];
+        } else if (!strcmp(argv[i], "-x") && i + 1 < argc) {
+            speed = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            const char * mode = argv[++i];
+            if (!strcmp(mode, "datagram")) {
+                bench_ksocket_mode = KSOCKET_MODE_DATAGRAM;
+            } else if (!strcmp(mode, "ring")) {
+                bench_ksocket_rings = 1;
+            } else if (strcmp(mode, "stream")) {
+                path = NULL;
+                break;
+            }
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = fopen(argv[++i], "w");
+            if (!output) {
+                perror("fopen");
+                return 1;
+            }
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (!path || speed < 0) {
+        fprintf(stderr, "Usage: %s -i capture.kcc [-x speed] [-m stream|datagram|ring] [-o output.json]\n"
+                "  -x 1 keeps the recorded timing, 10 runs ten times faster, 0 as fast as possible\n", argv[0]);
+        return 1;
+    }
+
+    replay_record_t * records;
+    size_t count;
+    uint64_t dropped;
+    if (replay_load(path, &records, &count, &dropped)) return 1;
+    if (dropped) {
+        fprintf(stderr, "warning: the capture missed %llu frames after it filled up\n", (unsigned long long)dropped);
+    }
+
+    uint64_t recorded = count ? records[count - 1].time : 0;
+    replay_worker_t * workers = (replay_worker_t *)calloc(REPLAY_MAX_CONTROLS, sizeof(replay_worker_t));
+    int controls = 0;
+    size_t frames = replay_split(records, count, workers, &controls);
+    if (controls > REPLAY_MAX_CONTROLS) {
+        fprintf(stderr, "the capture has %d controls; at most %d can be replayed\n", controls, REPLAY_MAX_CONTROLS);
+        free(workers);
+        free(records);
+        return 1;
+    }
+
+    // recorded CONNECTs are redirected here, whatever address they named; a
+    // HOLD server reads and discards, where the SINK one expects its framing
+    bench_server_t sink;
+    if (bench_server_start(&sink, BENCH_SERVER_HOLD)) {
+        fprintf(stderr, "failed to start loopback listener\n");
+        free(workers);
+        free(records);
+        return 1;
+    }
+    char * payload = (char *)calloc(1, 0xFFFF);
+    volatile uint64_t start = 0;
+    pthread_t * threads = (pthread_t *)calloc(controls, sizeof(pthread_t));
+    int started = 0;
+    for (; started < controls; started++) {
+        replay_worker_t * worker = &workers[started];
+        worker->port = sink.port;
+        worker->speed = speed;
+        worker->payload = payload;
+        worker->start = &start;
+        for (int j = 0; j < REPLAY_OP_COUNT; j++) bench_samples_init(&worker->samples[j]);
+        if (pthread_create(&threads[started], NULL, replay_worker_main, worker)) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    // give every thread a moment to reach its first wait before the clock starts
+    replay_sleep_until(bench_now_ns() + 100000000ull);
+    uint64_t began = bench_now_ns();
+    __atomic_store_n(&start, began, __ATOMIC_RELEASE);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed = bench_now_ns() - began;
+    bench_server_stop(&sink);
+
+    const char * names[REPLAY_OP_COUNT] = {"connect", "send", "close"};
+    bench_samples_t all[REPLAY_OP_COUNT];
+    uint64_t bytes = 0, skipped = 0;
+    int failed = started < controls;
+    for (int j = 0; j < REPLAY_OP_COUNT; j++) bench_samples_init(&all[j]);
+    for (int i = 0; i < started; i++) {
+        for (int j = 0; j < REPLAY_OP_COUNT; j++) {
+            bench_samples_merge(&all[j], &workers[i].samples[j]);
+            bench_samples_free(&workers[i].samples[j]);
+        }
+        bytes += workers[i].bytes;
+        skipped += workers[i].skipped;
+        failed |= workers[i].failed;
+    }
+
+    double seconds = (double)elapsed / 1e9;
+    fprintf(output, "{\"benchmark\": \"replay\", \"capture\": \"%s\", \"speed\": %.3f, \"controls\": %d, "
+            "\"frames\": %zu, \"recorded_seconds\": %.6f, \"seconds\": %.6f, \"bytes\": %llu, "
+            "\"mb_per_sec\": %.3f, \"frames_per_sec\": %.1f, \"skipped_sends\": %llu, \"latency\": [\n",
+            path, speed, controls, frames, recorded / 1e9, seconds, (unsigned long long)bytes,
+            bytes / (1024.0 * 1024.0) / seconds, frames / seconds, (unsigned long long)skipped);
+    fprintf(stderr, "replayed %zu frames from %d controls in %.3fs (recorded over %.3fs): %.2f MB/s\n",
+            frames, controls, seconds, recorded / 1e9, bytes / (1024.0 * 1024.0) / seconds);
+    for (int j = 0; j < REPLAY_OP_COUNT; j++) {
+        size_t samples = all[j].count;
+        uint64_t p50 = bench_samples_percentile(&all[j], 0.50);
+        uint64_t p99 = bench_samples_percentile(&all[j], 0.99);
+        uint64_t p999 = bench_samples_percentile(&all[j], 0.999);
+        uint64_t max = bench_samples_percentile(&all[j], 1.0);
+        fprintf(output, "%s  {\"frame\": \"%s\", \"count\": %zu, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+                "\"p999_us\": %.2f, \"max_us\": %.2f}", j ? ",\n" : "", names[j], samples,
+                p50 / 1000.0, p99 / 1000.0, p999 / 1000.0, max / 1000.0);
+        fprintf(stderr, "%-8s n=%-8zu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+                names[j], samples, p50 / 1000.0, p99 / 1000.0, p999 / 1000.0, max / 1000.0);
+        bench_samples_free(&all[j]);
+    }
+    fprintf(output, "\n]}\n");
+    if (output != stdout) fclose(output);
+
+    free(threads);
+    free(payload);
+    free(workers);
+    free(records);
+    if (failed) {
+        fprintf(stderr, "replay aborted: is the KernelConnexions kext loaded?\n");
+        return 1;
+    }
+    return 0;
+}
+
+#pragma mark - Private -
+
+static int replay_load(const char * path, replay_record_t ** records, size_t * count, uint64_t * dropped) {
+    FILE * file = fopen(path, "rb");
+    if (!file) {
+        perror("fopen");
+        return -1;
+    }
+    replay_file_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != REPLAY_MAGIC ||
+        header.version != REPLAY_VERSION) {
+        fprintf(stderr, "%s is not a capture\n", path);
+        fclose(file);
+        return -1;
+    }
+    *records = (replay_record_t *)malloc(sizeof(replay_record_t) * (header.count ? header.count : 1));
+    if (fread(*records, sizeof(replay_record_t), header.count, file) != header.count) {
+        fprintf(stderr, "%s is truncated\n", path);
+        free(*records);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    *count = header.count;
+    *dropped = header.dropped;
+    return 0;
+}
+
+/**
+ * Keep the frames clients sent, grouped by control. Returns how many are left.
+ */
+static size_t replay_split(replay_record_t * records, size_t count, replay_worker_t * workers, int * controls) {
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        replay_record_t * record = &records[i];
+        if (record->direction != REPLAY_TO_KEXT) continue;
+        if (record->type == CONTROL_PACKET_SEND_STAMPED && record->length >= 8) {
+            // the payload is made up anyway, so replay it as a plain send
+            record->type = CONTROL_PACKET_SEND;
+            record->length -= 8;
+        }
+        if (record->type != CONTROL_PACKET_CONNECT && record->type != CONTROL_PACKET_CONNECT_MULTI &&
+            record->type != CONTROL_PACKET_CONNECT_DATA && record->type != CONTROL_PACKET_SEND &&
+            record->type != CONTROL_PACKET_CLOSE) continue;
+        records[kept++] = *record;
+    }
+    // ties keep their recorded order
+    qsort(records, kept, sizeof(replay_record_t), replay_compare);
+
+    *controls = 0;
+    for (size_t i = 0; i < kept; i++) {
+        if (i == 0 || records[i].control != records[i - 1].control) {
+            if (*controls < REPLAY_MAX_CONTROLS) workers[*controls].records = &records[i];
+            (*controls)++;
+        }
+        if (*controls <= REPLAY_MAX_CONTROLS) workers[*controls - 1].count++;
+    }
+    return kept;
+}
+
+static int replay_compare(const void * a, const void * b) {
+    const replay_record_t * x = (const replay_record_t *)a;
+    const replay_record_t * y = (const replay_record_t *)b;
+    if (x->control != y->control) return x->control < y->control ? -1 : 1;
+    if (x->time != y->time) return x->time < y->time ? -1 : 1;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void * replay_worker_main(void * arg) {
+    replay_worker_t * worker = (replay_worker_t *)arg;
+    uint64_t start;
+    while (!(start = __atomic_load_n(worker->start, __ATOMIC_ACQUIRE))) {
+        replay_sleep_until(bench_now_ns() + 1000000ull);
+    }
+    struct in_addr loopback;
+    loopback.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = -1;
+    int connected = 0;
+    for (size_t i = 0; i < worker->count && !worker->failed; i++) {
+        const replay_record_t * record = &worker->records[i];
+        uint64_t scheduled = worker->speed > 0 ? start + (uint64_t)(record->time / worker->speed) : bench_now_ns();
+        replay_sleep_until(scheduled);
+
+        int op;
+        if (record->type == CONTROL_PACKET_SEND) {
+            op = REPLAY_OP_SEND;
+            if (!connected) {
+                worker->skipped++;
+                continue;
+            }
+            if (ksocket_send(fd, worker->payload, record->length) < 0) {
+                // the recorded peer may well have hung up here too
+                connected = 0;
+                continue;
+            }
+            worker->bytes += record->length;
+        } else if (record->type == CONTROL_PACKET_CLOSE) {
+            op = REPLAY_OP_CLOSE;
+            if (!connected) continue;
+            ksocket_disconnect(fd);
+            connected = 0;
+        } else {
+            op = REPLAY_OP_CONNECT;
+            // a recorded CONNECT_DATA connects with as much early data again
+            uint16_t early = 0;
+            if (record->type == CONTROL_PACKET_CONNECT_DATA && record->length > KC_CONNECT_DATA_IPV4_SIZE) {
+                early = record->length - KC_CONNECT_DATA_IPV4_SIZE;
+            }
+            if (fd < 0) {
+                if ((fd = bench_ksocket_open(worker->port)) < 0 ||
+                    (early && ksocket_send(fd, worker->payload, early))) {
+                    worker->failed = 1;
+                    break;
+                }
+            } else if (record->type == CONTROL_PACKET_CONNECT_DATA ?
+                       ksocket_connect_ipv4_data(fd, &loopback, worker->port, worker->payload, early) :
+                       ksocket_connect_ipv4(fd, &loopback, worker->port)) {
+                worker->failed = 1;
+                break;
+            }
+            worker->bytes += early;
+            connected = 1;
+        }
+        bench_samples_add(&worker->samples[op], bench_now_ns() - scheduled);
+    }
+    if (fd >= 0) ksocket_close(fd);
+    return NULL;
+}
+
+static void replay_sleep_until(uint64_t deadline) {
+    uint64_t now = bench_now_ns();
+    if (now >= deadline) return;
+    struct timespec wait;
+    wait.tv_sec = (time_t)((deadline - now) / 1000000000ull);
+    wait.tv_nsec = (long)((deadline - now) % 1000000000ull);
+    nanosleep(&wait, NULL);
+}
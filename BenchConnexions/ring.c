@@ -0,0 +1,243 @@
+//
+//  ring.c
+//  BenchConnexions
+//
+//  Created by Alex Nichol on 12/12/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "bench.h"
+#include "../KernelConnexions/ring.h"
+
+// exercises the shared ring on its own, with a thread on either end standing
+// in for the client and the kext, so it runs without the kext loaded. With a
+// budget, the consumer charges frames the way the kext does and leaves them
+// in the ring while it is refused, and the producer backs off like
+// ksocket_ring_write()
+
+#define RING_BUDGET_RETRY 1000 // microseconds the consumer waits before trying a refused frame again
+#define RING_BACKOFF_MIN 50 // microseconds
+#define RING_BACKOFF_MAX 1000
+
+typedef struct {
+    KCRing ring; // each side keeps its own view
+    pthread_mutex_t lock; // stands in for the doorbell
+    pthread_cond_t cond;
+    uint64_t doorbells;
+    uint64_t frames;
+    uint16_t maxLength;
+    volatile int mismatches;
+} ring_side_t;
+
+typedef struct {
+    ring_side_t producer;
+    ring_side_t consumer;
+    volatile uint64_t producerRings; // bumped by the consumer
+    volatile uint64_t consumerRings; // bumped by the producer
+    uint32_t budget; // bytes of handled frames the consumer may hold; 0 for no limit
+    uint64_t refusals; // frames the consumer left in the ring for a while
+    uint64_t backoffs; // times the producer found the ring full and slept
+} ring_test_t;
+
+static void * ring_producer_main(void * arg);
+static void * ring_consumer_main(void * arg);
+static void ring_doorbell(ring_side_t * side, volatile uint64_t * counter);
+static void ring_sleep(ring_side_t * side, volatile uint64_t * counter, uint64_t seen);
+static uint16_t ring_frame_length(uint64_t index, uint16_t maxLength);
+static uint8_t ring_frame_byte(uint64_t index, uint16_t offset);
+
+int bench_ring_main(int argc, const char * argv[]) {
+    uint32_t size = KC_RING_MIN_SIZE;
+    uint64_t frames = 1000000;
+    long maxLength = 4096;
+    long budget = 0;
+    FILE * output = stdout;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            size = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            frames = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            maxLength = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+            budget = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = fopen(argv[++i], "w");
+            if (!output) {
+                perror("fopen");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [-r ring-size] [-n frames] [-s max-frame] [-b budget] [-o output.json]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!kc_ring_valid_size(size) || maxLength < 1 || maxLength > 0xffff) {
+        fprintf(stderr, "ring size must be a power of two from %d to %d, frames at most 65535 bytes\n",
+                KC_RING_MIN_SIZE, KC_RING_MAX_SIZE);
+        return 1;
+    }
+    if (budget && (budget < maxLength + KC_FRAME_HEADER_SIZE || budget > INT32_MAX)) {
+        // a frame bigger than the budget would never be let through
+        fprintf(stderr, "the budget must have room for the largest frame and its header\n");
+        return 1;
+    }
+
+    void * memory = malloc(kc_ring_total_size(size));
+    if (!memory) return 1;
+    ring_test_t test;
+    bzero(&test, sizeof(test));
+    test.budget = (uint32_t)budget;
+    kc_ring_format(&test.consumer.ring, memory, size);
+    kc_ring_open(&test.producer.ring, memory, kc_ring_total_size(size));
+    ring_side_t * sides[2] = {&test.producer, &test.consumer};
+    for (int i = 0; i < 2; i++) {
+        pthread_mutex_init(&sides[i]->lock, NULL);
+        pthread_cond_init(&sides[i]->cond, NULL);
+        sides[i]->frames = frames;
+        sides[i]->maxLength = (uint16_t)maxLength;
+    }
+
+    pthread_t producer, consumer;
+    uint64_t start = bench_now_ns();
+    pthread_create(&consumer, NULL, ring_consumer_main, &test);
+    pthread_create(&producer, NULL, ring_producer_main, &test);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    uint64_t elapsed = bench_now_ns() - start;
+
+    uint64_t bytes = 0;
+    for (uint64_t i = 0; i < frames; i++) {
+        bytes += ring_frame_length(i, (uint16_t)maxLength);
+    }
+    double seconds = (double)elapsed / 1e9;
+    int mismatches = test.consumer.mismatches;
+    fprintf(output, "{\"benchmark\": \"ring\", \"ring_size\": %u, \"frames\": %llu, \"bytes\": %llu, "
+            "\"seconds\": %.6f, \"frames_per_sec\": %.0f, \"mb_per_sec\": %.3f, "
+            "\"consumer_doorbells\": %llu, \"producer_doorbells\": %llu, \"budget\": %u, \"refusals\": %llu, "
+            "\"backoffs\": %llu, \"mismatches\": %d}\n",
+            size, (unsigned long long)frames, (unsigned long long)bytes, seconds, frames / seconds,
+            bytes / (1024.0 * 1024.0) / seconds, (unsigned long long)test.producer.doorbells,
+            (unsigned long long)test.consumer.doorbells, test.budget, (unsigned long long)test.refusals,
+            (unsigned long long)test.backoffs, mismatches);
+    fprintf(stderr, "ring size=%u %.0f frames/s %.2f MB/s doorbells=%llu/%llu mismatches=%d\n",
+            size, frames / seconds, bytes / (1024.0 * 1024.0) / seconds,
+            (unsigned long long)test.producer.doorbells, (unsigned long long)test.consumer.doorbells, mismatches);
+    if (test.budget) {
+        fprintf(stderr, "budget=%u refusals=%llu backoffs=%llu\n", test.budget,
+                (unsigned long long)test.refusals, (unsigned long long)test.backoffs);
+    }
+    // a budget that never ran out tested nothing
+    int failed = mismatches || (test.budget && !test.refusals && bytes + frames * KC_FRAME_HEADER_SIZE > test.budget);
+    if (output != stdout) fclose(output);
+
+    for (int i = 0; i < 2; i++) {
+        pthread_cond_destroy(&sides[i]->cond);
+        pthread_mutex_destroy(&sides[i]->lock);
+    }
+    free(memory);
+    return failed ? 2 : 0;
+}
+
+#pragma mark - Threads -
+
+static void * ring_producer_main(void * arg) {
+    ring_test_t * test = (ring_test_t *)arg;
+    ring_side_t * side = &test->producer;
+    useconds_t backoff = RING_BACKOFF_MIN;
+    for (uint64_t i = 0; i < side->frames; i++) {
+        uint16_t length = ring_frame_length(i, side->maxLength);
+        uint8_t * body;
+        while (!(body = (uint8_t *)kc_ring_reserve(&side->ring, CONTROL_PACKET_SEND, length))) {
+            if (test->budget) {
+                // a client has no doorbell for the budget, only the ring filling up
+                test->backoffs++;
+                usleep(backoff);
+                if (backoff < RING_BACKOFF_MAX) backoff *= 2;
+                continue;
+            }
+            uint64_t seen = test->producerRings;
+            if (kc_ring_producer_wait(&side->ring, length)) {
+                ring_sleep(side, &test->producerRings, seen);
+            }
+        }
+        backoff = RING_BACKOFF_MIN;
+        for (uint16_t j = 0; j < length; j++) {
+            body[j] = ring_frame_byte(i, j);
+        }
+        if (kc_ring_commit(&side->ring)) {
+            side->doorbells++;
+            ring_doorbell(&test->consumer, &test->consumerRings);
+        }
+    }
+    return NULL;
+}
+
+static void * ring_consumer_main(void * arg) {
+    ring_test_t * test = (ring_test_t *)arg;
+    ring_side_t * side = &test->consumer;
+    uint32_t charged = 0; // handled frames that haven't drained yet
+    for (uint64_t i = 0; i < side->frames; i++) {
+        uint8_t type;
+        uint16_t length;
+        uint8_t * body;
+        while (!(body = (uint8_t *)kc_ring_peek(&side->ring, &type, &length))) {
+            if (side->ring.corrupt) {
+                side->mismatches++;
+                return NULL;
+            }
+            uint64_t seen = test->consumerRings;
+            if (kc_ring_consumer_wait(&side->ring)) {
+                ring_sleep(side, &test->consumerRings, seen);
+            }
+        }
+        if (test->budget) {
+            // refused frames stay put; by the retry, everything handled so
+            // far has gone out, as if the connection had drained its writes
+            while (charged + length + KC_FRAME_HEADER_SIZE > test->budget) {
+                test->refusals++;
+                usleep(RING_BUDGET_RETRY);
+                charged = 0;
+            }
+            charged += length + KC_FRAME_HEADER_SIZE;
+        }
+        int ok = type == CONTROL_PACKET_SEND && length == ring_frame_length(i, side->maxLength);
+        for (uint16_t j = 0; ok && j < length; j++) {
+            ok = body[j] == ring_frame_byte(i, j);
+        }
+        if (!ok) side->mismatches++;
+        if (kc_ring_release(&side->ring, length)) {
+            side->doorbells++;
+            ring_doorbell(&test->producer, &test->producerRings);
+        }
+    }
+    return NULL;
+}
+
+#pragma mark - Private -
+
+static void ring_doorbell(ring_side_t * side, volatile uint64_t * counter) {
+    pthread_mutex_lock(&side->lock);
+    (*counter)++;
+    pthread_cond_signal(&side->cond);
+    pthread_mutex_unlock(&side->lock);
+}
+
+static void ring_sleep(ring_side_t * side, volatile uint64_t * counter, uint64_t seen) {
+    // a doorbell that came in before we got here still counts
+    pthread_mutex_lock(&side->lock);
+    while (*counter == seen) {
+        pthread_cond_wait(&side->cond, &side->lock);
+    }
+    pthread_mutex_unlock(&side->lock);
+}
+
+static uint16_t ring_frame_length(uint64_t index, uint16_t maxLength) {
+    // odd lengths and an occasional empty frame keep the wrap records honest
+    return (uint16_t)((index * 7919) % ((uint64_t)maxLength + 1));
+}
+
+static uint8_t ring_frame_byte(uint64_t index, uint16_t offset) {
+    return (uint8_t)(index * 31 + offset);
+}
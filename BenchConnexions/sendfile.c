@@ -0,0 +1,213 @@
+//
+//  sendfile.c
+//  BenchConnexions
+//
+//  Created by Alex Nichol on 12/19/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "bench.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// uploads one file to the sink three ways: read() into a buffer and
+// ksocket_send() it, ksocket_send_mapped() over a mapping of the whole file,
+// and ksocket_send_file()
+
+#define SENDFILE_READ_SIZE 65536
+
+#define SENDFILE_READ_SEND 0
+#define SENDFILE_MAPPED 1
+#define SENDFILE_FILE 2
+#define SENDFILE_METHODS 3
+
+typedef struct {
+    uint64_t best; // nanoseconds, from the length going out to the sink's ack
+    ksocket_transfer_stats_t stats; // of the best run
+} sendfile_result_t;
+
+static int sendfile_run(int method, uint16_t port, int fd, size_t size, uint64_t * elapsed, ksocket_transfer_stats_t * stats);
+static int sendfile_read_send(int socket, int fd, size_t size, ksocket_transfer_stats_t * stats);
+static int sendfile_make_file(size_t size, char * path, size_t pathSize);
+
+int bench_sendfile_main(int argc, const char * argv[]) {
+    size_t megabytes = 256;
+    int runs = 3;
+    const char * path = NULL;
+    FILE * output = stdout;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            megabytes = (size_t)atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            path = argv[++i];
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = fopen(argv[++i], "w");
+            if (!output) {
+                perror("fopen");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [-s megabytes] [-n runs] [-f file] [-o output.json]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (runs < 1 || (!path && megabytes < 1)) {
+        fprintf(stderr, "runs and size must be positive\n");
+        return 1;
+    }
+
+    // without -f, a scratch file that is removed again afterwards
+    char scratch[64] = "";
+    if (!path) {
+        if (sendfile_make_file(megabytes * 1024 * 1024, scratch, sizeof(scratch))) {
+            perror("creating a scratch file");
+            return 1;
+        }
+        path = scratch;
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) || info.st_size < 1) {
+        fprintf(stderr, "cannot read %s\n", path);
+        if (fd >= 0) close(fd);
+        if (*scratch) unlink(scratch);
+        return 1;
+    }
+    size_t size = (size_t)info.st_size;
+
+    bench_server_t server;
+    if (bench_server_start(&server, BENCH_SERVER_SINK)) {
+        fprintf(stderr, "failed to start loopback server\n");
+        close(fd);
+        if (*scratch) unlink(scratch);
+        return 1;
+    }
+
+    sendfile_result_t results[SENDFILE_METHODS];
+    bzero(results, sizeof(results));
+    int failed = 0;
+    for (int run = 0; run < runs && !failed; run++) {
+        for (int method = 0; method < SENDFILE_METHODS && !failed; method++) {
+            uint64_t elapsed;
+            ksocket_transfer_stats_t stats;
+            if (sendfile_run(method, server.port, fd, size, &elapsed, &stats)) {
+                failed = 1;
+                break;
+            }
+            if (!results[method].best || elapsed < results[method].best) {
+                results[method].best = elapsed;
+                results[method].stats = stats;
+            }
+        }
+    }
+    bench_server_stop(&server);
+    close(fd);
+    if (*scratch) unlink(scratch);
+    if (failed) {
+        fprintf(stderr, "benchmark aborted: is the KernelConnexions kext loaded?\n");
+        return 1;
+    }
+
+    const char * names[] = {"read_send", "send_mapped", "send_file"};
+    fprintf(output, "{\"benchmark\": \"sendfile\", \"bytes\": %zu, \"runs\": %d, \"results\": [\n", size, runs);
+    for (int method = 0; method < SENDFILE_METHODS; method++) {
+        sendfile_result_t * result = &results[method];
+        double megabytesPerSec = size / (1024.0 * 1024.0) / (result->best / 1e9);
+        fprintf(output, "%s  {\"method\": \"%s\", \"seconds\": %.6f, \"mb_per_sec\": %.3f, "
+                "\"frames\": %llu, \"writes\": %llu}",
+                method ? ",\n" : "", names[method], result->best / 1e9, megabytesPerSec,
+                (unsigned long long)result->stats.frames, (unsigned long long)result->stats.writes);
+        fprintf(stderr, "%-12s %9.2f MB/s frames=%-8llu writes=%llu\n", names[method], megabytesPerSec,
+                (unsigned long long)result->stats.frames, (unsigned long long)result->stats.writes);
+    }
+    fprintf(output, "\n]}\n");
+    if (output != stdout) fclose(output);
+    return 0;
+}
+
+#pragma mark - Private -
+
+static int sendfile_run(int method, uint16_t port, int fd, size_t size, uint64_t * elapsed, ksocket_transfer_stats_t * stats) {
+    int socket = bench_ksocket_open(port);
+    if (socket < 0) return -1;
+    void * mapping = NULL;
+    if (method == SENDFILE_MAPPED) {
+        // mapped ahead of time; the point is what sending from it costs
+        mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) {
+            ksocket_close(socket);
+            return -1;
+        }
+    }
+
+    uint64_t start = bench_now_ns();
+    uint32_t lengthBig[2] = {htonl((uint32_t)((uint64_t)size >> 32)), htonl((uint32_t)size)};
+    int result = ksocket_send(socket, lengthBig, 8);
+    if (!result) {
+        if (method == SENDFILE_READ_SEND) {
+            result = sendfile_read_send(socket, fd, size, stats);
+        } else if (method == SENDFILE_MAPPED) {
+            result = ksocket_send_mapped(socket, mapping, size, stats);
+        } else {
+            result = ksocket_send_file(socket, fd, 0, size, stats);
+        }
+    }
+    // the sink acks once every byte has made it through
+    if (!result) result = bench_ksocket_read_exact(socket, 1);
+    *elapsed = bench_now_ns() - start;
+
+    if (mapping) munmap(mapping, size);
+    ksocket_close(socket);
+    return result;
+}
+
+static int sendfile_read_send(int socket, int fd, size_t size, ksocket_transfer_stats_t * stats) {
+    bzero(stats, sizeof(ksocket_transfer_stats_t));
+    char * buff = (char *)malloc(SENDFILE_READ_SIZE);
+    size_t offset = 0;
+    while (offset < size) {
+        size_t want = size - offset < SENDFILE_READ_SIZE ? size - offset : SENDFILE_READ_SIZE;
+        ssize_t got = pread(fd, buff, want, (off_t)offset);
+        if (got <= 0 || ksocket_send(socket, buff, (int)got)) {
+            free(buff);
+            return -1;
+        }
+        // ksocket_send() writes each frame with its own writev()
+        uint64_t frames = (got + KC_FRAME_MAX_BODY - 1) / KC_FRAME_MAX_BODY;
+        offset += got;
+        stats->frames += frames;
+        stats->writes += frames;
+    }
+    free(buff);
+    stats->bytes = size;
+    return 0;
+}
+
+static int sendfile_make_file(size_t size, char * path, size_t pathSize) {
+    snprintf(path, pathSize, "/tmp/ksendfile.XXXXXX");
+    int fd = mkstemp(path);
+    if (fd < 0) return -1;
+    char * buff = (char *)malloc(SENDFILE_READ_SIZE);
+    for (size_t i = 0; i < SENDFILE_READ_SIZE; i++) buff[i] = (char)(i * 31);
+    size_t written = 0;
+    while (written < size) {
+        size_t chunk = size - written < SENDFILE_READ_SIZE ? size - written : SENDFILE_READ_SIZE;
+        ssize_t res = write(fd, buff, chunk);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) {
+            free(buff);
+            close(fd);
+            unlink(path);
+            return -1;
+        }
+        written += res;
+    }
+    free(buff);
+    close(fd);
+    return 0;
+}
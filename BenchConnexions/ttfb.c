@@ -0,0 +1,132 @@
+//
+//  ttfb.c
+//  BenchConnexions
+//
+//  Created by Alex Nichol on 12/20/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "bench.h"
+#include <arpa/inet.h>
+
+// time to first byte of a request/response exchange over a fresh connection,
+// from the start of the connect to the first byte of the echoed request:
+// connect, wait for CONNECTED, then send; send right behind the connect
+// without waiting; or send along with the connect
+
+#define TTFB_CONNECT_THEN_SEND 0
+#define TTFB_PIPELINED 1
+#define TTFB_CONNECT_DATA 2
+#define TTFB_METHODS 3
+
+static int ttfb_exchange(int method, int fd, uint16_t port, const char * request, size_t size, uint64_t * elapsed);
+
+int bench_ttfb_main(int argc, const char * argv[]) {
+    int count = 2000;
+    size_t size = 64;
+    FILE * output = stdout;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            size = (size_t)atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = fopen(argv[++i], "w");
+            if (!output) {
+                perror("fopen");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [-n exchanges] [-s request-bytes] [-o output.json]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (count < 1 || size < 1 || size > KC_FRAME_MAX_BODY) {
+        fprintf(stderr, "exchanges must be positive and requests 1 to %d bytes\n", KC_FRAME_MAX_BODY);
+        return 1;
+    }
+
+    bench_server_t server;
+    if (bench_server_start(&server, BENCH_SERVER_ECHO)) {
+        fprintf(stderr, "failed to start loopback server\n");
+        return 1;
+    }
+    int fd = ksocket_init();
+    if (fd < 0) {
+        fprintf(stderr, "ksocket_init failed: is the KernelConnexions kext loaded?\n");
+        bench_server_stop(&server);
+        return 1;
+    }
+    char * request = (char *)malloc(size);
+    memset(request, 'q', size);
+
+    // the methods take turns, so drift on the machine hits both alike
+    bench_samples_t samples[TTFB_METHODS];
+    for (int method = 0; method < TTFB_METHODS; method++) bench_samples_init(&samples[method]);
+    int failed = 0;
+    for (int i = 0; i < count && !failed; i++) {
+        for (int method = 0; method < TTFB_METHODS; method++) {
+            uint64_t elapsed;
+            if (ttfb_exchange(method, fd, server.port, request, size, &elapsed)) {
+                fprintf(stderr, "exchange %d failed: %s\n", i, strerror(errno));
+                failed = 1;
+                break;
+            }
+            bench_samples_add(&samples[method], elapsed);
+        }
+    }
+    ksocket_close(fd);
+    bench_server_stop(&server);
+    free(request);
+
+    if (!failed) {
+        const char * names[] = {"connect_then_send", "pipelined", "connect_data"};
+        fprintf(output, "{\"benchmark\": \"ttfb\", \"exchanges\": %d, \"request_bytes\": %zu, \"results\": [\n", count, size);
+        for (int method = 0; method < TTFB_METHODS; method++) {
+            bench_samples_t * set = &samples[method];
+            uint64_t total = 0;
+            for (size_t i = 0; i < set->count; i++) total += set->samples[i];
+            double mean = (double)total / set->count / 1000.0;
+            double p50 = bench_samples_percentile(set, 0.5) / 1000.0;
+            double p99 = bench_samples_percentile(set, 0.99) / 1000.0;
+            fprintf(output, "%s  {\"method\": \"%s\", \"mean_us\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f}",
+                    method ? ",\n" : "", names[method], mean, p50, p99);
+            fprintf(stderr, "%-18s mean=%.1fus p50=%.1fus p99=%.1fus\n", names[method], mean, p50, p99);
+        }
+        fprintf(output, "\n]}\n");
+    }
+    if (output != stdout) fclose(output);
+    for (int method = 0; method < TTFB_METHODS; method++) bench_samples_free(&samples[method]);
+    return failed;
+}
+
+#pragma mark - Private -
+
+static int ttfb_exchange(int method, int fd, uint16_t port, const char * request, size_t size, uint64_t * elapsed) {
+    struct in_addr loopback;
+    loopback.s_addr = htonl(INADDR_LOOPBACK);
+    uint64_t start = bench_now_ns();
+    if (method == TTFB_CONNECT_DATA) {
+        if (ksocket_connect_ipv4_data(fd, &loopback, port, request, size)) return -1;
+    } else if (method == TTFB_PIPELINED) {
+        if (ksocket_connect_ipv4_async(fd, &loopback, port)) return -1;
+        if (ksocket_send(fd, request, (int)size)) return -1;
+    } else {
+        if (ksocket_connect_ipv4(fd, &loopback, port)) return -1;
+        if (ksocket_send(fd, request, (int)size)) return -1;
+    }
+    void * buff = NULL;
+    errno = 0;
+    int got = ksocket_read(fd, &buff);
+    *elapsed = bench_now_ns() - start;
+    if (got <= 0) {
+        if (!errno) errno = ECONNRESET;
+        return -1;
+    }
+    free(buff);
+
+    // the rest of the echo has to be gone before the next connect
+    if ((size_t)got < size && bench_ksocket_read_exact(fd, size - got)) return -1;
+    return ksocket_disconnect(fd);
+}
@@ -0,0 +1,207 @@
+//
+//  unload.c
+//  BenchConnexions
+//
+//  Created by Alex Nichol on 12/15/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "bench.h"
+#include <sys/types.h>
+#include <sys/sysctl.h>
+#include <sys/wait.h>
+#include <poll.h>
+
+#define UNLOAD_BUNDLE_ID "com.aqnichol.KernelConnexions"
+
+typedef struct {
+    int * fds;
+    int count;
+    uint64_t start; // set just before kextunload runs
+    volatile int unloading;
+    volatile int stopping;
+    int notified; // told the kext is unloading, then closed
+    int failed; // died some other way
+    uint64_t firstNotice;
+    uint64_t lastClose;
+} unload_poller_t;
+
+static void * unload_poller_main(void * arg);
+static int unload_run_kextunload();
+
+int bench_unload_main(int argc, const char * argv[]) {
+    int connections = 10000;
+    size_t pending = 0;
+    int timeout = -1;
+    FILE * output = stdout;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            connections = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            pending = (size_t)atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            timeout = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = fopen(argv[++i], "w");
+            if (!output) {
+                perror("fopen");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [-c connections] [-w queued-bytes-each] [-t drain-timeout-ms] [-o output.json]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (connections < 1) {
+        fprintf(stderr, "connections must be positive\n");
+        return 1;
+    }
+    if (bench_raise_fd_limit(connections * 2 + 64)) {
+        fprintf(stderr, "cannot raise the descriptor limit for %d connections\n", connections);
+        return 1;
+    }
+    if (timeout >= 0 && sysctlbyname("net.kernelconnexions.drain_timeout_ms", NULL, NULL, &timeout, sizeof(timeout))) {
+        perror("sysctl net.kernelconnexions.drain_timeout_ms");
+        return 1;
+    }
+    size_t timeoutSize = sizeof(timeout);
+    if (sysctlbyname("net.kernelconnexions.drain_timeout_ms", &timeout, &timeoutSize, NULL, 0)) {
+        fprintf(stderr, "is the KernelConnexions kext loaded?\n");
+        return 1;
+    }
+
+    // a stalled peer keeps whatever the kext queues for it in the kext
+    bench_server_t server;
+    if (bench_server_start(&server, pending ? BENCH_SERVER_STALL : BENCH_SERVER_HOLD)) {
+        fprintf(stderr, "failed to start loopback listener\n");
+        return 1;
+    }
+    unload_poller_t poller;
+    bzero(&poller, sizeof(poller));
+    poller.fds = (int *)malloc(sizeof(int) * connections);
+    char * payload = pending ? (char *)malloc(pending) : NULL;
+    if (payload) memset(payload, 'k', pending);
+    for (; poller.count < connections; poller.count++) {
+        int fd = bench_ksocket_open(server.port);
+        if (fd < 0) {
+            fprintf(stderr, "connect %d of %d failed: %s\n", poller.count + 1, connections, strerror(errno));
+            break;
+        }
+        poller.fds[poller.count] = fd;
+        if (payload && ksocket_send(fd, payload, (int)pending)) {
+            fprintf(stderr, "send on connection %d failed: %s\n", poller.count + 1, strerror(errno));
+            ksocket_close(fd);
+            break;
+        }
+    }
+    free(payload);
+    if (poller.count < connections) {
+        for (int i = 0; i < poller.count; i++) ksocket_close(poller.fds[i]);
+        free(poller.fds);
+        bench_server_stop(&server);
+        return 1;
+    }
+    fprintf(stderr, "%d connections open%s; unloading\n", connections, pending ? " with writes queued" : "");
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, unload_poller_main, &poller)) {
+        perror("pthread_create");
+        for (int i = 0; i < poller.count; i++) ksocket_close(poller.fds[i]);
+        free(poller.fds);
+        bench_server_stop(&server);
+        return 1;
+    }
+    poller.start = bench_now_ns();
+    poller.unloading = 1;
+    int status = unload_run_kextunload();
+    uint64_t unloadTime = bench_now_ns() - poller.start;
+    poller.stopping = 1;
+    pthread_join(thread, NULL);
+    for (int i = 0; i < poller.count; i++) {
+        if (poller.fds[i] >= 0) ksocket_close(poller.fds[i]);
+    }
+    free(poller.fds);
+    bench_server_stop(&server);
+
+    int unloaded = status == 0;
+    fprintf(output, "{\"benchmark\": \"unload\", \"connections\": %d, \"queued_bytes_each\": %zu, "
+            "\"drain_timeout_ms\": %d, \"unloaded\": %s, \"unload_ms\": %.3f, \"notified\": %d, "
+            "\"failed\": %d, \"first_notice_ms\": %.3f, \"last_close_ms\": %.3f}\n",
+            connections, pending, timeout, unloaded ? "true" : "false", unloadTime / 1e6,
+            poller.notified, poller.failed,
+            poller.firstNotice ? (poller.firstNotice - poller.start) / 1e6 : 0.0,
+            poller.lastClose ? (poller.lastClose - poller.start) / 1e6 : 0.0);
+    if (output != stdout) fclose(output);
+
+    fprintf(stderr, "%s in %.1fms; %d of %d clients told to close, the last one after %.1fms\n",
+            unloaded ? "unloaded" : "unload failed", unloadTime / 1e6, poller.notified, connections,
+            poller.lastClose ? (poller.lastClose - poller.start) / 1e6 : 0.0);
+    if (unloaded) fprintf(stderr, "load the kext again before running other benchmarks\n");
+    return unloaded ? 0 : 1;
+}
+
+#pragma mark - Private -
+
+static void * unload_poller_main(void * arg) {
+    // the kext can't close a control socket itself, so this plays every
+    // client: close each ksocket as soon as it hears about the unload
+    unload_poller_t * poller = (unload_poller_t *)arg;
+    struct pollfd * pfds = (struct pollfd *)malloc(sizeof(struct pollfd) * poller->count);
+    int * indexes = (int *)malloc(sizeof(int) * poller->count);
+    int open = poller->count;
+    while (open > 0 && !poller->stopping) {
+        int count = 0;
+        for (int i = 0; i < poller->count; i++) {
+            if (poller->fds[i] < 0) continue;
+            pfds[count].fd = poller->fds[i];
+            pfds[count].events = POLLIN;
+            pfds[count].revents = 0;
+            indexes[count++] = i;
+        }
+        if (poll(pfds, (nfds_t)count, 100) <= 0) continue;
+        for (int i = 0; i < count; i++) {
+            if (!pfds[i].revents) continue;
+            void * buff = NULL;
+            errno = 0;
+            int res = ksocket_read(pfds[i].fd, &buff);
+            if (res > 0) {
+                free(buff);
+                continue;
+            }
+            if (res == 0) continue; // a hangup; the control stays open
+            uint64_t now = bench_now_ns();
+            if (errno == ESHUTDOWN) {
+                if (!poller->firstNotice) poller->firstNotice = now;
+                poller->notified++;
+            } else {
+                poller->failed++;
+            }
+            ksocket_close(pfds[i].fd);
+            poller->fds[indexes[i]] = -1;
+            if (poller->unloading) poller->lastClose = now;
+            open--;
+        }
+    }
+    free(indexes);
+    free(pfds);
+    return NULL;
+}
+
+static int unload_run_kextunload() {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        execl("/sbin/kextunload", "kextunload", "-b", UNLOAD_BUNDLE_ID, (char *)NULL);
+        perror("kextunload");
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
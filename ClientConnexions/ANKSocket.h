@@ -10,13 +10,20 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include "ksockets.h"
+#include "kspool.h"
+#include "ksresolver.h"
 
 @interface ANKSocket : NSObject {
     int fd;
     NSMutableData * backlog;
+    kspool_t * pool;
+    BOOL reusable;
 }
 
++ (ksresolver_t *)sharedResolver;
+
 - (id)initWithHost:(NSString *)host port:(uint16_t)port;
+- (id)initWithHost:(NSString *)host port:(uint16_t)port pool:(kspool_t *)aPool;
 - (NSData *)read:(NSUInteger)max;
 - (BOOL)write:(NSData *)data;
 - (void)close;
@@ -10,24 +10,77 @@
 
 @implementation ANKSocket
 
++ (ksresolver_t *)sharedResolver {
+    static ksresolver_t * resolver = NULL;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        resolver = ksresolver_create(4, 60, 5);
+    });
+    return resolver;
+}
+
++ (int)interleaveAddresses:(const ksresolver_result_t *)result into:(ksocket_candidate_t *)candidates {
+    // alternate families, starting with whichever the resolver preferred, so
+    // a broken family costs one stagger instead of every address in it
+    int firstFamily = result->addrs[0].family;
+    int taken[KSRESOLVER_MAX_ADDRS] = {0};
+    int count = 0;
+    while (count < result->count && count < KSOCKET_MAX_CANDIDATES) {
+        int wantFamily = (count % 2 == 0) ? firstFamily : (firstFamily == AF_INET ? AF_INET6 : AF_INET);
+        int pick = -1;
+        for (int i = 0; i < result->count && pick < 0; i++) {
+            if (!taken[i] && result->addrs[i].family == wantFamily) pick = i;
+        }
+        for (int i = 0; i < result->count && pick < 0; i++) {
+            if (!taken[i]) pick = i;
+        }
+        taken[pick] = 1;
+        candidates[count].family = result->addrs[pick].family;
+        memcpy(candidates[count].addr, result->addrs[pick].addr, 16);
+        count++;
+    }
+    return count;
+}
+
 - (id)initWithHost:(NSString *)host port:(uint16_t)port {
+    return [self initWithHost:host port:port pool:NULL];
+}
+
+- (id)initWithHost:(NSString *)host port:(uint16_t)port pool:(kspool_t *)aPool {
     if ((self = [super init])) {
-        struct hostent * ent = gethostbyname([host UTF8String]);
-        if (!ent) return nil;
+        fd = -1;
+        ksresolver_result_t result;
+        if (ksresolver_resolve([ANKSocket sharedResolver], [host UTF8String], &result)) return nil;
+        ksresolver_addr_t * addr = &result.addrs[0];
+        if (aPool) {
+            fd = kspool_acquire(aPool, addr->family, addr->addr, port);
+            if (fd < 0) return nil;
+            pool = aPool;
+            reusable = YES;
+            backlog = [[NSMutableData alloc] init];
+            return self;
+        }
         fd = ksocket_init();
         if (fd < 0) return nil;
-        if (ent->h_addrtype == AF_INET) {
-            if (ksocket_connect_ipv4(fd, ent->h_addr_list[0], port) != 0) {
-                close(fd);
+        if (result.count > 1) {
+            ksocket_candidate_t candidates[KSOCKET_MAX_CANDIDATES];
+            int count = [ANKSocket interleaveAddresses:&result into:candidates];
+            if (ksocket_connect_multi(fd, candidates, count, port, 0) != 0) {
+                [self close];
                 return nil;
             }
-        } else if (ent->h_addrtype == AF_INET6) {
-            if (ksocket_connect_ipv6(fd, ent->h_addr_list[0], port) != 0) {
-                close(fd);
+        } else if (addr->family == AF_INET) {
+            if (ksocket_connect_ipv4(fd, addr->addr, port) != 0) {
+                [self close];
+                return nil;
+            }
+        } else if (addr->family == AF_INET6) {
+            if (ksocket_connect_ipv6(fd, addr->addr, port) != 0) {
+                [self close];
                 return nil;
             }
         } else {
-            close(fd);
+            [self close];
             return nil;
         }
         backlog = [[NSMutableData alloc] init];
@@ -47,10 +100,12 @@
             return d;
         }
     }
+    if (fd < 0) return nil;
     void * buff = 0;
     int len = ksocket_read(fd, &buff);
     if (len <= 0) {
-        close(fd);
+        reusable = NO;
+        [self close];
         return nil;
     }
     [backlog appendBytes:buff length:len];
@@ -59,19 +114,28 @@
 }
 
 - (BOOL)write:(NSData *)data {
+    if (fd < 0) return NO;
     if (ksocket_send(fd, [data bytes], (int)[data length])) {
-        close(fd);
+        reusable = NO;
+        [self close];
         return NO;
     }
     return YES;
 }
 
 - (void)close {
-    ksocket_close(fd);
+    if (fd < 0) return;
+    if (pool) {
+        // unread data means the peer is mid-response; don't hand that out
+        kspool_release(pool, fd, reusable && [backlog length] == 0);
+    } else {
+        ksocket_close(fd);
+    }
+    fd = -1;
 }
 
 - (void)dealloc {
-    ksocket_close(fd);
+    [self close];
 }
 
 @end
@@ -0,0 +1,849 @@
+//
+//  KSocket.hpp
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/13/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef KernelConnexions_KSocket_hpp
+#define KernelConnexions_KSocket_hpp
+
+// A header-only C++20 layer over ksockets. One Executor per thread drives any
+// number of KSockets; every operation is an awaitable that lives in the
+// awaiting coroutine's frame, so nothing is allocated per read or write.
+//
+//     kc::Task<void> fetch(kc::Executor & executor, in_addr addr) {
+//         kc::KSocket socket = kc::KSocket::open(executor);
+//         if (co_await socket.connect_ipv4(&addr, 80)) co_return;
+//         co_await socket.write_all(request, requestLength);
+//         char buffer[4096];
+//         ssize_t len;
+//         while ((len = co_await socket.read_some(buffer, sizeof(buffer))) > 0) { ... }
+//         co_await socket.close();
+//     }
+//
+//     kc::Executor executor;
+//     kc::spawn(fetch(executor, addr));
+//     executor.run();
+//
+// Results follow the C library, except that errors come back as -errno
+// rather than -1 and errno. Rings (ksocket_ring_attach) are not used here.
+// Writes are never stamped, but if ksocket_set_timestamps() is on for fd(),
+// the kext's inbound STAMPS still land in the stage histograms.
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <chrono>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#ifdef __APPLE__
+#include <sys/event.h>
+#else
+#include <sys/epoll.h>
+#endif
+
+extern "C" {
+#include "ksockets.h"
+}
+
+namespace kc {
+
+#pragma mark - Tasks -
+
+template <typename T> class Task;
+
+namespace detail {
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+    bool detached = false;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept {
+            PromiseBase & promise = handle.promise();
+            if (promise.continuation) return promise.continuation;
+            if (promise.detached) handle.destroy();
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() {
+        // nobody is left to rethrow to
+        if (detached) std::terminate();
+        exception = std::current_exception();
+    }
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+    std::optional<T> value;
+    Task<T> get_return_object();
+    template <typename U> void return_value(U && result) { value.emplace(std::forward<U>(result)); }
+    T result() {
+        if (exception) std::rethrow_exception(exception);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+    void result() {
+        if (exception) std::rethrow_exception(exception);
+    }
+};
+
+} // namespace detail
+
+/**
+ * A lazily started coroutine. co_await it from another coroutine, or hand
+ * it to spawn() to run it on its own.
+ */
+template <typename T = void>
+class Task {
+public:
+    using promise_type = detail::Promise<T>;
+
+    Task(Task && other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task & operator=(Task && other) noexcept {
+        if (this != &other) {
+            if (handle) handle.destroy();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    Task(const Task &) = delete;
+    Task & operator=(const Task &) = delete;
+    ~Task() {
+        if (handle) handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return !handle || handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() { return handle.promise().result(); }
+
+private:
+    friend promise_type;
+    friend void spawn(Task<void> task);
+    explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    std::coroutine_handle<promise_type> handle;
+};
+
+namespace detail {
+template <typename T>
+inline Task<T> Promise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+inline Task<void> Promise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+} // namespace detail
+
+/**
+ * Start a task that nobody awaits. It runs until its first suspension right
+ * away and frees itself when it finishes.
+ */
+inline void spawn(Task<void> task) {
+    auto handle = std::exchange(task.handle, nullptr);
+    if (!handle) return;
+    handle.promise().detached = true;
+    handle.resume();
+}
+
+#pragma mark - Executor -
+
+class Executor;
+
+namespace detail {
+
+struct Watch;
+
+/**
+ * A pending read, write or retry. The awaitable derives from this, so it is
+ * stored in the awaiting coroutine's frame. attempt() does as much as it can
+ * without blocking and says what it needs next.
+ */
+struct Operation {
+    enum Status { Done, WantRead, WantWrite, WantRetry };
+    Status (*attempt)(Operation * operation) = nullptr;
+    Watch * watch = nullptr;
+    std::coroutine_handle<> handle;
+    Operation * nextRetry = nullptr;
+    std::chrono::steady_clock::time_point deadline;
+    std::chrono::microseconds backoff{0};
+    int retries = 0; // budget refusals since the operation last made progress
+};
+
+// one per file descriptor; lives as long as the socket does
+struct Watch {
+    int fd = -1;
+    Operation * reader = nullptr;
+    Operation * writer = nullptr;
+};
+
+} // namespace detail
+
+/**
+ * Runs KSocket operations for one thread. Sockets are registered once,
+ * edge-triggered, so waiting for readiness costs no system calls beyond the
+ * epoll_wait/kevent itself. Uses kqueue on Apple platforms.
+ */
+class Executor {
+public:
+    Executor() {
+#ifdef __APPLE__
+        poller = kqueue();
+#else
+        poller = epoll_create1(EPOLL_CLOEXEC);
+#endif
+    }
+    ~Executor() {
+        if (poller >= 0) ::close(poller);
+    }
+    Executor(const Executor &) = delete;
+    Executor & operator=(const Executor &) = delete;
+
+    bool valid() const { return poller >= 0; }
+
+    /**
+     * Run until stop() is called or no operation is left waiting.
+     */
+    void run() {
+        stopped = false;
+        while (!stopped && (pending || retries)) {
+            poll_once();
+        }
+    }
+
+    void stop() { stopped = true; }
+
+    // used by KSocket
+    int add(detail::Watch * watch) {
+#ifdef __APPLE__
+        struct kevent changes[2];
+        EV_SET(&changes[0], watch->fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, watch);
+        EV_SET(&changes[1], watch->fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, watch);
+        return kevent(poller, changes, 2, NULL, 0, NULL) < 0 ? -errno : 0;
+#else
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = watch;
+        return epoll_ctl(poller, EPOLL_CTL_ADD, watch->fd, &event) < 0 ? -errno : 0;
+#endif
+    }
+
+    void remove(detail::Watch * watch) {
+        // closing the fd drops it from the poller; events already fetched
+        // for it in this round must not be delivered
+        for (int i = eventIndex; i < eventCount; i++) {
+            if (event_watch(i) == watch) set_event_watch(i, NULL);
+        }
+        if (watch->reader) pending--;
+        if (watch->writer) pending--;
+        watch->reader = watch->writer = nullptr;
+        detail::Operation ** link = &retries;
+        while (*link) {
+            if ((*link)->watch == watch) *link = (*link)->nextRetry;
+            else link = &(*link)->nextRetry;
+        }
+    }
+
+    /**
+     * Start an operation; returns true if it finished without waiting.
+     * Otherwise the coroutine is resumed once it has.
+     */
+    bool begin(detail::Operation * operation) {
+        detail::Operation::Status status = operation->attempt(operation);
+        if (status == detail::Operation::Done) return true;
+        park(operation, status);
+        return false;
+    }
+
+private:
+    static constexpr int kMaxEvents = 64;
+
+    void park(detail::Operation * operation, detail::Operation::Status status) {
+        detail::Watch * watch = operation->watch;
+        if (status == detail::Operation::WantRead) {
+            watch->reader = operation;
+            pending++;
+        } else if (status == detail::Operation::WantWrite) {
+            watch->writer = operation;
+            pending++;
+        } else {
+            schedule_retry(operation);
+        }
+    }
+
+    detail::Watch * event_watch(int index) const {
+#ifdef __APPLE__
+        return (detail::Watch *)events[index].udata;
+#else
+        return (detail::Watch *)events[index].data.ptr;
+#endif
+    }
+
+    void set_event_watch(int index, detail::Watch * watch) {
+#ifdef __APPLE__
+        events[index].udata = watch;
+#else
+        events[index].data.ptr = watch;
+#endif
+    }
+
+    void poll_once() {
+        int timeout = -1;
+        if (retries) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(retries->deadline - std::chrono::steady_clock::now());
+            timeout = wait.count() < 0 ? 0 : (int)wait.count() + 1;
+        }
+#ifdef __APPLE__
+        struct timespec spec, * specPtr = NULL;
+        if (timeout >= 0) {
+            spec.tv_sec = timeout / 1000;
+            spec.tv_nsec = (timeout % 1000) * 1000000L;
+            specPtr = &spec;
+        }
+        int count = kevent(poller, NULL, 0, events, kMaxEvents, specPtr);
+#else
+        int count = epoll_wait(poller, events, kMaxEvents, timeout);
+#endif
+        if (count < 0) {
+            if (errno != EINTR) stopped = true;
+            return;
+        }
+        eventCount = count;
+        for (eventIndex = 0; eventIndex < eventCount; eventIndex++) {
+            detail::Watch * watch = event_watch(eventIndex);
+            if (!watch) continue;
+#ifdef __APPLE__
+            bool failed = events[eventIndex].flags & (EV_EOF | EV_ERROR);
+            bool readable = events[eventIndex].filter == EVFILT_READ || failed;
+            bool writable = events[eventIndex].filter == EVFILT_WRITE || failed;
+#else
+            uint32_t flags = events[eventIndex].events;
+            bool failed = flags & (EPOLLERR | EPOLLHUP | EPOLLRDHUP);
+            bool readable = (flags & EPOLLIN) || failed;
+            bool writable = (flags & EPOLLOUT) || failed;
+#endif
+            // resuming the reader may close the socket, which clears the event
+            if (readable && watch->reader) wake(&watch->reader);
+            if (writable && event_watch(eventIndex) && watch->writer) wake(&watch->writer);
+        }
+        eventIndex = eventCount = 0;
+        fire_retries();
+    }
+
+    void wake(detail::Operation ** slot) {
+        detail::Operation * operation = *slot;
+        *slot = nullptr;
+        pending--;
+        detail::Operation::Status status = operation->attempt(operation);
+        if (status == detail::Operation::Done) {
+            operation->handle.resume();
+        } else {
+            park(operation, status);
+        }
+    }
+
+    void schedule_retry(detail::Operation * operation) {
+        // the kext refused the write because it is over its memory budget;
+        // back off the same way ksocket_write_frame does
+        using std::chrono::microseconds;
+        if (operation->backoff.count() == 0) {
+            operation->backoff = microseconds(KSOCKET_BUDGET_BACKOFF_MIN);
+        } else if (operation->backoff.count() < KSOCKET_BUDGET_BACKOFF_MAX) {
+            operation->backoff *= 2;
+        }
+        operation->retries++;
+        operation->deadline = std::chrono::steady_clock::now() + operation->backoff;
+        detail::Operation ** link = &retries;
+        while (*link && (*link)->deadline <= operation->deadline) link = &(*link)->nextRetry;
+        operation->nextRetry = *link;
+        *link = operation;
+    }
+
+    void fire_retries() {
+        auto now = std::chrono::steady_clock::now();
+        while (retries && retries->deadline <= now) {
+            detail::Operation * operation = retries;
+            retries = operation->nextRetry;
+            operation->nextRetry = nullptr;
+            detail::Operation::Status status = operation->attempt(operation);
+            if (status == detail::Operation::Done) {
+                operation->handle.resume();
+            } else {
+                park(operation, status);
+            }
+        }
+    }
+
+    int poller = -1;
+    bool stopped = false;
+    size_t pending = 0; // operations waiting on a socket
+    detail::Operation * retries = nullptr; // sorted by deadline
+#ifdef __APPLE__
+    struct kevent events[kMaxEvents];
+#else
+    struct epoll_event events[kMaxEvents];
+#endif
+    int eventIndex = 0;
+    int eventCount = 0;
+};
+
+#pragma mark - Frames -
+
+namespace detail {
+
+struct SocketState {
+    Watch watch;
+    Executor * executor = nullptr;
+    bool datagram = false;
+    // stream mode only ever buffers a header and a short control body;
+    // DATA bodies are read straight into the caller's buffer
+    uint8_t header[KC_FRAME_HEADER_SIZE];
+    int headerFill = 0;
+    uint16_t bodyLeft = 0;
+    uint8_t small[sizeof(ksocket_stamps_t)];
+    uint16_t smallFill = 0;
+    // datagram mode has to take a whole frame at once
+    std::unique_ptr<uint8_t[]> datagramBuffer;
+    size_t datagramOffset = 0;
+    size_t datagramLeft = 0;
+};
+
+// a frame on its way out, which may take several writes on a stream
+struct OutFrame {
+    uint8_t header[KC_FRAME_HEADER_SIZE];
+    const uint8_t * body = nullptr;
+    uint16_t length = 0;
+    size_t sent = 0;
+
+    void set(uint8_t type, const void * data, uint16_t len) {
+        kc_frame_put_header(header, type, len);
+        body = (const uint8_t *)data;
+        length = len;
+        sent = 0;
+    }
+};
+
+inline uint32_t decode_value(const uint8_t * body, size_t length) {
+    // ERROR and HUNGUP carry a big endian errno, TIMEOUT a reason byte
+    if (length == KC_STATUS_SIZE) return kc_status_decode(body, (uint16_t)length);
+    return length == KC_TIMEOUT_SIZE ? body[0] : 0;
+}
+
+/**
+ * Move towards the next frame without blocking. Either copies DATA into buff
+ * and returns how much (type is CONTROL_PACKET_DATA), or finishes another
+ * frame and returns 0 with its type and value. -EAGAIN if the socket ran dry.
+ */
+inline ssize_t read_step(SocketState * state, void * buff, size_t len, uint8_t & type, uint32_t & value) {
+    int fd = state->watch.fd;
+    if (state->datagram) {
+        while (!state->datagramLeft) {
+            if (!state->datagramBuffer) state->datagramBuffer.reset(new uint8_t[KC_FRAME_HEADER_SIZE + KC_FRAME_MAX_BODY]);
+            uint8_t * frame = state->datagramBuffer.get();
+            ssize_t res = ::recv(fd, frame, KC_FRAME_HEADER_SIZE + KC_FRAME_MAX_BODY, 0);
+            if (res < 0) {
+                if (errno == EINTR) continue;
+                return -errno;
+            }
+            if (res == 0) return -ECONNRESET;
+            if (res < KC_FRAME_HEADER_SIZE || res - KC_FRAME_HEADER_SIZE != kc_frame_length(frame)) return -EPROTO;
+            uint8_t * body = &frame[KC_FRAME_HEADER_SIZE];
+            size_t bodyLength = res - KC_FRAME_HEADER_SIZE;
+            if (kc_frame_type(frame) == CONTROL_PACKET_STAMPS) {
+                ksocket_record_stamps(body, (int)bodyLength);
+                continue;
+            }
+            if (kc_frame_type(frame) != CONTROL_PACKET_DATA) {
+                type = kc_frame_type(frame);
+                value = decode_value(body, bodyLength);
+                return 0;
+            }
+            state->datagramOffset = KC_FRAME_HEADER_SIZE;
+            state->datagramLeft = bodyLength;
+        }
+        size_t count = len < state->datagramLeft ? len : state->datagramLeft;
+        memcpy(buff, &state->datagramBuffer[state->datagramOffset], count);
+        state->datagramOffset += count;
+        state->datagramLeft -= count;
+        type = CONTROL_PACKET_DATA;
+        return (ssize_t)count;
+    }
+
+    while (1) {
+        if (state->headerFill < KC_FRAME_HEADER_SIZE) {
+            ssize_t res = ::read(fd, &state->header[state->headerFill], KC_FRAME_HEADER_SIZE - state->headerFill);
+            if (res < 0) {
+                if (errno == EINTR) continue;
+                return -errno;
+            }
+            if (res == 0) return -ECONNRESET;
+            state->headerFill += (int)res;
+            if (state->headerFill < KC_FRAME_HEADER_SIZE) continue;
+            state->bodyLeft = kc_frame_length(state->header);
+            state->smallFill = 0;
+            if (state->header[0] != CONTROL_PACKET_DATA && state->bodyLeft > sizeof(state->small)) return -EPROTO;
+        }
+        if (state->header[0] == CONTROL_PACKET_DATA) {
+            if (!state->bodyLeft) {
+                state->headerFill = 0;
+                continue;
+            }
+            size_t want = len < state->bodyLeft ? len : state->bodyLeft;
+            ssize_t res = ::read(fd, buff, want);
+            if (res < 0) {
+                if (errno == EINTR) continue;
+                return -errno;
+            }
+            if (res == 0) return -ECONNRESET;
+            state->bodyLeft -= (uint16_t)res;
+            if (!state->bodyLeft) state->headerFill = 0;
+            type = CONTROL_PACKET_DATA;
+            return res;
+        }
+        while (state->smallFill < state->bodyLeft) {
+            ssize_t res = ::read(fd, &state->small[state->smallFill], state->bodyLeft - state->smallFill);
+            if (res < 0) {
+                if (errno == EINTR) continue;
+                return -errno;
+            }
+            if (res == 0) return -ECONNRESET;
+            state->smallFill += (uint16_t)res;
+        }
+        state->headerFill = 0;
+        if (state->header[0] == CONTROL_PACKET_STAMPS) {
+            ksocket_record_stamps(state->small, state->smallFill);
+            continue;
+        }
+        type = state->header[0];
+        value = decode_value(state->small, state->smallFill);
+        return 0;
+    }
+}
+
+/**
+ * Write as much of a frame as the socket takes. 0 once it is all out,
+ * -EAGAIN if the socket is full, -ENOBUFS if the kext is over its budget.
+ */
+inline int write_step(SocketState * state, OutFrame * frame) {
+    size_t total = KC_FRAME_HEADER_SIZE + (size_t)frame->length;
+    while (frame->sent < total) {
+        struct iovec vectors[2];
+        int count = 0;
+        if (frame->sent < KC_FRAME_HEADER_SIZE) {
+            vectors[count].iov_base = &frame->header[frame->sent];
+            vectors[count++].iov_len = KC_FRAME_HEADER_SIZE - frame->sent;
+            if (frame->length) {
+                vectors[count].iov_base = (void *)frame->body;
+                vectors[count++].iov_len = frame->length;
+            }
+        } else {
+            vectors[count].iov_base = (void *)&frame->body[frame->sent - KC_FRAME_HEADER_SIZE];
+            vectors[count++].iov_len = total - frame->sent;
+        }
+        ssize_t res = ::writev(state->watch.fd, vectors, count);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        if (state->datagram && (size_t)res != total) return -EMSGSIZE;
+        frame->sent += res;
+    }
+    return 0;
+}
+
+#pragma mark - Operations -
+
+struct ReadOperation : Operation {
+    SocketState * state;
+    void * buff;
+    size_t len;
+    ssize_t result = 0;
+
+    ReadOperation(SocketState * s, void * b, size_t l) : state(s), buff(b), len(l) {
+        watch = &s->watch;
+        attempt = &ReadOperation::step;
+    }
+
+    static Status step(Operation * operation) {
+        ReadOperation * op = static_cast<ReadOperation *>(operation);
+        while (1) {
+            uint8_t type;
+            uint32_t value = 0;
+            ssize_t res = read_step(op->state, op->buff, op->len, type, value);
+            if (res == -EAGAIN || res == -EWOULDBLOCK) return WantRead;
+            if (res < 0) {
+                op->result = res;
+                return Done;
+            }
+            if (type == CONTROL_PACKET_DATA) {
+                if (!res) continue;
+                op->result = res;
+                return Done;
+            } else if (type == CONTROL_PACKET_HUNGUP || type == CONTROL_PACKET_ERROR) {
+                op->result = value ? -(ssize_t)value : 0;
+                return Done;
+            } else if (type == CONTROL_PACKET_TIMEOUT) {
+                op->result = -ETIMEDOUT;
+                return Done;
+            } else if (type == CONTROL_PACKET_UNLOADING) {
+                op->result = -ESHUTDOWN;
+                return Done;
+            }
+        }
+    }
+
+    bool await_ready() { return !len || state->executor->begin(this); }
+    void await_suspend(std::coroutine_handle<> awaiting) { handle = awaiting; }
+    ssize_t await_resume() const { return result; }
+};
+
+struct WriteOperation : Operation {
+    SocketState * state;
+    const uint8_t * data;
+    size_t length;
+    size_t offset = 0;
+    OutFrame frame;
+    bool framing = false;
+    int result = 0;
+
+    WriteOperation(SocketState * s, const void * d, size_t l) : state(s), data((const uint8_t *)d), length(l) {
+        watch = &s->watch;
+        attempt = &WriteOperation::step;
+    }
+
+    static Status step(Operation * operation) {
+        WriteOperation * op = static_cast<WriteOperation *>(operation);
+        while (1) {
+            if (!op->framing) {
+                if (op->offset >= op->length) return Done;
+                size_t chunk = op->length - op->offset > 0xffff ? 0xffff : op->length - op->offset;
+                op->frame.set(CONTROL_PACKET_SEND, &op->data[op->offset], (uint16_t)chunk);
+                op->framing = true;
+            }
+            int res = write_step(op->state, &op->frame);
+            if (res == -EAGAIN || res == -EWOULDBLOCK) return WantWrite;
+            if (res == -ENOBUFS && op->retries < KSOCKET_BUDGET_RETRIES) return WantRetry;
+            if (res < 0) {
+                op->result = res;
+                return Done;
+            }
+            op->offset += op->frame.length;
+            op->framing = false;
+            op->retries = 0;
+            op->backoff = std::chrono::microseconds(0);
+        }
+    }
+
+    bool await_ready() { return state->executor->begin(this); }
+    void await_suspend(std::coroutine_handle<> awaiting) { handle = awaiting; }
+    int await_resume() const { return result; }
+};
+
+struct ConnectOperation : Operation {
+    SocketState * state;
+    uint8_t body[KC_CONNECT_IPV6_SIZE];
+    OutFrame frame;
+    bool written = false;
+    bool wait; // false: done once CONNECT is written, and reads see the outcome
+    int result = 0;
+    uint8_t discard[64];
+
+    ConnectOperation(SocketState * s, const void * addr, size_t addrLength, uint16_t port, bool w = true)
+        : state(s), wait(w) {
+        frame.set(CONTROL_PACKET_CONNECT, body, kc_connect_encode(body, port, addr, addrLength == 16));
+        watch = &s->watch;
+        attempt = &ConnectOperation::step;
+    }
+
+    static Status step(Operation * operation) {
+        ConnectOperation * op = static_cast<ConnectOperation *>(operation);
+        if (!op->written) {
+            int res = write_step(op->state, &op->frame);
+            if (res == -EAGAIN || res == -EWOULDBLOCK) return WantWrite;
+            if (res == -ENOBUFS && op->retries < KSOCKET_BUDGET_RETRIES) return WantRetry;
+            if (res < 0) {
+                op->result = res;
+                return Done;
+            }
+            op->written = true;
+            if (!op->wait) return Done;
+        }
+        while (1) {
+            uint8_t type;
+            uint32_t value = 0;
+            ssize_t res = read_step(op->state, op->discard, sizeof(op->discard), type, value);
+            if (res == -EAGAIN || res == -EWOULDBLOCK) return WantRead;
+            if (res < 0) {
+                op->result = (int)res;
+                return Done;
+            }
+            if (type == CONTROL_PACKET_CONNECTED) {
+                op->result = 0;
+                return Done;
+            } else if (type == CONTROL_PACKET_ERROR || type == CONTROL_PACKET_HUNGUP) {
+                // a connect that fails asynchronously hangs up with the error
+                op->result = value ? -(int)value : -ECONNREFUSED;
+                return Done;
+            } else if (type == CONTROL_PACKET_TIMEOUT) {
+                op->result = -ETIMEDOUT;
+                return Done;
+            } else if (type == CONTROL_PACKET_UNLOADING) {
+                op->result = -ESHUTDOWN;
+                return Done;
+            }
+        }
+    }
+
+    bool await_ready() { return state->executor->begin(this); }
+    void await_suspend(std::coroutine_handle<> awaiting) { handle = awaiting; }
+    int await_resume() const { return result; }
+};
+
+} // namespace detail
+
+#pragma mark - KSocket -
+
+/**
+ * A ksocket driven by an Executor. Move-only; destroying it closes the
+ * ksocket without telling the remote end, so co_await close() first.
+ * Operations must not outlive the socket, and at most one read and one
+ * write may be in flight at a time.
+ */
+class KSocket {
+public:
+    KSocket() = default;
+    KSocket(KSocket && other) noexcept = default;
+    KSocket & operator=(KSocket && other) noexcept {
+        if (this != &other) {
+            reset();
+            state = std::move(other.state);
+        }
+        return *this;
+    }
+    KSocket(const KSocket &) = delete;
+    KSocket & operator=(const KSocket &) = delete;
+    ~KSocket() { reset(); }
+
+    /**
+     * Open a ksocket on an executor. Returns an empty KSocket with errno set
+     * on failure.
+     */
+    static KSocket open(Executor & executor, int mode = KSOCKET_MODE_STREAM) {
+        int fd = ksocket_init_mode(mode);
+        if (fd < 0) return KSocket();
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            int error = errno;
+            ksocket_close(fd);
+            errno = error;
+            return KSocket();
+        }
+        std::unique_ptr<detail::SocketState> state(new detail::SocketState());
+        state->watch.fd = fd;
+        state->executor = &executor;
+        state->datagram = mode == KSOCKET_MODE_DATAGRAM;
+        int error = executor.add(&state->watch);
+        if (error) {
+            ksocket_close(fd);
+            errno = -error;
+            return KSocket();
+        }
+        return KSocket(std::move(state));
+    }
+
+    explicit operator bool() const { return state != nullptr; }
+    int fd() const { return state ? state->watch.fd : -1; }
+
+    // 0 once connected, or -errno
+    [[nodiscard]] detail::ConnectOperation connect_ipv4(const void * addr, uint16_t port) {
+        return detail::ConnectOperation(state.get(), addr, 4, port);
+    }
+    [[nodiscard]] detail::ConnectOperation connect_ipv6(const void * addr, uint16_t port) {
+        return detail::ConnectOperation(state.get(), addr, 16, port);
+    }
+
+    /**
+     * Like ksocket_connect_ipv4_async(): 0 once CONNECT is written, so
+     * writes can follow without a round trip. The kext holds them until
+     * the connection opens; if it never does, read() returns -errno.
+     */
+    [[nodiscard]] detail::ConnectOperation start_connect_ipv4(const void * addr, uint16_t port) {
+        return detail::ConnectOperation(state.get(), addr, 4, port, false);
+    }
+    [[nodiscard]] detail::ConnectOperation start_connect_ipv6(const void * addr, uint16_t port) {
+        return detail::ConnectOperation(state.get(), addr, 16, port, false);
+    }
+
+    /**
+     * Wait for data and copy up to len bytes of it. Returns the byte count,
+     * 0 if the connection was closed, or -errno (-ETIMEDOUT if one of the
+     * kext's timeouts closed it, -ESHUTDOWN if the kext is unloading and the
+     * KSocket should be closed).
+     */
+    [[nodiscard]] detail::ReadOperation read_some(void * buff, size_t len) {
+        return detail::ReadOperation(state.get(), buff, len);
+    }
+
+    // 0 once everything has been handed to the kext, or -errno
+    [[nodiscard]] detail::WriteOperation write_all(const void * buff, size_t len) {
+        return detail::WriteOperation(state.get(), buff, len);
+    }
+
+    struct CloseOperation : detail::WriteOperation {
+        KSocket * socket;
+        CloseOperation(KSocket * s) : detail::WriteOperation(s->state.get(), NULL, 0), socket(s) {
+            frame.set(CONTROL_PACKET_CLOSE, NULL, 0);
+            framing = true;
+        }
+        int await_resume() {
+            socket->reset();
+            return result;
+        }
+    };
+
+    /**
+     * Close the connection, then the ksocket itself.
+     */
+    [[nodiscard]] CloseOperation close() { return CloseOperation(this); }
+
+    /**
+     * Close the ksocket right away.
+     */
+    void reset() {
+        if (!state) return;
+        state->executor->remove(&state->watch);
+        ksocket_close(state->watch.fd);
+        state.reset();
+    }
+
+private:
+    explicit KSocket(std::unique_ptr<detail::SocketState> s) : state(std::move(s)) {}
+    std::unique_ptr<detail::SocketState> state; // allocated once, so sockets can move while operations wait
+};
+
+} // namespace kc
+
+#endif
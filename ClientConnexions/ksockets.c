@@ -7,12 +7,62 @@
 //
 
 #include "ksockets.h"
+#include "../KernelConnexions/ring.h"
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+#define KSOCKET_MODE_TABLE_SIZE 4096 // fds past this ask the socket for its type
 
 static int ksocket_read_ensure(int fd, void * buff, int len);
 static int ksocket_write_ensure(int fd, const void * buff, int len);
+static int ksocket_write_frame(int fd, uint8_t type, const void * body, uint16_t len);
+static int ksocket_write_vectors(int fd, struct iovec * vectors, int count, uint64_t * writes);
+static int ksocket_send_region(int fd, const uint8_t * buff, size_t len, ksocket_transfer_stats_t * totals);
+static int ksocket_read_frame(int fd, ksocket_header_t * header, char ** body);
+static int ksocket_is_datagram(int fd);
+static int ksocket_connect_data(int fd, const void * addr, int isIpv6, uint16_t port, const void * data, size_t len);
 static int ksocket_wait_response(int fd);
+static int ksocket_next_frame(int fd, ksocket_header_t * header, char ** body);
+static int ksocket_next_raw_frame(int fd, ksocket_header_t * header, char ** body);
+static int ksocket_is_stamped(int fd);
+static void ksocket_set_connecting(int fd, int connecting);
+static int ksocket_is_connecting(int fd);
+static void ksocket_stage_add(int stage, uint64_t start, uint64_t end);
+static int ksocket_ring_write(int fd, uint8_t type, const void * body, uint16_t len);
+static int ksocket_setsockopt(int fd, int option, const void * value, socklen_t len);
+static int ksocket_getsockopt(int fd, int option, void * value, socklen_t * len);
+static uint64_t ksocket_now();
+static uint64_t ksocket_elapsed_ns(uint64_t start, uint64_t end);
+
+typedef struct {
+    KCRing send;
+    KCRing receive;
+    pthread_mutex_t sendLock; // the send ring has one producer
+} ksocket_rings_t;
+
+static __thread int lastTimeoutReason = 0;
+static volatile uint8_t datagramFds[KSOCKET_MODE_TABLE_SIZE];
+static ksocket_rings_t * volatile ringFds[KSOCKET_MODE_TABLE_SIZE];
+static volatile uint8_t stampFds[KSOCKET_MODE_TABLE_SIZE];
+static volatile uint8_t connectingFds[KSOCKET_MODE_TABLE_SIZE]; // async connect not yet answered
+static ksocket_stage_histogram_t stageHistograms[KSOCKET_STAGE_COUNT];
+#ifdef __APPLE__
+static mach_timebase_info_data_t timebase;
+#endif
 
 int ksocket_init() {
+    return ksocket_init_mode(KSOCKET_MODE_STREAM);
+}
+
+int ksocket_init_mode(int mode) {
+#ifdef __APPLE__
     struct sockaddr_ctl addr;
     struct ctl_info info;
     bzero(&addr, sizeof(addr));
@@ -22,12 +72,17 @@ int ksocket_init() {
     addr.sc_family = AF_SYSTEM;
     addr.ss_sysaddr = AF_SYS_CONTROL;
     
-    strncpy(info.ctl_name, "com.aqnichol.KernelConnexions", sizeof(info.ctl_name));
+    if (mode == KSOCKET_MODE_DATAGRAM) {
+        strncpy(info.ctl_name, "com.aqnichol.KernelConnexions.datagram", sizeof(info.ctl_name));
+    } else {
+        strncpy(info.ctl_name, "com.aqnichol.KernelConnexions", sizeof(info.ctl_name));
+    }
     
-    int fd = socket(PF_SYSTEM, SOCK_STREAM, SYSPROTO_CONTROL);
+    int fd = socket(PF_SYSTEM, mode == KSOCKET_MODE_DATAGRAM ? SOCK_DGRAM : SOCK_STREAM, SYSPROTO_CONTROL);
     if (fd < 0) return fd;
     
     if (ioctl(fd, CTLIOCGINFO, &info)) {
+        close(fd);
         return -1;
     }
     
@@ -36,47 +91,127 @@ int ksocket_init() {
     
     int result;
     if ((result = connect(fd, (struct sockaddr *)&addr, sizeof(addr)))) {
+        close(fd);
         return result;
     }
     
+    if (fd < KSOCKET_MODE_TABLE_SIZE) {
+        datagramFds[fd] = mode == KSOCKET_MODE_DATAGRAM;
+    }
     return fd;
+#else
+    if (mode != KSOCKET_MODE_STREAM) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    const char * path = getenv(KSOCKET_DAEMON_PATH_ENV);
+    if (!path || !*path) path = KSOCKET_DAEMON_PATH;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return fd;
+    
+    int result;
+    if ((result = connect(fd, (struct sockaddr *)&addr, sizeof(addr)))) {
+        close(fd);
+        return result;
+    }
+    if (fd < KSOCKET_MODE_TABLE_SIZE) datagramFds[fd] = 0;
+    return fd;
+#endif
 }
 
 int ksocket_close(int socket) {
+    if (socket >= 0 && socket < KSOCKET_MODE_TABLE_SIZE) {
+        datagramFds[socket] = 0;
+        stampFds[socket] = 0;
+        connectingFds[socket] = 0;
+        // the kext unmaps the rings when the socket goes
+        ksocket_rings_t * rings = ringFds[socket];
+        ringFds[socket] = NULL;
+        if (rings) {
+            pthread_mutex_destroy(&rings->sendLock);
+            free(rings);
+        }
+    }
     close(socket);
     return 0;
 }
 
 // protocol
 int ksocket_connect_ipv4(int socket, const void * addr, uint16_t port) {
-    ksocket_header_t header;
-    header.type = CONTROL_PACKET_CONNECT;
-    header.len = htons(6);
-    if (ksocket_write_ensure(socket, &header, 3) != 0) return -1;
-    uint16_t portBig = htons(port);
-    if (ksocket_write_ensure(socket, &portBig, 2) != 0) return -1;
-    if (ksocket_write_ensure(socket, addr, 4) != 0) return -1;
+    char body[KC_CONNECT_IPV4_SIZE];
+    uint16_t len = kc_connect_encode(body, port, addr, 0);
+    if (ksocket_write_frame(socket, CONTROL_PACKET_CONNECT, body, len) != 0) return -1;
     errno = 0;
     return ksocket_wait_response(socket);
 }
 
 int ksocket_connect_ipv6(int socket, const void * addr, uint16_t port) {
-    ksocket_header_t header;
-    header.type = CONTROL_PACKET_CONNECT;
-    header.len = htons(18);
-    if (ksocket_write_ensure(socket, &header, 3) != 0) return -1;
-    uint16_t portBig = htons(port);
-    if (ksocket_write_ensure(socket, &portBig, 2) != 0) return -1;
-    if (ksocket_write_ensure(socket, addr, 16) != 0) return -1;
+    char body[KC_CONNECT_IPV6_SIZE];
+    uint16_t len = kc_connect_encode(body, port, addr, 1);
+    if (ksocket_write_frame(socket, CONTROL_PACKET_CONNECT, body, len) != 0) return -1;
+    errno = 0;
+    return ksocket_wait_response(socket);
+}
+
+int ksocket_connect_ipv4_async(int socket, const void * addr, uint16_t port) {
+    char body[KC_CONNECT_IPV4_SIZE];
+    if (ksocket_write_frame(socket, CONTROL_PACKET_CONNECT, body, kc_connect_encode(body, port, addr, 0)) != 0) return -1;
+    ksocket_set_connecting(socket, 1);
+    return 0;
+}
+
+int ksocket_connect_ipv6_async(int socket, const void * addr, uint16_t port) {
+    char body[KC_CONNECT_IPV6_SIZE];
+    if (ksocket_write_frame(socket, CONTROL_PACKET_CONNECT, body, kc_connect_encode(body, port, addr, 1)) != 0) return -1;
+    ksocket_set_connecting(socket, 1);
+    return 0;
+}
+
+int ksocket_wait_connected(int socket) {
+    errno = 0;
+    int result = ksocket_wait_response(socket);
+    ksocket_set_connecting(socket, 0);
+    return result;
+}
+
+int ksocket_connect_ipv4_data(int socket, const void * addr, uint16_t port, const void * data, size_t len) {
+    return ksocket_connect_data(socket, addr, 0, port, data, len);
+}
+
+int ksocket_connect_ipv6_data(int socket, const void * addr, uint16_t port, const void * data, size_t len) {
+    return ksocket_connect_data(socket, addr, 1, port, data, len);
+}
+
+int ksocket_connect_multi(int socket, const ksocket_candidate_t * candidates, int count, uint16_t port, uint16_t stagger) {
+    char body[KC_CONNECT_MULTI_MIN_SIZE + KSOCKET_MAX_CANDIDATES * KC_CANDIDATE_MAX_SIZE];
+    uint16_t len = kc_connect_multi_encode(body, port, stagger);
+    for (int i = 0; i < count && i < KSOCKET_MAX_CANDIDATES; i++) {
+        if (candidates[i].family == AF_INET) {
+            len = kc_candidate_encode(body, len, 4, candidates[i].addr);
+        } else if (candidates[i].family == AF_INET6) {
+            len = kc_candidate_encode(body, len, 6, candidates[i].addr);
+        }
+    }
+    if (len == KC_CONNECT_MULTI_MIN_SIZE) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+    if (ksocket_write_frame(socket, CONTROL_PACKET_CONNECT_MULTI, body, len) != 0) return -1;
     errno = 0;
     return ksocket_wait_response(socket);
 }
 
 int ksocket_disconnect(int socket) {
-    ksocket_header_t header;
-    header.type = CONTROL_PACKET_CLOSE;
-    header.len = 0;
-    return ksocket_write_ensure(socket, &header, 3);
+    return ksocket_write_frame(socket, CONTROL_PACKET_CLOSE, NULL, 0);
 }
 
 /**
@@ -90,38 +225,268 @@ int ksocket_disconnect(int socket) {
  */
 int ksocket_read(int socket, void ** buffOut) {
     ksocket_header_t header;
-    if (ksocket_read_ensure(socket, &header, 3) != 0) return -1;
+    char * buff = NULL;
+    do {
+        // after ksocket_connect_ipv4_async(), CONNECTED turns up in line
+        free(buff);
+        buff = NULL;
+        if (ksocket_next_frame(socket, &header, &buff) != 0) return -1;
+        if (header.type == CONTROL_PACKET_CONNECTED) ksocket_set_connecting(socket, 0);
+    } while (header.type == CONTROL_PACKET_CONNECTED);
+    if (header.type == CONTROL_PACKET_HUNGUP || header.type == CONTROL_PACKET_ERROR) {
+        // so does the reason a connect failed; any other ERROR is the ksocket's own
+        int closed = header.type == CONTROL_PACKET_HUNGUP || ksocket_is_connecting(socket);
+        ksocket_set_connecting(socket, 0);
+        errno = kc_status_decode(buff, kc_frame_length(&header));
+        free(buff);
+        if (!closed && !errno) errno = EIO;
+        return closed ? 0 : -1;
+    }
     if (header.len == 0) {
-        if (header.type == CONTROL_PACKET_HUNGUP) return 0;
-        else return -1;
+        if (header.type == CONTROL_PACKET_UNLOADING) errno = ESHUTDOWN;
+        return -1;
     }
-    char * buff = (char *)malloc(htons(header.len));
-    if (ksocket_read_ensure(socket, buff, htons(header.len)) != 0) {
+    if (header.type == CONTROL_PACKET_TIMEOUT) {
+        lastTimeoutReason = buff[0];
         free(buff);
-        return -1;
+        errno = ETIMEDOUT;
+        return 0;
     }
     if (header.type != CONTROL_PACKET_DATA) {
         free(buff);
         return -1;
     }
     *buffOut = buff;
-    return htons(header.len);
+    return kc_frame_length(&header);
 }
 
 int ksocket_send(int socket, const void * buff, int len) {
     int offset = 0;
+    if (ksocket_is_stamped(socket)) {
+        // the stamp leaves room for less data in each frame
+        char frame[0xffff];
+        while (offset < len) {
+            int nextSize = len - offset > KC_FRAME_MAX_BODY - KC_STAMP_SIZE ? KC_FRAME_MAX_BODY - KC_STAMP_SIZE : len - offset;
+            uint64_t now = ksocket_now();
+            memcpy(frame, &now, KC_STAMP_SIZE);
+            memcpy(&frame[KC_STAMP_SIZE], &((const char *)buff)[offset], nextSize);
+            if (ksocket_write_frame(socket, CONTROL_PACKET_SEND_STAMPED, frame, nextSize + KC_STAMP_SIZE) != 0) return -1;
+            offset += nextSize;
+        }
+        return 0;
+    }
     while (offset < len) {
-        int nextSize = len - offset > 0xffff ? 0xffff : len - offset;
-        ksocket_header_t header;
-        header.type = CONTROL_PACKET_SEND;
-        header.len = htons(nextSize);
-        if (ksocket_write_ensure(socket, &header, 3) != 0) return -1;
-        if (ksocket_write_ensure(socket, &buff[offset], nextSize) != 0) return -1;
+        int nextSize = len - offset > KC_FRAME_MAX_BODY ? KC_FRAME_MAX_BODY : len - offset;
+        if (ksocket_write_frame(socket, CONTROL_PACKET_SEND, &((const char *)buff)[offset], nextSize) != 0) return -1;
         offset += nextSize;
     }
     return 0;
 }
 
+int ksocket_send_mapped(int socket, const void * buff, size_t len, ksocket_transfer_stats_t * stats) {
+    ksocket_transfer_stats_t totals;
+    bzero(&totals, sizeof(totals));
+    uint64_t start = ksocket_now();
+    int result = ksocket_send_region(socket, (const uint8_t *)buff, len, &totals);
+    totals.nanoseconds = ksocket_elapsed_ns(start, ksocket_now());
+    if (stats) *stats = totals;
+    return result;
+}
+
+int ksocket_send_file(int socket, int fd, off_t offset, size_t len, ksocket_transfer_stats_t * stats) {
+    // touching a mapping past the end of the file is SIGBUS, not an error
+    struct stat info;
+    if (fstat(fd, &info)) return -1;
+    if (offset < 0 || offset > info.st_size || (uint64_t)(info.st_size - offset) < len) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    ksocket_transfer_stats_t totals;
+    bzero(&totals, sizeof(totals));
+    uint64_t start = ksocket_now();
+    off_t pageSize = (off_t)sysconf(_SC_PAGESIZE);
+    int result = 0;
+    while (len > 0) {
+        // mmap() only takes page-aligned offsets
+        off_t mapOffset = offset - offset % pageSize;
+        size_t skip = (size_t)(offset - mapOffset);
+        size_t chunk = len < KSOCKET_SEND_MAP_CHUNK ? len : KSOCKET_SEND_MAP_CHUNK;
+        void * region = mmap(NULL, skip + chunk, PROT_READ, MAP_SHARED, fd, mapOffset);
+        if (region == MAP_FAILED) {
+            result = -1;
+            break;
+        }
+        madvise(region, skip + chunk, MADV_SEQUENTIAL);
+        result = ksocket_send_region(socket, (const uint8_t *)region + skip, chunk, &totals);
+        munmap(region, skip + chunk);
+        if (result) break;
+        offset += chunk;
+        len -= chunk;
+    }
+    totals.nanoseconds = ksocket_elapsed_ns(start, ksocket_now());
+    if (stats) *stats = totals;
+    return result;
+}
+
+int ksocket_ring_attach(int socket, uint32_t size) {
+    if (socket < 0 || socket >= KSOCKET_MODE_TABLE_SIZE) {
+        errno = EBADF;
+        return -1;
+    }
+    if (ringFds[socket]) {
+        errno = EEXIST;
+        return -1;
+    }
+    if (!size) size = KC_RING_DEFAULT_SIZE;
+    if (ksocket_setsockopt(socket, CONTROL_OPT_RING, &size, sizeof(size))) return -1;
+    
+    KCRingAddresses addresses;
+    socklen_t len = sizeof(addresses);
+    if (ksocket_getsockopt(socket, CONTROL_OPT_RING, &addresses, &len)) return -1;
+    if (len != sizeof(addresses)) {
+        errno = EPROTO;
+        return -1;
+    }
+    
+    ksocket_rings_t * rings = (ksocket_rings_t *)calloc(1, sizeof(ksocket_rings_t));
+    if (!rings) return -1;
+    if (!kc_ring_open(&rings->send, (void *)(uintptr_t)addresses.sendAddress, addresses.mappedSize) ||
+        !kc_ring_open(&rings->receive, (void *)(uintptr_t)addresses.receiveAddress, addresses.mappedSize)) {
+        free(rings);
+        errno = EPROTO;
+        return -1;
+    }
+    pthread_mutex_init(&rings->sendLock, NULL);
+    ringFds[socket] = rings;
+    return 0;
+}
+
+// timeouts
+int ksocket_set_timeouts(int socket, const ksocket_timeouts_t * timeouts) {
+    return ksocket_setsockopt(socket, CONTROL_OPT_TIMEOUTS, timeouts, sizeof(ksocket_timeouts_t));
+}
+
+int ksocket_get_timeouts(int socket, ksocket_timeouts_t * timeouts) {
+    socklen_t len = sizeof(ksocket_timeouts_t);
+    if (ksocket_getsockopt(socket, CONTROL_OPT_TIMEOUTS, timeouts, &len)) return -1;
+    if (len != sizeof(ksocket_timeouts_t)) return -1;
+    return 0;
+}
+
+int ksocket_timeout_reason() {
+    return lastTimeoutReason;
+}
+
+// coalescing
+int ksocket_set_coalescing(int socket, const ksocket_coalescing_t * coalescing) {
+    return ksocket_setsockopt(socket, CONTROL_OPT_COALESCE, coalescing, sizeof(ksocket_coalescing_t));
+}
+
+int ksocket_get_coalescing(int socket, ksocket_coalescing_t * coalescing) {
+    socklen_t len = sizeof(ksocket_coalescing_t);
+    if (ksocket_getsockopt(socket, CONTROL_OPT_COALESCE, coalescing, &len)) return -1;
+    if (len != sizeof(ksocket_coalescing_t)) return -1;
+    return 0;
+}
+
+// scheduling
+int ksocket_set_weight(int socket, uint32_t weight) {
+    return ksocket_setsockopt(socket, CONTROL_OPT_WEIGHT, &weight, sizeof(weight));
+}
+
+int ksocket_get_weight(int socket, uint32_t * weight) {
+    socklen_t len = sizeof(uint32_t);
+    if (ksocket_getsockopt(socket, CONTROL_OPT_WEIGHT, weight, &len)) return -1;
+    if (len != sizeof(uint32_t)) return -1;
+    return 0;
+}
+
+// timestamps
+int ksocket_set_timestamps(int socket, int enabled) {
+    if (socket < 0 || socket >= KSOCKET_MODE_TABLE_SIZE) {
+        errno = EBADF;
+        return -1;
+    }
+    uint32_t value = enabled ? 1 : 0;
+    if (ksocket_setsockopt(socket, CONTROL_OPT_TIMESTAMPS, &value, sizeof(value))) return -1;
+    stampFds[socket] = (uint8_t)value;
+    return 0;
+}
+
+void ksocket_get_stage_histograms(ksocket_stage_histogram_t * histograms) {
+    for (int i = 0; i < KSOCKET_STAGE_COUNT; i++) {
+        ksocket_stage_histogram_t * source = &stageHistograms[i];
+        histograms[i].samples = __atomic_load_n(&source->samples, __ATOMIC_RELAXED);
+        histograms[i].totalNs = __atomic_load_n(&source->totalNs, __ATOMIC_RELAXED);
+        histograms[i].maxNs = __atomic_load_n(&source->maxNs, __ATOMIC_RELAXED);
+        for (int j = 0; j < KSOCKET_STAGE_BUCKETS; j++) {
+            histograms[i].buckets[j] = __atomic_load_n(&source->buckets[j], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void ksocket_reset_stage_histograms() {
+    for (int i = 0; i < KSOCKET_STAGE_COUNT; i++) {
+        ksocket_stage_histogram_t * histogram = &stageHistograms[i];
+        __atomic_store_n(&histogram->samples, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&histogram->totalNs, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&histogram->maxNs, 0, __ATOMIC_RELAXED);
+        for (int j = 0; j < KSOCKET_STAGE_BUCKETS; j++) {
+            __atomic_store_n(&histogram->buckets[j], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+const char * ksocket_stage_name(int stage) {
+    static const char * names[KSOCKET_STAGE_COUNT] = {
+        "to_kext", "dispatch_queue", "to_socket", "kext_receive", "to_client"
+    };
+    if (stage < 0 || stage >= KSOCKET_STAGE_COUNT) return "unknown";
+    return names[stage];
+}
+
+uint64_t ksocket_stage_percentile(const ksocket_stage_histogram_t * histogram, double percentile) {
+    if (!histogram->samples) return 0;
+    uint64_t rank = (uint64_t)(percentile * (histogram->samples - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < KSOCKET_STAGE_BUCKETS - 1; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) return (1ull << i) * 1000;
+    }
+    return histogram->maxNs;
+}
+
+void ksocket_record_stamps(const void * body, int len) {
+    if (len != sizeof(ksocket_stamps_t)) return;
+    ksocket_stamps_t stamps;
+    memcpy(&stamps, body, sizeof(stamps));
+    if (stamps.direction == KSOCKET_STAMPS_OUTBOUND) {
+        ksocket_stage_add(KSOCKET_STAGE_TO_KEXT, stamps.stamps[0], stamps.stamps[1]);
+        ksocket_stage_add(KSOCKET_STAGE_DISPATCH_QUEUE, stamps.stamps[1], stamps.stamps[2]);
+        ksocket_stage_add(KSOCKET_STAGE_TO_SOCKET, stamps.stamps[2], stamps.stamps[3]);
+    } else if (stamps.direction == KSOCKET_STAMPS_INBOUND) {
+        // the DATA frame comes right behind, so reading this is reading it
+        ksocket_stage_add(KSOCKET_STAGE_KEXT_RECEIVE, stamps.stamps[0], stamps.stamps[1]);
+        ksocket_stage_add(KSOCKET_STAGE_TO_CLIENT, stamps.stamps[1], ksocket_now());
+    }
+}
+
+// stats
+int ksocket_get_pool_stats(int socket, ksocket_pool_stats_t * stats) {
+    socklen_t len = sizeof(ksocket_pool_stats_t);
+    if (ksocket_getsockopt(socket, CONTROL_OPT_POOL_STATS, stats, &len)) return -1;
+    if (len != sizeof(ksocket_pool_stats_t)) return -1;
+    return 0;
+}
+
+int ksocket_get_upcall_stats(int socket, ksocket_upcall_stats_t * stats) {
+    socklen_t len = sizeof(ksocket_upcall_stats_t);
+    if (ksocket_getsockopt(socket, CONTROL_OPT_UPCALL_STATS, stats, &len)) return -1;
+    if (len != sizeof(ksocket_upcall_stats_t)) return -1;
+    return 0;
+}
+
 #pragma mark - Private -
 
 static int ksocket_read_ensure(int fd, void * buff, int len) {
@@ -134,12 +499,20 @@ static int ksocket_read_ensure(int fd, void * buff, int len) {
             if (errno == EINTR) continue;
             else return -1;
         }
+        if (res == 0) {
+            // the other end went away, between frames or partway into one
+            errno = ECONNRESET;
+            return -1;
+        }
         off += res;
     }
     return 0;
 }
 
 static int ksocket_write_ensure(int fd, const void * buff, int len) {
+    // only ever finishes a frame that is partly written, and the kext takes
+    // the rest of a frame once it has the start, so there is no ENOBUFS to
+    // back off from here
     int off = 0;
     const char * cBuf = (const char *)buff;
     while (off < len) {
@@ -154,26 +527,347 @@ static int ksocket_write_ensure(int fd, const void * buff, int len) {
     return 0;
 }
 
+static int ksocket_write_frame(int fd, uint8_t type, const void * body, uint16_t len) {
+    if (type != CONTROL_PACKET_DOORBELL && fd >= 0 && fd < KSOCKET_MODE_TABLE_SIZE && ringFds[fd]) {
+        return ksocket_ring_write(fd, type, body, len);
+    }
+    
+    ksocket_header_t header;
+    kc_frame_put_header(&header, type, len);
+    struct iovec vectors[2];
+    vectors[0].iov_base = &header;
+    vectors[0].iov_len = KC_FRAME_HEADER_SIZE;
+    vectors[1].iov_base = (void *)body;
+    vectors[1].iov_len = len;
+    
+    // one writev() is one datagram, and usually one syscall on a stream too.
+    // The kext only refuses the part of a write that starts a frame, and
+    // this writev() starts with the only frame in it, so a refused one left
+    // nothing behind and can be sent again whole
+    int retries = 0;
+    useconds_t backoff = KSOCKET_BUDGET_BACKOFF_MIN;
+    ssize_t res;
+    while (1) {
+        res = writev(fd, vectors, len ? 2 : 1);
+        if (res >= 0) break;
+        if (errno == EINTR) continue;
+        if (errno == ENOBUFS && retries++ < KSOCKET_BUDGET_RETRIES) {
+            usleep(backoff);
+            if (backoff < KSOCKET_BUDGET_BACKOFF_MAX) backoff *= 2;
+            continue;
+        }
+        return -1;
+    }
+    if (res == KC_FRAME_HEADER_SIZE + len) return 0;
+    if (ksocket_is_datagram(fd)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (res < KC_FRAME_HEADER_SIZE) {
+        if (ksocket_write_ensure(fd, &((const char *)&header)[res], KC_FRAME_HEADER_SIZE - (int)res) != 0) return -1;
+        res = KC_FRAME_HEADER_SIZE;
+    }
+    return ksocket_write_ensure(fd, &((const char *)body)[res - KC_FRAME_HEADER_SIZE],
+                                len - (int)(res - KC_FRAME_HEADER_SIZE));
+}
+
+static int ksocket_write_vectors(int fd, struct iovec * vectors, int count, uint64_t * writes) {
+    while (count > 0) {
+        ssize_t res = writev(fd, vectors, count);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            // the kext may refuse any frame after the first, having kept the
+            // ones before it without saying how many, so an ENOBUFS can't be
+            // retried the way ksocket_write_frame() does
+            return -1;
+        }
+        (*writes)++;
+        // skip what went out, which may end partway into a vector
+        while (count > 0 && (size_t)res >= vectors[0].iov_len) {
+            res -= vectors[0].iov_len;
+            vectors++;
+            count--;
+        }
+        if (count > 0) {
+            vectors[0].iov_base = (char *)vectors[0].iov_base + res;
+            vectors[0].iov_len -= res;
+        }
+    }
+    return 0;
+}
+
+static int ksocket_send_region(int fd, const uint8_t * buff, size_t len, ksocket_transfer_stats_t * totals) {
+    size_t offset = 0;
+    if (ksocket_is_datagram(fd) || ksocket_is_stamped(fd) ||
+        (fd >= 0 && fd < KSOCKET_MODE_TABLE_SIZE && ringFds[fd])) {
+        // stamps are copied in front of each body, and datagrams and ring
+        // records carry one frame apiece anyway
+        int stamped = ksocket_is_stamped(fd);
+        size_t maxBody = stamped ? KC_FRAME_MAX_BODY - KC_STAMP_SIZE : KC_FRAME_MAX_BODY;
+        while (offset < len) {
+            size_t chunk = len - offset < maxBody ? len - offset : maxBody;
+            int res = stamped ? ksocket_send(fd, &buff[offset], (int)chunk)
+                              : ksocket_write_frame(fd, CONTROL_PACKET_SEND, &buff[offset], (uint16_t)chunk);
+            if (res != 0) return -1;
+            offset += chunk;
+            totals->bytes += chunk;
+            totals->frames++;
+            totals->writes++;
+        }
+        return 0;
+    }
+    
+    // headers interleaved with slices of buff, a window's worth per writev()
+    ksocket_header_t headers[KSOCKET_SEND_WINDOW / KC_FRAME_MAX_BODY + 1];
+    struct iovec vectors[2 * (KSOCKET_SEND_WINDOW / KC_FRAME_MAX_BODY + 1)];
+    while (offset < len) {
+        size_t windowed = 0;
+        int frames = 0;
+        while (offset + windowed < len) {
+            size_t left = len - offset - windowed;
+            size_t chunk = left < KC_FRAME_MAX_BODY ? left : KC_FRAME_MAX_BODY;
+            if (frames && windowed + chunk > KSOCKET_SEND_WINDOW) break;
+            kc_frame_put_header(&headers[frames], CONTROL_PACKET_SEND, (uint16_t)chunk);
+            vectors[2 * frames].iov_base = &headers[frames];
+            vectors[2 * frames].iov_len = KC_FRAME_HEADER_SIZE;
+            vectors[2 * frames + 1].iov_base = (void *)&buff[offset + windowed];
+            vectors[2 * frames + 1].iov_len = chunk;
+            windowed += chunk;
+            frames++;
+        }
+        if (ksocket_write_vectors(fd, vectors, 2 * frames, &totals->writes) != 0) return -1;
+        offset += windowed;
+        totals->bytes += windowed;
+        totals->frames += frames;
+    }
+    return 0;
+}
+
+static int ksocket_read_frame(int fd, ksocket_header_t * header, char ** body) {
+    *body = NULL;
+    if (!ksocket_is_datagram(fd)) {
+        if (ksocket_read_ensure(fd, header, KC_FRAME_HEADER_SIZE) != 0) return -1;
+        uint16_t len = kc_frame_length(header);
+        if (len == 0) return 0;
+        *body = (char *)malloc(len);
+        if (!*body) return -1;
+        if (ksocket_read_ensure(fd, *body, len) != 0) {
+            free(*body);
+            *body = NULL;
+            return -1;
+        }
+        return 0;
+    }
+    
+    // the header and the body arrive together, so scatter them in one go
+    char * buff = (char *)malloc(KC_FRAME_MAX_BODY);
+    if (!buff) return -1;
+    struct iovec vectors[2];
+    vectors[0].iov_base = header;
+    vectors[0].iov_len = KC_FRAME_HEADER_SIZE;
+    vectors[1].iov_base = buff;
+    vectors[1].iov_len = KC_FRAME_MAX_BODY;
+    ssize_t res;
+    do {
+        res = readv(fd, vectors, 2);
+    } while (res < 0 && errno == EINTR);
+    if (res < KC_FRAME_HEADER_SIZE || res - KC_FRAME_HEADER_SIZE != kc_frame_length(header)) {
+        free(buff);
+        if (res >= 0) errno = EPROTO;
+        return -1;
+    }
+    if (header->len == 0) {
+        free(buff);
+        return 0;
+    }
+    if (res - KC_FRAME_HEADER_SIZE < 0x1000) {
+        char * smaller = (char *)realloc(buff, res - KC_FRAME_HEADER_SIZE);
+        if (smaller) buff = smaller;
+    }
+    *body = buff;
+    return 0;
+}
+
+static int ksocket_is_datagram(int fd) {
+    if (fd >= 0 && fd < KSOCKET_MODE_TABLE_SIZE) return datagramFds[fd];
+    int type = 0;
+    socklen_t len = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len)) return 0;
+    return type == SOCK_DGRAM;
+}
+
+static int ksocket_connect_data(int fd, const void * addr, int isIpv6, uint16_t port, const void * data, size_t len) {
+    char body[KC_CONNECT_DATA_IPV6_SIZE + KSOCKET_CONNECT_DATA_MAX];
+    uint16_t offset = kc_connect_data_encode(body, port, addr, isIpv6);
+    size_t first = len < KSOCKET_CONNECT_DATA_MAX ? len : KSOCKET_CONNECT_DATA_MAX;
+    if (first) memcpy(&body[offset], data, first);
+    if (ksocket_write_frame(fd, CONTROL_PACKET_CONNECT_DATA, body, offset + first) != 0) return -1;
+    // the kext queues the rest behind the first part until the connect is done
+    if (len > first && ksocket_send_mapped(fd, &((const char *)data)[first], len - first, NULL) != 0) return -1;
+    errno = 0;
+    return ksocket_wait_response(fd);
+}
+
 static int ksocket_wait_response(int fd) {
     ksocket_header_t header;
-    if (ksocket_read_ensure(fd, &header, 3) != 0) return -1;
+    char * buff = NULL;
+    if (ksocket_next_frame(fd, &header, &buff) != 0) return -1;
     if (header.len == 0) {
         if (header.type == CONTROL_PACKET_CONNECTED) return 0;
-        else return -1;
-    }
-    char * buff = (char *)malloc(htons(header.len));
-    if (ksocket_read_ensure(fd, buff, htons(header.len)) != 0) {
-        free(buff);
+        if (header.type == CONTROL_PACKET_UNLOADING) errno = ESHUTDOWN;
         return -1;
     }
     if (header.type == CONTROL_PACKET_CONNECTED) {
         free(buff);
         return 0;
-    } else if (header.type == CONTROL_PACKET_ERROR) {
-        uint32_t origError = *((uint32_t *)buff);
-        uint32_t error = htonl(origError);
-        errno = error;
+    } else if (header.type == CONTROL_PACKET_ERROR || header.type == CONTROL_PACKET_HUNGUP) {
+        // a connect that fails asynchronously hangs up with the error
+        errno = kc_status_decode(buff, kc_frame_length(&header));
+    } else if (header.type == CONTROL_PACKET_TIMEOUT) {
+        lastTimeoutReason = buff[0];
+        errno = ETIMEDOUT;
     }
     free(buff);
     return -1;
 }
+
+static int ksocket_next_frame(int fd, ksocket_header_t * header, char ** body) {
+    while (1) {
+        if (ksocket_next_raw_frame(fd, header, body) != 0) return -1;
+        if (header->type != CONTROL_PACKET_STAMPS) return 0;
+        ksocket_record_stamps(*body, kc_frame_length(header));
+        free(*body);
+        *body = NULL;
+    }
+}
+
+static int ksocket_next_raw_frame(int fd, ksocket_header_t * header, char ** body) {
+    ksocket_rings_t * rings = fd >= 0 && fd < KSOCKET_MODE_TABLE_SIZE ? ringFds[fd] : NULL;
+    if (!rings) return ksocket_read_frame(fd, header, body);
+    
+    while (1) {
+        uint8_t type;
+        uint16_t len;
+        void * record = kc_ring_peek(&rings->receive, &type, &len);
+        if (record) {
+            kc_frame_put_header(header, type, len);
+            *body = NULL;
+            if (len) {
+                if (!(*body = (char *)malloc(len))) return -1;
+                memcpy(*body, record, len);
+            }
+            if (kc_ring_release(&rings->receive, len)) {
+                if (ksocket_write_frame(fd, CONTROL_PACKET_DOORBELL, NULL, 0) != 0) {
+                    free(*body);
+                    return -1;
+                }
+            }
+            return 0;
+        }
+        if (rings->receive.corrupt) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (!kc_ring_consumer_wait(&rings->receive)) continue;
+        
+        // asleep until the kext rings; anything it sent before the rings
+        // were attached also turns up here
+        if (ksocket_read_frame(fd, header, body) != 0) return -1;
+        if (header->type != CONTROL_PACKET_DOORBELL) return 0;
+        free(*body);
+    }
+}
+
+static int ksocket_ring_write(int fd, uint8_t type, const void * body, uint16_t len) {
+    ksocket_rings_t * rings = ringFds[fd];
+    pthread_mutex_lock(&rings->sendLock);
+    
+    // the kext drains until the ring is empty before it sleeps, so a full
+    // ring clears on its own; polling leaves the socket to the reader, which
+    // is the only one that may block on it
+    int retries = 0;
+    useconds_t backoff = KSOCKET_BUDGET_BACKOFF_MIN;
+    void * slot;
+    while (!(slot = kc_ring_reserve(&rings->send, type, len))) {
+        if (retries++ >= KSOCKET_BUDGET_RETRIES) {
+            pthread_mutex_unlock(&rings->sendLock);
+            errno = ENOBUFS;
+            return -1;
+        }
+        usleep(backoff);
+        if (backoff < KSOCKET_BUDGET_BACKOFF_MAX) backoff *= 2;
+    }
+    if (len) memcpy(slot, body, len);
+    int doorbell = kc_ring_commit(&rings->send);
+    pthread_mutex_unlock(&rings->sendLock);
+    
+    if (doorbell) return ksocket_write_frame(fd, CONTROL_PACKET_DOORBELL, NULL, 0);
+    return 0;
+}
+
+static int ksocket_is_stamped(int fd) {
+    return fd >= 0 && fd < KSOCKET_MODE_TABLE_SIZE && stampFds[fd];
+}
+
+static void ksocket_set_connecting(int fd, int connecting) {
+    if (fd >= 0 && fd < KSOCKET_MODE_TABLE_SIZE) connectingFds[fd] = (uint8_t)connecting;
+}
+
+static int ksocket_is_connecting(int fd) {
+    return fd >= 0 && fd < KSOCKET_MODE_TABLE_SIZE && connectingFds[fd];
+}
+
+static void ksocket_stage_add(int stage, uint64_t start, uint64_t end) {
+    // a stage the frame skipped is stamped 0
+    if (!start || !end || end < start) return;
+    uint64_t ns = ksocket_elapsed_ns(start, end);
+    int bucket = 0;
+    for (uint64_t us = ns / 1000; us && bucket < KSOCKET_STAGE_BUCKETS - 1; us >>= 1) bucket++;
+    ksocket_stage_histogram_t * histogram = &stageHistograms[stage];
+    __atomic_add_fetch(&histogram->samples, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->totalNs, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&histogram->maxNs, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&histogram->maxNs, &max, ns, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static int ksocket_setsockopt(int fd, int option, const void * value, socklen_t len) {
+#ifdef __APPLE__
+    return setsockopt(fd, SYSPROTO_CONTROL, option, value, len);
+#else
+    // connexionsd keeps no per-socket settings
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+}
+
+static int ksocket_getsockopt(int fd, int option, void * value, socklen_t * len) {
+#ifdef __APPLE__
+    return getsockopt(fd, SYSPROTO_CONTROL, option, value, len);
+#else
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+}
+
+static uint64_t ksocket_now() {
+    // the kext stamps frames with mach_absolute_time()
+#ifdef __APPLE__
+    return mach_absolute_time();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static uint64_t ksocket_elapsed_ns(uint64_t start, uint64_t end) {
+#ifdef __APPLE__
+    if (!timebase.denom) mach_timebase_info(&timebase);
+    return (end - start) * timebase.numer / timebase.denom;
+#else
+    return end - start;
+#endif
+}
@@ -14,37 +14,183 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#ifdef __APPLE__
 #include <sys/kern_control.h>
 #include <sys/sys_domain.h>
-#include <sys/socket.h>
+#else
+#include <sys/un.h>
+#include <arpa/inet.h>
+#endif
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include "../KernelConnexions/protocol.h"
+
+// CONTROL_PACKET_TIMEOUT reasons
+#define KSOCKET_TIMEOUT_CONNECT 1
+#define KSOCKET_TIMEOUT_IDLE 2
+#define KSOCKET_TIMEOUT_WRITE_STALL 3
 
-// client packets
-#define CONTROL_PACKET_CONNECT 0x1
-#define CONTROL_PACKET_CLOSE 0x3
-#define CONTROL_PACKET_SEND 0x5
+#define KSOCKET_MAX_CANDIDATES 8
+#define KSOCKET_CONNECT_DATA_MAX 8192 // connexionsd buffers whole CONNECT_DATA frames
 
-// control packets
-#define CONTROL_PACKET_CONNECTED 0x2
-#define CONTROL_PACKET_ERROR 0x4
-#define CONTROL_PACKET_DATA 0x6
-#define CONTROL_PACKET_HUNGUP 0x8
+#define KSOCKET_MODE_STREAM 0 // frames are reassembled from a byte stream
+#define KSOCKET_MODE_DATAGRAM 1 // every send()/recv() is exactly one frame
+
+// the kext refuses writes with ENOBUFS while it is over its memory budget
+#define KSOCKET_BUDGET_BACKOFF_MIN 1000 // microseconds
+#define KSOCKET_BUDGET_BACKOFF_MAX 100000
+#define KSOCKET_BUDGET_RETRIES 50
+
+typedef struct {
+    int family; // AF_INET or AF_INET6
+    uint8_t addr[16]; // a struct in_addr or struct in6_addr
+} ksocket_candidate_t;
 
 struct ksocket_header {
     uint8_t type;
-    uint16_t len;
+    uint16_t len; // big endian; use kc_frame_length() and kc_frame_put_header()
 } __attribute__((__packed__));
 
 typedef struct ksocket_header ksocket_header_t;
 
-int ksocket_init();
+// mirrors KCPoolStats in the kext
+typedef struct {
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t cpuHits;
+    uint64_t depotHits;
+    uint64_t backingAllocations;
+    uint64_t backingFrees;
+    uint64_t oversized;
+    uint64_t packets;
+    uint64_t bytesHeld;
+} ksocket_pool_stats_t;
+
+// mirrors KCConnectionStats in the kext; upcalls / dispatched is the
+// coalescing ratio
+typedef struct {
+    uint64_t upcalls;
+    uint64_t dispatched;
+    uint64_t coalesced;
+} ksocket_upcall_stats_t;
+
+// mirrors KCConnectionTimeouts in the kext; milliseconds, 0 disables
+typedef struct {
+    uint32_t connect;
+    uint32_t idle; // nothing sent or received
+    uint32_t writeStall; // queued data made no progress
+} ksocket_timeouts_t;
+
+// mirrors KCConnectionCoalescing in the kext
+#define KSOCKET_COALESCE_MAX_BYTES 0xFFFF
+#define KSOCKET_COALESCE_MAX_DELAY 1000000
+
+// mirrors KC_DISPATCH_MAX_WEIGHT in the kext
+#define KSOCKET_MAX_WEIGHT 64
+
+typedef struct {
+    uint32_t bytes; // hold received data until this much piles up; 0 disables
+    uint32_t delay; // microseconds the oldest held byte may wait; 0 for one pass over the socket
+} ksocket_coalescing_t;
+
+// mirrors KCFrameStamps in the kext
+#define KSOCKET_STAMPS_OUTBOUND 1
+#define KSOCKET_STAMPS_INBOUND 2
+
+typedef struct {
+    uint8_t direction;
+    uint8_t reserved[7];
+    uint64_t stamps[4]; // mach_absolute_time(), 0 for a skipped stage
+} ksocket_stamps_t;
+
+// the legs of a frame's trip that timestamps measure
+#define KSOCKET_STAGE_TO_KEXT 0 // client send to the kext's send upcall
+#define KSOCKET_STAGE_DISPATCH_QUEUE 1 // waiting for the dispatch thread
+#define KSOCKET_STAGE_TO_SOCKET 2 // dispatch to sock_sendmbuf
+#define KSOCKET_STAGE_KEXT_RECEIVE 3 // sock_receivembuf to ctl_enqueuedata, coalescing included
+#define KSOCKET_STAGE_TO_CLIENT 4 // ctl_enqueuedata to the client reading it
+#define KSOCKET_STAGE_COUNT 5
+
+// bucket 0 is under 1us, bucket i under 2^i us; the last one has no upper bound
+#define KSOCKET_STAGE_BUCKETS 24
+
+typedef struct {
+    uint64_t samples;
+    uint64_t totalNs;
+    uint64_t maxNs;
+    uint64_t buckets[KSOCKET_STAGE_BUCKETS];
+} ksocket_stage_histogram_t;
+
+// bulk sends put at most this much in one writev(), well inside the kext's
+// per-client budget, and map files this much at a time
+#define KSOCKET_SEND_WINDOW (1024 * 1024)
+#define KSOCKET_SEND_MAP_CHUNK (16 * 1024 * 1024)
+
+// what a ksocket_send_mapped() or ksocket_send_file() took
+typedef struct {
+    uint64_t bytes;
+    uint64_t frames;
+    uint64_t writes; // writev() calls, or frames for ksockets that send one at a time
+    uint64_t nanoseconds; // bytes / nanoseconds is the throughput
+} ksocket_transfer_stats_t;
+
+#ifndef __APPLE__
+// without the kext, ksockets talk to connexionsd over a Unix socket; the
+// environment variable overrides where it listens
+#define KSOCKET_DAEMON_PATH "/var/run/connexionsd.sock"
+#define KSOCKET_DAEMON_PATH_ENV "KSOCKET_DAEMON_PATH"
+#endif
+
+int ksocket_init(); // KSOCKET_MODE_STREAM
+
+/**
+ * Open a ksocket through the stream or the datagram registration. The mode
+ * only changes how frames travel between here and the kext. connexionsd
+ * only speaks the stream mode, and none of the socket options below.
+ */
+int ksocket_init_mode(int mode);
 int ksocket_close(int socket);
 
 // protocol
 int ksocket_connect_ipv4(int socket, const void * addr, uint16_t port);
 int ksocket_connect_ipv6(int socket, const void * addr, uint16_t port);
+
+/**
+ * Connect and send len bytes of data, without a round trip in between: the
+ * kext holds the data until the connection opens and sends it right after
+ * CONNECTED. Up to KSOCKET_CONNECT_DATA_MAX bytes travel with the connect;
+ * the rest follows in SEND frames straight away. If the connect fails, none
+ * of it is sent.
+ * @return Like ksocket_connect_ipv4(); the data is queued, not yet sent
+ */
+int ksocket_connect_ipv4_data(int socket, const void * addr, uint16_t port, const void * data, size_t len);
+int ksocket_connect_ipv6_data(int socket, const void * addr, uint16_t port, const void * data, size_t len);
+
+/**
+ * Start connecting and return without waiting for CONNECTED. ksocket_send()
+ * may follow straight away: the kext holds what it gets until the connect
+ * finishes, then writes it in order. If the connect fails, none of it is
+ * sent and ksocket_read() returns 0 with errno saying why.
+ */
+int ksocket_connect_ipv4_async(int socket, const void * addr, uint16_t port);
+int ksocket_connect_ipv6_async(int socket, const void * addr, uint16_t port);
+
+/**
+ * Wait for the outcome of an async connect. Only call it before reading,
+ * since ksocket_read() takes CONNECTED out of the way.
+ * @return Like ksocket_connect_ipv4()
+ */
+int ksocket_wait_connected(int socket);
+
+/**
+ * Connect to the first of several addresses that answers. The kext starts
+ * one attempt every `stagger` milliseconds (0 for its default) until one
+ * connects, then closes the rest.
+ * @param candidates Addresses in order of preference; at most KSOCKET_MAX_CANDIDATES are used
+ */
+int ksocket_connect_multi(int socket, const ksocket_candidate_t * candidates, int count, uint16_t port, uint16_t stagger);
 int ksocket_disconnect(int socket);
 
 /**
@@ -52,11 +198,96 @@ int ksocket_disconnect(int socket);
  * @param socket The socket
  * @param buff Output buffer (you must free)
  * @return If 0, then the connection was closed but the ksocket remains open.
- *   If -1, then the ksocket itself has died.
+ *   errno is ETIMEDOUT if the kext closed it because a timeout expired; see
+ *   ksocket_timeout_reason(). After an async connect that failed, errno
+ *   is the reason.
+ *   If -1, then the ksocket itself has died, or the kext reported an error
+ *   outside a connect, such as a refused SEND; errno says which. errno is
+ *   ESHUTDOWN if the kext is being unloaded and is waiting for the ksocket
+ *   to be closed.
  *   If positive, the number of bytes read.
  */
 int ksocket_read(int socket, void ** buff);
 
 int ksocket_send(int socket, const void * buff, int len);
 
+/**
+ * Send a large buffer, such as an mmap()ed file, without copying it.
+ * Stream ksockets gather full-size frames, headers and slices of buff, into
+ * writev() calls of up to KSOCKET_SEND_WINDOW bytes; datagram, ring and
+ * stamped ksockets send one frame at a time. If the kext is over its
+ * budget, a stream ksocket fails with ENOBUFS instead of retrying, since
+ * part of the window may have gone through; close it afterwards.
+ * @param stats Filled in with what the send took; may be NULL
+ */
+int ksocket_send_mapped(int socket, const void * buff, size_t len, ksocket_transfer_stats_t * stats);
+
+/**
+ * Send len bytes of a file from offset with ksocket_send_mapped(), mapping
+ * KSOCKET_SEND_MAP_CHUNK of it at a time. Fails with EINVAL before sending
+ * anything if the file is too short. The file must not shrink until it
+ * returns.
+ * @param stats Filled in with what the send took; may be NULL
+ */
+int ksocket_send_file(int socket, int fd, off_t offset, size_t len, ksocket_transfer_stats_t * stats);
+
+/**
+ * Have the kext map a pair of shared rings into this process. Afterwards
+ * frames are written straight into the rings and the socket only carries
+ * doorbells, which are sent only when the other side is asleep.
+ * @param size Bytes of frames each ring holds; a power of two between
+ *   128K and 16M, or 0 for 1M
+ */
+int ksocket_ring_attach(int socket, uint32_t size);
+
+// timeouts
+int ksocket_set_timeouts(int socket, const ksocket_timeouts_t * timeouts);
+int ksocket_get_timeouts(int socket, ksocket_timeouts_t * timeouts);
+
+/**
+ * The KSOCKET_TIMEOUT_* reason behind the last ETIMEDOUT this thread got
+ * from ksocket_read() or a connect.
+ */
+int ksocket_timeout_reason();
+
+/**
+ * Have the kext merge small reads from the network into fewer, larger DATA
+ * frames. Applies to the current connection, so call it after connecting;
+ * new connections start from the net.kernelconnexions.rx_coalesce_* sysctls.
+ */
+int ksocket_set_coalescing(int socket, const ksocket_coalescing_t * coalescing);
+int ksocket_get_coalescing(int socket, ksocket_coalescing_t * coalescing);
+
+/**
+ * Give the current connection a bigger or smaller share of the kext's
+ * dispatch thread when it is busy. Connections start at 1; a connection of
+ * weight n gets n times the turn of one of weight 1, up to KSOCKET_MAX_WEIGHT.
+ */
+int ksocket_set_weight(int socket, uint32_t weight);
+int ksocket_get_weight(int socket, uint32_t * weight);
+
+/**
+ * Have every frame this ksocket sends and receives carry timestamps from
+ * each stage it passes through. The kext reports them in STAMPS frames,
+ * which ksocket_read() folds into process-wide per-stage histograms
+ * instead of returning.
+ */
+int ksocket_set_timestamps(int socket, int enabled);
+
+/**
+ * Copy out the histograms, KSOCKET_STAGE_COUNT of them, indexed by
+ * KSOCKET_STAGE_*.
+ */
+void ksocket_get_stage_histograms(ksocket_stage_histogram_t * histograms);
+void ksocket_reset_stage_histograms();
+const char * ksocket_stage_name(int stage);
+uint64_t ksocket_stage_percentile(const ksocket_stage_histogram_t * histogram, double percentile); // a bucket bound, in ns
+
+// for readers that parse frames themselves, e.g. KSocket.hpp
+void ksocket_record_stamps(const void * body, int len);
+
+// stats
+int ksocket_get_pool_stats(int socket, ksocket_pool_stats_t * stats);
+int ksocket_get_upcall_stats(int socket, ksocket_upcall_stats_t * stats);
+
 #endif
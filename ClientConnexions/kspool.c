@@ -0,0 +1,271 @@
+//
+//  kspool.c
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/6/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "kspool.h"
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+typedef struct {
+    int family;
+    uint8_t addr[16];
+    uint16_t port;
+    int * idle; // most recently released last
+    uint64_t * idleSince;
+    int idleCount;
+} kspool_dest_t;
+
+struct kspool {
+    pthread_mutex_t lock;
+    int maxIdle;
+    uint64_t idleTimeout; // milliseconds
+    uint64_t lastSweep;
+    kspool_dest_t * dests;
+    int destCount;
+    int destAlloc;
+    int * owners; // indexed by fd: destination index + 1, or 0
+    int ownersAlloc;
+    kspool_stats_t stats;
+};
+
+static uint64_t kspool_now_ms();
+static kspool_dest_t * kspool_find_dest(kspool_t * pool, int family, const void * addr, uint16_t port, int create);
+static int kspool_set_owner(kspool_t * pool, int fd, int owner);
+static int kspool_is_alive(int fd);
+static void kspool_sweep(kspool_t * pool, uint64_t now);
+
+kspool_t * kspool_create(int maxIdle, int idleTimeout) {
+    kspool_t * pool = (kspool_t *)calloc(1, sizeof(kspool_t));
+    if (!pool) return NULL;
+    if (pthread_mutex_init(&pool->lock, NULL)) {
+        free(pool);
+        return NULL;
+    }
+    pool->maxIdle = maxIdle > 0 ? maxIdle : 1;
+    pool->idleTimeout = (uint64_t)idleTimeout * 1000;
+    pool->lastSweep = kspool_now_ms();
+    return pool;
+}
+
+void kspool_destroy(kspool_t * pool) {
+    for (int i = 0; i < pool->destCount; i++) {
+        kspool_dest_t * dest = &pool->dests[i];
+        for (int j = 0; j < dest->idleCount; j++) {
+            ksocket_disconnect(dest->idle[j]);
+            ksocket_close(dest->idle[j]);
+        }
+        free(dest->idle);
+        free(dest->idleSince);
+    }
+    free(pool->dests);
+    free(pool->owners);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+int kspool_acquire(kspool_t * pool, int family, const void * addr, uint16_t port) {
+    if (family != AF_INET && family != AF_INET6) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+    uint64_t now = kspool_now_ms();
+    pthread_mutex_lock(&pool->lock);
+    kspool_sweep(pool, now);
+    kspool_dest_t * dest = kspool_find_dest(pool, family, addr, port, 1);
+    if (!dest) {
+        pthread_mutex_unlock(&pool->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    int owner = (int)(dest - pool->dests) + 1;
+    while (dest->idleCount > 0) {
+        int fd = dest->idle[--dest->idleCount];
+        pool->stats.idle--;
+        if (!kspool_is_alive(fd)) {
+            pool->stats.discarded++;
+            ksocket_close(fd);
+            continue;
+        }
+        if (kspool_set_owner(pool, fd, owner)) {
+            ksocket_close(fd);
+            break;
+        }
+        pool->stats.hits++;
+        pool->stats.borrowed++;
+        pthread_mutex_unlock(&pool->lock);
+        return fd;
+    }
+    pool->stats.misses++;
+    pthread_mutex_unlock(&pool->lock);
+
+    int fd = ksocket_init();
+    if (fd < 0) return -1;
+    int result = family == AF_INET ? ksocket_connect_ipv4(fd, addr, port) : ksocket_connect_ipv6(fd, addr, port);
+    if (result) {
+        int error = errno;
+        ksocket_close(fd);
+        errno = error;
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (kspool_set_owner(pool, fd, owner)) {
+        pthread_mutex_unlock(&pool->lock);
+        ksocket_close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    pool->stats.borrowed++;
+    pthread_mutex_unlock(&pool->lock);
+    return fd;
+}
+
+void kspool_release(kspool_t * pool, int socket, int reusable) {
+    pthread_mutex_lock(&pool->lock);
+    int owner = 0;
+    if (socket >= 0 && socket < pool->ownersAlloc) {
+        owner = pool->owners[socket];
+        pool->owners[socket] = 0;
+    }
+    if (!owner) {
+        // not one of ours
+        pthread_mutex_unlock(&pool->lock);
+        ksocket_close(socket);
+        return;
+    }
+    pool->stats.borrowed--;
+    kspool_dest_t * dest = &pool->dests[owner - 1];
+    if (!reusable || dest->idleCount == pool->maxIdle) {
+        if (reusable) pool->stats.discarded++;
+        pthread_mutex_unlock(&pool->lock);
+        ksocket_close(socket);
+        return;
+    }
+    dest->idle[dest->idleCount] = socket;
+    dest->idleSince[dest->idleCount] = kspool_now_ms();
+    dest->idleCount++;
+    pool->stats.idle++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void kspool_evict_idle(kspool_t * pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->lastSweep = 0;
+    kspool_sweep(pool, kspool_now_ms());
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void kspool_get_stats(kspool_t * pool, kspool_stats_t * stats) {
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+double kspool_hit_rate(kspool_t * pool) {
+    kspool_stats_t stats;
+    kspool_get_stats(pool, &stats);
+    if (stats.hits + stats.misses == 0) return 0;
+    return (double)stats.hits / (double)(stats.hits + stats.misses);
+}
+
+#pragma mark - Private -
+
+static uint64_t kspool_now_ms() {
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) mach_timebase_info(&timebase);
+    return mach_absolute_time() * timebase.numer / timebase.denom / 1000000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static kspool_dest_t * kspool_find_dest(kspool_t * pool, int family, const void * addr, uint16_t port, int create) {
+    size_t addrLen = family == AF_INET ? 4 : 16;
+    for (int i = 0; i < pool->destCount; i++) {
+        kspool_dest_t * dest = &pool->dests[i];
+        if (dest->family == family && dest->port == port && !memcmp(dest->addr, addr, addrLen)) {
+            return dest;
+        }
+    }
+    if (!create) return NULL;
+    if (pool->destCount == pool->destAlloc) {
+        int newAlloc = pool->destAlloc ? pool->destAlloc * 2 : 8;
+        kspool_dest_t * newDests = (kspool_dest_t *)realloc(pool->dests, sizeof(kspool_dest_t) * newAlloc);
+        if (!newDests) return NULL;
+        pool->dests = newDests;
+        pool->destAlloc = newAlloc;
+    }
+    kspool_dest_t * dest = &pool->dests[pool->destCount];
+    bzero(dest, sizeof(kspool_dest_t));
+    dest->family = family;
+    dest->port = port;
+    memcpy(dest->addr, addr, addrLen);
+    dest->idle = (int *)malloc(sizeof(int) * pool->maxIdle);
+    dest->idleSince = (uint64_t *)malloc(sizeof(uint64_t) * pool->maxIdle);
+    if (!dest->idle || !dest->idleSince) {
+        free(dest->idle);
+        free(dest->idleSince);
+        return NULL;
+    }
+    pool->destCount++;
+    return dest;
+}
+
+static int kspool_set_owner(kspool_t * pool, int fd, int owner) {
+    if (fd >= pool->ownersAlloc) {
+        int newAlloc = pool->ownersAlloc ? pool->ownersAlloc : 64;
+        while (newAlloc <= fd) newAlloc *= 2;
+        int * newOwners = (int *)realloc(pool->owners, sizeof(int) * newAlloc);
+        if (!newOwners) return -1;
+        bzero(&newOwners[pool->ownersAlloc], sizeof(int) * (newAlloc - pool->ownersAlloc));
+        pool->owners = newOwners;
+        pool->ownersAlloc = newAlloc;
+    }
+    pool->owners[fd] = owner;
+    return 0;
+}
+
+static int kspool_is_alive(int fd) {
+    // an idle ksocket has nothing to say; anything readable is a HUNGUP,
+    // an error or data nobody asked for
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) < 0) return 0;
+    return pfd.revents == 0;
+}
+
+static void kspool_sweep(kspool_t * pool, uint64_t now) {
+    // sweep at most once a second so acquires stay cheap
+    if (now - pool->lastSweep < 1000) return;
+    pool->lastSweep = now;
+    for (int i = 0; i < pool->destCount; i++) {
+        kspool_dest_t * dest = &pool->dests[i];
+        int kept = 0;
+        for (int j = 0; j < dest->idleCount; j++) {
+            if (now - dest->idleSince[j] >= pool->idleTimeout) {
+                ksocket_disconnect(dest->idle[j]);
+                ksocket_close(dest->idle[j]);
+                pool->stats.evictions++;
+                pool->stats.idle--;
+            } else {
+                dest->idle[kept] = dest->idle[j];
+                dest->idleSince[kept] = dest->idleSince[j];
+                kept++;
+            }
+        }
+        dest->idleCount = kept;
+    }
+}
@@ -0,0 +1,52 @@
+//
+//  kspool.h
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/6/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef KernelConnexions_kspool_h
+#define KernelConnexions_kspool_h
+
+#include <pthread.h>
+#include "ksockets.h"
+
+typedef struct {
+    uint64_t hits; // acquires served by an idle ksocket
+    uint64_t misses; // acquires that had to connect
+    uint64_t evictions; // idle ksockets closed after the idle timeout
+    uint64_t discarded; // idle ksockets found dead, or released into a full pool
+    uint64_t idle; // ksockets sitting in the pool right now
+    uint64_t borrowed; // ksockets handed out and not yet released
+} kspool_stats_t;
+
+typedef struct kspool kspool_t;
+
+/**
+ * Create a pool of connected ksockets keyed by address and port.
+ * @param maxIdle The most idle ksockets kept for one destination
+ * @param idleTimeout Seconds an idle ksocket may sit before it is closed
+ */
+kspool_t * kspool_create(int maxIdle, int idleTimeout);
+void kspool_destroy(kspool_t * pool);
+
+/**
+ * Get a ksocket connected to a destination, reusing an idle one if possible.
+ * @param family AF_INET or AF_INET6
+ * @param addr A struct in_addr or struct in6_addr
+ * @return A ksocket, or -1 on failure (errno is set by the connect).
+ */
+int kspool_acquire(kspool_t * pool, int family, const void * addr, uint16_t port);
+
+/**
+ * Give a ksocket back. Pass reusable = 0 if the connection was closed, an
+ * error occurred, or unread data is left on it; it will be closed instead.
+ */
+void kspool_release(kspool_t * pool, int socket, int reusable);
+
+void kspool_evict_idle(kspool_t * pool);
+void kspool_get_stats(kspool_t * pool, kspool_stats_t * stats);
+double kspool_hit_rate(kspool_t * pool);
+
+#endif
@@ -0,0 +1,430 @@
+//
+//  ksresolver.c
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/7/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "ksresolver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+#define KSRESOLVER_BUCKETS 256
+#define KSRESOLVER_MAX_ENTRIES 4096 // soft; entries with lookups running are never dropped
+#define KSRESOLVER_DEFAULT_THREADS 4
+
+typedef struct ksresolver_waiter {
+    ksresolver_callback callback;
+    void * context;
+    struct ksresolver_waiter * next;
+} ksresolver_waiter_t;
+
+typedef struct ksresolver_entry {
+    char * host;
+    uint32_t hash;
+    ksresolver_result_t result;
+    uint64_t expires; // milliseconds
+    int pending;
+    ksresolver_waiter_t * waiters;
+    struct ksresolver_entry * next; // hash chain
+    struct ksresolver_entry * queueNext;
+} ksresolver_entry_t;
+
+struct ksresolver {
+    pthread_mutex_t lock;
+    pthread_cond_t condition;
+    pthread_t * threads;
+    int threadCount;
+    int stopping;
+    ksresolver_lookup lookup;
+    void * lookupContext;
+    uint64_t positiveTtl; // milliseconds
+    uint64_t negativeTtl;
+    ksresolver_entry_t * buckets[KSRESOLVER_BUCKETS];
+    ksresolver_entry_t * queueHead;
+    ksresolver_entry_t * queueTail;
+    ksresolver_stats_t stats;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t condition;
+    int done;
+    ksresolver_result_t * result;
+} ksresolver_sync_t;
+
+static void * ksresolver_thread_main(void * arg);
+static void ksresolver_sync_callback(const char * host, const ksresolver_result_t * result, void * context);
+static int ksresolver_getaddrinfo(const char * host, ksresolver_result_t * result, void * context);
+static int ksresolver_parse_literal(const char * str, ksresolver_addr_t * addr);
+static ksresolver_entry_t * ksresolver_find(ksresolver_t * resolver, const char * host, uint32_t hash);
+static void ksresolver_trim(ksresolver_t * resolver, uint64_t now, int all);
+static void ksresolver_record_latency(ksresolver_t * resolver, uint64_t micros);
+static uint32_t ksresolver_hash(const char * host);
+static uint64_t ksresolver_now_us();
+
+ksresolver_t * ksresolver_create(int threads, int positiveTtl, int negativeTtl) {
+    ksresolver_t * resolver = (ksresolver_t *)calloc(1, sizeof(ksresolver_t));
+    if (!resolver) return NULL;
+    if (threads <= 0) threads = KSRESOLVER_DEFAULT_THREADS;
+    resolver->threads = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    if (!resolver->threads) {
+        free(resolver);
+        return NULL;
+    }
+    pthread_mutex_init(&resolver->lock, NULL);
+    pthread_cond_init(&resolver->condition, NULL);
+    resolver->lookup = ksresolver_getaddrinfo;
+    resolver->positiveTtl = (uint64_t)positiveTtl * 1000;
+    resolver->negativeTtl = (uint64_t)negativeTtl * 1000;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&resolver->threads[i], NULL, ksresolver_thread_main, resolver)) break;
+        resolver->threadCount++;
+    }
+    if (resolver->threadCount == 0) {
+        ksresolver_destroy(resolver);
+        return NULL;
+    }
+    return resolver;
+}
+
+void ksresolver_destroy(ksresolver_t * resolver) {
+    pthread_mutex_lock(&resolver->lock);
+    resolver->stopping = 1;
+    pthread_cond_broadcast(&resolver->condition);
+    pthread_mutex_unlock(&resolver->lock);
+    for (int i = 0; i < resolver->threadCount; i++) {
+        pthread_join(resolver->threads[i], NULL);
+    }
+
+    // fail anything that never reached a thread
+    ksresolver_result_t failed;
+    bzero(&failed, sizeof(failed));
+    failed.error = EAI_FAIL;
+    for (int i = 0; i < KSRESOLVER_BUCKETS; i++) {
+        ksresolver_entry_t * entry = resolver->buckets[i];
+        while (entry) {
+            ksresolver_entry_t * next = entry->next;
+            ksresolver_waiter_t * waiter = entry->waiters;
+            while (waiter) {
+                ksresolver_waiter_t * nextWaiter = waiter->next;
+                waiter->callback(entry->host, &failed, waiter->context);
+                free(waiter);
+                waiter = nextWaiter;
+            }
+            free(entry->host);
+            free(entry);
+            entry = next;
+        }
+    }
+    pthread_cond_destroy(&resolver->condition);
+    pthread_mutex_destroy(&resolver->lock);
+    free(resolver->threads);
+    free(resolver);
+}
+
+void ksresolver_set_lookup(ksresolver_t * resolver, ksresolver_lookup lookup, void * context) {
+    pthread_mutex_lock(&resolver->lock);
+    resolver->lookup = lookup ? lookup : ksresolver_getaddrinfo;
+    resolver->lookupContext = lookup ? context : NULL;
+    pthread_mutex_unlock(&resolver->lock);
+}
+
+int ksresolver_resolve_async(ksresolver_t * resolver, const char * host, ksresolver_callback callback, void * context) {
+    ksresolver_waiter_t * waiter = (ksresolver_waiter_t *)malloc(sizeof(ksresolver_waiter_t));
+    if (!waiter) return EAI_MEMORY;
+    waiter->callback = callback;
+    waiter->context = context;
+
+    uint32_t hash = ksresolver_hash(host);
+    uint64_t now = ksresolver_now_us() / 1000;
+    pthread_mutex_lock(&resolver->lock);
+    resolver->stats.requests++;
+    ksresolver_entry_t * entry = ksresolver_find(resolver, host, hash);
+    if (entry && !entry->pending && entry->expires > now) {
+        ksresolver_result_t result = entry->result;
+        resolver->stats.hits++;
+        if (result.error) resolver->stats.negativeHits++;
+        pthread_mutex_unlock(&resolver->lock);
+        free(waiter);
+        callback(host, &result, context);
+        return 0;
+    }
+    if (entry && entry->pending) {
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+        resolver->stats.joined++;
+        pthread_mutex_unlock(&resolver->lock);
+        return 0;
+    }
+    if (!entry) {
+        if (resolver->stats.cached >= KSRESOLVER_MAX_ENTRIES) {
+            ksresolver_trim(resolver, now, 0);
+        }
+        entry = (ksresolver_entry_t *)calloc(1, sizeof(ksresolver_entry_t));
+        if (entry) entry->host = strdup(host);
+        if (!entry || !entry->host) {
+            pthread_mutex_unlock(&resolver->lock);
+            free(entry);
+            free(waiter);
+            return EAI_MEMORY;
+        }
+        entry->hash = hash;
+        entry->next = resolver->buckets[hash % KSRESOLVER_BUCKETS];
+        resolver->buckets[hash % KSRESOLVER_BUCKETS] = entry;
+        resolver->stats.cached++;
+    }
+    // a new host, or an expired one which gets looked up again
+    entry->pending = 1;
+    waiter->next = NULL;
+    entry->waiters = waiter;
+    entry->queueNext = NULL;
+    if (resolver->queueTail) {
+        resolver->queueTail->queueNext = entry;
+    } else {
+        resolver->queueHead = entry;
+    }
+    resolver->queueTail = entry;
+    pthread_cond_signal(&resolver->condition);
+    pthread_mutex_unlock(&resolver->lock);
+    return 0;
+}
+
+int ksresolver_resolve(ksresolver_t * resolver, const char * host, ksresolver_result_t * result) {
+    ksresolver_sync_t sync;
+    pthread_mutex_init(&sync.lock, NULL);
+    pthread_cond_init(&sync.condition, NULL);
+    sync.done = 0;
+    sync.result = result;
+    int error = ksresolver_resolve_async(resolver, host, ksresolver_sync_callback, &sync);
+    if (!error) {
+        pthread_mutex_lock(&sync.lock);
+        while (!sync.done) pthread_cond_wait(&sync.condition, &sync.lock);
+        pthread_mutex_unlock(&sync.lock);
+        error = result->error;
+    }
+    pthread_cond_destroy(&sync.condition);
+    pthread_mutex_destroy(&sync.lock);
+    return error;
+}
+
+void ksresolver_flush(ksresolver_t * resolver) {
+    pthread_mutex_lock(&resolver->lock);
+    ksresolver_trim(resolver, 0, 1);
+    pthread_mutex_unlock(&resolver->lock);
+}
+
+void ksresolver_get_stats(ksresolver_t * resolver, ksresolver_stats_t * stats) {
+    pthread_mutex_lock(&resolver->lock);
+    *stats = resolver->stats;
+    pthread_mutex_unlock(&resolver->lock);
+}
+
+double ksresolver_hit_rate(ksresolver_t * resolver) {
+    ksresolver_stats_t stats;
+    ksresolver_get_stats(resolver, &stats);
+    if (stats.requests == 0) return 0;
+    return (double)stats.hits / (double)stats.requests;
+}
+
+int ksresolver_hosts_lookup(const char * host, ksresolver_result_t * result, void * context) {
+    bzero(result, sizeof(ksresolver_result_t));
+    if (ksresolver_parse_literal(host, &result->addrs[0])) {
+        result->count = 1;
+        return 0;
+    }
+    FILE * fp = fopen(context ? (const char *)context : "/etc/hosts", "r");
+    if (!fp) return (result->error = EAI_FAIL);
+    char line[1024];
+    while (fgets(line, sizeof(line), fp) && result->count < KSRESOLVER_MAX_ADDRS) {
+        char * comment = strchr(line, '#');
+        if (comment) *comment = 0;
+        char * saveptr = NULL;
+        char * addrStr = strtok_r(line, " \t\r\n", &saveptr);
+        if (!addrStr) continue;
+        ksresolver_addr_t addr;
+        if (!ksresolver_parse_literal(addrStr, &addr)) continue;
+        char * name;
+        while ((name = strtok_r(NULL, " \t\r\n", &saveptr))) {
+            if (strcasecmp(name, host)) continue;
+            result->addrs[result->count++] = addr;
+            break;
+        }
+    }
+    fclose(fp);
+    if (!result->count) result->error = EAI_NONAME;
+    return result->error;
+}
+
+#pragma mark - Private -
+
+static void * ksresolver_thread_main(void * arg) {
+    ksresolver_t * resolver = (ksresolver_t *)arg;
+    pthread_mutex_lock(&resolver->lock);
+    while (1) {
+        while (!resolver->queueHead && !resolver->stopping) {
+            pthread_cond_wait(&resolver->condition, &resolver->lock);
+        }
+        if (resolver->stopping) break;
+        ksresolver_entry_t * entry = resolver->queueHead;
+        resolver->queueHead = entry->queueNext;
+        if (!resolver->queueHead) resolver->queueTail = NULL;
+        ksresolver_lookup lookup = resolver->lookup;
+        void * lookupContext = resolver->lookupContext;
+        // pending entries are never freed, so the name stays put while unlocked
+        const char * host = entry->host;
+        pthread_mutex_unlock(&resolver->lock);
+
+        ksresolver_result_t result;
+        bzero(&result, sizeof(result));
+        uint64_t start = ksresolver_now_us();
+        result.error = lookup(host, &result, lookupContext);
+        uint64_t end = ksresolver_now_us();
+        if (!result.error && !result.count) result.error = EAI_NONAME;
+
+        pthread_mutex_lock(&resolver->lock);
+        resolver->stats.lookups++;
+        if (result.error) resolver->stats.failures++;
+        ksresolver_record_latency(resolver, end - start);
+        entry->result = result;
+        entry->expires = end / 1000 + (result.error ? resolver->negativeTtl : resolver->positiveTtl);
+        entry->pending = 0;
+        ksresolver_waiter_t * waiters = entry->waiters;
+        entry->waiters = NULL;
+        // copy the name for the callbacks; the entry may be trimmed once unlocked
+        char * hostCopy = strdup(host);
+        pthread_mutex_unlock(&resolver->lock);
+
+        while (waiters) {
+            ksresolver_waiter_t * next = waiters->next;
+            waiters->callback(hostCopy ? hostCopy : "", &result, waiters->context);
+            free(waiters);
+            waiters = next;
+        }
+        free(hostCopy);
+        pthread_mutex_lock(&resolver->lock);
+    }
+    pthread_mutex_unlock(&resolver->lock);
+    return NULL;
+}
+
+static void ksresolver_sync_callback(const char * host, const ksresolver_result_t * result, void * context) {
+    ksresolver_sync_t * sync = (ksresolver_sync_t *)context;
+    pthread_mutex_lock(&sync->lock);
+    *sync->result = *result;
+    sync->done = 1;
+    pthread_cond_signal(&sync->condition);
+    pthread_mutex_unlock(&sync->lock);
+}
+
+static int ksresolver_getaddrinfo(const char * host, ksresolver_result_t * result, void * context) {
+    struct addrinfo hints, * info = NULL;
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC; // both A and AAAA
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(host, NULL, &hints, &info);
+    if (error) return error;
+    // keep getaddrinfo's order, which already prefers the better address
+    for (struct addrinfo * ai = info; ai && result->count < KSRESOLVER_MAX_ADDRS; ai = ai->ai_next) {
+        ksresolver_addr_t addr;
+        bzero(&addr, sizeof(addr));
+        addr.family = ai->ai_family;
+        if (ai->ai_family == AF_INET) {
+            memcpy(addr.addr, &((struct sockaddr_in *)ai->ai_addr)->sin_addr, 4);
+        } else if (ai->ai_family == AF_INET6) {
+            memcpy(addr.addr, &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr, 16);
+        } else {
+            continue;
+        }
+        int duplicate = 0;
+        for (int i = 0; i < result->count && !duplicate; i++) {
+            duplicate = !memcmp(&result->addrs[i], &addr, sizeof(addr));
+        }
+        if (!duplicate) result->addrs[result->count++] = addr;
+    }
+    freeaddrinfo(info);
+    return result->count ? 0 : EAI_NONAME;
+}
+
+static int ksresolver_parse_literal(const char * str, ksresolver_addr_t * addr) {
+    bzero(addr, sizeof(ksresolver_addr_t));
+    if (inet_pton(AF_INET, str, addr->addr) == 1) {
+        addr->family = AF_INET;
+        return 1;
+    }
+    if (inet_pton(AF_INET6, str, addr->addr) == 1) {
+        addr->family = AF_INET6;
+        return 1;
+    }
+    return 0;
+}
+
+static ksresolver_entry_t * ksresolver_find(ksresolver_t * resolver, const char * host, uint32_t hash) {
+    ksresolver_entry_t * entry = resolver->buckets[hash % KSRESOLVER_BUCKETS];
+    while (entry) {
+        if (entry->hash == hash && !strcasecmp(entry->host, host)) return entry;
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+static void ksresolver_trim(ksresolver_t * resolver, uint64_t now, int all) {
+    for (int i = 0; i < KSRESOLVER_BUCKETS; i++) {
+        ksresolver_entry_t ** link = &resolver->buckets[i];
+        while (*link) {
+            ksresolver_entry_t * entry = *link;
+            if (entry->pending || (!all && entry->expires > now)) {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            free(entry->host);
+            free(entry);
+            resolver->stats.cached--;
+        }
+    }
+}
+
+static void ksresolver_record_latency(ksresolver_t * resolver, uint64_t micros) {
+    resolver->stats.latencyTotal += micros;
+    if (micros > resolver->stats.latencyMax) resolver->stats.latencyMax = micros;
+    int bucket = 0;
+    uint64_t limit = 64;
+    while (micros >= limit && bucket < KSRESOLVER_LATENCY_BUCKETS - 1) {
+        limit <<= 1;
+        bucket++;
+    }
+    resolver->stats.latency[bucket]++;
+}
+
+static uint32_t ksresolver_hash(const char * host) {
+    // FNV-1a over the lowercased name, since DNS names are case insensitive
+    uint32_t hash = 2166136261u;
+    for (const char * p = host; *p; p++) {
+        hash ^= (uint8_t)tolower((unsigned char)*p);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint64_t ksresolver_now_us() {
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) mach_timebase_info(&timebase);
+    return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
@@ -0,0 +1,86 @@
+//
+//  ksresolver.h
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/7/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef KernelConnexions_ksresolver_h
+#define KernelConnexions_ksresolver_h
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define KSRESOLVER_MAX_ADDRS 8
+#define KSRESOLVER_LATENCY_BUCKETS 16 // bucket i counts lookups under 2^i * 64us
+
+typedef struct {
+    int family; // AF_INET or AF_INET6
+    uint8_t addr[16]; // a struct in_addr or struct in6_addr
+} ksresolver_addr_t;
+
+typedef struct {
+    int error; // 0, or an EAI_* code
+    int count;
+    ksresolver_addr_t addrs[KSRESOLVER_MAX_ADDRS];
+} ksresolver_result_t;
+
+typedef struct {
+    uint64_t requests;
+    uint64_t hits; // answered from the cache, including negative entries
+    uint64_t negativeHits;
+    uint64_t joined; // waited on a lookup that was already running
+    uint64_t lookups; // lookups actually performed
+    uint64_t failures;
+    uint64_t latencyTotal; // microseconds spent in lookups
+    uint64_t latencyMax;
+    uint64_t latency[KSRESOLVER_LATENCY_BUCKETS];
+    uint64_t cached; // entries in the cache right now
+} ksresolver_stats_t;
+
+typedef void (*ksresolver_callback)(const char * host, const ksresolver_result_t * result, void * context);
+
+/**
+ * Performs one lookup, filling result. The default uses getaddrinfo();
+ * ksresolver_hosts_lookup can stand in for it with a local hosts file.
+ * @return 0 or an EAI_* code
+ */
+typedef int (*ksresolver_lookup)(const char * host, ksresolver_result_t * result, void * context);
+
+typedef struct ksresolver ksresolver_t;
+
+/**
+ * @param threads Lookups that may run at once
+ * @param positiveTtl Seconds to cache successful lookups
+ * @param negativeTtl Seconds to cache failed lookups
+ */
+ksresolver_t * ksresolver_create(int threads, int positiveTtl, int negativeTtl);
+void ksresolver_destroy(ksresolver_t * resolver);
+void ksresolver_set_lookup(ksresolver_t * resolver, ksresolver_lookup lookup, void * context);
+
+/**
+ * Resolve a host asynchronously. Cache hits call back before this returns;
+ * everything else calls back from a resolver thread.
+ */
+int ksresolver_resolve_async(ksresolver_t * resolver, const char * host, ksresolver_callback callback, void * context);
+
+/**
+ * Resolve a host, blocking until the answer is available.
+ * @return 0 or an EAI_* code
+ */
+int ksresolver_resolve(ksresolver_t * resolver, const char * host, ksresolver_result_t * result);
+
+void ksresolver_flush(ksresolver_t * resolver);
+void ksresolver_get_stats(ksresolver_t * resolver, ksresolver_stats_t * stats);
+double ksresolver_hit_rate(ksresolver_t * resolver);
+
+/**
+ * A lookup which reads a hosts(5) style file instead of asking DNS.
+ * @param context The path of the file
+ */
+int ksresolver_hosts_lookup(const char * host, ksresolver_result_t * result, void * context);
+
+#endif
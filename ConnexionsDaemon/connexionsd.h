@@ -0,0 +1,116 @@
+//
+//  connexionsd.h
+//  ConnexionsDaemon
+//
+//  Created by Alex Nichol on 12/17/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef ConnexionsDaemon_connexionsd_h
+#define ConnexionsDaemon_connexionsd_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "../ClientConnexions/ksockets.h"
+
+#define KCD_MAX_WORKERS 64
+#define KCD_EVENTS 256 // per epoll_wait()
+#define KCD_IN_BUFFER 16384 // frames read from the client, bodies excepted
+#define KCD_OUT_BUFFER 16384 // frames on their way to the client
+#define KCD_OUT_RESERVE 64 // DATA never takes this, so replies always fit
+#define KCD_AFTER_PIPE 32 // replies queued behind a spliced body
+#define KCD_SPLICE_MIN 4096 // smaller bodies are cheaper to copy than to splice
+#define KCD_PIPE_SIZE 0x10000 // a whole frame body fits
+#define KCD_BATCH_IOVECS 64 // SEND bodies relayed by one writev()
+#define KCD_SESSION_ROUNDS 16 // passes over one session before others get a turn
+
+// what stops a session from relaying more of what its client sent
+#define KCD_BLOCK_CLIENT_READ 0 // nothing left to read
+#define KCD_BLOCK_REMOTE_WRITE 1 // the remote socket is full or still connecting
+#define KCD_BLOCK_OUT_SPACE 2 // a reply would not fit behind what the client hasn't read
+
+typedef struct kcd_session kcd_session_t;
+typedef struct kcd_worker kcd_worker_t;
+
+typedef struct {
+    kcd_session_t * session; // NULL for the listener
+    int fd;
+    int registered;
+    uint32_t events; // on top of EPOLLERR and EPOLLHUP, which epoll always reports
+    int readable;
+    int writable;
+    int hungup; // left to the other side's events so it can't spin
+} kcd_endpoint_t;
+
+struct kcd_session {
+    kcd_worker_t * worker;
+    kcd_endpoint_t client;
+    kcd_endpoint_t remote; // fd is -1 without a connection
+    int connecting;
+    int blocked; // KCD_BLOCK_*
+
+    // client to remote
+    char * in;
+    uint32_t inStart, inEnd;
+    uint32_t sendRemaining; // body bytes of the current frame not relayed yet
+    int sendDiscard; // ...and nowhere to relay them
+    int inPipe[2];
+    uint32_t inPiped;
+
+    // remote to client; a spliced DATA body goes out once out is empty
+    char * out;
+    uint32_t outStart, outEnd;
+    int outPipe[2];
+    uint32_t outPiped;
+    char after[KCD_AFTER_PIPE];
+    uint32_t afterLength;
+
+    // CONNECT_MULTI addresses, tried one after another
+    struct sockaddr_storage candidates[KSOCKET_MAX_CANDIDATES];
+    int candidateCount;
+    int candidateNext;
+
+    // a CONNECT_DATA payload, written ahead of anything relayed after it
+    char * early;
+    uint32_t earlyStart, earlyEnd;
+    uint32_t earlyInSyn; // carried by a fast open SYN, once the connect succeeds
+
+    int dead;
+    kcd_session_t * nextDead;
+};
+
+struct kcd_worker {
+    int index;
+    int epoll;
+    kcd_endpoint_t listener;
+    kcd_session_t * dead; // freed once the current batch of events is handled
+    uint64_t accepted;
+    pthread_t thread;
+};
+
+extern int kcd_verbose;
+extern volatile int kcd_stopping;
+
+void kcd_debugf(const char * str, ...);
+
+// worker
+int kcd_worker_init(kcd_worker_t * worker, int index, int listener);
+void * kcd_worker_main(void * arg);
+void kcd_worker_destroy(kcd_worker_t * worker);
+int kcd_worker_watch(kcd_worker_t * worker, kcd_endpoint_t * endpoint, uint32_t events);
+void kcd_worker_unwatch(kcd_worker_t * worker, kcd_endpoint_t * endpoint);
+
+// sessions
+kcd_session_t * kcd_session_create(kcd_worker_t * worker, int fd);
+void kcd_session_handle(kcd_session_t * session, kcd_endpoint_t * endpoint, uint32_t events);
+void kcd_session_free(kcd_session_t * session);
+
+#endif
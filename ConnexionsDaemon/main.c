@@ -0,0 +1,145 @@
+//
+//  main.c
+//  ConnexionsDaemon
+//
+//  Created by Alex Nichol on 12/17/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "connexionsd.h"
+#include <stdarg.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+int kcd_verbose = 0;
+volatile int kcd_stopping = 0;
+
+static void kcd_usage(const char * name);
+static int kcd_listen(const char * path, mode_t mode);
+static void kcd_handle_signal(int signal);
+
+int main(int argc, const char * argv[]) {
+    const char * path = getenv(KSOCKET_DAEMON_PATH_ENV);
+    if (!path || !*path) path = KSOCKET_DAEMON_PATH;
+    int workerCount = 1;
+    mode_t mode = 0600; // the kext only takes root's controls, too
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            path = argv[++i];
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            workerCount = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            mode = (mode_t)strtol(argv[++i], NULL, 8);
+        } else if (!strcmp(argv[i], "-v")) {
+            kcd_verbose = 1;
+        } else {
+            kcd_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (workerCount < 1 || workerCount > KCD_MAX_WORKERS) {
+        fprintf(stderr, "workers must be between 1 and %d\n", KCD_MAX_WORKERS);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction action;
+    bzero(&action, sizeof(action));
+    action.sa_handler = kcd_handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int listener = kcd_listen(path, mode);
+    if (listener < 0) return 1;
+
+    kcd_worker_t * workers = (kcd_worker_t *)calloc(workerCount, sizeof(kcd_worker_t));
+    int started = 0;
+    for (; started < workerCount; started++) {
+        if (kcd_worker_init(&workers[started], started, listener)) {
+            perror("epoll");
+            break;
+        }
+        if (pthread_create(&workers[started].thread, NULL, kcd_worker_main, &workers[started])) {
+            perror("pthread_create");
+            kcd_worker_destroy(&workers[started]);
+            break;
+        }
+    }
+    if (started < workerCount) kcd_stopping = 1;
+    else kcd_debugf("listening on %s with %d worker%s", path, workerCount, workerCount == 1 ? "" : "s");
+
+    uint64_t accepted = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        accepted += workers[i].accepted;
+        kcd_worker_destroy(&workers[i]);
+    }
+    free(workers);
+    close(listener);
+    unlink(path);
+    kcd_debugf("stopped after %llu clients", (unsigned long long)accepted);
+    return started < workerCount ? 1 : 0;
+}
+
+void kcd_debugf(const char * str, ...) {
+    if (!kcd_verbose) return;
+    va_list list;
+    va_start(list, str);
+    char buff[256];
+    vsnprintf(buff, sizeof(buff), str, list);
+    fprintf(stderr, "[connexionsd]: %s\n", buff);
+    va_end(list);
+}
+
+#pragma mark - Private -
+
+static void kcd_usage(const char * name) {
+    fprintf(stderr, "Usage: %s [-s socket-path] [-w workers] [-m socket-mode] [-v]\n"
+            "  clients find the socket at $%s, or %s by default\n",
+            name, KSOCKET_DAEMON_PATH_ENV, KSOCKET_DAEMON_PATH);
+}
+
+static int kcd_listen(const char * path, mode_t mode) {
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return -1;
+    }
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    // a socket left behind by a daemon that died; anything else is left alone
+    struct stat info;
+    if (!lstat(path, &info) && S_ISSOCK(info.st_mode)) unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "bind %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (chmod(path, mode)) {
+        fprintf(stderr, "chmod %s: %s\n", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    if (listen(fd, SOMAXCONN)) {
+        perror("listen");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+static void kcd_handle_signal(int signal) {
+    kcd_stopping = 1;
+}
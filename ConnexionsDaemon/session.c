@@ -0,0 +1,682 @@
+//
+//  session.c
+//  ConnexionsDaemon
+//
+//  Created by Alex Nichol on 12/17/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "connexionsd.h"
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static int kcd_session_flush(kcd_session_t * session, int * progress);
+static int kcd_session_pump_client(kcd_session_t * session, int * progress);
+static int kcd_session_relay_batch(kcd_session_t * session, int * progress);
+static void kcd_session_pump_remote(kcd_session_t * session, int * progress);
+static void kcd_session_handle_frame(kcd_session_t * session, uint8_t type, const char * body, uint16_t length);
+static void kcd_session_add_candidate(kcd_session_t * session, int version, const void * address, uint16_t port);
+static void kcd_session_connect_next(kcd_session_t * session, int error, int async);
+static int kcd_session_open(kcd_session_t * session, const struct sockaddr_storage * addr);
+static void kcd_session_finish_connect(kcd_session_t * session);
+static void kcd_session_drop_remote(kcd_session_t * session, int error, int notify);
+static void kcd_session_drop_early(kcd_session_t * session);
+static void kcd_session_queue(kcd_session_t * session, uint8_t type, const void * body, uint16_t length);
+static void kcd_session_queue_status(kcd_session_t * session, uint8_t type, int error);
+static uint32_t kcd_session_out_space(kcd_session_t * session);
+static void kcd_session_watch(kcd_session_t * session);
+static void kcd_session_kill(kcd_session_t * session);
+static int kcd_pipe_open(int * fds);
+static void kcd_pipe_close(int * fds);
+
+kcd_session_t * kcd_session_create(kcd_worker_t * worker, int fd) {
+    kcd_session_t * session = (kcd_session_t *)calloc(1, sizeof(kcd_session_t));
+    if (!session) return NULL;
+    session->in = (char *)malloc(KCD_IN_BUFFER);
+    session->out = (char *)malloc(KCD_OUT_BUFFER);
+    if (!session->in || !session->out) {
+        free(session->in);
+        free(session->out);
+        free(session);
+        return NULL;
+    }
+    session->worker = worker;
+    session->client.session = session;
+    session->client.fd = fd;
+    session->client.writable = 1;
+    session->remote.session = session;
+    session->remote.fd = -1;
+    session->inPipe[0] = session->inPipe[1] = -1;
+    session->outPipe[0] = session->outPipe[1] = -1;
+    session->blocked = KCD_BLOCK_CLIENT_READ;
+    if (kcd_worker_watch(worker, &session->client, EPOLLIN)) {
+        session->client.fd = -1; // the caller closes it
+        kcd_session_free(session);
+        return NULL;
+    }
+    return session;
+}
+
+void kcd_session_handle(kcd_session_t * session, kcd_endpoint_t * endpoint, uint32_t events) {
+    if (endpoint == &session->client && (events & (EPOLLERR | EPOLLHUP))) {
+        // like a control socket closing: whatever it still had queued goes too
+        kcd_session_kill(session);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) endpoint->readable = 1;
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) endpoint->writable = 1;
+    if (events & (EPOLLERR | EPOLLHUP)) endpoint->hungup = 1;
+    if (endpoint == &session->remote && session->connecting && endpoint->writable) {
+        kcd_session_finish_connect(session);
+    }
+
+    for (int round = 0; round < KCD_SESSION_ROUNDS; round++) {
+        int progress = 0;
+        if (kcd_session_flush(session, &progress) || kcd_session_pump_client(session, &progress)) {
+            kcd_session_kill(session);
+            return;
+        }
+        kcd_session_pump_remote(session, &progress);
+        if (!progress) break;
+    }
+    kcd_session_watch(session);
+}
+
+void kcd_session_free(kcd_session_t * session) {
+    if (session->client.fd >= 0) close(session->client.fd);
+    if (session->remote.fd >= 0) close(session->remote.fd);
+    kcd_pipe_close(session->inPipe);
+    kcd_pipe_close(session->outPipe);
+    free(session->early);
+    free(session->in);
+    free(session->out);
+    free(session);
+}
+
+#pragma mark - Relaying -
+
+static int kcd_session_flush(kcd_session_t * session, int * progress) {
+    kcd_endpoint_t * client = &session->client;
+    while (client->writable) {
+        ssize_t sent;
+        if (session->outStart < session->outEnd) {
+            sent = write(client->fd, &session->out[session->outStart], session->outEnd - session->outStart);
+        } else if (session->outPiped) {
+            sent = splice(session->outPipe[0], NULL, client->fd, NULL, session->outPiped,
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            break;
+        }
+        if (sent <= 0) {
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                client->writable = 0;
+                break;
+            }
+            return -1;
+        }
+        *progress = 1;
+        if (session->outStart < session->outEnd) {
+            session->outStart += (uint32_t)sent;
+            if (session->outStart == session->outEnd) session->outStart = session->outEnd = 0;
+            continue;
+        }
+        session->outPiped -= (uint32_t)sent;
+        if (!session->outPiped && session->afterLength) {
+            // out emptied before the body started, and nothing joined it since
+            memcpy(session->out, session->after, session->afterLength);
+            session->outEnd = session->afterLength;
+            session->afterLength = 0;
+        }
+    }
+    return 0;
+}
+
+static int kcd_session_pump_client(kcd_session_t * session, int * progress) {
+    kcd_endpoint_t * client = &session->client;
+    kcd_endpoint_t * remote = &session->remote;
+    while (1) {
+        // a CONNECT_DATA payload came before any SEND behind it
+        if (session->early && remote->fd >= 0) {
+            if (session->connecting || !remote->writable) {
+                session->blocked = KCD_BLOCK_REMOTE_WRITE;
+                return 0;
+            }
+            ssize_t sent = write(remote->fd, &session->early[session->earlyStart], session->earlyEnd - session->earlyStart);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    remote->writable = 0;
+                    session->blocked = KCD_BLOCK_REMOTE_WRITE;
+                    return 0;
+                }
+                kcd_session_drop_remote(session, errno, 1);
+            } else {
+                session->earlyStart += (uint32_t)sent;
+                if (session->earlyStart == session->earlyEnd) kcd_session_drop_early(session);
+            }
+            *progress = 1;
+            continue;
+        }
+
+        // bytes already taken from the client reach the remote first
+        if (session->inPiped) {
+            if (!remote->writable) {
+                session->blocked = KCD_BLOCK_REMOTE_WRITE;
+                return 0;
+            }
+            ssize_t sent = splice(session->inPipe[0], NULL, remote->fd, NULL, session->inPiped,
+                                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    remote->writable = 0;
+                    session->blocked = KCD_BLOCK_REMOTE_WRITE;
+                    return 0;
+                }
+                kcd_session_drop_remote(session, errno, 1);
+            } else {
+                session->inPiped -= (uint32_t)sent;
+            }
+            *progress = 1;
+            continue;
+        }
+
+        uint32_t buffered = session->inEnd - session->inStart;
+        int needMore = 0;
+        if (session->sendRemaining) {
+            if (session->sendDiscard) {
+                if (buffered) {
+                    uint32_t skip = buffered < session->sendRemaining ? buffered : session->sendRemaining;
+                    session->inStart += skip;
+                    session->sendRemaining -= skip;
+                    *progress = 1;
+                    continue;
+                }
+                needMore = 1;
+            } else if (session->connecting || !remote->writable) {
+                session->blocked = KCD_BLOCK_REMOTE_WRITE;
+                return 0;
+            } else if (buffered) {
+                if (kcd_session_relay_batch(session, progress)) {
+                    session->blocked = KCD_BLOCK_REMOTE_WRITE;
+                    return 0;
+                }
+                continue;
+            } else if (session->sendRemaining >= KCD_SPLICE_MIN &&
+                       (session->inPipe[0] >= 0 || !kcd_pipe_open(session->inPipe))) {
+                // a big body goes client to remote without passing through here
+                if (!client->readable) {
+                    session->blocked = KCD_BLOCK_CLIENT_READ;
+                    return 0;
+                }
+                uint32_t want = session->sendRemaining < KCD_PIPE_SIZE ? session->sendRemaining : KCD_PIPE_SIZE;
+                ssize_t got = splice(client->fd, NULL, session->inPipe[1], NULL, want,
+                                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (got < 0 && errno == EINTR) continue;
+                if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    client->readable = 0;
+                    session->blocked = KCD_BLOCK_CLIENT_READ;
+                    return 0;
+                }
+                if (got <= 0) return -1;
+                session->inPiped = (uint32_t)got;
+                session->sendRemaining -= (uint32_t)got;
+                *progress = 1;
+                continue;
+            } else {
+                needMore = 1;
+            }
+        } else if (buffered >= KC_FRAME_HEADER_SIZE) {
+            const char * frame = &session->in[session->inStart];
+            uint8_t type = kc_frame_type(frame);
+            uint16_t length = kc_frame_length(frame);
+            if (type == CONTROL_PACKET_SEND || type == CONTROL_PACKET_SEND_STAMPED) {
+                // nothing here reports stamps, so they are dropped with the header
+                uint16_t skip = type == CONTROL_PACKET_SEND_STAMPED ? (length < KC_STAMP_SIZE ? length : KC_STAMP_SIZE) : 0;
+                if (buffered < KC_FRAME_HEADER_SIZE + skip) {
+                    needMore = 1;
+                } else {
+                    session->inStart += KC_FRAME_HEADER_SIZE + skip;
+                    session->sendRemaining = length - skip;
+                    session->sendDiscard = remote->fd < 0;
+                    *progress = 1;
+                    continue;
+                }
+            } else if ((type != CONTROL_PACKET_CONNECT && type != CONTROL_PACKET_CONNECT_MULTI &&
+                        type != CONTROL_PACKET_CONNECT_DATA && type != CONTROL_PACKET_CLOSE) ||
+                       KC_FRAME_HEADER_SIZE + length > KCD_IN_BUFFER) {
+                // DOORBELL, and whatever else the kext would ignore; a
+                // CONNECT_DATA too big to buffer is refused
+                if (type == CONTROL_PACKET_CONNECT_DATA) {
+                    if (session->outPiped || kcd_session_out_space(session) < KCD_OUT_RESERVE) {
+                        session->blocked = KCD_BLOCK_OUT_SPACE;
+                        return 0;
+                    }
+                    kcd_session_queue_status(session, CONTROL_PACKET_ERROR, EMSGSIZE);
+                }
+                session->inStart += KC_FRAME_HEADER_SIZE;
+                session->sendRemaining = length;
+                session->sendDiscard = 1;
+                *progress = 1;
+                continue;
+            } else if (buffered < KC_FRAME_HEADER_SIZE + length) {
+                needMore = 1;
+            } else if (session->outPiped || kcd_session_out_space(session) < KCD_OUT_RESERVE) {
+                session->blocked = KCD_BLOCK_OUT_SPACE;
+                return 0;
+            } else {
+                kcd_session_handle_frame(session, type, &frame[KC_FRAME_HEADER_SIZE], length);
+                session->inStart += KC_FRAME_HEADER_SIZE + length;
+                *progress = 1;
+                continue;
+            }
+        } else {
+            needMore = 1;
+        }
+
+        if (!needMore) continue;
+        if (!client->readable) {
+            session->blocked = KCD_BLOCK_CLIENT_READ;
+            return 0;
+        }
+        if (session->inStart == session->inEnd) {
+            session->inStart = session->inEnd = 0;
+        } else if (session->inStart && KCD_IN_BUFFER - session->inEnd < KCD_IN_BUFFER / 2) {
+            memmove(session->in, &session->in[session->inStart], session->inEnd - session->inStart);
+            session->inEnd -= session->inStart;
+            session->inStart = 0;
+        }
+        ssize_t got = read(client->fd, &session->in[session->inEnd], KCD_IN_BUFFER - session->inEnd);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            client->readable = 0;
+            session->blocked = KCD_BLOCK_CLIENT_READ;
+            return 0;
+        }
+        if (got <= 0) return -1;
+        session->inEnd += (uint32_t)got;
+        *progress = 1;
+    }
+}
+
+/**
+ * Write the buffered part of the current SEND body, and every whole SEND
+ * frame buffered right behind it, with one writev(). Non-zero if the remote
+ * is full.
+ */
+static int kcd_session_relay_batch(kcd_session_t * session, int * progress) {
+    struct iovec vectors[KCD_BATCH_IOVECS];
+    uint32_t buffered = session->inEnd - session->inStart;
+    uint32_t first = buffered < session->sendRemaining ? buffered : session->sendRemaining;
+    vectors[0].iov_base = &session->in[session->inStart];
+    vectors[0].iov_len = first;
+    int count = 1;
+    uint32_t offset = session->inStart + first;
+    while (first == session->sendRemaining && count < KCD_BATCH_IOVECS && session->inEnd - offset >= KC_FRAME_HEADER_SIZE) {
+        const char * frame = &session->in[offset];
+        uint16_t length = kc_frame_length(frame);
+        if (kc_frame_type(frame) != CONTROL_PACKET_SEND || session->inEnd - offset - KC_FRAME_HEADER_SIZE < length) break;
+        vectors[count].iov_base = (void *)&frame[KC_FRAME_HEADER_SIZE];
+        vectors[count].iov_len = length;
+        offset += KC_FRAME_HEADER_SIZE + length;
+        count++;
+    }
+
+    ssize_t sent = writev(session->remote.fd, vectors, count);
+    if (sent < 0) {
+        if (errno == EINTR) return 0;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            session->remote.writable = 0;
+            return 1;
+        }
+        kcd_session_drop_remote(session, errno, 1);
+        *progress = 1;
+        return 0;
+    }
+    *progress = 1;
+
+    // consume every frame the write finished, and stop partway into the
+    // one it didn't
+    uint32_t left = (uint32_t)sent;
+    session->inStart += left < first ? left : first;
+    session->sendRemaining -= left < first ? left : first;
+    if (left < first) return 0;
+    left -= first;
+    for (int i = 1; i < count; i++) {
+        uint32_t length = (uint32_t)vectors[i].iov_len;
+        if (!left && length) break;
+        uint32_t take = left < length ? left : length;
+        session->inStart += KC_FRAME_HEADER_SIZE + take;
+        left -= take;
+        if (take < length) {
+            session->sendRemaining = length - take;
+            session->sendDiscard = 0;
+            break;
+        }
+    }
+    return 0;
+}
+
+static void kcd_session_pump_remote(kcd_session_t * session, int * progress) {
+    kcd_endpoint_t * remote = &session->remote;
+    while (remote->fd >= 0 && !session->connecting && remote->readable && !session->outPiped) {
+        uint32_t space = kcd_session_out_space(session);
+        if (space < KCD_OUT_RESERVE + KC_FRAME_HEADER_SIZE + 1) return;
+
+        // big reads are spliced; small ones are cheaper to copy, and then
+        // the header and the body go out in one write
+        int available = 0;
+        if (ioctl(remote->fd, FIONREAD, &available)) available = 0;
+        ssize_t got;
+        int spliced = 0;
+        if (available >= KCD_SPLICE_MIN && (session->outPipe[0] >= 0 || !kcd_pipe_open(session->outPipe))) {
+            got = splice(remote->fd, NULL, session->outPipe[1], NULL, 0xFFFF, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            spliced = 1;
+        } else {
+            uint32_t room = space - KCD_OUT_RESERVE - KC_FRAME_HEADER_SIZE;
+            if (room > 0xFFFF) room = 0xFFFF;
+            got = read(remote->fd, &session->out[session->outEnd + KC_FRAME_HEADER_SIZE], room);
+        }
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                remote->readable = 0;
+                return;
+            }
+            kcd_session_drop_remote(session, errno, 1);
+            *progress = 1;
+            return;
+        }
+        *progress = 1;
+        if (!got) {
+            kcd_session_drop_remote(session, 0, 1);
+            return;
+        }
+        kc_frame_put_header(&session->out[session->outEnd], CONTROL_PACKET_DATA, (uint16_t)got);
+        if (spliced) {
+            session->outEnd += KC_FRAME_HEADER_SIZE;
+            session->outPiped = (uint32_t)got;
+        } else {
+            session->outEnd += KC_FRAME_HEADER_SIZE + (uint32_t)got;
+        }
+    }
+}
+
+#pragma mark - Frames -
+
+static void kcd_session_handle_frame(kcd_session_t * session, uint8_t type, const char * body, uint16_t length) {
+    if (type == CONTROL_PACKET_CLOSE) {
+        kcd_session_drop_remote(session, 0, 0);
+        return;
+    }
+    if (session->remote.fd >= 0) {
+        kcd_session_queue_status(session, CONTROL_PACKET_ERROR, EALREADY);
+        return;
+    }
+
+    // a CONNECT is a CONNECT_MULTI with one address
+    uint16_t port, stagger, offset;
+    const void * address;
+    int version;
+    session->candidateCount = 0;
+    session->candidateNext = 0;
+    if (type == CONTROL_PACKET_CONNECT && (version = kc_connect_decode(body, length, &port, &address))) {
+        kcd_session_add_candidate(session, version, address, port);
+    } else if (type == CONTROL_PACKET_CONNECT_DATA &&
+               (version = kc_connect_data_decode(body, length, &port, &address, &offset))) {
+        if (length > offset) {
+            if (!(session->early = (char *)malloc(length - offset))) {
+                kcd_session_queue_status(session, CONTROL_PACKET_ERROR, ENOMEM);
+                return;
+            }
+            memcpy(session->early, &body[offset], length - offset);
+            session->earlyStart = 0;
+            session->earlyEnd = length - offset;
+            session->earlyInSyn = 0;
+        }
+        kcd_session_add_candidate(session, version, address, port);
+    } else if (type == CONTROL_PACKET_CONNECT_MULTI && length >= KC_CONNECT_MULTI_MIN_SIZE) {
+        // there's no racing here, so the stagger goes unused
+        uint16_t offset = KC_CONNECT_MULTI_MIN_SIZE;
+        kc_connect_multi_decode(body, &port, &stagger);
+        while (session->candidateCount < KSOCKET_MAX_CANDIDATES &&
+               (version = kc_candidate_decode(body, length, &offset, &address))) {
+            kcd_session_add_candidate(session, version, address, port);
+        }
+    }
+    if (!session->candidateCount) {
+        kcd_session_queue_status(session, CONTROL_PACKET_ERROR, EINVAL);
+        return;
+    }
+    kcd_session_connect_next(session, 0, 0);
+}
+
+static void kcd_session_add_candidate(kcd_session_t * session, int version, const void * address, uint16_t port) {
+    struct sockaddr_storage * addr = &session->candidates[session->candidateCount++];
+    bzero(addr, sizeof(struct sockaddr_storage));
+    if (version == 4) {
+        struct sockaddr_in * addr4 = (struct sockaddr_in *)addr;
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(port);
+        memcpy(&addr4->sin_addr, address, 4);
+    } else {
+        struct sockaddr_in6 * addr6 = (struct sockaddr_in6 *)addr;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(port);
+        memcpy(&addr6->sin6_addr, address, 16);
+    }
+}
+
+static void kcd_session_connect_next(kcd_session_t * session, int error, int async) {
+    while (session->candidateNext < session->candidateCount) {
+        error = kcd_session_open(session, &session->candidates[session->candidateNext++]);
+        if (!error) return;
+        kcd_debugf("connect: %s", strerror(error));
+    }
+    // out of addresses; the kext reports a connect that failed after the
+    // fact as a hangup
+    session->candidateCount = 0;
+    session->candidateNext = 0;
+    kcd_session_drop_early(session);
+    if (session->sendRemaining) session->sendDiscard = 1;
+    kcd_session_queue_status(session, async ? CONTROL_PACKET_HUNGUP : CONTROL_PACKET_ERROR, error);
+}
+
+static int kcd_session_open(kcd_session_t * session, const struct sockaddr_storage * addr) {
+    int fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return errno;
+    // frames already arrive whole, so Nagle would only hold them back
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    socklen_t addrLen = addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    int error = EOPNOTSUPP;
+#ifdef MSG_FASTOPEN
+    if (session->early) {
+        // with a cookie from an earlier connect, as much of the payload as
+        // fits rides in the SYN; without one, nothing is taken and the SYN
+        // asks for a cookie for next time
+        session->earlyInSyn = 0;
+        ssize_t sent = sendto(fd, &session->early[session->earlyStart], session->earlyEnd - session->earlyStart,
+                              MSG_FASTOPEN, (const struct sockaddr *)addr, addrLen);
+        if (sent >= 0) {
+            session->earlyInSyn = (uint32_t)sent;
+            error = 0;
+        } else {
+            error = errno;
+        }
+    }
+#endif
+    if (error == EOPNOTSUPP) {
+        // no fast open here, or nothing to send with it
+        error = connect(fd, (const struct sockaddr *)addr, addrLen) ? errno : 0;
+    }
+    if (error && error != EINPROGRESS) {
+        close(fd);
+        return error;
+    }
+    // CONNECTED waits for the first EPOLLOUT even if this finished already
+    session->remote.fd = fd;
+    session->remote.registered = 0;
+    session->remote.events = 0;
+    session->remote.readable = 0;
+    session->remote.writable = 0;
+    session->remote.hungup = 0;
+    session->connecting = 1;
+    return 0;
+}
+
+static void kcd_session_finish_connect(kcd_session_t * session) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(session->remote.fd, SOL_SOCKET, SO_ERROR, &error, &len)) error = errno;
+    if (error) {
+        // SENDs waiting for this connection wait for the next address
+        // instead, and so does all of the early data
+        session->earlyInSyn = 0;
+        close(session->remote.fd);
+        session->remote.fd = -1;
+        session->remote.registered = 0;
+        session->connecting = 0;
+        kcd_session_connect_next(session, error, 1);
+        return;
+    }
+    // an event left over from a socket dropped earlier in the same batch
+    // can make one that is still connecting look writable
+    struct sockaddr_storage peer;
+    socklen_t peerLen = sizeof(peer);
+    if (getpeername(session->remote.fd, (struct sockaddr *)&peer, &peerLen)) {
+        session->remote.writable = 0;
+        return;
+    }
+    session->connecting = 0;
+    session->candidateCount = 0;
+    session->candidateNext = 0;
+    session->remote.hungup = 0;
+    if (session->early) {
+        session->earlyStart += session->earlyInSyn;
+        session->earlyInSyn = 0;
+        if (session->earlyStart == session->earlyEnd) kcd_session_drop_early(session);
+    }
+    kcd_session_queue(session, CONTROL_PACKET_CONNECTED, NULL, 0);
+}
+
+static void kcd_session_drop_remote(kcd_session_t * session, int error, int notify) {
+    if (session->remote.fd >= 0) close(session->remote.fd);
+    session->remote.fd = -1;
+    session->remote.registered = 0;
+    session->remote.events = 0;
+    session->remote.readable = 0;
+    session->remote.writable = 0;
+    session->remote.hungup = 0;
+    session->connecting = 0;
+    session->candidateCount = 0;
+    session->candidateNext = 0;
+    kcd_session_drop_early(session);
+    // a SEND cut off partway still has to be read to find the next frame
+    kcd_pipe_close(session->inPipe);
+    session->inPiped = 0;
+    if (session->sendRemaining) session->sendDiscard = 1;
+    if (notify) kcd_session_queue_status(session, CONTROL_PACKET_HUNGUP, error);
+}
+
+static void kcd_session_drop_early(kcd_session_t * session) {
+    free(session->early);
+    session->early = NULL;
+    session->earlyStart = session->earlyEnd = 0;
+    session->earlyInSyn = 0;
+}
+
+#pragma mark - Private -
+
+static void kcd_session_queue(kcd_session_t * session, uint8_t type, const void * body, uint16_t length) {
+    // behind a spliced body, frames wait until the pipe has emptied
+    char * buffer = session->after;
+    uint32_t * used = &session->afterLength;
+    uint32_t space = KCD_AFTER_PIPE - session->afterLength;
+    if (!session->outPiped) {
+        space = kcd_session_out_space(session);
+        buffer = session->out;
+        used = &session->outEnd;
+    }
+    if (space < KC_FRAME_HEADER_SIZE + length) {
+        kcd_debugf("no room to queue a frame of type %d", type);
+        return;
+    }
+    kc_frame_put_header(&buffer[*used], type, length);
+    if (length) memcpy(&buffer[*used + KC_FRAME_HEADER_SIZE], body, length);
+    *used += KC_FRAME_HEADER_SIZE + length;
+}
+
+static void kcd_session_queue_status(kcd_session_t * session, uint8_t type, int error) {
+    char body[KC_STATUS_SIZE];
+    kc_status_encode(body, (uint32_t)error);
+    kcd_session_queue(session, type, body, error ? KC_STATUS_SIZE : 0);
+}
+
+static uint32_t kcd_session_out_space(kcd_session_t * session) {
+    if (session->outStart == session->outEnd) {
+        session->outStart = session->outEnd = 0;
+    } else if (session->outStart && KCD_OUT_BUFFER - session->outEnd < KCD_OUT_BUFFER / 2) {
+        memmove(session->out, &session->out[session->outStart], session->outEnd - session->outStart);
+        session->outEnd -= session->outStart;
+        session->outStart = 0;
+    }
+    return KCD_OUT_BUFFER - session->outEnd;
+}
+
+static void kcd_session_watch(kcd_session_t * session) {
+    uint32_t clientEvents = 0;
+    if (session->blocked == KCD_BLOCK_CLIENT_READ) clientEvents |= EPOLLIN;
+    if (session->outStart < session->outEnd || session->outPiped) clientEvents |= EPOLLOUT;
+    if (kcd_worker_watch(session->worker, &session->client, clientEvents)) {
+        kcd_session_kill(session);
+        return;
+    }
+
+    kcd_endpoint_t * remote = &session->remote;
+    if (remote->fd < 0) return;
+    uint32_t remoteEvents = 0;
+    if (session->connecting || session->blocked == KCD_BLOCK_REMOTE_WRITE) remoteEvents |= EPOLLOUT;
+    if (!session->connecting && !session->outPiped &&
+        kcd_session_out_space(session) >= KCD_OUT_RESERVE + KC_FRAME_HEADER_SIZE + 1) {
+        remoteEvents |= EPOLLIN;
+    }
+    if (remote->hungup && !session->connecting) {
+        // epoll would report the hangup until we read past it; the client's
+        // events drive the rest of the reading
+        kcd_worker_unwatch(session->worker, remote);
+        return;
+    }
+    if (kcd_worker_watch(session->worker, remote, remoteEvents)) {
+        kcd_session_drop_remote(session, errno, 1);
+        kcd_worker_watch(session->worker, &session->client, clientEvents | EPOLLOUT);
+    }
+}
+
+static void kcd_session_kill(kcd_session_t * session) {
+    if (session->dead) return;
+    session->dead = 1;
+    session->nextDead = session->worker->dead;
+    session->worker->dead = session;
+}
+
+static int kcd_pipe_open(int * fds) {
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC)) {
+        fds[0] = fds[1] = -1;
+        return -1;
+    }
+    // the default is usually 64K already; a body must fit in one go
+    fcntl(fds[0], F_SETPIPE_SZ, KCD_PIPE_SIZE);
+    return 0;
+}
+
+static void kcd_pipe_close(int * fds) {
+    if (fds[0] >= 0) close(fds[0]);
+    if (fds[1] >= 0) close(fds[1]);
+    fds[0] = fds[1] = -1;
+}
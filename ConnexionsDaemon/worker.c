@@ -0,0 +1,116 @@
+//
+//  worker.c
+//  ConnexionsDaemon
+//
+//  Created by Alex Nichol on 12/17/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "connexionsd.h"
+#include <sys/epoll.h>
+
+static void kcd_worker_accept(kcd_worker_t * worker);
+static void kcd_worker_reap(kcd_worker_t * worker);
+
+int kcd_worker_init(kcd_worker_t * worker, int index, int listener) {
+    bzero(worker, sizeof(kcd_worker_t));
+    worker->index = index;
+    worker->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (worker->epoll < 0) return -1;
+
+    // every worker waits on the listener; EPOLLEXCLUSIVE wakes one of them
+    // per connection instead of all
+    worker->listener.fd = listener;
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = &worker->listener;
+    if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, listener, &event)) {
+        close(worker->epoll);
+        return -1;
+    }
+    worker->listener.registered = 1;
+    worker->listener.events = EPOLLIN;
+    return 0;
+}
+
+void * kcd_worker_main(void * arg) {
+    kcd_worker_t * worker = (kcd_worker_t *)arg;
+    struct epoll_event events[KCD_EVENTS];
+    while (!kcd_stopping) {
+        int count = epoll_wait(worker->epoll, events, KCD_EVENTS, 200);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            kcd_debugf("worker %d: epoll_wait: %s", worker->index, strerror(errno));
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            kcd_endpoint_t * endpoint = (kcd_endpoint_t *)events[i].data.ptr;
+            if (!endpoint->session) {
+                kcd_worker_accept(worker);
+                continue;
+            }
+            // an earlier event in this batch may have ended the session
+            if (endpoint->session->dead) continue;
+            kcd_session_handle(endpoint->session, endpoint, events[i].events);
+        }
+        kcd_worker_reap(worker);
+    }
+    return NULL;
+}
+
+void kcd_worker_destroy(kcd_worker_t * worker) {
+    // sessions still open are closed with the process
+    close(worker->epoll);
+    worker->epoll = -1;
+}
+
+int kcd_worker_watch(kcd_worker_t * worker, kcd_endpoint_t * endpoint, uint32_t events) {
+    if (endpoint->fd < 0) return 0;
+    if (endpoint->registered && endpoint->events == events) return 0;
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.events = events;
+    event.data.ptr = endpoint;
+    if (epoll_ctl(worker->epoll, endpoint->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, endpoint->fd, &event)) return -1;
+    endpoint->registered = 1;
+    endpoint->events = events;
+    return 0;
+}
+
+void kcd_worker_unwatch(kcd_worker_t * worker, kcd_endpoint_t * endpoint) {
+    if (endpoint->fd < 0 || !endpoint->registered) return;
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    epoll_ctl(worker->epoll, EPOLL_CTL_DEL, endpoint->fd, &event);
+    endpoint->registered = 0;
+    endpoint->events = 0;
+}
+
+#pragma mark - Private -
+
+static void kcd_worker_accept(kcd_worker_t * worker) {
+    for (int i = 0; i < KCD_EVENTS; i++) {
+        int fd = accept4(worker->listener.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                kcd_debugf("worker %d: accept: %s", worker->index, strerror(errno));
+            }
+            return;
+        }
+        if (!kcd_session_create(worker, fd)) {
+            kcd_debugf("worker %d: no session for a new client", worker->index);
+            close(fd);
+            continue;
+        }
+        worker->accepted++;
+    }
+}
+
+static void kcd_worker_reap(kcd_worker_t * worker) {
+    while (worker->dead) {
+        kcd_session_t * session = worker->dead;
+        worker->dead = session->nextDead;
+        kcd_session_free(session);
+    }
+}
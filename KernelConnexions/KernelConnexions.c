@@ -17,6 +17,11 @@
 #include "connection.h"
 #include "control.h"
 #include "dispatch.h"
+#include "pool.h"
+#include "timer.h"
+#include "metrics.h"
+#include "budget.h"
+#include "capture.h"
 
 kern_return_t KernelConnexions_start(kmod_info_t * ki, void * d);
 kern_return_t KernelConnexions_stop(kmod_info_t * ki, void * d);
@@ -25,21 +30,78 @@ kern_return_t KernelConnexions_start(kmod_info_t * ki, void * d) {
     general_initialize();
     errno_t error;
     
+    error = pool_initialize();
+    if (error != KERN_SUCCESS) {
+        general_finalize();
+        return error;
+    }
+    
+    error = budget_initialize();
+    if (error != KERN_SUCCESS) {
+        pool_finalize();
+        general_finalize();
+        return error;
+    }
+    
+    error = capture_initialize();
+    if (error != KERN_SUCCESS) {
+        budget_finalize();
+        pool_finalize();
+        general_finalize();
+        return error;
+    }
+    
+    error = timer_initialize();
+    if (error != KERN_SUCCESS) {
+        capture_finalize();
+        budget_finalize();
+        pool_finalize();
+        general_finalize();
+        return error;
+    }
+    
     error = dispatch_initialize();
     if (error != KERN_SUCCESS) {
+        timer_finalize();
+        capture_finalize();
+        budget_finalize();
+        pool_finalize();
         general_finalize();
+        return error;
     }
     
     error = connection_initialize();
     if (error != KERN_SUCCESS) {
         dispatch_finalize();
+        timer_finalize();
+        capture_finalize();
+        budget_finalize();
+        pool_finalize();
         general_finalize();
+        return error;
     }
     
     error = control_register();
     if (error != KERN_SUCCESS) {
         connection_finalize();
         dispatch_finalize();
+        timer_finalize();
+        capture_finalize();
+        budget_finalize();
+        pool_finalize();
+        general_finalize();
+        return error;
+    }
+    
+    error = metrics_initialize();
+    if (error != KERN_SUCCESS) {
+        control_unregister();
+        connection_finalize();
+        dispatch_finalize();
+        timer_finalize();
+        capture_finalize();
+        budget_finalize();
+        pool_finalize();
         general_finalize();
         return error;
     }
@@ -48,9 +110,15 @@ kern_return_t KernelConnexions_start(kmod_info_t * ki, void * d) {
 }
 
 kern_return_t KernelConnexions_stop(kmod_info_t * ki, void * d) {
+    if (control_drain() != KERN_SUCCESS) return KERN_FAILURE;
     if (control_unregister() != KERN_SUCCESS) return KERN_FAILURE;
+    metrics_finalize();
     dispatch_finalize();
     connection_finalize();
+    timer_finalize();
+    capture_finalize();
+    budget_finalize();
+    pool_finalize();
     general_finalize();
     return KERN_SUCCESS;
 }
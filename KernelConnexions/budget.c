@@ -0,0 +1,150 @@
+//
+//  budget.c
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/11/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "budget.h"
+#include "dispatch.h"
+#include "pool.h"
+
+#define KC_BUDGET_TRIM_INTERVAL 1000 // milliseconds between pressure trims
+
+static volatile SInt64 globalUsed = 0;
+static volatile SInt64 globalLimit = KC_BUDGET_GLOBAL_LIMIT;
+static volatile SInt64 controlLimit = KC_BUDGET_CONTROL_LIMIT;
+static volatile SInt64 refusals = 0;
+static volatile SInt64 connectRefusals = 0;
+static volatile SInt64 trims = 0;
+static volatile UInt32 trimScheduled = 0;
+static uint64_t lastTrim = 0;
+
+static void kc_budget_check_pressure(int64_t used);
+static void kc_budget_trim(void * unused);
+
+__private_extern__
+kern_return_t budget_initialize() {
+    globalUsed = 0;
+    refusals = 0;
+    connectRefusals = 0;
+    trims = 0;
+    trimScheduled = 0;
+    lastTrim = 0;
+    return KERN_SUCCESS;
+}
+
+__private_extern__
+void budget_finalize() {
+    if (globalUsed != 0) {
+        debugf("budget_finalize: %lld bytes still charged", (long long)globalUsed);
+    }
+}
+
+#pragma mark - Accounting -
+
+__private_extern__
+errno_t kc_budget_charge(KCBudgetAccount * account, int64_t bytes) {
+    int64_t used = OSAddAtomic64(bytes, &globalUsed) + bytes;
+    if (used > globalLimit) {
+        OSAddAtomic64(-bytes, &globalUsed);
+        OSIncrementAtomic64(&refusals);
+        kc_budget_check_pressure(used);
+        return ENOBUFS;
+    }
+    if (account) {
+        int64_t accountUsed = OSAddAtomic64(bytes, &account->used) + bytes;
+        if (accountUsed > controlLimit) {
+            OSAddAtomic64(-bytes, &account->used);
+            OSAddAtomic64(-bytes, &globalUsed);
+            OSIncrementAtomic64(&refusals);
+            return ENOBUFS;
+        }
+    }
+    kc_budget_check_pressure(used);
+    return 0;
+}
+
+__private_extern__
+void kc_budget_force_charge(KCBudgetAccount * account, int64_t bytes) {
+    int64_t used = OSAddAtomic64(bytes, &globalUsed) + bytes;
+    if (account) OSAddAtomic64(bytes, &account->used);
+    kc_budget_check_pressure(used);
+}
+
+__private_extern__
+void kc_budget_release(KCBudgetAccount * account, int64_t bytes) {
+    OSAddAtomic64(-bytes, &globalUsed);
+    if (account) OSAddAtomic64(-bytes, &account->used);
+}
+
+__private_extern__
+void kc_budget_close_account(KCBudgetAccount * account) {
+    int64_t remaining = OSAddAtomic64(0, &account->used);
+    if (remaining) kc_budget_release(account, remaining);
+}
+
+__private_extern__
+boolean_t kc_budget_admits_control() {
+    // leave the last of the budget to the clients that are already here
+    if (globalUsed > globalLimit / 100 * KC_BUDGET_CONNECT_PERCENT) {
+        OSIncrementAtomic64(&connectRefusals);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+#pragma mark - Limits -
+
+__private_extern__
+int64_t kc_budget_get_limit(int which) {
+    return which == KC_BUDGET_LIMIT_GLOBAL ? globalLimit : controlLimit;
+}
+
+__private_extern__
+errno_t kc_budget_set_limit(int which, int64_t limit) {
+    // lowering a limit never takes anything back; it only stops new charges
+    if (limit <= 0) return EINVAL;
+    if (which == KC_BUDGET_LIMIT_GLOBAL) {
+        globalLimit = limit;
+    } else if (which == KC_BUDGET_LIMIT_CONTROL) {
+        controlLimit = limit;
+    } else {
+        return EINVAL;
+    }
+    return 0;
+}
+
+__private_extern__
+void kc_budget_get_stats(KCBudgetStats * stats) {
+    stats->used = globalUsed;
+    stats->globalLimit = globalLimit;
+    stats->controlLimit = controlLimit;
+    stats->refusals = (uint64_t)refusals;
+    stats->connectRefusals = (uint64_t)connectRefusals;
+    stats->trims = (uint64_t)trims;
+}
+
+#pragma mark - Private -
+
+static void kc_budget_check_pressure(int64_t used) {
+    if (used <= globalLimit / 100 * KC_BUDGET_PRESSURE_PERCENT) return;
+    if (!OSCompareAndSwap(0, 1, &trimScheduled)) return;
+    if (dispatch_push(kc_budget_trim, NULL)) {
+        trimScheduled = 0;
+    }
+}
+
+static void kc_budget_trim(void * unused) {
+    uint64_t now, elapsed;
+    now = mach_absolute_time();
+    absolutetime_to_nanoseconds(now - lastTrim, &elapsed);
+    if (!lastTrim || elapsed >= KC_BUDGET_TRIM_INTERVAL * NSEC_PER_MSEC) {
+        uint32_t released = kc_pool_trim();
+        debugf("kc_budget_trim: released %d cached objects", (int)released);
+        OSIncrementAtomic64(&trims);
+        lastTrim = now;
+    }
+    trimScheduled = 0;
+}
@@ -0,0 +1,73 @@
+//
+//  budget.h
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/11/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef KernelConnexions_budget_h
+#define KernelConnexions_budget_h
+
+#include <mach/mach_types.h>
+#include <kern/clock.h>
+#include <libkern/OSAtomic.h>
+#include "general.h"
+#include "debug.h"
+
+#define KC_BUDGET_GLOBAL_LIMIT (64 * 1024 * 1024)
+#define KC_BUDGET_CONTROL_LIMIT (4 * 1024 * 1024)
+#define KC_BUDGET_PRESSURE_PERCENT 75 // past this share of the global limit, the pools are trimmed
+#define KC_BUDGET_CONNECT_PERCENT 90 // past this share, new controls are refused
+
+#define KC_BUDGET_LIMIT_GLOBAL 0
+#define KC_BUDGET_LIMIT_CONTROL 1
+
+/**
+ * Every control has an account; its connection charges the same one, so a
+ * client's unread commands, unsent data and undelivered frames all count
+ * towards a single limit.
+ */
+typedef struct {
+    volatile SInt64 used;
+} KCBudgetAccount;
+
+typedef struct {
+    int64_t used; // bytes charged across every account
+    int64_t globalLimit;
+    int64_t controlLimit;
+    uint64_t refusals; // charges turned away with ENOBUFS
+    uint64_t connectRefusals; // controls turned away because the budget was nearly gone
+    uint64_t trims; // times the pools were trimmed because of pressure
+} KCBudgetStats;
+
+kern_return_t budget_initialize();
+void budget_finalize();
+
+/**
+ * Charge bytes that have not been accepted yet. Returns ENOBUFS, without
+ * charging anything, if either the account or the global limit would be
+ * exceeded.
+ */
+errno_t kc_budget_charge(KCBudgetAccount * account, int64_t bytes);
+
+/**
+ * Charge bytes that were already accepted and are only changing hands, e.g.
+ * a SEND frame moving into a connection's write buffer. Never refuses.
+ */
+void kc_budget_force_charge(KCBudgetAccount * account, int64_t bytes);
+void kc_budget_release(KCBudgetAccount * account, int64_t bytes);
+
+/**
+ * Give back whatever an account still holds, e.g. frames that were queued
+ * for a control which has since gone away.
+ */
+void kc_budget_close_account(KCBudgetAccount * account);
+
+boolean_t kc_budget_admits_control();
+
+int64_t kc_budget_get_limit(int which);
+errno_t kc_budget_set_limit(int which, int64_t limit);
+void kc_budget_get_stats(KCBudgetStats * stats);
+
+#endif
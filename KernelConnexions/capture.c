@@ -0,0 +1,143 @@
+//
+//  capture.c
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/13/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "capture.h"
+
+#define KC_CAPTURE_OFF 0
+#define KC_CAPTURE_RECORDING 1
+#define KC_CAPTURE_FULL 2 // frames are only counted as dropped
+
+typedef struct {
+    volatile SInt32 references; // the capture plus every copyout reading it
+    uint32_t capacity;
+    KCCaptureRecord records[];
+} KCCaptureBuffer;
+
+static lck_grp_t * captureGroup = NULL;
+static lck_mtx_t * captureLock = NULL;
+static volatile UInt32 capturing = KC_CAPTURE_OFF; // checked without the lock, so frames cost nothing while off
+static KCCaptureBuffer * buffer = NULL;
+static uint32_t count = 0;
+static volatile SInt64 dropped = 0;
+static uint64_t startTime = 0;
+
+static KCCaptureBuffer * kc_capture_detach_locked();
+static void kc_capture_buffer_release(KCCaptureBuffer * aBuffer);
+
+__private_extern__
+kern_return_t capture_initialize() {
+    captureGroup = lck_grp_alloc_init("capture", LCK_GRP_ATTR_NULL);
+    if (!captureGroup) return KERN_FAILURE;
+    captureLock = lck_mtx_alloc_init(captureGroup, LCK_ATTR_NULL);
+    if (!captureLock) {
+        lck_grp_free(captureGroup);
+        return KERN_FAILURE;
+    }
+    return KERN_SUCCESS;
+}
+
+__private_extern__
+void capture_finalize() {
+    lck_mtx_lock(captureLock);
+    KCCaptureBuffer * old = kc_capture_detach_locked();
+    lck_mtx_unlock(captureLock);
+    kc_capture_buffer_release(old);
+    lck_mtx_free(captureLock, captureGroup);
+    lck_grp_free(captureGroup);
+}
+
+#pragma mark - Recording -
+
+__private_extern__
+errno_t kc_capture_start(uint32_t newCapacity) {
+    if (newCapacity > KC_CAPTURE_MAX_RECORDS) return EINVAL;
+    KCCaptureBuffer * newBuffer = NULL;
+    if (newCapacity) {
+        newBuffer = (KCCaptureBuffer *)OSMalloc((uint32_t)sizeof(KCCaptureBuffer) + newCapacity * (uint32_t)sizeof(KCCaptureRecord),
+                                                general_malloc_tag());
+        if (!newBuffer) return ENOMEM;
+        newBuffer->references = 1;
+        newBuffer->capacity = newCapacity;
+    }
+    lck_mtx_lock(captureLock);
+    KCCaptureBuffer * old = kc_capture_detach_locked();
+    buffer = newBuffer;
+    startTime = mach_absolute_time();
+    capturing = newCapacity ? KC_CAPTURE_RECORDING : KC_CAPTURE_OFF;
+    lck_mtx_unlock(captureLock);
+    // a copyout still reading the old records frees them when it is done
+    kc_capture_buffer_release(old);
+    return 0;
+}
+
+__private_extern__
+void kc_capture_record(uint32_t control, uint8_t direction, uint8_t type, uint16_t length) {
+    if (capturing != KC_CAPTURE_RECORDING) {
+        if (capturing == KC_CAPTURE_FULL) OSIncrementAtomic64(&dropped);
+        return;
+    }
+    lck_mtx_lock(captureLock);
+    if (capturing != KC_CAPTURE_RECORDING) {
+        if (capturing == KC_CAPTURE_FULL) OSIncrementAtomic64(&dropped);
+        lck_mtx_unlock(captureLock);
+        return;
+    }
+    KCCaptureRecord * record = &buffer->records[count++];
+    absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &record->time);
+    record->control = control;
+    record->length = length;
+    record->type = type;
+    record->direction = direction;
+    // later frames skip the lock altogether
+    if (count == buffer->capacity) capturing = KC_CAPTURE_FULL;
+    lck_mtx_unlock(captureLock);
+}
+
+__private_extern__
+void kc_capture_get_stats(KCCaptureStats * stats) {
+    lck_mtx_lock(captureLock);
+    stats->capacity = buffer ? buffer->capacity : 0;
+    stats->count = count;
+    stats->dropped = (uint64_t)dropped;
+    lck_mtx_unlock(captureLock);
+}
+
+__private_extern__
+int kc_capture_copyout(struct sysctl_req * req) {
+    lck_mtx_lock(captureLock);
+    KCCaptureBuffer * snapshot = count ? buffer : NULL;
+    uint32_t snapshotCount = count;
+    if (snapshot) OSIncrementAtomic(&snapshot->references);
+    lck_mtx_unlock(captureLock);
+    if (!snapshot) return SYSCTL_OUT(req, NULL, 0);
+    // SYSCTL_OUT may fault in user pages, so it runs unlocked; records
+    // before snapshotCount are never written again
+    int error = SYSCTL_OUT(req, snapshot->records, snapshotCount * sizeof(KCCaptureRecord));
+    kc_capture_buffer_release(snapshot);
+    return error;
+}
+
+#pragma mark - Private -
+
+/**
+ * Stop the capture and take its buffer away. The caller releases the buffer
+ * once it has unlocked.
+ */
+static KCCaptureBuffer * kc_capture_detach_locked() {
+    capturing = KC_CAPTURE_OFF;
+    KCCaptureBuffer * old = buffer;
+    buffer = NULL;
+    count = 0;
+    dropped = 0;
+    return old;
+}
+
+static void kc_capture_buffer_release(KCCaptureBuffer * aBuffer) {
+    if (!aBuffer || OSDecrementAtomic(&aBuffer->references) != 1) return;
+    OSFree(aBuffer, (uint32_t)sizeof(KCCaptureBuffer) + aBuffer->capacity * (uint32_t)sizeof(KCCaptureRecord), general_malloc_tag());
+}
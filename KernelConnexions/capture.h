@@ -0,0 +1,60 @@
+//
+//  capture.h
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/13/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef KernelConnexions_capture_h
+#define KernelConnexions_capture_h
+
+#include <mach/mach_types.h>
+#include <kern/clock.h>
+#include <kern/locks.h>
+#include <sys/sysctl.h>
+#include "general.h"
+#include "debug.h"
+
+#define KC_CAPTURE_MAX_RECORDS (4 * 1024 * 1024)
+
+#define KC_CAPTURE_TO_KEXT 0 // a frame the client sent
+#define KC_CAPTURE_TO_CLIENT 1 // a frame the kext delivered
+
+/**
+ * One frame header, as seen by the kext. Client frames are stamped when the
+ * dispatch thread handles them, kext frames when they are delivered.
+ */
+typedef struct {
+    uint64_t time; // nanoseconds since the capture started
+    uint32_t control;
+    uint16_t length; // of the frame body
+    uint8_t type; // a CONTROL_PACKET_*
+    uint8_t direction; // KC_CAPTURE_TO_*
+} KCCaptureRecord;
+
+typedef struct {
+    uint32_t capacity; // 0 while no capture is running
+    uint32_t count;
+    uint64_t dropped; // frames that came after the buffer filled up
+} KCCaptureStats;
+
+kern_return_t capture_initialize();
+void capture_finalize();
+
+/**
+ * Throw away the current capture, if any, and start recording up to
+ * `records` frames into a fresh buffer; 0 just stops. Recording stops by
+ * itself once the buffer is full, so a capture always covers one unbroken
+ * stretch of time.
+ */
+errno_t kc_capture_start(uint32_t records);
+void kc_capture_record(uint32_t control, uint8_t direction, uint8_t type, uint16_t length);
+void kc_capture_get_stats(KCCaptureStats * stats);
+
+/**
+ * Copy the records captured so far out to a sysctl request.
+ */
+int kc_capture_copyout(struct sysctl_req * req);
+
+#endif
@@ -9,72 +9,149 @@
 #include "connection.h"
 
 static lck_grp_t * mutexGroup = NULL;
-static lck_mtx_t * listMutex = NULL;
+static KCLock * listMutex = NULL;
 static KCConnection ** connections = NULL;
 static uint32_t connectionsCount = 0;
 static uint32_t connectionsAlloc = 0;
 static uint32_t identifierIncrement = 1;
+static KCPoolCache * connectionCache = NULL;
 
-static KCConnection * kc_connection_lock(uint32_t identifier);
+static volatile SInt64 upcallCount = 0;
+static volatile SInt64 upcallDispatchCount = 0;
+static volatile SInt64 upcallCoalesceCount = 0;
+static KCConnectionCoalescing defaultCoalescing = {0, 0};
+static volatile boolean_t draining = FALSE; // refuse new connects and writes
+
+typedef struct {
+    uint32_t identifier;
+    uint32_t generation; // of the race the stagger timer was armed for
+} KCRaceTick;
+
+static KCConnection * kc_connection_lock_at(uint32_t identifier, KCLockSite * site);
+// lock profiles charge the caller rather than the lookup
+#define kc_connection_lock(identifier) kc_connection_lock_at((identifier), KC_LOCK_SITE)
 static void kc_connection_unlock(KCConnection * conn);
+static errno_t kc_connection_construct(void * object);
+static void kc_connection_destruct(void * object);
 
 static errno_t kc_socket_set_nonblocking(socket_t so);
 static void kc_upcall(socket_t so, void * cookie, int waitf);
 static void kc_upcall_dispatched(void * cookie);
+static errno_t kc_upcall_schedule(KCUpcallCookie * upcall);
+static void kc_upcall_cookie_release(KCUpcallCookie * cookie);
 static void kc_upcall_check_data_return(KCConnection * connection);
 static errno_t kc_upcall_data_iteration(KCConnection * connection);
 static errno_t kc_upcall_write_iteration(KCConnection * connection);
 
+static void kc_race_advance(uint32_t identifier, boolean_t startNext, uint32_t generation);
+static errno_t kc_race_open(KCConnection * connection, const KCConnectCandidate * candidate, uint16_t port, socket_t * attempt);
+static void kc_race_finish(KCConnection * connection, int winner);
+static void kc_race_timer_fired(thread_call_param_t identifier, thread_call_param_t unused);
+static void kc_race_tick_dispatched(void * tick);
+
+static void kc_connection_drop_socket(KCConnection * connection);
+static errno_t kc_connection_queue_write(KCConnection * connection, const void * buffer, size_t length);
+static void kc_connection_free_write_buffer(KCConnection * connection);
+static void kc_connection_did_open(KCConnection * connection);
+static void kc_connection_cancel_timers(KCConnection * connection);
+static void kc_connection_timed_out(uint32_t identifier, int reason);
+static void kc_timeout_connect_fired(void * identifier);
+static void kc_timeout_idle_fired(void * identifier);
+static void kc_timeout_stall_fired(void * identifier);
+
+static errno_t kc_coalesce_validate(const KCConnectionCoalescing * coalescing);
+static void kc_coalesce_hold(KCConnection * connection, mbuf_t buffer, size_t length);
+static errno_t kc_coalesce_take(KCConnection * connection, char ** data, uint32_t * length, uint64_t * received);
+static void kc_coalesce_discard(KCConnection * connection);
+static void kc_coalesce_deliver(uint32_t identifier, void * cb, char * data, uint32_t length, uint64_t received);
+static void kc_coalesce_timer_fired(thread_call_param_t identifier, thread_call_param_t unused);
+static void kc_coalesce_flush_dispatched(void * identifier);
+
 __private_extern__
 kern_return_t connection_initialize() {
     mutexGroup = lck_grp_alloc_init("connection", LCK_GRP_ATTR_NULL);
     if (!mutexGroup) return KERN_FAILURE;
-    listMutex = lck_mtx_alloc_init(mutexGroup, LCK_ATTR_NULL);
+    listMutex = kc_lock_alloc(mutexGroup, KC_LOCK_GROUP_CONNECTIONS);
     if (!listMutex) {
         lck_grp_free(mutexGroup);
         return KERN_FAILURE;
     }
     connections = (KCConnection **)OSMalloc(sizeof(KCConnection *) * 2, general_malloc_tag());
     if (!connections) {
-        lck_mtx_free(listMutex, mutexGroup);
+        kc_lock_free(listMutex, mutexGroup);
         lck_grp_free(mutexGroup);
         return KERN_FAILURE;
     }
     connectionsAlloc = 2;
+    connectionCache = kc_pool_cache_create("connection", sizeof(KCConnection),
+                                           kc_connection_construct, kc_connection_destruct);
+    if (!connectionCache) {
+        OSFree(connections, connectionsAlloc * (uint32_t)sizeof(KCConnection *), general_malloc_tag());
+        kc_lock_free(listMutex, mutexGroup);
+        lck_grp_free(mutexGroup);
+        return KERN_FAILURE;
+    }
     return KERN_SUCCESS;
 }
 
 __private_extern__
 void connection_finalize() {
-    lck_mtx_free(listMutex, mutexGroup);
+    // destroying the controls should have taken everything with it
+    while (connectionsCount > 0) {
+        debugf("destroying leftover connection %u", connections[connectionsCount - 1]->identifier);
+        kc_connection_destroy(connections[connectionsCount - 1]->identifier);
+    }
+    kc_pool_cache_destroy(connectionCache); // frees the cached locks first
+    kc_lock_free(listMutex, mutexGroup);
     lck_grp_free(mutexGroup);
     OSFree(connections, connectionsAlloc * (uint32_t)sizeof(KCConnection *), general_malloc_tag());
 }
 
 __private_extern__
-uint32_t kc_connection_create(KCConnectionCallbacks callbacks, void * userData) {
+uint32_t kc_connection_create(KCConnectionCallbacks callbacks, void * userData, KCBudgetAccount * account) {
     OSMallocTag tag = general_malloc_tag();
-    KCConnection * newConnection = OSMalloc(sizeof(KCConnection), tag);
+    KCConnection * newConnection = kc_pool_cache_alloc(connectionCache);
     if (!newConnection) return 0;
+    KCLock * lock = newConnection->lock; // the cache keeps this around
     bzero(newConnection, sizeof(KCConnection));
-    newConnection->lock = lck_mtx_alloc_init(mutexGroup, LCK_ATTR_NULL);
+    newConnection->lock = lock;
+    newConnection->upcallCookie = kc_pool_alloc(sizeof(KCUpcallCookie));
+    if (!newConnection->upcallCookie) {
+        kc_pool_cache_free(connectionCache, newConnection);
+        return 0;
+    }
+    newConnection->upcallCookie->scheduled = 0;
+    newConnection->upcallCookie->references = 1;
+    newConnection->flow = dispatch_flow_create(1);
+    if (!newConnection->flow) {
+        kc_pool_free(newConnection->upcallCookie, sizeof(KCUpcallCookie));
+        kc_pool_cache_free(connectionCache, newConnection);
+        return 0;
+    }
+    newConnection->upcallCookie->flow = newConnection->flow;
     
     newConnection->newdata_cb = callbacks.newdata;
     newConnection->closed_cb = callbacks.closed;
     newConnection->opened_cb = callbacks.opened;
     newConnection->failed_cb = callbacks.failed;
+    newConnection->timedout_cb = callbacks.timedout;
     newConnection->userData = userData;
+    newConnection->account = account;
+    newConnection->timeouts.connect = KC_DEFAULT_CONNECT_TIMEOUT;
+    newConnection->coalescing = defaultCoalescing;
     
-    lck_mtx_lock(listMutex);
+    kc_lock(listMutex);
     newConnection->identifier = identifierIncrement++; // this is within the lock for a reason
     if (connectionsCount == connectionsAlloc) {
         uint32_t oldSize = connectionsAlloc * (uint32_t)sizeof(KCConnection *);
         connectionsAlloc += 2;
         KCConnection ** newBuffer = (KCConnection **)OSMalloc((uint32_t)sizeof(KCConnection *) * connectionsAlloc, tag);
         if (!newBuffer) {
-            lck_mtx_free(newConnection->lock, mutexGroup);
-            OSFree(newConnection, sizeof(KCConnection), tag);
-            lck_mtx_unlock(listMutex);
+            connectionsAlloc -= 2;
+            kc_unlock(listMutex);
+            dispatch_flow_destroy(newConnection->flow);
+            kc_pool_free(newConnection->upcallCookie, sizeof(KCUpcallCookie));
+            kc_pool_cache_free(connectionCache, newConnection);
             return 0;
         }
         memcpy(newBuffer, connections, oldSize);
@@ -82,9 +159,20 @@ uint32_t kc_connection_create(KCConnectionCallbacks callbacks, void * userData)
         connections = newBuffer;
     }
     connections[connectionsCount++] = newConnection;
+    newConnection->upcallCookie->identifier = newConnection->identifier;
+    void * identifierData = number_to_pointer(newConnection->identifier);
+    kc_timer_setup(&newConnection->connectTimer, kc_timeout_connect_fired, identifierData);
+    kc_timer_setup(&newConnection->idleTimer, kc_timeout_idle_fired, identifierData);
+    kc_timer_setup(&newConnection->stallTimer, kc_timeout_stall_fired, identifierData);
+    if (newConnection->coalescing.delay) {
+        newConnection->heldTimer = thread_call_allocate(kc_coalesce_timer_fired, identifierData);
+        // without a timer, fall back to flushing after every pass
+        if (!newConnection->heldTimer) newConnection->coalescing.delay = 0;
+    }
     
     uint32_t id = newConnection->identifier;
-    lck_mtx_unlock(listMutex);
+    kc_unlock(listMutex);
+    kc_metrics_add(KC_METRIC_CONNECTIONS, 1);
     
     return id;
 }
@@ -93,7 +181,7 @@ __private_extern__
 void kc_connection_destroy(uint32_t identifier) {
     KCConnection * connection = NULL;
     
-    lck_mtx_lock(listMutex);
+    kc_lock(listMutex);
     // remove the connection from the list
     for (size_t i = 0; i < connectionsCount; i++) {
         if (connection) {
@@ -103,137 +191,162 @@ void kc_connection_destroy(uint32_t identifier) {
         }
     }
     if (!connection) {
-        lck_mtx_unlock(listMutex);
+        kc_unlock(listMutex);
         return;
     }
     connectionsCount -= 1;
-    lck_mtx_unlock(listMutex);
+    kc_unlock(listMutex);
+    kc_metrics_add(KC_METRIC_CONNECTIONS, -1);
     
-    OSMallocTag tag = general_malloc_tag();
-    lck_mtx_lock(connection->lock);
+    kc_lock(connection->lock);
+    kc_connection_cancel_timers(connection);
+    if (connection->race) {
+        kc_race_finish(connection, -1);
+    }
+    thread_call_t raceTimer = connection->raceTimer;
+    connection->raceTimer = NULL;
+    kc_coalesce_discard(connection);
+    thread_call_t heldTimer = connection->heldTimer;
+    connection->heldTimer = NULL;
     if (connection->socket) {
         sock_close(connection->socket);
         connection->socket = NULL;
     }
-    if (connection->writeBuffer) {
-        mbuf_free(connection->writeBuffer);
-        connection->writeBuffer = NULL;
+    kc_connection_free_write_buffer(connection);
+    // queued upcalls may still hold the cookie; they'll find no connection
+    kc_upcall_cookie_release(connection->upcallCookie);
+    connection->upcallCookie = NULL;
+    uint32_t flow = connection->flow;
+    kc_unlock(connection->lock);
+    // a callout already running has to finish before its call can be freed;
+    // either one only finds the connection gone
+    if (raceTimer) {
+        thread_call_cancel_wait(raceTimer);
+        thread_call_free(raceTimer);
+    }
+    if (heldTimer) {
+        thread_call_cancel_wait(heldTimer);
+        thread_call_free(heldTimer);
     }
-    lck_mtx_t * mtx = connection->lock;
-    lck_mtx_unlock(connection->lock);
-    lck_mtx_free(mtx, mutexGroup);
-    OSFree(connection, sizeof(KCConnection), tag);
+    kc_pool_cache_free(connectionCache, connection);
+    dispatch_flow_destroy(flow);
 }
 
 __private_extern__
-errno_t kc_connection_connect(uint32_t identifier, const void * host, uint16_t port, boolean_t isIpv6) {
+errno_t kc_connection_connect(uint32_t identifier, const void * host, uint16_t port, boolean_t isIpv6,
+                              const void * early, size_t earlyLength) {
     errno_t error;
     KCConnection * connection;
+    if (draining) return ESHUTDOWN;
     if (!(connection = kc_connection_lock(identifier))) return ENOENT;
-    if (connection->socket) {
+    if (connection->socket || connection->race) {
         kc_connection_unlock(connection);
         return EALREADY;
     }
-    if (isIpv6) {
-        struct sockaddr_in6 addr;
-        bzero(&addr, sizeof(addr));
-        memcpy(&addr.sin6_addr, host, sizeof(addr.sin6_addr));
-        addr.sin6_family = AF_INET6;
-        addr.sin6_len = sizeof(addr);
-        addr.sin6_port = port;
-        error = sock_socket(AF_INET6, SOCK_STREAM, 0,
-                            kc_upcall, number_to_pointer(identifier), &connection->socket);
-        if (error) {
-            debugf("sock_socket(ipv6): error %d", error);
-            kc_connection_unlock(connection);
-            return error;
-        }
-        if ((error = kc_socket_set_nonblocking(connection->socket))) {
-            debugf("kc_socket_set_nonblocking(ipv6): error %d", error);
-            sock_close(connection->socket);
-            connection->socket = NULL;
-            kc_connection_unlock(connection);
-            return error;
-        }
-        error = sock_connect(connection->socket, (const struct sockaddr *)&addr, MSG_DONTWAIT);
-        if (error != EINPROGRESS && error) {
-            debugf("sock_connect(ipv6): error %d", error);
-            sock_close(connection->socket);
-            connection->socket = NULL;
-            kc_connection_unlock(connection);
-            return error;
-        }
-        if (!error) {
-            // call callback immediately
-            kc_connection_opened cb = (kc_connection_opened)connection->opened_cb;
-            kc_connection_unlock(connection);
-            cb(identifier);
-        } else {
-            kc_connection_unlock(connection);
-        }
+    // sock_connect() can't put data in the SYN, so early data waits in the
+    // write buffer and goes out in the same pass that reports the connect
+    if (earlyLength && (error = kc_connection_queue_write(connection, early, earlyLength))) {
+        kc_connection_unlock(connection);
+        return error;
+    }
+    // kc_race_open() opens a socket for one address just as well
+    KCConnectCandidate candidate;
+    bzero(&candidate, sizeof(candidate));
+    candidate.family = isIpv6 ? AF_INET6 : AF_INET;
+    memcpy(candidate.address, host, isIpv6 ? 16 : 4);
+    error = kc_race_open(connection, &candidate, port, &connection->socket);
+    if (error && error != EINPROGRESS) {
+        debugf("kc_connection_connect(ipv%d): error %d", isIpv6 ? 6 : 4, error);
+        kc_connection_free_write_buffer(connection);
+        kc_connection_unlock(connection);
+        return error;
+    }
+    if (!error) {
+        // call callback immediately
+        connection->isConnected = TRUE;
+        kc_connection_did_open(connection);
+        kc_connection_opened cb = (kc_connection_opened)connection->opened_cb;
+        KCUpcallCookie * cookie = connection->upcallCookie;
+        OSIncrementAtomic(&cookie->references);
+        kc_connection_unlock(connection);
+        cb(identifier);
+        // the early data goes out behind CONNECTED, like after an upcall
+        if (earlyLength) kc_upcall(NULL, cookie, 0);
+        kc_upcall_cookie_release(cookie);
     } else {
-        struct sockaddr_in addr;
-        bzero(&addr, sizeof(addr));
-        memcpy(&addr.sin_addr, host, sizeof(addr.sin_addr));
-        addr.sin_family = AF_INET;
-        addr.sin_len = sizeof(addr);
-        addr.sin_port = port;
-        error = sock_socket(AF_INET, SOCK_STREAM, 0,
-                            kc_upcall, number_to_pointer(identifier), &connection->socket);
-        if (error) {
-            debugf("sock_socket(ipv4): error %d", error);
-            kc_connection_unlock(connection);
-            return error;
-        }
-        if ((error = kc_socket_set_nonblocking(connection->socket))) {
-            debugf("kc_socket_set_nonblocking(ipv4): error %d", error);
-            sock_close(connection->socket);
-            connection->socket = NULL;
-            kc_connection_unlock(connection);
-            return error;
-        }
-        error = sock_connect(connection->socket, (const struct sockaddr *)&addr, MSG_DONTWAIT);
-        if (error != EINPROGRESS && error) {
-            debugf("sock_connect(ipv4): error %d", error);
-            sock_close(connection->socket);
-            connection->socket = NULL;
-            kc_connection_unlock(connection);
-            return error;
-        }
-        if (!error) {
-            // call callback immediately
-            kc_connection_opened cb = (kc_connection_opened)connection->opened_cb;
-            kc_connection_unlock(connection);
-            cb(identifier);
-        } else {
-            kc_connection_unlock(connection);
+        if (connection->timeouts.connect) {
+            kc_timer_arm(&connection->connectTimer, connection->timeouts.connect);
         }
-        debugf("sock_connect(ipv4): final result: %d", error);
+        kc_connection_unlock(connection);
     }
+    debugf("kc_connection_connect: final result: %d", error);
     return error;
 }
 
 __private_extern__
-errno_t kc_connection_write(uint32_t identifier, const void * buffer, size_t length) {
+errno_t kc_connection_connect_multi(uint32_t identifier, const KCConnectCandidate * candidates, uint32_t count,
+                                    uint16_t port, uint32_t stagger) {
+    if (count == 0) return EINVAL;
+    if (draining) return ESHUTDOWN;
+    if (count > KC_RACE_MAX_CANDIDATES) count = KC_RACE_MAX_CANDIDATES;
     KCConnection * connection;
     if (!(connection = kc_connection_lock(identifier))) return ENOENT;
-    
-    mbuf_t bodyPacket;
-    if (mbuf_allocpacket(MBUF_WAITOK, length, NULL, &bodyPacket)) {
+    if (connection->socket || connection->race) {
+        kc_connection_unlock(connection);
+        return EALREADY;
+    }
+    if (!connection->raceTimer) {
+        connection->raceTimer = thread_call_allocate(kc_race_timer_fired, number_to_pointer(identifier));
+        if (!connection->raceTimer) {
+            kc_connection_unlock(connection);
+            return ENOMEM;
+        }
+    }
+    KCConnectRace * race = (KCConnectRace *)kc_pool_alloc(sizeof(KCConnectRace));
+    if (!race) {
         kc_connection_unlock(connection);
         return ENOMEM;
     }
-    mbuf_copyback(bodyPacket, 0, length, buffer, MBUF_WAITOK);
-    mbuf_settype(bodyPacket, MBUF_TYPE_DATA);
-    mbuf_setlen(bodyPacket, length);
+    bzero(race, sizeof(KCConnectRace));
+    memcpy(race->candidates, candidates, sizeof(KCConnectCandidate) * count);
+    race->count = count;
+    race->port = port;
+    race->stagger = stagger ? stagger : KC_RACE_DEFAULT_STAGGER;
+    race->generation = ++connection->raceGeneration;
+    connection->race = race;
+    if (connection->timeouts.connect) {
+        // covers the whole race, not each attempt
+        kc_timer_arm(&connection->connectTimer, connection->timeouts.connect);
+    }
+    kc_connection_unlock(connection);
     
-    if (connection->writeBuffer) {
-        connection->writeBuffer = mbuf_concatenate(connection->writeBuffer, bodyPacket);
-    } else {
-        connection->writeBuffer = bodyPacket;
+    kc_race_advance(identifier, TRUE, 0);
+    return 0;
+}
+
+__private_extern__
+errno_t kc_connection_write(uint32_t identifier, const void * buffer, size_t length, uint64_t * sendTime) {
+    KCConnection * connection;
+    if (draining) return ESHUTDOWN;
+    if (!(connection = kc_connection_lock(identifier))) return ENOENT;
+    if (!connection->socket && !connection->race) {
+        // queued, it would go to whichever peer the next connect reaches
+        kc_connection_unlock(connection);
+        return ENOTCONN;
     }
-        
+    
     errno_t error;
+    if ((error = kc_connection_queue_write(connection, buffer, length))) {
+        kc_connection_unlock(connection);
+        return error;
+    }
+        
+    if (sendTime) *sendTime = mach_absolute_time();
+    if (!connection->isConnected) {
+        // still connecting; the pass that reports the connect writes it
+        kc_connection_unlock(connection);
+        return EINPROGRESS;
+    }
     while (!(error = kc_upcall_write_iteration(connection))) {
     }
     if (error == EWOULDBLOCK) error = EINPROGRESS;
@@ -247,10 +360,13 @@ __private_extern__
 errno_t kc_connection_close(uint32_t identifier) {
     KCConnection * connection;
     if (!(connection = kc_connection_lock(identifier))) return ENOENT;
+    if (connection->race) {
+        kc_race_finish(connection, -1);
+    }
     if (connection->socket) {
-        sock_close(connection->socket);
-        connection->socket = NULL;
-        connection->isConnected = FALSE;
+        kc_connection_drop_socket(connection);
+    } else {
+        kc_connection_cancel_timers(connection);
     }
     kc_connection_unlock(connection);
     return 0;
@@ -265,11 +381,280 @@ void * kc_connection_get_user_data(uint32_t identifier) {
     return buff;
 }
 
+__private_extern__
+errno_t kc_connection_set_timeouts(uint32_t identifier, const KCConnectionTimeouts * timeouts) {
+    KCConnection * connection;
+    if (!(connection = kc_connection_lock(identifier))) return ENOENT;
+    connection->timeouts = *timeouts;
+    // new values apply to timers that are already running, too
+    if (kc_timer_is_armed(&connection->connectTimer) && !timeouts->connect) {
+        kc_timer_cancel(&connection->connectTimer);
+    }
+    if (connection->socket && connection->isConnected) {
+        if (timeouts->idle) {
+            kc_timer_arm(&connection->idleTimer, timeouts->idle);
+        } else {
+            kc_timer_cancel(&connection->idleTimer);
+        }
+        if (!timeouts->writeStall) {
+            kc_timer_cancel(&connection->stallTimer);
+        } else if (connection->writeBuffer) {
+            kc_timer_arm(&connection->stallTimer, timeouts->writeStall);
+        }
+    }
+    kc_connection_unlock(connection);
+    return 0;
+}
+
+__private_extern__
+errno_t kc_connection_get_timeouts(uint32_t identifier, KCConnectionTimeouts * timeouts) {
+    KCConnection * connection;
+    if (!(connection = kc_connection_lock(identifier))) return ENOENT;
+    *timeouts = connection->timeouts;
+    kc_connection_unlock(connection);
+    return 0;
+}
+
+__private_extern__
+void kc_connection_get_stats(KCConnectionStats * stats) {
+    stats->upcalls = (uint64_t)upcallCount;
+    stats->dispatched = (uint64_t)upcallDispatchCount;
+    stats->coalesced = (uint64_t)upcallCoalesceCount;
+}
+
+#pragma mark - Draining -
+
+__private_extern__
+void kc_connection_drain(uint64_t flushDeadline, KCConnectionDrainStats * stats) {
+    bzero(stats, sizeof(KCConnectionDrainStats));
+    draining = TRUE;
+    
+    // queued writes get until the deadline to go out; the sockets are
+    // non-blocking, so keep making passes until nothing is left
+    while (mach_absolute_time() < flushDeadline) {
+        boolean_t pending = FALSE;
+        kc_lock(listMutex);
+        for (uint32_t i = 0; i < connectionsCount; i++) {
+            KCConnection * connection = connections[i];
+            kc_lock(connection->lock);
+            if (connection->writeBuffer && connection->socket && connection->isConnected) {
+                errno_t error;
+                while (!(error = kc_upcall_write_iteration(connection))) {
+                }
+                if (error == EWOULDBLOCK) pending = TRUE;
+            }
+            kc_unlock(connection->lock);
+        }
+        kc_unlock(listMutex);
+        if (!pending) break;
+        IOSleep(1);
+    }
+    
+    // then everything closes in one pass; nobody gets a callback, since the
+    // controls are about to hear that the kext is going away
+    kc_lock(listMutex);
+    for (uint32_t i = 0; i < connectionsCount; i++) {
+        KCConnection * connection = connections[i];
+        kc_lock(connection->lock);
+        stats->discardedBytes += connection->writeBufferSize;
+        kc_connection_free_write_buffer(connection);
+        if (connection->race) {
+            kc_race_finish(connection, -1);
+        }
+        if (connection->socket) {
+            kc_connection_drop_socket(connection);
+            stats->closed++;
+        } else {
+            kc_connection_cancel_timers(connection);
+        }
+        kc_unlock(connection->lock);
+    }
+    kc_unlock(listMutex);
+}
+
+__private_extern__
+void kc_connection_resume() {
+    draining = FALSE;
+}
+
+#pragma mark - Scheduling -
+
+__private_extern__
+uint32_t kc_connection_get_flow(uint32_t identifier) {
+    KCConnection * connection;
+    if (!(connection = kc_connection_lock(identifier))) return KC_DISPATCH_DEFAULT_FLOW;
+    uint32_t flow = connection->flow;
+    kc_connection_unlock(connection);
+    return flow;
+}
+
+__private_extern__
+errno_t kc_connection_set_weight(uint32_t identifier, uint32_t weight) {
+    uint32_t flow = kc_connection_get_flow(identifier);
+    if (flow == KC_DISPATCH_DEFAULT_FLOW) return ENOENT;
+    return dispatch_flow_set_weight(flow, weight);
+}
+
+__private_extern__
+uint32_t kc_connection_get_weight(uint32_t identifier) {
+    uint32_t flow = kc_connection_get_flow(identifier);
+    if (flow == KC_DISPATCH_DEFAULT_FLOW) return 0;
+    return dispatch_flow_get_weight(flow);
+}
+
+#pragma mark - Coalescing -
+
+__private_extern__
+errno_t kc_connection_set_coalescing(uint32_t identifier, const KCConnectionCoalescing * coalescing) {
+    errno_t error = kc_coalesce_validate(coalescing);
+    if (error) return error;
+    KCConnection * connection;
+    if (!(connection = kc_connection_lock(identifier))) return ENOENT;
+    if (coalescing->delay && !connection->heldTimer) {
+        connection->heldTimer = thread_call_allocate(kc_coalesce_timer_fired, number_to_pointer(identifier));
+        if (!connection->heldTimer) {
+            kc_connection_unlock(connection);
+            return ENOMEM;
+        }
+    }
+    connection->coalescing = *coalescing;
+    // only the dispatch thread may deliver, or frames could overtake each other;
+    // if a pass gets there first, it flushes whatever is past the new threshold
+    // before it reads
+    boolean_t flush = connection->heldData != NULL;
+    uint32_t flow = connection->flow;
+    kc_connection_unlock(connection);
+    if (flush) dispatch_push_flow(flow, kc_coalesce_flush_dispatched, number_to_pointer(identifier));
+    return 0;
+}
+
+__private_extern__
+errno_t kc_connection_get_coalescing(uint32_t identifier, KCConnectionCoalescing * coalescing) {
+    KCConnection * connection;
+    if (!(connection = kc_connection_lock(identifier))) return ENOENT;
+    *coalescing = connection->coalescing;
+    kc_connection_unlock(connection);
+    return 0;
+}
+
+__private_extern__
+void kc_connection_get_default_coalescing(KCConnectionCoalescing * coalescing) {
+    *coalescing = defaultCoalescing;
+}
+
+__private_extern__
+errno_t kc_connection_set_default_coalescing(const KCConnectionCoalescing * coalescing) {
+    errno_t error = kc_coalesce_validate(coalescing);
+    if (error) return error;
+    defaultCoalescing = *coalescing;
+    return 0;
+}
+
+static errno_t kc_coalesce_validate(const KCConnectionCoalescing * coalescing) {
+    if (coalescing->bytes > KC_COALESCE_MAX_BYTES || coalescing->delay > KC_COALESCE_MAX_DELAY) return EINVAL;
+    return 0;
+}
+
+static void kc_coalesce_hold(KCConnection * connection, mbuf_t buffer, size_t length) {
+    if (connection->heldData) {
+        connection->heldData = mbuf_concatenate(connection->heldData, buffer);
+        kc_metrics_add(KC_METRIC_RX_COALESCED_READS, 1);
+    } else {
+        connection->heldData = buffer;
+        connection->heldReceived = mach_absolute_time();
+    }
+    connection->heldSize += length;
+    kc_budget_force_charge(connection->account, length);
+    if (connection->coalescing.delay && connection->heldTimer && !connection->heldTimerArmed) {
+        uint64_t deadline;
+        clock_interval_to_deadline(connection->coalescing.delay, kMicrosecondScale, &deadline);
+        thread_call_enter_delayed(connection->heldTimer, deadline);
+        connection->heldTimerArmed = TRUE;
+    }
+}
+
+/**
+ * Copy out whatever is held back, for the caller to deliver once it has
+ * dropped the lock, along with when the oldest of it was received. ENODATA
+ * if nothing is held.
+ */
+static errno_t kc_coalesce_take(KCConnection * connection, char ** data, uint32_t * length, uint64_t * received) {
+    if (!connection->heldData) return ENODATA;
+    if (connection->heldTimerArmed) {
+        thread_call_cancel(connection->heldTimer);
+        connection->heldTimerArmed = FALSE;
+    }
+    uint32_t size = (uint32_t)connection->heldSize;
+    char * rawData = kc_pool_alloc(size);
+    if (rawData) {
+        mbuf_copydata(connection->heldData, 0, size, rawData);
+    }
+    mbuf_freem(connection->heldData);
+    connection->heldData = NULL;
+    connection->heldSize = 0;
+    kc_budget_release(connection->account, size);
+    if (!rawData) return ENOMEM;
+    *data = rawData;
+    *length = size;
+    *received = connection->heldReceived;
+    return 0;
+}
+
+static void kc_coalesce_discard(KCConnection * connection) {
+    if (connection->heldTimerArmed) {
+        thread_call_cancel(connection->heldTimer);
+        connection->heldTimerArmed = FALSE;
+    }
+    if (!connection->heldData) return;
+    mbuf_freem(connection->heldData);
+    kc_budget_release(connection->account, connection->heldSize);
+    connection->heldData = NULL;
+    connection->heldSize = 0;
+}
+
+static void kc_coalesce_deliver(uint32_t identifier, void * cb, char * data, uint32_t length, uint64_t received) {
+    // the owner's account may go away while we're unlocked, so frames on
+    // their way to the client only count against the global budget
+    kc_budget_force_charge(NULL, length);
+    ((kc_connection_newdata)cb)(identifier, data, length, received);
+    kc_budget_release(NULL, length);
+}
+
+static void kc_coalesce_timer_fired(thread_call_param_t identifier, thread_call_param_t unused) {
+    // on the connection's own flow, so the flush can't overtake a pass
+    uint32_t flow = kc_connection_get_flow(pointer_to_number(identifier));
+    if (flow == KC_DISPATCH_DEFAULT_FLOW) return;
+    if (dispatch_push_flow(flow, kc_coalesce_flush_dispatched, identifier)) {
+        debugf("kc_coalesce_timer_fired: failed to queue a flush");
+        // let the next hold arm the timer again, rather than holding forever
+        KCConnection * connection;
+        if ((connection = kc_connection_lock(pointer_to_number(identifier)))) {
+            connection->heldTimerArmed = FALSE;
+            kc_connection_unlock(connection);
+        }
+        return;
+    }
+    kc_metrics_add(KC_METRIC_RX_FLUSH_DEADLINE, 1);
+}
+
+static void kc_coalesce_flush_dispatched(void * identifier) {
+    KCConnection * connection;
+    if (!(connection = kc_connection_lock(pointer_to_number(identifier)))) return;
+    char * data;
+    uint32_t length;
+    uint64_t received;
+    void * cb = connection->newdata_cb;
+    errno_t error = kc_coalesce_take(connection, &data, &length, &received);
+    kc_connection_unlock(connection);
+    if (error) return;
+    kc_coalesce_deliver(pointer_to_number(identifier), cb, data, length, received);
+}
+
 #pragma mark - Private -
 
-static KCConnection * kc_connection_lock(uint32_t identifier) {
+static KCConnection * kc_connection_lock_at(uint32_t identifier, KCLockSite * site) {
     KCConnection * conn = NULL;
-    lck_mtx_lock(listMutex);
+    kc_lock_at(listMutex, site);
     for (size_t i = 0; i < connectionsCount; i++) {
         if (connections[i]->identifier == identifier) {
             conn = connections[i];
@@ -277,16 +662,27 @@ static KCConnection * kc_connection_lock(uint32_t identifier) {
         }
     }
     if (!conn) {
-        lck_mtx_unlock(listMutex);
+        kc_unlock(listMutex);
         return NULL;
     }
-    lck_mtx_lock(conn->lock);
-    lck_mtx_unlock(listMutex);
+    kc_lock_at(conn->lock, site);
+    kc_unlock(listMutex);
     return conn;
 }
 
 static void kc_connection_unlock(KCConnection * conn) {
-    lck_mtx_unlock(conn->lock);
+    kc_unlock(conn->lock);
+}
+
+static errno_t kc_connection_construct(void * object) {
+    KCConnection * conn = (KCConnection *)object;
+    conn->lock = kc_lock_alloc(mutexGroup, KC_LOCK_GROUP_CONNECTION);
+    return conn->lock ? 0 : ENOMEM;
+}
+
+static void kc_connection_destruct(void * object) {
+    KCConnection * conn = (KCConnection *)object;
+    kc_lock_free(conn->lock, mutexGroup);
 }
 
 static errno_t kc_socket_set_nonblocking(socket_t so) {
@@ -298,13 +694,57 @@ static errno_t kc_socket_set_nonblocking(socket_t so) {
 }
 
 static void kc_upcall(socket_t so, void * cookie, int waitf) {
-    dispatch_push(kc_upcall_dispatched, cookie);
+    KCUpcallCookie * upcall = (KCUpcallCookie *)cookie;
+    OSIncrementAtomic64(&upcallCount);
+    // the queued dispatch reads and writes everything available, so one
+    // pending entry per connection is all we ever need
+    errno_t error = kc_upcall_schedule(upcall);
+    KC_TRACE(KC_TRACE_UPCALL, upcall->identifier, error, 0, 0);
+    if (error == EALREADY) {
+        OSIncrementAtomic64(&upcallCoalesceCount);
+    } else if (!error) {
+        OSIncrementAtomic64(&upcallDispatchCount);
+    }
+}
+
+/**
+ * Queue a pass over the socket on the connection's flow. EALREADY if one is
+ * queued already.
+ */
+static errno_t kc_upcall_schedule(KCUpcallCookie * upcall) {
+    if (!OSCompareAndSwap(0, 1, &upcall->scheduled)) return EALREADY;
+    OSIncrementAtomic(&upcall->references);
+    errno_t error = dispatch_push_flow(upcall->flow, kc_upcall_dispatched, upcall);
+    if (error) {
+        upcall->scheduled = 0;
+        kc_upcall_cookie_release(upcall);
+    }
+    return error;
+}
+
+static void kc_upcall_cookie_release(KCUpcallCookie * cookie) {
+    if (OSDecrementAtomic(&cookie->references) == 1) {
+        kc_pool_free(cookie, sizeof(KCUpcallCookie));
+    }
 }
 
 static void kc_upcall_dispatched(void * cookie) {
-    uint32_t identifier = pointer_to_number(cookie);
+    KCUpcallCookie * upcall = (KCUpcallCookie *)cookie;
+    // clear the flag before looking at the socket so that anything arriving
+    // from here on queues another pass instead of being lost
+    OSCompareAndSwap(1, 0, &upcall->scheduled);
+    uint32_t identifier = upcall->identifier;
+    kc_upcall_cookie_release(upcall);
+    KC_TRACE(KC_TRACE_UPCALL_PASS, identifier, 0, 0, 0);
+    
     KCConnection * connection;
     if (!(connection = kc_connection_lock(identifier))) return;
+    if (connection->race) {
+        // the upcall came from one of the attempts
+        kc_connection_unlock(connection);
+        kc_race_advance(identifier, FALSE, 0);
+        return;
+    }
     socket_t so = connection->socket;
     if (!so) {
         kc_connection_unlock(connection);
@@ -315,13 +755,20 @@ static void kc_upcall_dispatched(void * cookie) {
         void * cb;
         if (sock_isconnected(so)) {
             connection->isConnected = TRUE;
+            kc_connection_did_open(connection);
             void * cb = connection->opened_cb;
             kc_connection_unlock(connection);
             ((kc_connection_opened)cb)(identifier);
+            // data may have arrived in the same batch of upcalls
+            if ((connection = kc_connection_lock(identifier))) {
+                if (connection->socket && connection->isConnected) {
+                    kc_upcall_check_data_return(connection);
+                } else {
+                    kc_connection_unlock(connection);
+                }
+            }
         } else {
-            sock_close(connection->socket);
-            connection->socket = NULL;
-            connection->isConnected = FALSE;
+            kc_connection_drop_socket(connection);
             cb = connection->failed_cb;
             kc_connection_unlock(connection);
             ((kc_connection_failed)cb)(identifier, 0);
@@ -340,8 +787,7 @@ static void kc_upcall_check_data_return(KCConnection * connection) {
     if (!sock_isconnected(so)) {
         debugf("not connected");
         if (connection->socket) {
-            sock_close(connection->socket);
-            connection->socket = NULL;
+            kc_connection_drop_socket(connection);
         }
         connection->isConnected = FALSE;
         cb = connection->closed_cb;
@@ -352,47 +798,88 @@ static void kc_upcall_check_data_return(KCConnection * connection) {
         errno_t error = 0;
         while (!(error = kc_upcall_data_iteration(connection))) {
             if (!kc_connection_lock(identifier)) return;
+            errno_t scheduled;
+            if (dispatch_turn_remaining() <= 0 &&
+                (!(scheduled = kc_upcall_schedule(connection->upcallCookie)) || scheduled == EALREADY)) {
+                // other connections get a turn before we read any more;
+                // the next pass picks up from here, writes included
+                kc_metrics_add(KC_METRIC_DISPATCH_YIELDS, 1);
+                kc_connection_unlock(connection);
+                return;
+            }
+        }
+        // whatever was held back goes out before the hangup does
+        char * held = NULL;
+        uint32_t heldLength = 0;
+        uint64_t heldReceived = 0;
+        void * newdataCb = connection->newdata_cb;
+        if (error == ESHUTDOWN || (error != EJUSTRETURN && error != EWOULDBLOCK && error)) {
+            if (!kc_coalesce_take(connection, &held, &heldLength, &heldReceived)) {
+                kc_metrics_add(KC_METRIC_RX_FLUSH_PASS, 1);
+            }
         }
         if (error == ESHUTDOWN) {
-            sock_close(connection->socket);
-            connection->socket = NULL;
-            connection->isConnected = FALSE;
+            kc_connection_drop_socket(connection);
             cb = connection->closed_cb;
             kc_connection_unlock(connection);
+            if (held) kc_coalesce_deliver(identifier, newdataCb, held, heldLength, heldReceived);
             ((kc_connection_closed)cb)(identifier);
             return;
         } else if (error == EJUSTRETURN) {
             kc_connection_unlock(connection);
             return;
         } else if (error != EWOULDBLOCK && error) {
-            sock_close(connection->socket);
-            connection->socket = NULL;
-            connection->isConnected = FALSE;
+            kc_connection_drop_socket(connection);
             cb = connection->failed_cb;
             kc_connection_unlock(connection);
+            if (held) kc_coalesce_deliver(identifier, newdataCb, held, heldLength, heldReceived);
             ((kc_connection_failed)cb)(identifier, error);
             return;
         }
         while (!(error = kc_upcall_write_iteration(connection))) {
         }
         if (error != EWOULDBLOCK && error != ENODATA) {
-            connection->isConnected = FALSE;
-            sock_close(connection->socket);
-            connection->socket = NULL;
+            kc_connection_drop_socket(connection);
             cb = connection->failed_cb;
             kc_connection_unlock(connection);
             ((kc_connection_failed)cb)(identifier, error);
             return;
         }
+        // without a deadline, coalescing only covers what this pass found
+        if (!connection->coalescing.delay && !kc_coalesce_take(connection, &held, &heldLength, &heldReceived)) {
+            kc_metrics_add(KC_METRIC_RX_FLUSH_PASS, 1);
+        }
         kc_connection_unlock(connection);
+        if (held) kc_coalesce_deliver(identifier, newdataCb, held, heldLength, heldReceived);
     }
 }
 
 static errno_t kc_upcall_data_iteration(KCConnection * connection) {
     if (!connection->socket) return EJUSTRETURN;
+    void * cb = connection->newdata_cb;
+    uint32_t identifier = connection->identifier;
+    char * rawData;
+    uint32_t len;
+    uint64_t received;
+    errno_t error;
+    if (connection->heldData && connection->heldSize >= connection->coalescing.bytes) {
+        // the threshold came down, or coalescing was turned off, since this
+        // was held; it has to go out before anything newer
+        kc_metrics_add(KC_METRIC_RX_FLUSH_SIZE, 1);
+        if ((error = kc_coalesce_take(connection, &rawData, &len, &received))) return error;
+        kc_connection_unlock(connection);
+        kc_coalesce_deliver(identifier, cb, rawData, len, received);
+        return 0;
+    }
     mbuf_t buffer;
     size_t recvLen = 0xFFFF;
-    errno_t error = sock_receivembuf(connection->socket, NULL, &buffer, MSG_DONTWAIT, &recvLen);
+    if (connection->coalescing.bytes) {
+        // never read past the threshold, so a held frame always fits in one DATA packet
+        recvLen = connection->coalescing.bytes - connection->heldSize;
+    }
+    error = sock_receivembuf(connection->socket, NULL, &buffer, MSG_DONTWAIT, &recvLen);
+    received = mach_absolute_time();
+    KC_TRACE(KC_TRACE_SOCK_RECEIVE, connection->identifier, error ? 0 : recvLen, error, 0);
     if (error) {
         return error;
     } else {
@@ -400,18 +887,34 @@ static errno_t kc_upcall_data_iteration(KCConnection * connection) {
             return ESHUTDOWN;
         }
     }
+    dispatch_charge(recvLen);
 
-    uint32_t len = (uint32_t)mbuf_len(buffer);
-    char * rawData = OSMalloc(len, general_malloc_tag());
-    if (!rawData) {
-        return ENOMEM;
+    if (connection->timeouts.idle) {
+        kc_timer_arm(&connection->idleTimer, connection->timeouts.idle);
+    }
+    if (connection->coalescing.bytes) {
+        kc_metrics_add(KC_METRIC_NET_BYTES_IN, recvLen);
+        kc_coalesce_hold(connection, buffer, recvLen);
+        if (connection->heldSize < connection->coalescing.bytes) {
+            kc_connection_unlock(connection);
+            return 0;
+        }
+        kc_metrics_add(KC_METRIC_RX_FLUSH_SIZE, 1);
+        if ((error = kc_coalesce_take(connection, &rawData, &len, &received))) return error;
+    } else {
+        // the socket may hand back a chain, so go by what it says it read
+        len = (uint32_t)recvLen;
+        rawData = kc_pool_alloc(len);
+        if (!rawData) {
+            mbuf_freem(buffer);
+            return ENOMEM;
+        }
+        mbuf_copydata(buffer, 0, len, rawData);
+        mbuf_freem(buffer);
+        kc_metrics_add(KC_METRIC_NET_BYTES_IN, len);
     }
-    mbuf_copydata(buffer, 0, len, rawData);
-    mbuf_free(buffer);
-    void * cb = connection->newdata_cb;
-    uint32_t identifier = connection->identifier;
     kc_connection_unlock(connection);
-    ((kc_connection_newdata)cb)(identifier, rawData, len);
+    kc_coalesce_deliver(identifier, cb, rawData, len, received);
     return 0;
 }
 
@@ -422,13 +925,304 @@ static errno_t kc_upcall_write_iteration(KCConnection * connection) {
     mbuf_dup(connection->writeBuffer, MBUF_WAITOK, &packetCopy);
     // note: our mbuf is automatically freed by sock_sendmbuf
     errno_t error = sock_sendmbuf(connection->socket, NULL, packetCopy, MSG_DONTWAIT, &sentCount);
-    if (error) return error;
-    if (sentCount == mbuf_len(connection->writeBuffer)) {
-        mbuf_free(connection->writeBuffer);
-        connection->writeBuffer = NULL;
+    KC_TRACE(KC_TRACE_SOCK_SEND, connection->identifier, connection->writeBufferSize, sentCount, error);
+    if (error) {
+        // the stall clock runs from the last time anything went out
+        if (error == EWOULDBLOCK && connection->timeouts.writeStall &&
+            !kc_timer_is_armed(&connection->stallTimer)) {
+            kc_timer_arm(&connection->stallTimer, connection->timeouts.writeStall);
+        }
+        return error;
+    }
+    kc_metrics_add(KC_METRIC_NET_BYTES_OUT, sentCount);
+    dispatch_charge(sentCount);
+    if (sentCount == connection->writeBufferSize) {
+        kc_connection_free_write_buffer(connection);
+        kc_timer_cancel(&connection->stallTimer);
     } else {
         // remove the first sentCount bytes
         mbuf_adj(connection->writeBuffer, (int)sentCount);
+        connection->writeBufferSize -= sentCount;
+        kc_budget_release(connection->account, sentCount);
+        kc_metrics_add(KC_METRIC_WRITE_BUFFER_BYTES, -(int64_t)sentCount);
+        if (sentCount && connection->timeouts.writeStall) {
+            kc_timer_arm(&connection->stallTimer, connection->timeouts.writeStall);
+        }
+    }
+    if (sentCount && connection->timeouts.idle && connection->isConnected) {
+        kc_timer_arm(&connection->idleTimer, connection->timeouts.idle);
     }
     return 0;
 }
+
+#pragma mark - Multi-address Connect -
+
+/**
+ * Look at every attempt, start more if asked to or if none are left, and
+ * finish the race once one connects or all have failed. A non-zero
+ * generation comes from the stagger timer, which only counts for the race
+ * it was armed for.
+ */
+static void kc_race_advance(uint32_t identifier, boolean_t startNext, uint32_t generation) {
+    KCConnection * connection;
+    if (!(connection = kc_connection_lock(identifier))) return;
+    KCConnectRace * race = connection->race;
+    if (!race || (generation && race->generation != generation)) {
+        kc_connection_unlock(connection);
+        return;
+    }
+    
+    int winner = -1;
+    uint32_t live = 0;
+    for (uint32_t i = 0; i < race->started && winner < 0; i++) {
+        socket_t so = race->attempts[i];
+        if (!so) continue;
+        if (sock_isconnected(so)) {
+            winner = (int)i;
+            break;
+        }
+        int soError = 0;
+        int soErrorLen = sizeof(soError);
+        if (!sock_getsockopt(so, SOL_SOCKET, SO_ERROR, &soError, &soErrorLen) && soError) {
+            debugf("kc_race_advance: attempt %d failed: %d", (int)i, soError);
+            sock_close(so);
+            race->attempts[i] = NULL;
+            race->lastError = soError;
+            continue;
+        }
+        live++;
+    }
+    
+    // the stagger timer starts the next candidate; so does running out of
+    // live attempts, without waiting for the timer
+    boolean_t armTimer = FALSE;
+    while (winner < 0 && race->started < race->count && (startNext || !live)) {
+        uint32_t index = race->started++;
+        errno_t error = kc_race_open(connection, &race->candidates[index], race->port, &race->attempts[index]);
+        if (!error) {
+            winner = (int)index;
+        } else if (error == EINPROGRESS) {
+            live++;
+            startNext = FALSE;
+            armTimer = TRUE;
+        } else {
+            race->lastError = error;
+        }
+    }
+    
+    if (winner >= 0) {
+        kc_race_finish(connection, winner);
+        connection->isConnected = TRUE;
+        kc_connection_did_open(connection);
+        kc_connection_opened cb = (kc_connection_opened)connection->opened_cb;
+        KCUpcallCookie * cookie = connection->upcallCookie;
+        OSIncrementAtomic(&cookie->references);
+        kc_connection_unlock(connection);
+        cb(identifier);
+        // data may have reached the winner before it won; queue a pass for it
+        // now that CONNECTED has gone out
+        kc_upcall(NULL, cookie, 0);
+        kc_upcall_cookie_release(cookie);
+        return;
+    }
+    if (!live) {
+        errno_t error = race->lastError ? race->lastError : EHOSTUNREACH;
+        kc_race_finish(connection, -1);
+        kc_connection_cancel_timers(connection);
+        kc_connection_free_write_buffer(connection);
+        kc_connection_failed cb = (kc_connection_failed)connection->failed_cb;
+        kc_connection_unlock(connection);
+        cb(identifier, error);
+        return;
+    }
+    if (armTimer && race->started < race->count) {
+        uint64_t deadline;
+        clock_interval_to_deadline(race->stagger, kMillisecondScale, &deadline);
+        thread_call_enter1_delayed(connection->raceTimer, number_to_pointer(race->generation), deadline);
+    }
+    kc_connection_unlock(connection);
+}
+
+static errno_t kc_race_open(KCConnection * connection, const KCConnectCandidate * candidate, uint16_t port, socket_t * attempt) {
+    struct sockaddr_storage storage;
+    bzero(&storage, sizeof(storage));
+    if (candidate->family == AF_INET6) {
+        struct sockaddr_in6 * addr = (struct sockaddr_in6 *)&storage;
+        memcpy(&addr->sin6_addr, candidate->address, sizeof(addr->sin6_addr));
+        addr->sin6_family = AF_INET6;
+        addr->sin6_len = sizeof(struct sockaddr_in6);
+        addr->sin6_port = port;
+    } else if (candidate->family == AF_INET) {
+        struct sockaddr_in * addr = (struct sockaddr_in *)&storage;
+        memcpy(&addr->sin_addr, candidate->address, sizeof(addr->sin_addr));
+        addr->sin_family = AF_INET;
+        addr->sin_len = sizeof(struct sockaddr_in);
+        addr->sin_port = port;
+    } else {
+        return EAFNOSUPPORT;
+    }
+    
+    // every attempt shares the connection's cookie, so upcalls from any of
+    // them coalesce into one pass over the race
+    errno_t error = sock_socket(candidate->family, SOCK_STREAM, 0, kc_upcall, connection->upcallCookie, attempt);
+    if (error) {
+        debugf("kc_race_open: sock_socket error %d", error);
+        *attempt = NULL;
+        return error;
+    }
+    if ((error = kc_socket_set_nonblocking(*attempt))) {
+        sock_close(*attempt);
+        *attempt = NULL;
+        return error;
+    }
+    error = sock_connect(*attempt, (const struct sockaddr *)&storage, MSG_DONTWAIT);
+    if (error && error != EINPROGRESS) {
+        debugf("kc_race_open: sock_connect error %d", error);
+        sock_close(*attempt);
+        *attempt = NULL;
+    }
+    return error;
+}
+
+static void kc_race_finish(KCConnection * connection, int winner) {
+    KCConnectRace * race = connection->race;
+    for (uint32_t i = 0; i < race->started; i++) {
+        if (race->attempts[i] && (int)i != winner) {
+            sock_close(race->attempts[i]);
+        }
+    }
+    if (winner >= 0) {
+        connection->socket = race->attempts[winner];
+    }
+    // a callout already on its way finds the generation has moved on
+    thread_call_cancel(connection->raceTimer);
+    kc_pool_free(race, sizeof(KCConnectRace));
+    connection->race = NULL;
+}
+
+static void kc_race_timer_fired(thread_call_param_t identifier, thread_call_param_t generation) {
+    // attempts are only opened, and the callbacks only called, on the
+    // connection's flow, so CONNECTED can't overtake or trail its DATA
+    uint32_t flow = kc_connection_get_flow(pointer_to_number(identifier));
+    if (flow == KC_DISPATCH_DEFAULT_FLOW) return;
+    KCRaceTick * tick = (KCRaceTick *)kc_pool_alloc(sizeof(KCRaceTick));
+    if (!tick) {
+        // the race still moves on as attempts fail, just without the stagger
+        debugf("kc_race_timer_fired: failed to allocate");
+        return;
+    }
+    tick->identifier = pointer_to_number(identifier);
+    tick->generation = pointer_to_number(generation);
+    if (dispatch_push_flow(flow, kc_race_tick_dispatched, tick)) {
+        debugf("kc_race_timer_fired: failed to queue the next attempt");
+        kc_pool_free(tick, sizeof(KCRaceTick));
+    }
+}
+
+static void kc_race_tick_dispatched(void * tick) {
+    KCRaceTick * raceTick = (KCRaceTick *)tick;
+    uint32_t identifier = raceTick->identifier;
+    uint32_t generation = raceTick->generation;
+    kc_pool_free(raceTick, sizeof(KCRaceTick));
+    kc_race_advance(identifier, TRUE, generation);
+}
+
+#pragma mark - Timeouts -
+
+static void kc_connection_drop_socket(KCConnection * connection) {
+    // unsent data was meant for this peer, not whichever one comes next
+    kc_coalesce_discard(connection);
+    kc_connection_free_write_buffer(connection);
+    sock_close(connection->socket);
+    connection->socket = NULL;
+    connection->isConnected = FALSE;
+    kc_connection_cancel_timers(connection);
+}
+
+static errno_t kc_connection_queue_write(KCConnection * connection, const void * buffer, size_t length) {
+    mbuf_t bodyPacket;
+    if (mbuf_allocpacket(MBUF_WAITOK, length, NULL, &bodyPacket)) return ENOMEM;
+    mbuf_copyback(bodyPacket, 0, length, buffer, MBUF_WAITOK);
+    mbuf_settype(bodyPacket, MBUF_TYPE_DATA);
+    mbuf_setlen(bodyPacket, length);
+    
+    if (connection->writeBuffer) {
+        connection->writeBuffer = mbuf_concatenate(connection->writeBuffer, bodyPacket);
+    } else {
+        connection->writeBuffer = bodyPacket;
+    }
+    connection->writeBufferSize += length;
+    kc_budget_force_charge(connection->account, length);
+    kc_metrics_add(KC_METRIC_WRITE_BUFFER_BYTES, length);
+    return 0;
+}
+
+static void kc_connection_free_write_buffer(KCConnection * connection) {
+    if (!connection->writeBuffer) return;
+    mbuf_freem(connection->writeBuffer);
+    connection->writeBuffer = NULL;
+    kc_metrics_add(KC_METRIC_WRITE_BUFFER_BYTES, -(int64_t)connection->writeBufferSize);
+    kc_budget_release(connection->account, connection->writeBufferSize);
+    connection->writeBufferSize = 0;
+}
+
+static void kc_connection_did_open(KCConnection * connection) {
+    kc_timer_cancel(&connection->connectTimer);
+    if (connection->timeouts.idle) {
+        kc_timer_arm(&connection->idleTimer, connection->timeouts.idle);
+    }
+    if (connection->writeBuffer && connection->timeouts.writeStall) {
+        kc_timer_arm(&connection->stallTimer, connection->timeouts.writeStall);
+    }
+}
+
+static void kc_connection_cancel_timers(KCConnection * connection) {
+    kc_timer_cancel(&connection->connectTimer);
+    kc_timer_cancel(&connection->idleTimer);
+    kc_timer_cancel(&connection->stallTimer);
+}
+
+static void kc_connection_timed_out(uint32_t identifier, int reason) {
+    KCConnection * connection;
+    if (!(connection = kc_connection_lock(identifier))) return;
+    // the timer was unlinked before this ran; if it is armed again, something
+    // happened in between and the expiry is stale
+    boolean_t stale;
+    if (reason == KC_TIMEOUT_CONNECT) {
+        stale = kc_timer_is_armed(&connection->connectTimer) || connection->isConnected ||
+                (!connection->socket && !connection->race);
+    } else if (reason == KC_TIMEOUT_IDLE) {
+        stale = kc_timer_is_armed(&connection->idleTimer) || !connection->socket || !connection->isConnected;
+    } else {
+        stale = kc_timer_is_armed(&connection->stallTimer) || !connection->socket || !connection->writeBuffer;
+    }
+    if (stale) {
+        kc_connection_unlock(connection);
+        return;
+    }
+    debugf("connection %d timed out: reason %d", identifier, reason);
+    if (connection->race) {
+        kc_race_finish(connection, -1);
+    }
+    if (connection->socket) {
+        kc_connection_drop_socket(connection);
+    } else {
+        kc_connection_cancel_timers(connection);
+    }
+    kc_connection_free_write_buffer(connection);
+    kc_connection_timedout cb = (kc_connection_timedout)connection->timedout_cb;
+    kc_connection_unlock(connection);
+    if (cb) cb(identifier, reason);
+}
+
+static void kc_timeout_connect_fired(void * identifier) {
+    kc_connection_timed_out(pointer_to_number(identifier), KC_TIMEOUT_CONNECT);
+}
+
+static void kc_timeout_idle_fired(void * identifier) {
+    kc_connection_timed_out(pointer_to_number(identifier), KC_TIMEOUT_IDLE);
+}
+
+static void kc_timeout_stall_fired(void * identifier) {
+    kc_connection_timed_out(pointer_to_number(identifier), KC_TIMEOUT_WRITE_STALL);
+}
@@ -12,45 +12,174 @@
 #include "general.h"
 #include "debug.h"
 #include "dispatch.h"
+#include "pool.h"
+#include "timer.h"
+#include "metrics.h"
+#include "budget.h"
+#include "lockprof.h"
+#include "trace.h"
 #include <sys/kpi_socket.h>
 #include <netinet/in.h>
 #include <sys/mbuf.h>
 #include <kern/locks.h>
+#include <kern/thread_call.h>
 #include <sys/filio.h> // gives ioctl FIONBIO
 
+typedef struct {
+    uint32_t identifier;
+    volatile UInt32 scheduled; // an upcall is already sitting in the dispatch queue
+    volatile SInt32 references; // the connection plus every queued dispatch
+    uint32_t flow; // the connection's dispatch flow
+} KCUpcallCookie;
+
+#define KC_RACE_MAX_CANDIDATES 8
+#define KC_RACE_DEFAULT_STAGGER 250 // milliseconds between attempts, per RFC 6555
+
+// reasons passed to the timedout callback
+#define KC_TIMEOUT_CONNECT 1
+#define KC_TIMEOUT_IDLE 2 // nothing sent or received
+#define KC_TIMEOUT_WRITE_STALL 3 // queued data made no progress
+
+#define KC_DEFAULT_CONNECT_TIMEOUT 75000 // milliseconds, like the TCP connect timeout
+
+typedef struct {
+    uint32_t connect; // milliseconds; 0 disables
+    uint32_t idle;
+    uint32_t writeStall;
+} KCConnectionTimeouts;
+
+#define KC_COALESCE_MAX_BYTES 0xFFFF // one DATA frame
+#define KC_COALESCE_MAX_DELAY 1000000 // microseconds
+
+/**
+ * Received data is held back until `bytes` of it have piled up or the oldest
+ * byte has waited `delay` microseconds, so that a peer sending small segments
+ * doesn't turn into one frame (and one client wakeup) per segment.
+ */
+typedef struct {
+    uint32_t bytes; // 0 disables coalescing
+    uint32_t delay; // 0 only coalesces what one pass over the socket finds
+} KCConnectionCoalescing;
+
+typedef struct {
+    int family; // AF_INET or AF_INET6
+    uint8_t address[16];
+} KCConnectCandidate;
+
+typedef struct {
+    KCConnectCandidate candidates[KC_RACE_MAX_CANDIDATES];
+    socket_t attempts[KC_RACE_MAX_CANDIDATES]; // NULL once an attempt fails
+    uint32_t count;
+    uint32_t started;
+    uint16_t port; // network byte order
+    uint32_t stagger;
+    errno_t lastError;
+    uint32_t generation; // passed to the stagger timer, which may fire after the race is over
+} KCConnectRace;
+
 typedef struct {
     socket_t socket;
-    lck_mtx_t * lock;
+    KCLock * lock;
     void * userData;
     void * opened_cb;
     void * closed_cb;
     void * failed_cb;
     void * newdata_cb;
+    void * timedout_cb;
     boolean_t isConnected;
     uint32_t identifier;
     mbuf_t writeBuffer;
+    size_t writeBufferSize;
+    KCBudgetAccount * account; // owned by whoever created the connection
+    KCUpcallCookie * upcallCookie;
+    KCConnectRace * race; // non-NULL while a multi-address connect is running
+    thread_call_t raceTimer;
+    uint32_t raceGeneration; // of the latest race
+    KCConnectionTimeouts timeouts;
+    KCTimer connectTimer;
+    KCTimer idleTimer;
+    KCTimer stallTimer;
+    KCConnectionCoalescing coalescing;
+    mbuf_t heldData; // received but not yet passed to newdata
+    size_t heldSize;
+    thread_call_t heldTimer;
+    boolean_t heldTimerArmed;
+    uint64_t heldReceived; // when the oldest held byte came off the socket
+    uint32_t flow; // dispatch work for this connection, and its control, queues here
 } KCConnection;
 
+typedef struct {
+    uint64_t upcalls; // socket upcalls received
+    uint64_t dispatched; // upcalls which actually went into the dispatch queue
+    uint64_t coalesced; // upcalls folded into one that was already queued
+} KCConnectionStats;
+
+typedef struct {
+    uint32_t closed; // connections that still had a socket
+    uint64_t discardedBytes; // queued writes that didn't make the deadline
+} KCConnectionDrainStats;
+
 typedef void (*kc_connection_opened)(uint32_t identifier);
 typedef void (*kc_connection_closed)(uint32_t identifier);
 typedef void (*kc_connection_failed)(uint32_t identifier, errno_t error);
-typedef void (*kc_connection_newdata)(uint32_t identifier, char * buffer, size_t length);
+// received is the mach_absolute_time() at which the oldest byte came off the socket
+typedef void (*kc_connection_newdata)(uint32_t identifier, char * buffer, size_t length, uint64_t received);
+typedef void (*kc_connection_timedout)(uint32_t identifier, int reason);
 
 typedef struct {
     kc_connection_opened opened;
     kc_connection_closed closed;
     kc_connection_failed failed;
     kc_connection_newdata newdata;
+    kc_connection_timedout timedout;
 } KCConnectionCallbacks;
 
 kern_return_t connection_initialize();
 void connection_finalize();
 
-uint32_t kc_connection_create(KCConnectionCallbacks callbacks, void * userData);
+uint32_t kc_connection_create(KCConnectionCallbacks callbacks, void * userData, KCBudgetAccount * account);
 void kc_connection_destroy(uint32_t connection);
-errno_t kc_connection_connect(uint32_t connection, const void * host, uint16_t port, boolean_t isIpv6);
-errno_t kc_connection_write(uint32_t connection, const void * buffer, size_t length);
+// early, if given, is sent as soon as the connection opens
+errno_t kc_connection_connect(uint32_t connection, const void * host, uint16_t port, boolean_t isIpv6,
+                              const void * early, size_t earlyLength);
+errno_t kc_connection_connect_multi(uint32_t connection, const KCConnectCandidate * candidates, uint32_t count,
+                                    uint16_t port, uint32_t stagger);
+/**
+ * Queue data and send what the socket takes now. While a connect is still
+ * running, everything waits in the write buffer (EINPROGRESS) and goes out,
+ * in order, from the pass that sees the socket connect; if the connect
+ * fails, it is dropped. With no connect at all, ENOTCONN.
+ * sendTime, if given, gets the mach_absolute_time() just before sock_sendmbuf
+ */
+errno_t kc_connection_write(uint32_t connection, const void * buffer, size_t length, uint64_t * sendTime);
 errno_t kc_connection_close(uint32_t connection);
 void * kc_connection_get_user_data(uint32_t identifier);
+errno_t kc_connection_set_timeouts(uint32_t identifier, const KCConnectionTimeouts * timeouts);
+errno_t kc_connection_get_timeouts(uint32_t identifier, KCConnectionTimeouts * timeouts);
+void kc_connection_get_stats(KCConnectionStats * stats);
+
+errno_t kc_connection_set_coalescing(uint32_t identifier, const KCConnectionCoalescing * coalescing);
+errno_t kc_connection_get_coalescing(uint32_t identifier, KCConnectionCoalescing * coalescing);
+
+/**
+ * A connection's dispatch flow gets weight turns' worth of work for every
+ * one an ordinary connection gets; 1 to KC_DISPATCH_MAX_WEIGHT.
+ */
+uint32_t kc_connection_get_flow(uint32_t identifier); // KC_DISPATCH_DEFAULT_FLOW if there is no such connection
+errno_t kc_connection_set_weight(uint32_t identifier, uint32_t weight);
+uint32_t kc_connection_get_weight(uint32_t identifier);
+
+/**
+ * For unloading: refuse new connects and writes with ESHUTDOWN, flush queued
+ * writes until flushDeadline (absolute time), then close every socket at
+ * once without calling back. The connections themselves stay around until
+ * their controls destroy them. kc_connection_resume() takes new work again.
+ */
+void kc_connection_drain(uint64_t flushDeadline, KCConnectionDrainStats * stats);
+void kc_connection_resume();
+
+// what new connections start with
+void kc_connection_get_default_coalescing(KCConnectionCoalescing * coalescing);
+errno_t kc_connection_set_default_coalescing(const KCConnectionCoalescing * coalescing);
 
 #endif
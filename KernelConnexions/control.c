@@ -8,10 +8,21 @@
 
 #include "control.h"
 
-static KCControl * kc_control_lock(uint32_t identifier);
+static KCControl * kc_control_lock_at(uint32_t identifier, KCLockSite * site);
+// lock profiles charge the caller rather than the lookup
+#define kc_control_lock(identifier) kc_control_lock_at((identifier), KC_LOCK_SITE)
 static void kc_control_unlock(KCControl * control);
+static void kc_control_release_frame(uint32_t identifier, size_t length);
+static void kc_control_track_frames(KCControl * control, uint32_t offset);
 static void kc_process_packet(void * unitInfo);
+static void kc_process_datagram(void * job);
+static void kc_process_ring(uint32_t identifier);
+static void kc_process_ring_dispatched(void * unitInfo);
+static void kc_process_ring_retry(void * unitInfo);
+static void kc_handle_packet(uint32_t identifier, KCControlPacket * packet);
 static void kc_process_packet_connect(uint32_t identifier, KCControlPacket * packet);
+static void kc_process_packet_connect_multi(uint32_t identifier, KCControlPacket * packet);
+static void kc_process_packet_connect_data(uint32_t identifier, KCControlPacket * packet);
 static void kc_process_packet_send(uint32_t identifier, KCControlPacket * packet);
 static void kc_process_packet_close(uint32_t identifier, KCControlPacket * packet);
 
@@ -19,12 +30,24 @@ static errno_t control_handle_connect(kern_ctl_ref kctlref, struct sockaddr_ctl
 static errno_t control_handle_disconnect(kern_ctl_ref kctlref, u_int32_t unit, void * unitinfo);
 static errno_t control_handle_getopt(kern_ctl_ref kctlref, u_int32_t unit, void * unitinfo, int opt, void * data, size_t * len);
 static errno_t control_handle_send(kern_ctl_ref kctlref, u_int32_t unit, void * unitinfo, mbuf_t m, int flags);
+static errno_t control_handle_send_datagram(kern_ctl_ref kctlref, u_int32_t unit, void * unitinfo, mbuf_t m, int flags);
 static errno_t control_handle_setopt(kern_ctl_ref kctlref, u_int32_t unit, void * unitinfo, int opt, void * data, size_t len);
 
+static errno_t kc_control_enqueue(kern_ctl_ref ref, uint32_t unit, void * data, size_t length);
+static errno_t kc_control_deliver(uint32_t identifier, void * data, size_t length);
+static errno_t kc_control_deliver_stamped(uint32_t identifier, void * data, size_t length, uint64_t received);
+static void kc_control_send_stamps(uint32_t identifier, uint8_t direction, const uint64_t * stamps);
+static void kc_control_ring_doorbell(kern_ctl_ref ref, uint32_t unit);
+static void kc_control_send_error(uint32_t identifier, errno_t error);
+static void kc_control_broadcast_unloading();
+static errno_t kc_control_deregister(kern_ctl_ref ref);
+static void kc_control_resume();
+
 static void kc_connection_opened_callback(uint32_t connection);
 static void kc_connection_closed_callback(uint32_t connection);
 static void kc_connection_failed_callback(uint32_t connection, errno_t error);
-static void kc_connection_newdata_callback(uint32_t connection, char * buffer, size_t size);
+static void kc_connection_newdata_callback(uint32_t connection, char * buffer, size_t size, uint64_t received);
+static void kc_connection_timedout_callback(uint32_t connection, int reason);
 
 static struct kern_ctl_reg ConnexionsControlRegistration = {
     kBundleID,
@@ -40,21 +63,55 @@ static struct kern_ctl_reg ConnexionsControlRegistration = {
     control_handle_getopt
 };
 
+static struct kern_ctl_reg ConnexionsDatagramRegistration = {
+    kBundleID CONTROL_DATAGRAM_SUFFIX,
+    0,
+    0,
+    CTL_FLAG_PRIVILEGED,
+    CONTROL_DATAGRAM_SEND_SIZE,
+    CONTROL_DATAGRAM_RECV_SIZE,
+    control_handle_connect,
+    control_handle_disconnect,
+    control_handle_send_datagram,
+    control_handle_setopt,
+    control_handle_getopt
+};
+
+typedef struct {
+    uint32_t identifier;
+    KCControlPacket * packet;
+} KCDatagramJob;
+
+typedef struct {
+    kern_ctl_ref ref;
+    uint32_t unit;
+    char packetType; // what still has to go out through the socket, if anything
+} KCControlRoute;
+
 static KCConnectionCallbacks ConnectionCallbacks = {
     kc_connection_opened_callback,
     kc_connection_closed_callback,
     kc_connection_failed_callback,
-    kc_connection_newdata_callback
+    kc_connection_newdata_callback,
+    kc_connection_timedout_callback
 };
 
 static kern_ctl_ref clientControl = NULL;
+static kern_ctl_ref datagramControl = NULL;
 
 static lck_grp_t * mutexGroup = NULL;
-static lck_mtx_t * listMutex = NULL;
+static KCLock * listMutex = NULL;
 static KCControl ** controls = NULL;
 static uint32_t controlsCount = 0;
 static uint32_t controlsAlloc = 0;
 static uint32_t controlIdentifier = 1;
+static uint32_t controlsClosing = 0; // out of the list, but kc_control_destroy hasn't returned
+static KCPoolCache * controlCache = NULL;
+static volatile boolean_t draining = FALSE;
+static uint32_t drainTimeout = KC_DRAIN_DEFAULT_TIMEOUT;
+
+static errno_t kc_control_construct(void * object);
+static void kc_control_destruct(void * object);
 
 __private_extern__
 kern_return_t control_register() {
@@ -68,17 +125,38 @@ kern_return_t control_register() {
         return KERN_FAILURE;
     }
     
-    listMutex = lck_mtx_alloc_init(mutexGroup, LCK_ATTR_NULL);
+    listMutex = kc_lock_alloc(mutexGroup, KC_LOCK_GROUP_CONTROLS);
     if (!listMutex) {
         lck_grp_free(mutexGroup);
         OSFree(controls, (uint32_t)sizeof(KCControl *) * controlsAlloc, general_malloc_tag());
         return KERN_FAILURE;
     }
     
+    controlCache = kc_pool_cache_create("control", sizeof(KCControl), kc_control_construct, kc_control_destruct);
+    if (!controlCache) {
+        kc_lock_free(listMutex, mutexGroup);
+        lck_grp_free(mutexGroup);
+        OSFree(controls, (uint32_t)sizeof(KCControl *) * controlsAlloc, general_malloc_tag());
+        return KERN_FAILURE;
+    }
+    
     errno_t error = ctl_register(&ConnexionsControlRegistration, &clientControl);
     if (error != 0) {
         debugf("fatal: failed to register control: %lu", error);
-        lck_mtx_free(listMutex, mutexGroup);
+        kc_pool_cache_destroy(controlCache);
+        kc_lock_free(listMutex, mutexGroup);
+        lck_grp_free(mutexGroup);
+        OSFree(controls, (uint32_t)sizeof(KCControl *) * controlsAlloc, general_malloc_tag());
+        return KERN_FAILURE;
+    }
+    
+    error = ctl_register(&ConnexionsDatagramRegistration, &datagramControl);
+    if (error != 0) {
+        debugf("fatal: failed to register datagram control: %lu", error);
+        ctl_deregister(clientControl);
+        clientControl = NULL;
+        kc_pool_cache_destroy(controlCache);
+        kc_lock_free(listMutex, mutexGroup);
         lck_grp_free(mutexGroup);
         OSFree(controls, (uint32_t)sizeof(KCControl *) * controlsAlloc, general_malloc_tag());
         return KERN_FAILURE;
@@ -95,49 +173,117 @@ kern_ctl_ref control_get() {
 __private_extern__
 kern_return_t control_unregister() {
     if (clientControl) {
-        if (ctl_deregister(clientControl) != 0) {
+        if (kc_control_deregister(clientControl) != 0) {
             debugf("failed unloading because of connected controls");
+            kc_control_resume();
             return KERN_FAILURE;
         } else {
             clientControl = NULL;
         }
     }
+    if (datagramControl) {
+        if (kc_control_deregister(datagramControl) != 0) {
+            debugf("failed unloading because of connected datagram controls");
+            kc_control_resume();
+            return KERN_FAILURE;
+        } else {
+            datagramControl = NULL;
+        }
+    }
     
-    lck_mtx_free(listMutex, mutexGroup);
+    kc_pool_cache_destroy(controlCache);
+    kc_lock_free(listMutex, mutexGroup);
     lck_grp_free(mutexGroup);
     OSFree(controls, controlsAlloc * (uint32_t)sizeof(KCControl *), general_malloc_tag());
     
     return KERN_SUCCESS;
 }
 
+__private_extern__
+kern_return_t control_drain() {
+    uint64_t start = mach_absolute_time();
+    uint64_t deadline, flushDeadline;
+    clock_interval_to_deadline(drainTimeout, kMillisecondScale, &deadline);
+    // half of the time goes to queued writes, the rest to clients hanging up
+    clock_interval_to_deadline(drainTimeout / 2, kMillisecondScale, &flushDeadline);
+    
+    kc_lock(listMutex);
+    draining = TRUE;
+    kc_unlock(listMutex);
+    
+    KCConnectionDrainStats stats;
+    kc_connection_drain(flushDeadline, &stats);
+    kc_control_broadcast_unloading();
+    
+    kc_lock(listMutex);
+    while ((controlsCount > 0 || controlsClosing > 0) && mach_absolute_time() < deadline) {
+        kc_lock_sleep_deadline(listMutex, &controlsCount, deadline);
+    }
+    uint32_t remaining = controlsCount + controlsClosing;
+    kc_unlock(listMutex);
+    
+    uint64_t elapsed;
+    absolutetime_to_nanoseconds(mach_absolute_time() - start, &elapsed);
+    if (remaining) {
+        kc_control_resume();
+        debugf("drain gave up after %llums with %u controls still connected",
+               (unsigned long long)(elapsed / NSEC_PER_MSEC), remaining);
+        return KERN_FAILURE;
+    }
+    debugf("drained in %llums: closed %u connections, discarded %llu queued bytes",
+           (unsigned long long)(elapsed / NSEC_PER_MSEC), stats.closed, (unsigned long long)stats.discardedBytes);
+    return KERN_SUCCESS;
+}
+
+__private_extern__
+uint32_t kc_control_get_drain_timeout() {
+    return drainTimeout;
+}
+
+__private_extern__
+errno_t kc_control_set_drain_timeout(uint32_t milliseconds) {
+    if (milliseconds > KC_DRAIN_MAX_TIMEOUT) return EINVAL;
+    drainTimeout = milliseconds;
+    return 0;
+}
+
 #pragma mark - Data Structures -
 
 __private_extern__
-uint32_t kc_control_create(uint32_t unit) {
-    KCControl * control = (KCControl *)OSMalloc(sizeof(KCControl), general_malloc_tag());
+uint32_t kc_control_create(kern_ctl_ref ref, uint32_t unit) {
+    KCControl * control = (KCControl *)kc_pool_cache_alloc(controlCache);
     if (!control) return 0;
+    KCLock * lock = control->lock; // the cache keeps this around
     bzero(control, sizeof(KCControl));
+    control->lock = lock;
+    control->ref = ref;
     control->unit = unit;
-    control->lock = lck_mtx_alloc_init(mutexGroup, LCK_ATTR_NULL);
     
-    lck_mtx_lock(listMutex);
+    kc_lock(listMutex);
+    if (draining) {
+        // raced with control_drain, which would never tell this one to leave
+        kc_unlock(listMutex);
+        kc_pool_cache_free(controlCache, control);
+        return 0;
+    }
     control->identifier = controlIdentifier++;
-    control->connection = kc_connection_create(ConnectionCallbacks, number_to_pointer(control->identifier));
+    control->connection = kc_connection_create(ConnectionCallbacks, number_to_pointer(control->identifier),
+                                               &control->account);
     if (control->connection == 0) {
-        lck_mtx_unlock(listMutex);
-        lck_mtx_free(control->lock, mutexGroup);
-        OSFree(control, sizeof(KCControl), general_malloc_tag());
+        kc_unlock(listMutex);
+        kc_pool_cache_free(controlCache, control);
         return 0;
     }
+    control->flow = kc_connection_get_flow(control->connection);
+    kc_timer_setup(&control->ringRetry, kc_process_ring_retry, number_to_pointer(control->identifier));
     
     if (controlsAlloc == controlsCount) {
         uint32_t newSize = (controlsAlloc + 2) * (uint32_t)sizeof(KCControl *);
         KCControl ** newControls = (KCControl **)OSMalloc(newSize, general_malloc_tag());
         if (!newControls) {
-            lck_mtx_free(control->lock, mutexGroup);
             kc_connection_destroy(control->connection);
-            OSFree(control, sizeof(KCControl), general_malloc_tag());
-            lck_mtx_unlock(listMutex);
+            kc_pool_cache_free(controlCache, control);
+            kc_unlock(listMutex);
             return 0;
         }
         memcpy(newControls, controls, sizeof(KCControl *) * controlsCount);
@@ -149,14 +295,15 @@ uint32_t kc_control_create(uint32_t unit) {
     controls[controlsCount++] = control;
     
     uint32_t id = control->identifier;
-    lck_mtx_unlock(listMutex);
+    kc_unlock(listMutex);
+    kc_metrics_add(KC_METRIC_CONTROLS, 1);
     
     return id;
 }
 
 __private_extern__
 errno_t kc_control_destroy(uint32_t identifier) {
-    lck_mtx_lock(listMutex);
+    kc_lock(listMutex);
     
     KCControl * control = NULL;
     for (uint32_t i = 0; i < controlsCount; i++) {
@@ -167,55 +314,124 @@ errno_t kc_control_destroy(uint32_t identifier) {
         }
     }
     if (!control) {
-        lck_mtx_unlock(listMutex);
+        kc_unlock(listMutex);
         return ENOENT;
     }
     controlsCount -= 1;
-    lck_mtx_unlock(listMutex);
+    controlsClosing += 1;
+    kc_unlock(listMutex);
+    kc_metrics_add(KC_METRIC_CONTROLS, -1);
     
-    lck_mtx_lock(control->lock);
+    kc_lock(control->lock);
+    kc_timer_cancel(&control->ringRetry);
     kc_connection_destroy(control->connection);
     if (control->buffer) {
-        OSFree(control->buffer, control->bufferSize, general_malloc_tag());
+        kc_pool_free(control->buffer, control->bufferSize);
     }
-    lck_mtx_unlock(control->lock);
-    lck_mtx_free(control->lock, mutexGroup);
-    OSFree(control, sizeof(KCControl), general_malloc_tag());
+    if (control->hasRings) {
+        kc_ringmap_destroy(&control->sendMap);
+        kc_ringmap_destroy(&control->receiveMap);
+    }
+    // covers the buffer as well as datagrams still waiting to be processed
+    kc_budget_close_account(&control->account);
+    kc_unlock(control->lock);
+    kc_pool_cache_free(controlCache, control);
     
+    kc_lock(listMutex);
+    controlsClosing -= 1;
+    if (draining && !controlsCount && !controlsClosing) {
+        wakeup(&controlsCount);
+    }
+    kc_unlock(listMutex);
     return 0;
 }
 
 __private_extern__
-errno_t kc_control_append_data(uint32_t identifier, mbuf_t buffer) {
+errno_t kc_control_append_data(uint32_t identifier, mbuf_t buffer, uint32_t * flow) {
     KCControl * control;
     if (!(control = kc_control_lock(identifier))) return ENOENT;
+    *flow = control->flow;
+    size_t length = 0;
+    for (mbuf_t m = buffer; m; m = mbuf_next(m)) {
+        length += mbuf_len(m);
+    }
+    
+    // refusing the write pushes back on the client until its earlier
+    // commands (and the data they queued) have drained. sosend() hands us
+    // a large write in pieces, and a refused piece fails the whole write
+    // without saying how much of it we kept, so only the piece that starts
+    // a frame may be refused; the rest of a frame is always taken, which
+    // lets a client resend a refused frame from its first byte
+    if (control->frameHeaderSeen || control->frameBodyLeft) {
+        kc_budget_force_charge(&control->account, length);
+    } else {
+        errno_t error = kc_budget_charge(&control->account, length);
+        if (error) {
+            kc_control_unlock(control);
+            return error;
+        }
+    }
     
     if (!control->buffer) {
-        char * buff = OSMalloc((uint32_t)mbuf_len(buffer), general_malloc_tag());
+        char * buff = kc_pool_alloc((uint32_t)length);
         if (!buff) {
+            kc_budget_release(&control->account, length);
             kc_control_unlock(control);
             return ENOMEM;
         }
         control->buffer = buff;
-        control->bufferSize = (uint32_t)mbuf_len(buffer);
+        control->bufferSize = (uint32_t)length;
     } else {
-        char * newBuff = OSMalloc((uint32_t)mbuf_len(buffer) + control->bufferSize, general_malloc_tag());
+        char * newBuff = kc_pool_alloc((uint32_t)length + control->bufferSize);
         if (!newBuff) {
+            kc_budget_release(&control->account, length);
             kc_control_unlock(control);
             return ENOMEM;
         }
         memcpy(newBuff, control->buffer, control->bufferSize);
-        OSFree(control->buffer, control->bufferSize, general_malloc_tag());
+        kc_pool_free(control->buffer, control->bufferSize);
         control->buffer = newBuff;
-        control->bufferSize += (uint32_t)mbuf_len(buffer);
+        control->bufferSize += (uint32_t)length;
+    }
+    uint32_t offset = control->bufferSize - (uint32_t)length;
+    mbuf_copydata(buffer, 0, length, &control->buffer[offset]);
+    kc_control_track_frames(control, offset);
+    kc_metrics_add(KC_METRIC_CLIENT_BYTES_IN, length);
+    if (control->timestamps) {
+        // once full, the newest entry absorbs later appends, which only
+        // makes the frames it covers look like they arrived later
+        if (control->arrivalCount < KC_CONTROL_ARRIVALS) control->arrivalCount++;
+        KCControlArrival * arrival = &control->arrivals[control->arrivalCount - 1];
+        arrival->end = control->bufferSize;
+        arrival->time = mach_absolute_time();
     }
-    uint32_t offset = control->bufferSize - (uint32_t)mbuf_len(buffer);
-    mbuf_copydata(buffer, 0, mbuf_len(buffer), &control->buffer[offset]);
     
     kc_control_unlock(control);
     return 0;
 }
 
+/**
+ * Follow the frame headers through the bytes appended at offset, so the
+ * next append knows whether it starts a frame. Only headers are looked
+ * at; bodies are skipped over whole.
+ */
+static void kc_control_track_frames(KCControl * control, uint32_t offset) {
+    while (offset < control->bufferSize) {
+        if (control->frameBodyLeft) {
+            uint32_t skip = control->bufferSize - offset;
+            if (skip > control->frameBodyLeft) skip = control->frameBodyLeft;
+            control->frameBodyLeft -= skip;
+            offset += skip;
+            continue;
+        }
+        control->frameHeader[control->frameHeaderSeen++] = (uint8_t)control->buffer[offset++];
+        if (control->frameHeaderSeen == KC_FRAME_HEADER_SIZE) {
+            control->frameBodyLeft = kc_frame_length(control->frameHeader);
+            control->frameHeaderSeen = 0;
+        }
+    }
+}
+
 __private_extern__
 errno_t kc_control_read_packet(uint32_t identifier, KCControlPacket ** packet) {
     KCControl * control;
@@ -226,30 +442,55 @@ errno_t kc_control_read_packet(uint32_t identifier, KCControlPacket ** packet) {
         return ENODATA;
     }
     
-    if (control->bufferSize > 3) {
-        uint16_t sizeField = htons(*(uint16_t *)(&control->buffer[1]));
-        if (control->bufferSize >= sizeField + 3) {
+    // >= rather than >, so a frame with no body is read as soon as it's complete
+    if (control->bufferSize >= KC_FRAME_HEADER_SIZE) {
+        uint16_t sizeField = kc_frame_length(control->buffer);
+        if (control->bufferSize >= sizeField + KC_FRAME_HEADER_SIZE) {
             KCControlPacket * readPacket = kc_control_packet_allocate(sizeField);
-            readPacket->packetType = control->buffer[0];
-            memcpy(readPacket->data, &control->buffer[3], sizeField);
+            if (!readPacket) {
+                kc_control_unlock(control);
+                return ENOMEM;
+            }
+            readPacket->packetType = kc_frame_type(control->buffer);
+            memcpy(readPacket->data, &control->buffer[KC_FRAME_HEADER_SIZE], sizeField);
+            
+            // the frame arrived with the first append that reached its end
+            uint32_t frameEnd = sizeField + KC_FRAME_HEADER_SIZE;
+            uint32_t consumed = 0;
+            for (uint32_t i = 0; i < control->arrivalCount; i++) {
+                if (!readPacket->arrived && control->arrivals[i].end >= frameEnd) {
+                    readPacket->arrived = control->arrivals[i].time;
+                }
+                if (control->arrivals[i].end <= frameEnd) {
+                    consumed++;
+                } else {
+                    control->arrivals[i].end -= frameEnd;
+                }
+            }
+            if (consumed) {
+                control->arrivalCount -= consumed;
+                memmove(control->arrivals, &control->arrivals[consumed],
+                        sizeof(KCControlArrival) * control->arrivalCount);
+            }
             
-            if (sizeField + 3 == control->bufferSize) {
-                OSFree(control->buffer, control->bufferSize, general_malloc_tag());
+            if (frameEnd == control->bufferSize) {
+                kc_pool_free(control->buffer, control->bufferSize);
                 control->buffer = NULL;
                 control->bufferSize = 0;
             } else {
-                uint32_t newSize = control->bufferSize - sizeField - 3;
-                char * cutdownBuff = OSMalloc(newSize, general_malloc_tag());
+                uint32_t newSize = control->bufferSize - frameEnd;
+                char * cutdownBuff = kc_pool_alloc(newSize);
                 if (!cutdownBuff) {
                     kc_control_packet_free(readPacket);
                     kc_control_unlock(control);
                     return ENOMEM;
                 }
-                memcpy(cutdownBuff, &control->buffer[sizeField + 3], newSize);
-                OSFree(control->buffer, control->bufferSize, general_malloc_tag());
+                memcpy(cutdownBuff, &control->buffer[frameEnd], newSize);
+                kc_pool_free(control->buffer, control->bufferSize);
                 control->buffer = cutdownBuff;
                 control->bufferSize = newSize;
             }
+            kc_budget_release(&control->account, frameEnd);
             *packet = readPacket;
             kc_control_unlock(control);
             return 0;
@@ -260,6 +501,38 @@ errno_t kc_control_read_packet(uint32_t identifier, KCControlPacket ** packet) {
     return ENODATA;
 }
 
+__private_extern__
+errno_t kc_control_read_datagram(uint32_t identifier, mbuf_t datagram, KCControlPacket ** packet, uint32_t * flow) {
+    size_t length = 0;
+    for (mbuf_t m = datagram; m; m = mbuf_next(m)) {
+        length += mbuf_len(m);
+    }
+    char header[KC_FRAME_HEADER_SIZE];
+    if (length < KC_FRAME_HEADER_SIZE) return EINVAL;
+    mbuf_copydata(datagram, 0, KC_FRAME_HEADER_SIZE, header);
+    uint16_t sizeField = kc_frame_length(header);
+    if (sizeField + KC_FRAME_HEADER_SIZE != length) return EINVAL;
+    
+    KCControl * control;
+    if (!(control = kc_control_lock(identifier))) return ENOENT;
+    // released by whoever processes the packet, or when the control goes
+    errno_t error = kc_budget_charge(&control->account, length);
+    *flow = control->flow;
+    kc_control_unlock(control);
+    if (error) return error;
+    
+    KCControlPacket * readPacket = kc_control_packet_allocate(sizeField);
+    if (!readPacket) {
+        kc_control_release_frame(identifier, length);
+        return ENOMEM;
+    }
+    readPacket->packetType = kc_frame_type(header);
+    readPacket->arrived = mach_absolute_time();
+    mbuf_copydata(datagram, KC_FRAME_HEADER_SIZE, sizeField, readPacket->data);
+    *packet = readPacket;
+    return 0;
+}
+
 __private_extern__
 uint32_t kc_control_get_connection(uint32_t identifier) {
     KCControl * control;
@@ -279,15 +552,103 @@ uint32_t kc_control_get_unit(uint32_t identifier) {
     return unit;
 }
 
+__private_extern__
+kern_ctl_ref kc_control_get_route(uint32_t identifier, uint32_t * unit) {
+    KCControl * control;
+    if (!(control = kc_control_lock(identifier))) return NULL;
+    kern_ctl_ref ref = control->ref;
+    *unit = control->unit;
+    kc_control_unlock(control);
+    return ref;
+}
+
+#pragma mark - Rings -
+
+__private_extern__
+errno_t kc_control_attach_rings(uint32_t identifier, uint32_t size) {
+    if (!kc_ring_valid_size(size)) return EINVAL;
+    KCControl * control;
+    if (!(control = kc_control_lock(identifier))) return ENOENT;
+    if (control->hasRings) {
+        kc_control_unlock(control);
+        return EEXIST;
+    }
+    
+    // the rings are wired for as long as the control lives, so they count
+    // against its budget until kc_budget_close_account
+    uint32_t totalSize = kc_ring_total_size(size);
+    errno_t error = kc_budget_charge(&control->account, totalSize * 2);
+    if (error) {
+        kc_control_unlock(control);
+        return error;
+    }
+    if ((error = kc_ringmap_create(totalSize, &control->sendMap))) {
+        kc_budget_release(&control->account, totalSize * 2);
+        kc_control_unlock(control);
+        return error;
+    }
+    if ((error = kc_ringmap_create(totalSize, &control->receiveMap))) {
+        kc_ringmap_destroy(&control->sendMap);
+        kc_budget_release(&control->account, totalSize * 2);
+        kc_control_unlock(control);
+        return error;
+    }
+    kc_ring_format(&control->sendRing, control->sendMap.kernelAddress, size);
+    kc_ring_format(&control->receiveRing, control->receiveMap.kernelAddress, size);
+    control->hasRings = TRUE;
+    kc_control_unlock(control);
+    return 0;
+}
+
+__private_extern__
+errno_t kc_control_get_rings(uint32_t identifier, KCRingAddresses * addresses) {
+    KCControl * control;
+    if (!(control = kc_control_lock(identifier))) return ENOENT;
+    if (!control->hasRings) {
+        kc_control_unlock(control);
+        return ENOTCONN;
+    }
+    bzero(addresses, sizeof(KCRingAddresses));
+    addresses->sendAddress = control->sendMap.userAddress;
+    addresses->receiveAddress = control->receiveMap.userAddress;
+    addresses->mappedSize = control->sendMap.size;
+    kc_control_unlock(control);
+    return 0;
+}
+
+#pragma mark - Timestamps -
+
+__private_extern__
+errno_t kc_control_set_timestamps(uint32_t identifier, boolean_t enabled) {
+    KCControl * control;
+    if (!(control = kc_control_lock(identifier))) return ENOENT;
+    control->timestamps = enabled;
+    // bytes already buffered have no arrival to match against
+    control->arrivalCount = 0;
+    kc_control_unlock(control);
+    return 0;
+}
+
+__private_extern__
+boolean_t kc_control_get_timestamps(uint32_t identifier) {
+    KCControl * control;
+    if (!(control = kc_control_lock(identifier))) return FALSE;
+    boolean_t enabled = control->timestamps;
+    kc_control_unlock(control);
+    return enabled;
+}
+
 #pragma mark - Control Packets -
 
 __private_extern__
 KCControlPacket * kc_control_packet_allocate(uint16_t length) {
     uint32_t allocLen = length + (uint32_t)sizeof(KCControlPacket);
-    KCControlPacket * packet = OSMalloc(allocLen, general_malloc_tag());
+    KCControlPacket * packet = kc_pool_alloc(allocLen);
     if (!packet) return NULL;
     packet->packetType = 0;
     packet->length = length;
+    packet->arrived = 0;
+    packet->dequeued = 0;
     packet->data = &((char *)packet)[sizeof(KCControlPacket)];
     bzero(packet->data, length);
     return packet;
@@ -296,13 +657,13 @@ KCControlPacket * kc_control_packet_allocate(uint16_t length) {
 __private_extern__
 void kc_control_packet_free(KCControlPacket * packet) {
     uint32_t allocLen = packet->length + (uint32_t)sizeof(KCControlPacket);
-    OSFree(packet, allocLen, general_malloc_tag());
+    kc_pool_free(packet, allocLen);
 }
 
 #pragma mark - Private -
 
-static KCControl * kc_control_lock(uint32_t identifier) {
-    lck_mtx_lock(listMutex);
+static KCControl * kc_control_lock_at(uint32_t identifier, KCLockSite * site) {
+    kc_lock_at(listMutex, site);
     KCControl * control = NULL;
     for (uint32_t i = 0; i < controlsCount; i++) {
         if (controls[i]->identifier == identifier) {
@@ -311,68 +672,272 @@ static KCControl * kc_control_lock(uint32_t identifier) {
         }
     }
     if (!control) {
-        lck_mtx_unlock(listMutex);
+        kc_unlock(listMutex);
         return NULL;
     }
-    lck_mtx_lock(control->lock);
-    lck_mtx_unlock(listMutex);
+    kc_lock_at(control->lock, site);
+    kc_unlock(listMutex);
     return control;
 }
 
 static void kc_control_unlock(KCControl * control) {
-    lck_mtx_unlock(control->lock);
+    kc_unlock(control->lock);
+}
+
+static void kc_control_release_frame(uint32_t identifier, size_t length) {
+    // a datagram or ring frame that has been handled; if the control is
+    // gone, closing its account already gave this back
+    KCControl * control;
+    if (!(control = kc_control_lock(identifier))) return;
+    kc_budget_release(&control->account, length);
+    kc_control_unlock(control);
+}
+
+static errno_t kc_control_construct(void * object) {
+    KCControl * control = (KCControl *)object;
+    control->lock = kc_lock_alloc(mutexGroup, KC_LOCK_GROUP_CONTROL);
+    return control->lock ? 0 : ENOMEM;
+}
+
+static void kc_control_destruct(void * object) {
+    KCControl * control = (KCControl *)object;
+    kc_lock_free(control->lock, mutexGroup);
 }
 
 #pragma mark - Processing -
 
 static void kc_process_packet(void * unitInfo) {
     uint32_t identifier = pointer_to_number(unitInfo);
+    KC_TRACE(KC_TRACE_PROCESS | DBG_FUNC_START, identifier, 0, 0, 0);
     KCControlPacket * packet = NULL;
     errno_t error = kc_control_read_packet(identifier, &packet);
     if (!error) {
-        debugf("kc_process_packet of type: %d", (int)packet->packetType);
-        if (packet->packetType == CONTROL_PACKET_CONNECT) {
-            kc_process_packet_connect(identifier, packet);
-        } else if (packet->packetType == CONTROL_PACKET_SEND) {
-            kc_process_packet_send(identifier, packet);
-        } else if (packet->packetType == CONTROL_PACKET_CLOSE) {
-            kc_process_packet_close(identifier, packet);
-        }
+        kc_handle_packet(identifier, packet);
         kc_control_packet_free(packet);
     } else if (error == ENODATA) {
         debugf("kc_process_packet ENODATA");
     } else {
         debugf("kc_process_packet error: %d", error);
     }
+    KC_TRACE(KC_TRACE_PROCESS | DBG_FUNC_END, identifier, error, 0, 0);
+}
+
+static void kc_process_datagram(void * job) {
+    KCDatagramJob * datagramJob = (KCDatagramJob *)job;
+    uint32_t identifier = datagramJob->identifier;
+    KCControlPacket * packet = datagramJob->packet;
+    kc_pool_free(datagramJob, sizeof(KCDatagramJob));
+    
+    kc_handle_packet(identifier, packet);
+    kc_control_release_frame(identifier, packet->length + KC_FRAME_HEADER_SIZE);
+    kc_control_packet_free(packet);
+}
+
+static void kc_process_ring(uint32_t identifier) {
+    // only the dispatch thread consumes, but the control can go away between
+    // frames, so each one is copied out under the lock and handled without it
+    boolean_t doorbell = FALSE;
+    while (1) {
+        KCControl * control;
+        if (!(control = kc_control_lock(identifier))) return;
+        if (!control->hasRings) {
+            kc_control_unlock(control);
+            return;
+        }
+        if (dispatch_turn_remaining() <= 0 &&
+            !dispatch_push_flow(control->flow, kc_process_ring_dispatched, number_to_pointer(identifier))) {
+            // the rest of the ring waits for this connection's next turn
+            kern_ctl_ref ref = control->ref;
+            uint32_t unit = control->unit;
+            kc_control_unlock(control);
+            kc_metrics_add(KC_METRIC_DISPATCH_YIELDS, 1);
+            if (doorbell) kc_control_ring_doorbell(ref, unit);
+            return;
+        }
+        uint8_t type;
+        uint16_t length;
+        void * body = kc_ring_peek(&control->sendRing, &type, &length);
+        if (!body) {
+            if (control->sendRing.corrupt) {
+                debugf("kc_process_ring: corrupt ring from control %d", identifier);
+                kc_control_unlock(control);
+                kc_control_send_error(identifier, EPROTO);
+                return;
+            }
+            if (!kc_ring_consumer_wait(&control->sendRing)) {
+                kc_control_unlock(control);
+                continue;
+            }
+            kern_ctl_ref ref = control->ref;
+            uint32_t unit = control->unit;
+            kc_control_unlock(control);
+            if (doorbell) kc_control_ring_doorbell(ref, unit);
+            return;
+        }
+        // charged like a frame from the socket; while the account refuses,
+        // frames stay in the ring, which fills up and makes the client back
+        // off, and a timer comes back for them since no doorbell will
+        if (kc_budget_charge(&control->account, length + KC_FRAME_HEADER_SIZE)) {
+            kc_timer_arm(&control->ringRetry, KC_CONTROL_RING_RETRY);
+            kern_ctl_ref ref = control->ref;
+            uint32_t unit = control->unit;
+            kc_control_unlock(control);
+            if (doorbell) kc_control_ring_doorbell(ref, unit);
+            return;
+        }
+        KCControlPacket * packet = kc_control_packet_allocate(length);
+        if (!packet) {
+            // leave it in the ring; the next doorbell will try again
+            kc_budget_release(&control->account, length + KC_FRAME_HEADER_SIZE);
+            kc_control_unlock(control);
+            return;
+        }
+        packet->packetType = type;
+        packet->arrived = mach_absolute_time(); // as close as a ring gets to the send upcall
+        memcpy(packet->data, body, length);
+        if (kc_ring_release(&control->sendRing, length)) doorbell = TRUE;
+        kc_control_unlock(control);
+        
+        kc_metrics_add(KC_METRIC_CLIENT_BYTES_IN, length + KC_FRAME_HEADER_SIZE);
+        if (type != CONTROL_PACKET_DOORBELL) {
+            kc_handle_packet(identifier, packet);
+        }
+        kc_control_release_frame(identifier, length + KC_FRAME_HEADER_SIZE);
+        kc_control_packet_free(packet);
+    }
+}
+
+static void kc_process_ring_dispatched(void * unitInfo) {
+    kc_process_ring(pointer_to_number(unitInfo));
+}
+
+static void kc_process_ring_retry(void * unitInfo) {
+    // timers fire on the dispatch thread, but outside the control's flow
+    KCControl * control;
+    if (!(control = kc_control_lock(pointer_to_number(unitInfo)))) return;
+    uint32_t flow = control->flow;
+    kc_control_unlock(control);
+    if (!dispatch_push_flow(flow, kc_process_ring_dispatched, unitInfo)) return;
+    debugf("kc_process_ring_retry: failed to queue the ring");
+    if ((control = kc_control_lock(pointer_to_number(unitInfo)))) {
+        kc_timer_arm(&control->ringRetry, KC_CONTROL_RING_RETRY);
+        kc_control_unlock(control);
+    }
+}
+
+static void kc_handle_packet(uint32_t identifier, KCControlPacket * packet) {
+    packet->dequeued = mach_absolute_time();
+    kc_pool_count_packet();
+    kc_metrics_add(KC_METRIC_CLIENT_FRAMES_IN, 1);
+    kc_capture_record(identifier, KC_CAPTURE_TO_KEXT, (uint8_t)packet->packetType, packet->length);
+    KC_TRACE(KC_TRACE_FRAME, identifier, packet->packetType, packet->length, 0);
+    debugf("kc_handle_packet of type: %d", (int)packet->packetType);
+    if (packet->packetType == CONTROL_PACKET_DOORBELL) {
+        kc_process_ring(identifier);
+    } else if (packet->packetType == CONTROL_PACKET_CONNECT) {
+        kc_process_packet_connect(identifier, packet);
+    } else if (packet->packetType == CONTROL_PACKET_CONNECT_MULTI) {
+        kc_process_packet_connect_multi(identifier, packet);
+    } else if (packet->packetType == CONTROL_PACKET_CONNECT_DATA) {
+        kc_process_packet_connect_data(identifier, packet);
+    } else if (packet->packetType == CONTROL_PACKET_SEND || packet->packetType == CONTROL_PACKET_SEND_STAMPED) {
+        kc_process_packet_send(identifier, packet);
+    } else if (packet->packetType == CONTROL_PACKET_CLOSE) {
+        kc_process_packet_close(identifier, packet);
+    }
 }
 
 static void kc_process_packet_connect(uint32_t identifier, KCControlPacket * packet) {
     debugf("kc_process_packet_connect: entry");
-    boolean_t isIpv6 = FALSE;
-    if (packet->length == 6) {
-        debugf("kc_process_packet_connect: got ipv4 connect");
-    } else if (packet->length == 18) {
-        debugf("kc_process_packet_connect: got ipv6 connect");
-        isIpv6 = TRUE;
-    } else {
+    uint16_t port;
+    const void * addr;
+    int version = kc_connect_decode(packet->data, packet->length, &port, &addr);
+    if (!version) {
         debugf("kc_process_packet_connect: unknown ip version packet size");
         return;
     }
-    uint16_t port = *(uint16_t *)packet->data;
-    void * addr = &packet->data[2];
+    debugf("kc_process_packet_connect: got ipv%d connect", version);
+    uint32_t conn = kc_control_get_connection(identifier);
+    if (conn) {
+        errno_t error = kc_connection_connect(conn, addr, htons(port), version == 6, NULL, 0);
+        if (error && error != EINPROGRESS) kc_control_send_error(identifier, error);
+    }
+}
+
+static void kc_process_packet_connect_data(uint32_t identifier, KCControlPacket * packet) {
+    // port (2), family (1), the address, then data to send once connected
+    uint16_t port, offset;
+    const void * addr;
+    int version = kc_connect_data_decode(packet->data, packet->length, &port, &addr, &offset);
+    if (!version) {
+        kc_control_send_error(identifier, EINVAL);
+        return;
+    }
     uint32_t conn = kc_control_get_connection(identifier);
     if (conn) {
-        kc_connection_connect(conn, addr, port, isIpv6);
+        errno_t error = kc_connection_connect(conn, addr, htons(port), version == 6,
+                                              &packet->data[offset], packet->length - offset);
+        if (error && error != EINPROGRESS) {
+            debugf("kc_process_packet_connect_data: error %d", error);
+            kc_control_send_error(identifier, error);
+        }
+    }
+}
+
+static void kc_process_packet_connect_multi(uint32_t identifier, KCControlPacket * packet) {
+    // port (2), stagger in milliseconds (2), then a family byte (4 or 6)
+    // followed by the address for each candidate, in order of preference
+    if (packet->length < KC_CONNECT_MULTI_MIN_SIZE) {
+        kc_control_send_error(identifier, EINVAL);
+        return;
+    }
+    uint16_t port, stagger;
+    kc_connect_multi_decode(packet->data, &port, &stagger);
+    KCConnectCandidate candidates[KC_RACE_MAX_CANDIDATES];
+    uint32_t count = 0;
+    uint16_t offset = KC_CONNECT_MULTI_MIN_SIZE;
+    const void * addr;
+    int version;
+    while (count < KC_RACE_MAX_CANDIDATES &&
+           (version = kc_candidate_decode(packet->data, packet->length, &offset, &addr))) {
+        bzero(&candidates[count], sizeof(KCConnectCandidate));
+        candidates[count].family = version == 6 ? AF_INET6 : AF_INET;
+        memcpy(candidates[count].address, addr, version == 6 ? 16 : 4);
+        count++;
+    }
+    if (!count) {
+        kc_control_send_error(identifier, EINVAL);
+        return;
+    }
+    uint32_t conn = kc_control_get_connection(identifier);
+    if (conn) {
+        errno_t error = kc_connection_connect_multi(conn, candidates, count, htons(port), stagger);
+        if (error) {
+            debugf("kc_process_packet_connect_multi: error %d", error);
+            kc_control_send_error(identifier, error);
+        }
     }
 }
 
 static void kc_process_packet_send(uint32_t identifier, KCControlPacket * packet) {
-    if (packet->length > 0) {
+    const char * body = packet->data;
+    uint16_t length = packet->length;
+    uint64_t stamps[4] = {0, packet->arrived, packet->dequeued, 0};
+    if (packet->packetType == CONTROL_PACKET_SEND_STAMPED) {
+        if (length < KC_STAMP_SIZE) return;
+        memcpy(&stamps[0], body, KC_STAMP_SIZE);
+        body += KC_STAMP_SIZE;
+        length -= KC_STAMP_SIZE;
+    }
+    if (length > 0) {
         uint32_t conn = kc_control_get_connection(identifier);
         if (conn) {
-            kc_connection_write(conn, packet->data, packet->length);
+            errno_t error = kc_connection_write(conn, body, length, stamps[0] ? &stamps[3] : NULL);
+            KC_TRACE(KC_TRACE_WRITE, identifier, conn, length, error);
+            if (error && error != EINPROGRESS) kc_control_send_error(identifier, error);
         }
     }
+    if (stamps[3]) kc_control_send_stamps(identifier, KC_STAMPS_OUTBOUND, stamps);
 }
 
 static void kc_process_packet_close(uint32_t identifier, KCControlPacket * packet) {
@@ -384,10 +949,30 @@ static void kc_process_packet_close(uint32_t identifier, KCControlPacket * packe
 
 #pragma mark - Control Private -
 
+static errno_t kc_control_deregister(kern_ctl_ref ref) {
+    // a client that just hung up stays on kern_control's list until our
+    // disconnect handler has returned
+    errno_t error;
+    for (int tries = 0; (error = ctl_deregister(ref)) == EBUSY && draining && tries < 100; tries++) {
+        IOSleep(1);
+    }
+    return error;
+}
+
+static void kc_control_resume() {
+    // the unload failed, so go back to work; the connections stay closed
+    kc_lock(listMutex);
+    draining = FALSE;
+    kc_unlock(listMutex);
+    kc_connection_resume();
+}
+
 static errno_t control_handle_connect(kern_ctl_ref kctlref, struct sockaddr_ctl * sac, void ** unitinfo) {
     debugf("connected by PID %d", proc_selfpid());
-    uint32_t info = kc_control_create(sac->sc_unit);
-    if (!info) return ENOMEM;
+    if (draining) return ESHUTDOWN;
+    if (!kc_budget_admits_control()) return ENOBUFS;
+    uint32_t info = kc_control_create(kctlref, sac->sc_unit);
+    if (!info) return draining ? ESHUTDOWN : ENOMEM;
     *unitinfo = number_to_pointer(info); // this is ugly but screw it
     return 0;
 }
@@ -399,32 +984,297 @@ static errno_t control_handle_disconnect(kern_ctl_ref kctlref, u_int32_t unit, v
 }
 
 static errno_t control_handle_getopt(kern_ctl_ref kctlref, u_int32_t unit, void * unitinfo, int opt, void * data, size_t * len) {
+    if (opt == CONTROL_OPT_POOL_STATS) {
+        if (!data) {
+            *len = sizeof(KCPoolStats);
+            return 0;
+        }
+        if (*len < sizeof(KCPoolStats)) return EINVAL;
+        kc_pool_get_stats((KCPoolStats *)data);
+        *len = sizeof(KCPoolStats);
+    } else if (opt == CONTROL_OPT_UPCALL_STATS) {
+        if (!data) {
+            *len = sizeof(KCConnectionStats);
+            return 0;
+        }
+        if (*len < sizeof(KCConnectionStats)) return EINVAL;
+        kc_connection_get_stats((KCConnectionStats *)data);
+        *len = sizeof(KCConnectionStats);
+    } else if (opt == CONTROL_OPT_TIMEOUTS) {
+        if (!data) {
+            *len = sizeof(KCConnectionTimeouts);
+            return 0;
+        }
+        if (*len < sizeof(KCConnectionTimeouts)) return EINVAL;
+        uint32_t conn = kc_control_get_connection(pointer_to_number(unitinfo));
+        if (!conn) return ENOENT;
+        errno_t error = kc_connection_get_timeouts(conn, (KCConnectionTimeouts *)data);
+        if (error) return error;
+        *len = sizeof(KCConnectionTimeouts);
+    } else if (opt == CONTROL_OPT_RING) {
+        if (!data) {
+            *len = sizeof(KCRingAddresses);
+            return 0;
+        }
+        if (*len < sizeof(KCRingAddresses)) return EINVAL;
+        errno_t error = kc_control_get_rings(pointer_to_number(unitinfo), (KCRingAddresses *)data);
+        if (error) return error;
+        *len = sizeof(KCRingAddresses);
+    } else if (opt == CONTROL_OPT_COALESCE) {
+        if (!data) {
+            *len = sizeof(KCConnectionCoalescing);
+            return 0;
+        }
+        if (*len < sizeof(KCConnectionCoalescing)) return EINVAL;
+        uint32_t conn = kc_control_get_connection(pointer_to_number(unitinfo));
+        if (!conn) return ENOENT;
+        errno_t error = kc_connection_get_coalescing(conn, (KCConnectionCoalescing *)data);
+        if (error) return error;
+        *len = sizeof(KCConnectionCoalescing);
+    } else if (opt == CONTROL_OPT_TIMESTAMPS) {
+        if (!data) {
+            *len = sizeof(uint32_t);
+            return 0;
+        }
+        if (*len < sizeof(uint32_t)) return EINVAL;
+        *(uint32_t *)data = kc_control_get_timestamps(pointer_to_number(unitinfo)) ? 1 : 0;
+        *len = sizeof(uint32_t);
+    } else if (opt == CONTROL_OPT_WEIGHT) {
+        if (!data) {
+            *len = sizeof(uint32_t);
+            return 0;
+        }
+        if (*len < sizeof(uint32_t)) return EINVAL;
+        uint32_t conn = kc_control_get_connection(pointer_to_number(unitinfo));
+        if (!conn) return ENOENT;
+        *(uint32_t *)data = kc_connection_get_weight(conn);
+        *len = sizeof(uint32_t);
+    }
     return 0;
 }
 
 static errno_t control_handle_send(kern_ctl_ref kctlref, u_int32_t unit, void * unitinfo, mbuf_t m, int flags) {
     uint32_t identifier = pointer_to_number(unitinfo);
-    errno_t error;
-    if ((error = kc_control_append_data(identifier, m))) {
-        return error;
+    uint32_t flow;
+    errno_t error = kc_control_append_data(identifier, m, &flow);
+    KC_TRACE(KC_TRACE_CONTROL_SEND, identifier, mbuf_len(m), error, 0);
+    if (error) return error;
+    return dispatch_push_flow(flow, kc_process_packet, number_to_pointer(identifier));
+}
+
+static errno_t control_handle_send_datagram(kern_ctl_ref kctlref, u_int32_t unit, void * unitinfo, mbuf_t m, int flags) {
+    // every send() is one whole frame, so there is nothing to reassemble
+    uint32_t identifier = pointer_to_number(unitinfo);
+    KCControlPacket * packet;
+    uint32_t flow;
+    errno_t error = kc_control_read_datagram(identifier, m, &packet, &flow);
+    KC_TRACE(KC_TRACE_CONTROL_SEND, identifier, error ? 0 : packet->length + KC_FRAME_HEADER_SIZE, error, 0);
+    if (error) return error;
+    kc_metrics_add(KC_METRIC_CLIENT_BYTES_IN, packet->length + KC_FRAME_HEADER_SIZE);
+    
+    KCDatagramJob * job = (KCDatagramJob *)kc_pool_alloc(sizeof(KCDatagramJob));
+    if (!job) {
+        kc_control_release_frame(identifier, packet->length + KC_FRAME_HEADER_SIZE);
+        kc_control_packet_free(packet);
+        return ENOMEM;
     }
-    return dispatch_push(kc_process_packet, number_to_pointer(identifier));
+    job->identifier = identifier;
+    job->packet = packet;
+    if ((error = dispatch_push_flow(flow, kc_process_datagram, job))) {
+        kc_pool_free(job, sizeof(KCDatagramJob));
+        kc_control_release_frame(identifier, packet->length + KC_FRAME_HEADER_SIZE);
+        kc_control_packet_free(packet);
+    }
+    return error;
 }
 
 static errno_t control_handle_setopt(kern_ctl_ref kctlref, u_int32_t unit, void * unitinfo, int opt, void * data, size_t len) {
+    if (opt == CONTROL_OPT_TIMEOUTS) {
+        if (len != sizeof(KCConnectionTimeouts)) return EINVAL;
+        uint32_t conn = kc_control_get_connection(pointer_to_number(unitinfo));
+        if (!conn) return ENOENT;
+        return kc_connection_set_timeouts(conn, (const KCConnectionTimeouts *)data);
+    } else if (opt == CONTROL_OPT_RING) {
+        // setsockopt() runs in the client, which is where the rings get mapped
+        if (len != sizeof(uint32_t)) return EINVAL;
+        return kc_control_attach_rings(pointer_to_number(unitinfo), *(uint32_t *)data);
+    } else if (opt == CONTROL_OPT_COALESCE) {
+        if (len != sizeof(KCConnectionCoalescing)) return EINVAL;
+        uint32_t conn = kc_control_get_connection(pointer_to_number(unitinfo));
+        if (!conn) return ENOENT;
+        return kc_connection_set_coalescing(conn, (const KCConnectionCoalescing *)data);
+    } else if (opt == CONTROL_OPT_TIMESTAMPS) {
+        if (len != sizeof(uint32_t)) return EINVAL;
+        return kc_control_set_timestamps(pointer_to_number(unitinfo), *(uint32_t *)data != 0);
+    } else if (opt == CONTROL_OPT_WEIGHT) {
+        if (len != sizeof(uint32_t)) return EINVAL;
+        uint32_t conn = kc_control_get_connection(pointer_to_number(unitinfo));
+        if (!conn) return ENOENT;
+        return kc_connection_set_weight(conn, *(uint32_t *)data);
+    }
     return 0;
 }
 
 #pragma mark - Connection Callbacks -
 
+static errno_t kc_control_enqueue(kern_ctl_ref ref, uint32_t unit, void * data, size_t length) {
+    if (!ref) return ENOENT;
+    // on a datagram control each enqueue is delivered as its own record
+    errno_t error = ctl_enqueuedata(ref, unit, data, length, ref == datagramControl ? CTL_DATA_EOR : 0);
+    if (error) {
+        kc_metrics_add(KC_METRIC_ENQUEUE_FAILURES, 1);
+        return error;
+    }
+    kc_metrics_add(KC_METRIC_CLIENT_FRAMES_OUT, 1);
+    kc_metrics_add(KC_METRIC_CLIENT_BYTES_OUT, length);
+    return 0;
+}
+
+static errno_t kc_control_deliver(uint32_t identifier, void * data, size_t length) {
+    return kc_control_deliver_stamped(identifier, data, length, 0);
+}
+
+/**
+ * Deliver a frame. If the client turned timestamps on and received is set,
+ * an inbound STAMPS frame goes out just ahead of it; losing that one to a
+ * full buffer only costs a sample.
+ */
+static errno_t kc_control_deliver_stamped(uint32_t identifier, void * data, size_t length, uint64_t received) {
+    KCControl * control;
+    if (!(control = kc_control_lock(identifier))) return ENOENT;
+    kern_ctl_ref ref = control->ref;
+    uint32_t unit = control->unit;
+    boolean_t stamped = received && control->timestamps;
+    char stamps[KC_FRAME_HEADER_SIZE + sizeof(KCFrameStamps)];
+    kc_frame_put_header(stamps, CONTROL_PACKET_STAMPS, sizeof(KCFrameStamps));
+    KCFrameStamps frameStamps;
+    bzero(&frameStamps, sizeof(frameStamps));
+    frameStamps.direction = KC_STAMPS_INBOUND;
+    frameStamps.stamps[0] = received;
+    kc_capture_record(identifier, KC_CAPTURE_TO_CLIENT, kc_frame_type(data), (uint16_t)(length - KC_FRAME_HEADER_SIZE));
+    if (!control->hasRings) {
+        kc_control_unlock(control);
+        if (stamped) {
+            frameStamps.stamps[1] = mach_absolute_time();
+            memcpy(&stamps[KC_FRAME_HEADER_SIZE], &frameStamps, sizeof(frameStamps));
+            kc_control_enqueue(ref, unit, stamps, sizeof(stamps));
+        }
+        return kc_control_enqueue(ref, unit, data, length);
+    }
+    
+    // the lock makes the callbacks a single producer; the doorbell goes out
+    // after it is dropped, because ctl_enqueuedata takes the socket lock and
+    // control_handle_send holds that while it takes ours
+    if (stamped) {
+        // published by the same commit as the frame
+        void * stampsBody = kc_ring_reserve(&control->receiveRing, CONTROL_PACKET_STAMPS, sizeof(KCFrameStamps));
+        if (stampsBody) {
+            frameStamps.stamps[1] = mach_absolute_time();
+            memcpy(stampsBody, &frameStamps, sizeof(frameStamps));
+        }
+    }
+    char * frame = (char *)data;
+    uint16_t bodyLength = (uint16_t)(length - KC_FRAME_HEADER_SIZE);
+    void * body = kc_ring_reserve(&control->receiveRing, kc_frame_type(frame), bodyLength);
+    if (!body) {
+        // same as a full socket buffer
+        kc_control_unlock(control);
+        kc_metrics_add(KC_METRIC_ENQUEUE_FAILURES, 1);
+        return ENOBUFS;
+    }
+    memcpy(body, &frame[KC_FRAME_HEADER_SIZE], bodyLength);
+    int doorbell = kc_ring_commit(&control->receiveRing);
+    kc_control_unlock(control);
+    
+    kc_metrics_add(KC_METRIC_CLIENT_FRAMES_OUT, 1);
+    kc_metrics_add(KC_METRIC_CLIENT_BYTES_OUT, length);
+    if (doorbell) kc_control_ring_doorbell(ref, unit);
+    return 0;
+}
+
+static void kc_control_send_stamps(uint32_t identifier, uint8_t direction, const uint64_t * stamps) {
+    char data[KC_FRAME_HEADER_SIZE + sizeof(KCFrameStamps)];
+    kc_frame_put_header(data, CONTROL_PACKET_STAMPS, sizeof(KCFrameStamps));
+    KCFrameStamps frameStamps;
+    bzero(&frameStamps, sizeof(frameStamps));
+    frameStamps.direction = direction;
+    memcpy(frameStamps.stamps, stamps, sizeof(frameStamps.stamps));
+    memcpy(&data[KC_FRAME_HEADER_SIZE], &frameStamps, sizeof(frameStamps));
+    if (kc_control_deliver(identifier, data, sizeof(data))) {
+        debugf("error sending stamps");
+    }
+}
+
+static void kc_control_ring_doorbell(kern_ctl_ref ref, uint32_t unit) {
+    char data[KC_FRAME_HEADER_SIZE];
+    kc_frame_put_header(data, CONTROL_PACKET_DOORBELL, 0);
+    if (kc_control_enqueue(ref, unit, data, sizeof(data))) {
+        debugf("error ringing doorbell");
+    }
+}
+
+static void kc_control_send_error(uint32_t identifier, errno_t error) {
+    char data[KC_FRAME_HEADER_SIZE + KC_STATUS_SIZE];
+    kc_frame_put_header(data, CONTROL_PACKET_ERROR, KC_STATUS_SIZE);
+    kc_status_encode(&data[KC_FRAME_HEADER_SIZE], error);
+    
+    if (kc_control_deliver(identifier, data, sizeof(data))) {
+        debugf("error calling ctl_enqueuedata");
+    }
+}
+
+static void kc_control_broadcast_unloading() {
+    kc_lock(listMutex);
+    uint32_t count = controlsCount;
+    if (!count) {
+        kc_unlock(listMutex);
+        return;
+    }
+    KCControlRoute * routes = (KCControlRoute *)OSMalloc((uint32_t)sizeof(KCControlRoute) * count, general_malloc_tag());
+    if (!routes) {
+        kc_unlock(listMutex);
+        debugf("%s: failed to allocate", __FUNCTION__);
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        KCControl * control = controls[i];
+        KCControlRoute * route = &routes[i];
+        kc_lock(control->lock);
+        route->ref = control->ref;
+        route->unit = control->unit;
+        route->packetType = CONTROL_PACKET_UNLOADING;
+        kc_capture_record(control->identifier, KC_CAPTURE_TO_CLIENT, CONTROL_PACKET_UNLOADING, 0);
+        if (control->hasRings && kc_ring_reserve(&control->receiveRing, CONTROL_PACKET_UNLOADING, 0)) {
+            // a full ring falls back to the socket, which the client reads when it sleeps
+            route->packetType = kc_ring_commit(&control->receiveRing) ? CONTROL_PACKET_DOORBELL : 0;
+            kc_metrics_add(KC_METRIC_CLIENT_FRAMES_OUT, 1);
+            kc_metrics_add(KC_METRIC_CLIENT_BYTES_OUT, KC_FRAME_HEADER_SIZE);
+        }
+        kc_unlock(control->lock);
+    }
+    kc_unlock(listMutex);
+    
+    // same as kc_control_deliver: no enqueueing with our locks held
+    for (uint32_t i = 0; i < count; i++) {
+        if (!routes[i].packetType) continue;
+        char data[KC_FRAME_HEADER_SIZE];
+        kc_frame_put_header(data, routes[i].packetType, 0);
+        if (kc_control_enqueue(routes[i].ref, routes[i].unit, data, sizeof(data))) {
+            debugf("error telling unit %u about the unload", routes[i].unit);
+        }
+    }
+    OSFree(routes, (uint32_t)sizeof(KCControlRoute) * count, general_malloc_tag());
+}
+
 static void kc_connection_opened_callback(uint32_t connection) {
     void * userInfo = kc_connection_get_user_data(connection);
     uint32_t identifier = pointer_to_number(userInfo);
+    KC_TRACE(KC_TRACE_OPENED, connection, identifier, 0, 0);
     if (!identifier) return;
     
-    char data[] = {CONTROL_PACKET_CONNECTED, 0, 0};
-    uint32_t unit = kc_control_get_unit(identifier);
-    if (ctl_enqueuedata(clientControl, unit, data, 3, 0)) {
+    char data[KC_FRAME_HEADER_SIZE];
+    kc_frame_put_header(data, CONTROL_PACKET_CONNECTED, 0);
+    if (kc_control_deliver(identifier, data, sizeof(data))) {
         debugf("error calling ctl_enqueuedata");
     }
 }
@@ -432,11 +1282,12 @@ static void kc_connection_opened_callback(uint32_t connection) {
 static void kc_connection_closed_callback(uint32_t connection) {
     void * userInfo = kc_connection_get_user_data(connection);
     uint32_t identifier = pointer_to_number(userInfo);
+    KC_TRACE(KC_TRACE_CLOSED, connection, identifier, 0, 0);
     if (!identifier) return;
     
-    char data[] = {CONTROL_PACKET_HUNGUP, 0, 0};
-    uint32_t unit = kc_control_get_unit(identifier);
-    if (ctl_enqueuedata(clientControl, unit, data, 3, 0)) {
+    char data[KC_FRAME_HEADER_SIZE];
+    kc_frame_put_header(data, CONTROL_PACKET_HUNGUP, 0);
+    if (kc_control_deliver(identifier, data, sizeof(data))) {
         debugf("error calling ctl_enqueuedata");
     }
 }
@@ -444,50 +1295,60 @@ static void kc_connection_closed_callback(uint32_t connection) {
 static void kc_connection_failed_callback(uint32_t connection, errno_t error) {
     void * userInfo = kc_connection_get_user_data(connection);
     uint32_t identifier = pointer_to_number(userInfo);
+    KC_TRACE(KC_TRACE_FAILED, connection, identifier, error, 0);
     if (!identifier) return;
     
-    char data[7] = {CONTROL_PACKET_HUNGUP, 0, 4};
-    uint32_t errorBig = htonl(error);
-    memcpy(&data[3], &errorBig, 4);
+    char data[KC_FRAME_HEADER_SIZE + KC_STATUS_SIZE];
+    kc_frame_put_header(data, CONTROL_PACKET_HUNGUP, KC_STATUS_SIZE);
+    kc_status_encode(&data[KC_FRAME_HEADER_SIZE], error);
     
-    uint32_t unit = kc_control_get_unit(identifier);
-    if (ctl_enqueuedata(clientControl, unit, data, 7, 0)) {
+    if (kc_control_deliver(identifier, data, sizeof(data))) {
         debugf("error calling ctl_enqueuedata");
     }
 }
 
-static void kc_connection_newdata_callback(uint32_t connection, char * buffer, size_t size) {
+static void kc_connection_newdata_callback(uint32_t connection, char * buffer, size_t size, uint64_t received) {
     void * userInfo = kc_connection_get_user_data(connection);
     uint32_t identifier = pointer_to_number(userInfo);
-    if (!identifier) {
-        OSFree(buffer, (uint32_t)size, general_malloc_tag());
-        return;
-    }
-    uint32_t unit = kc_control_get_unit(identifier);
-        
+    KC_TRACE(KC_TRACE_NEWDATA | DBG_FUNC_START, connection, identifier, size, 0);
+    errno_t error = identifier ? 0 : ENOENT;
     const char * subBuffer = buffer;
-    uint32_t subSize = (uint32_t)size;
+    uint32_t subSize = identifier ? (uint32_t)size : 0;
     while (subSize > 0) {
         uint32_t useSize = subSize < 65536 ? subSize : 65535;
-        char * data = (char *)OSMalloc(useSize + 3, general_malloc_tag());
+        char * data = (char *)kc_pool_alloc(useSize + KC_FRAME_HEADER_SIZE);
         if (!data) {
             debugf("%s: failed to allocate", __FUNCTION__);
-            OSFree(buffer, (uint32_t)size, general_malloc_tag());
-            return;
+            error = ENOMEM;
+            break;
         }
-        data[0] = CONTROL_PACKET_DATA;
-        uint16_t sizeBig = htons(useSize);
-        memcpy(&data[1], &sizeBig, 2);
-        memcpy(&data[3], subBuffer, useSize);
+        kc_frame_put_header(data, CONTROL_PACKET_DATA, (uint16_t)useSize);
+        memcpy(&data[KC_FRAME_HEADER_SIZE], subBuffer, useSize);
         subBuffer = &subBuffer[useSize];
         subSize -= useSize;
-        if (ctl_enqueuedata(clientControl, unit, data, useSize + 3, 0)) {
+        kc_pool_count_packet();
+        // only the first chunk is stamped; the rest came off the socket with it
+        if ((error = kc_control_deliver_stamped(identifier, data, useSize + KC_FRAME_HEADER_SIZE, subBuffer == &buffer[useSize] ? received : 0))) {
             debugf("%s: failed to enqueue data", __FUNCTION__);
-            OSFree(data, useSize + 3, general_malloc_tag());
-            OSFree(buffer, (uint32_t)size, general_malloc_tag());
-            return;
+            kc_pool_free(data, useSize + KC_FRAME_HEADER_SIZE);
+            break;
         }
-        OSFree(data, useSize + 3, general_malloc_tag());
+        kc_pool_free(data, useSize + KC_FRAME_HEADER_SIZE);
+    }
+    kc_pool_free(buffer, (uint32_t)size);
+    KC_TRACE(KC_TRACE_NEWDATA | DBG_FUNC_END, connection, identifier, error, 0);
+}
+
+static void kc_connection_timedout_callback(uint32_t connection, int reason) {
+    void * userInfo = kc_connection_get_user_data(connection);
+    uint32_t identifier = pointer_to_number(userInfo);
+    KC_TRACE(KC_TRACE_TIMEDOUT, connection, identifier, reason, 0);
+    if (!identifier) return;
+    
+    char data[KC_FRAME_HEADER_SIZE + KC_TIMEOUT_SIZE];
+    kc_frame_put_header(data, CONTROL_PACKET_TIMEOUT, KC_TIMEOUT_SIZE);
+    data[KC_FRAME_HEADER_SIZE] = (char)reason;
+    if (kc_control_deliver(identifier, data, sizeof(data))) {
+        debugf("error calling ctl_enqueuedata");
     }
-    OSFree(buffer, (uint32_t)size, general_malloc_tag());
 }
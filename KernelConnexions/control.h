@@ -17,44 +17,112 @@
 #include "debug.h"
 #include "connection.h"
 #include "dispatch.h"
+#include "metrics.h"
+#include "budget.h"
+#include "capture.h"
+#include "trace.h"
+#include "protocol.h"
+#include "ring.h"
+#include "ringmap.h"
+#include "timer.h"
 
-// client packets
-#define CONTROL_PACKET_CONNECT 0x1
-#define CONTROL_PACKET_CLOSE 0x3
-#define CONTROL_PACKET_SEND 0x5
+// datagram-mode controls carry exactly one frame per send()/recv()
+#define CONTROL_DATAGRAM_SUFFIX ".datagram"
+#define CONTROL_DATAGRAM_SEND_SIZE (128 * 1024)
+#define CONTROL_DATAGRAM_RECV_SIZE (256 * 1024)
 
-// control packets
-#define CONTROL_PACKET_CONNECTED 0x2
-#define CONTROL_PACKET_ERROR 0x4
-#define CONTROL_PACKET_DATA 0x6
-#define CONTROL_PACKET_HUNGUP 0x8
+// unloading waits this long for clients to close their control sockets
+#define KC_DRAIN_DEFAULT_TIMEOUT 5000 // milliseconds
+#define KC_DRAIN_MAX_TIMEOUT 60000
+
+// KCFrameStamps directions
+#define KC_STAMPS_OUTBOUND 1 // client send, control send upcall, dispatch, sock_sendmbuf
+#define KC_STAMPS_INBOUND 2 // sock_receivembuf, ctl_enqueuedata; sent just before the DATA
+
+#define KC_CONTROL_ARRIVALS 16 // appends remembered per control while stamping
+#define KC_CONTROL_RING_RETRY 10 // milliseconds before a ring frame the budget turned away is tried again
+
+/**
+ * Where a frame was along the way, in mach_absolute_time() units and host
+ * byte order. A stage the frame skipped is 0.
+ */
+typedef struct {
+    uint8_t direction;
+    uint8_t reserved[7];
+    uint64_t stamps[4];
+} KCFrameStamps;
+
+typedef struct {
+    uint32_t end; // buffer offset just past the appended bytes
+    uint64_t time;
+} KCControlArrival;
 
 typedef struct {
     uint32_t connection;
+    uint32_t flow; // the connection's, so both queue their dispatch work together
     char * buffer;
     uint32_t bufferSize;
-    lck_mtx_t * lock;
+    uint8_t frameHeader[KC_FRAME_HEADER_SIZE]; // of the frame the appended stream ends partway into
+    uint8_t frameHeaderSeen;
+    uint32_t frameBodyLeft;
+    KCLock * lock;
     uint32_t identifier;
+    kern_ctl_ref ref; // which registration the client connected through
     uint32_t unit;
+    KCBudgetAccount account; // shared with the connection
+    boolean_t hasRings;
+    KCRingMap sendMap;
+    KCRingMap receiveMap;
+    KCRing sendRing; // the client produces, the dispatch thread consumes
+    KCRing receiveRing; // the connection callbacks produce under the lock
+    KCTimer ringRetry; // armed while the budget keeps the send ring's next frame out
+    boolean_t timestamps;
+    KCControlArrival arrivals[KC_CONTROL_ARRIVALS];
+    uint32_t arrivalCount;
 } KCControl;
 
 typedef struct {
     char packetType;
     uint16_t length;
     char * data;
+    uint64_t arrived; // when the control send upcall finished the frame, if stamping
+    uint64_t dequeued; // when the dispatch thread picked it up
 } KCControlPacket;
 
 kern_return_t control_register();
 kern_ctl_ref control_get();
 kern_return_t control_unregister();
 
-uint32_t kc_control_create(uint32_t unit);
+/**
+ * Get ready to unload: refuse new controls, flush and close every connection
+ * and tell each client to go away. A kext can't disconnect a kern_control
+ * client itself, so this waits up to the drain timeout for them to close
+ * their sockets. On failure everything takes new work again.
+ */
+kern_return_t control_drain();
+uint32_t kc_control_get_drain_timeout();
+errno_t kc_control_set_drain_timeout(uint32_t milliseconds);
+
+uint32_t kc_control_create(kern_ctl_ref ref, uint32_t unit);
 errno_t kc_control_destroy(uint32_t identifier);
 
-errno_t kc_control_append_data(uint32_t identifier, mbuf_t buffer);
+// both give the dispatch flow to queue the packet's processing on
+errno_t kc_control_append_data(uint32_t identifier, mbuf_t buffer, uint32_t * flow);
 errno_t kc_control_read_packet(uint32_t identifier, KCControlPacket ** packet); // maybe ENODATA
+errno_t kc_control_read_datagram(uint32_t identifier, mbuf_t datagram, KCControlPacket ** packet, uint32_t * flow);
 uint32_t kc_control_get_connection(uint32_t identifier);
 uint32_t kc_control_get_unit(uint32_t identifier);
+kern_ctl_ref kc_control_get_route(uint32_t identifier, uint32_t * unit); // NULL if the control is gone
+
+/**
+ * Map a pair of rings into the calling task; from then on frames travel
+ * through them and the control socket only carries doorbells.
+ */
+errno_t kc_control_attach_rings(uint32_t identifier, uint32_t size);
+errno_t kc_control_get_rings(uint32_t identifier, KCRingAddresses * addresses);
+
+errno_t kc_control_set_timestamps(uint32_t identifier, boolean_t enabled);
+boolean_t kc_control_get_timestamps(uint32_t identifier);
 
 KCControlPacket * kc_control_packet_allocate(uint16_t length);
 void kc_control_packet_free(KCControlPacket * packet);
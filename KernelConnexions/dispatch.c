@@ -7,40 +7,71 @@
 //
 
 #include "dispatch.h"
+#include "timer.h"
+#include "metrics.h"
 
 static lck_grp_t * queueGroup = NULL;
-static lck_mtx_t * queueMutex = NULL;
-static KCDispatchCB * dispatches = NULL;
-static uint32_t dispatchesCount = 0;
-static uint32_t dispatchesAlloc = 0;
+static KCLock * queueMutex = NULL;
+static uint32_t dispatchesCount = 0; // queued across every flow
+static uint32_t dispatchesHighWater = 0;
 static uint32_t queueStatus = 0; // 1 = stopping, 2 = stopped
+static boolean_t queueIdle = FALSE; // the thread is asleep on dispatchesCount
+static uint32_t quantum = KC_DISPATCH_DEFAULT_QUANTUM;
+
+// open flows, sorted by identifier; closed ones leave the list right away
+static KCDispatchFlow ** flows = NULL;
+static uint32_t flowsCount = 0;
+static uint32_t flowsAlloc = 0;
+static uint32_t flowIdentifier = KC_DISPATCH_DEFAULT_FLOW + 1;
+
+// flows with jobs, waiting for their turn
+static KCDispatchFlow * roundHead = NULL;
+static KCDispatchFlow * roundTail = NULL;
+
+// only the dispatch thread touches these
+static KCDispatchFlow * turnFlow = NULL;
+static int64_t turnBudget = 0;
+static int64_t turnCharge = 0;
 
 static thread_t backgroundThread = NULL;
 static void dispatch_queue_main();
+static KCDispatchFlow * dispatch_flow_alloc(uint32_t identifier, uint32_t weight);
+static void dispatch_flow_free(KCDispatchFlow * flow);
+static int32_t dispatch_flow_index(uint32_t identifier);
+static void dispatch_round_append(KCDispatchFlow * flow);
 
 __private_extern__
 kern_return_t dispatch_initialize() {
-    dispatches = (KCDispatchCB *)OSMalloc(sizeof(KCDispatchCB) * 2, general_malloc_tag());
-    if (!dispatches) {
+    flows = (KCDispatchFlow **)OSMalloc(sizeof(KCDispatchFlow *) * 2, general_malloc_tag());
+    if (!flows) {
+        return KERN_FAILURE;
+    }
+    flowsAlloc = 2;
+    flows[0] = dispatch_flow_alloc(KC_DISPATCH_DEFAULT_FLOW, 1);
+    if (!flows[0]) {
+        OSFree(flows, (uint32_t)sizeof(KCDispatchFlow *) * flowsAlloc, general_malloc_tag());
         return KERN_FAILURE;
     }
-    dispatchesAlloc = 2;
+    flowsCount = 1;
     
     queueGroup = lck_grp_alloc_init("queue", LCK_GRP_ATTR_NULL);
     if (!queueGroup) {
-        OSFree(dispatches, (uint32_t)sizeof(KCDispatchCB) * dispatchesAlloc, general_malloc_tag());
+        dispatch_flow_free(flows[0]);
+        OSFree(flows, (uint32_t)sizeof(KCDispatchFlow *) * flowsAlloc, general_malloc_tag());
         return KERN_FAILURE;
     }
-    queueMutex = lck_mtx_alloc_init(queueGroup, LCK_ATTR_NULL);
+    queueMutex = kc_lock_alloc(queueGroup, KC_LOCK_GROUP_QUEUE);
     if (!queueMutex) {
-        OSFree(dispatches, (uint32_t)sizeof(KCDispatchCB) * dispatchesAlloc, general_malloc_tag());
+        dispatch_flow_free(flows[0]);
+        OSFree(flows, (uint32_t)sizeof(KCDispatchFlow *) * flowsAlloc, general_malloc_tag());
         lck_grp_free(queueGroup);
         return KERN_FAILURE;
     }
     
     if (kernel_thread_start(dispatch_queue_main, NULL, &backgroundThread) != KERN_SUCCESS) {
-        OSFree(dispatches, (uint32_t)sizeof(KCDispatchCB) * dispatchesAlloc, general_malloc_tag());
-        lck_mtx_free(queueMutex, queueGroup);
+        dispatch_flow_free(flows[0]);
+        OSFree(flows, (uint32_t)sizeof(KCDispatchFlow *) * flowsAlloc, general_malloc_tag());
+        kc_lock_free(queueMutex, queueGroup);
         lck_grp_free(queueGroup);
         return KERN_FAILURE;
     }
@@ -50,68 +81,284 @@ kern_return_t dispatch_initialize() {
 
 __private_extern__
 void dispatch_finalize() {
-    // wait for the background thread to die
-    lck_mtx_lock(queueMutex);
+    // wake the background thread and wait for it to finish the queue
+    kc_lock(queueMutex);
     queueStatus = 1;
-    lck_mtx_unlock(queueMutex);
-    while (true) {
-        lck_mtx_lock(queueMutex);
-        if (queueStatus == 2) {
-            lck_mtx_unlock(queueMutex);
-            break;
-        }
-        lck_mtx_unlock(queueMutex);
-        IOSleep(10);
+    wakeup_one(&dispatchesCount);
+    while (queueStatus != 2) {
+        kc_lock_sleep_deadline(queueMutex, &queueStatus, 0);
+    }
+    kc_unlock(queueMutex);
+    // every job has run, so closed flows are already gone
+    for (uint32_t i = 0; i < flowsCount; i++) {
+        dispatch_flow_free(flows[i]);
     }
-    OSFree(dispatches, (uint32_t)sizeof(KCDispatchCB) * dispatchesAlloc, general_malloc_tag());
-    lck_mtx_free(queueMutex, queueGroup);
+    OSFree(flows, (uint32_t)sizeof(KCDispatchFlow *) * flowsAlloc, general_malloc_tag());
+    kc_lock_free(queueMutex, queueGroup);
     lck_grp_free(queueGroup);
     thread_deallocate(backgroundThread);
 }
 
+#pragma mark - Flows -
+
+__private_extern__
+uint32_t dispatch_flow_create(uint32_t weight) {
+    if (!weight || weight > KC_DISPATCH_MAX_WEIGHT) return 0;
+    kc_lock(queueMutex);
+    KCDispatchFlow * flow = dispatch_flow_alloc(flowIdentifier, weight);
+    if (!flow) {
+        kc_unlock(queueMutex);
+        return 0;
+    }
+    if (flowsCount == flowsAlloc) {
+        KCDispatchFlow ** newFlows = (KCDispatchFlow **)OSMalloc((uint32_t)sizeof(KCDispatchFlow *) * flowsAlloc * 2,
+                                                                 general_malloc_tag());
+        if (!newFlows) {
+            kc_unlock(queueMutex);
+            dispatch_flow_free(flow);
+            return 0;
+        }
+        memcpy(newFlows, flows, sizeof(KCDispatchFlow *) * flowsCount);
+        OSFree(flows, (uint32_t)sizeof(KCDispatchFlow *) * flowsAlloc, general_malloc_tag());
+        flows = newFlows;
+        flowsAlloc *= 2;
+    }
+    // identifiers only go up, so appending keeps the list sorted
+    flows[flowsCount++] = flow;
+    flowIdentifier++;
+    kc_unlock(queueMutex);
+    return flow->identifier;
+}
+
+__private_extern__
+void dispatch_flow_destroy(uint32_t identifier) {
+    if (identifier == KC_DISPATCH_DEFAULT_FLOW) return;
+    kc_lock(queueMutex);
+    int32_t index = dispatch_flow_index(identifier);
+    if (index < 0) {
+        kc_unlock(queueMutex);
+        return;
+    }
+    KCDispatchFlow * flow = flows[index];
+    memmove(&flows[index], &flows[index + 1], sizeof(KCDispatchFlow *) * (flowsCount - index - 1));
+    flowsCount--;
+    // queued jobs own memory, so they still run, just under no name
+    flow->closed = TRUE;
+    boolean_t idle = !flow->scheduled;
+    kc_unlock(queueMutex);
+    if (idle) dispatch_flow_free(flow);
+}
+
+__private_extern__
+errno_t dispatch_flow_set_weight(uint32_t identifier, uint32_t weight) {
+    if (!weight || weight > KC_DISPATCH_MAX_WEIGHT) return EINVAL;
+    kc_lock(queueMutex);
+    int32_t index = dispatch_flow_index(identifier);
+    if (index >= 0) flows[index]->weight = weight;
+    kc_unlock(queueMutex);
+    return index >= 0 ? 0 : ENOENT;
+}
+
+__private_extern__
+uint32_t dispatch_flow_get_weight(uint32_t identifier) {
+    kc_lock(queueMutex);
+    int32_t index = dispatch_flow_index(identifier);
+    uint32_t weight = index >= 0 ? flows[index]->weight : 0;
+    kc_unlock(queueMutex);
+    return weight;
+}
+
+#pragma mark - Jobs -
+
 __private_extern__
 errno_t dispatch_push(void (*call)(void * data), void * data) {
+    return dispatch_push_flow(KC_DISPATCH_DEFAULT_FLOW, call, data);
+}
+
+__private_extern__
+errno_t dispatch_push_flow(uint32_t identifier, void (*call)(void * data), void * data) {
     KCDispatchCB callback;
     callback.call = call;
     callback.data = data;
-    lck_mtx_lock(queueMutex);
-    if (dispatchesCount == dispatchesAlloc) {
-        KCDispatchCB * newDispatches = (KCDispatchCB *)OSMalloc((uint32_t)sizeof(KCDispatchCB) * (dispatchesAlloc + 2), general_malloc_tag());
-        if (!newDispatches) return ENOMEM;
-        for (uint32_t i = 0; i < dispatchesCount; i++) {
-            newDispatches[i] = dispatches[i];
+    callback.enqueued = mach_absolute_time();
+    kc_lock(queueMutex);
+    // a flow destroyed under a late caller hands its work to the default one
+    int32_t index = dispatch_flow_index(identifier);
+    KCDispatchFlow * flow = flows[index >= 0 ? index : 0];
+    if (flow->jobsCount == flow->jobsAlloc) {
+        uint32_t newAlloc = flow->jobsAlloc * 2;
+        KCDispatchCB * newJobs = (KCDispatchCB *)OSMalloc((uint32_t)sizeof(KCDispatchCB) * newAlloc, general_malloc_tag());
+        if (!newJobs) {
+            kc_unlock(queueMutex);
+            KC_TRACE(KC_TRACE_DISPATCH_PUSH, data, identifier, 0, ENOMEM);
+            return ENOMEM;
+        }
+        for (uint32_t i = 0; i < flow->jobsCount; i++) {
+            newJobs[i] = flow->jobs[(flow->jobsHead + i) % flow->jobsAlloc];
         }
-        OSFree(dispatches, (uint32_t)sizeof(KCDispatchCB) * dispatchesAlloc, general_malloc_tag());
-        dispatches = newDispatches;
-        dispatchesAlloc += 2;
+        OSFree(flow->jobs, (uint32_t)sizeof(KCDispatchCB) * flow->jobsAlloc, general_malloc_tag());
+        flow->jobs = newJobs;
+        flow->jobsAlloc = newAlloc;
+        flow->jobsHead = 0;
+    }
+    flow->jobs[(flow->jobsHead + flow->jobsCount) % flow->jobsAlloc] = callback;
+    flow->jobsCount++;
+    KC_TRACE(KC_TRACE_DISPATCH_PUSH, data, flow->identifier, flow->jobsCount, 0);
+    if (!flow->scheduled) {
+        flow->scheduled = TRUE;
+        dispatch_round_append(flow);
+    }
+    if (++dispatchesCount > dispatchesHighWater) {
+        dispatchesHighWater = dispatchesCount;
     }
-    dispatches[dispatchesCount++] = callback;
-    lck_mtx_unlock(queueMutex);
+    if (queueIdle) {
+        queueIdle = FALSE;
+        wakeup_one(&dispatchesCount);
+    }
+    kc_unlock(queueMutex);
+    return 0;
+}
+
+__private_extern__
+void dispatch_charge(size_t bytes) {
+    if (current_thread() != backgroundThread) return;
+    turnCharge += bytes;
+}
+
+__private_extern__
+int64_t dispatch_turn_remaining() {
+    if (current_thread() != backgroundThread) return INT64_MAX;
+    return turnBudget - turnCharge;
+}
+
+__private_extern__
+uint32_t dispatch_get_quantum() {
+    return quantum;
+}
+
+__private_extern__
+errno_t dispatch_set_quantum(uint32_t newQuantum) {
+    if (newQuantum < KC_DISPATCH_MIN_QUANTUM || newQuantum > KC_DISPATCH_MAX_QUANTUM) return EINVAL;
+    quantum = newQuantum;
     return 0;
 }
 
+__private_extern__
+void dispatch_get_stats(uint32_t * depth, uint32_t * highWater) {
+    kc_lock(queueMutex);
+    *depth = dispatchesCount;
+    *highWater = dispatchesHighWater;
+    kc_unlock(queueMutex);
+}
+
 #pragma mark - Private -
 
 static void dispatch_queue_main(void * nothing, wait_result_t waitResult) {
     while (true) {
-        lck_mtx_lock(queueMutex);
-        if (queueStatus != 0) {
+        // the idle sleep below doubles as the timer wheel's tick
+        timer_advance();
+    
+        kc_lock(queueMutex);
+        // jobs that are already queued own memory, so run them before leaving
+        if (queueStatus != 0 && dispatchesCount == 0) {
             queueStatus = 2;
-            lck_mtx_unlock(queueMutex);
+            wakeup(&queueStatus);
+            kc_unlock(queueMutex);
             return;
         }
-        
+    
         if (dispatchesCount > 0) {
-            KCDispatchCB callMe = dispatches[0];
-            for (uint32_t i = 0; i + 1 < dispatchesCount; i++) {
-                dispatches[i] = dispatches[i + 1];
+            KCDispatchFlow * flow = turnFlow;
+            if (!flow) {
+                flow = roundHead;
+                roundHead = flow->next;
+                if (!roundHead) roundTail = NULL;
+                flow->next = NULL;
+                flow->deficit += (int64_t)quantum * flow->weight;
+                if (flow->deficit <= 0) {
+                    // still paying for a turn that ran over
+                    dispatch_round_append(flow);
+                    kc_unlock(queueMutex);
+                    continue;
+                }
+                turnFlow = flow;
             }
+            KCDispatchCB callMe = flow->jobs[flow->jobsHead];
+            flow->jobsHead = (flow->jobsHead + 1) % flow->jobsAlloc;
+            flow->jobsCount--;
             dispatchesCount--;
-            lck_mtx_unlock(queueMutex);
+            turnBudget = flow->deficit;
+            turnCharge = 0;
+            kc_unlock(queueMutex);
+    
+            uint64_t waited;
+            absolutetime_to_nanoseconds(mach_absolute_time() - callMe.enqueued, &waited);
+            kc_metrics_record_latency(waited);
+            KC_TRACE(KC_TRACE_DISPATCH_RUN | DBG_FUNC_START, callMe.data, flow->identifier, waited, 0);
             callMe.call(callMe.data);
+            KC_TRACE(KC_TRACE_DISPATCH_RUN | DBG_FUNC_END, callMe.data, flow->identifier, 0, 0);
+    
+            kc_lock(queueMutex);
+            flow->deficit -= turnCharge > KC_DISPATCH_JOB_COST ? turnCharge : KC_DISPATCH_JOB_COST;
+            boolean_t release = FALSE;
+            if (!flow->jobsCount) {
+                // an idle flow can't save up for later, but it keeps its debts
+                if (flow->deficit > 0) flow->deficit = 0;
+                flow->scheduled = FALSE;
+                turnFlow = NULL;
+                release = flow->closed;
+            } else if (flow->deficit <= 0) {
+                turnFlow = NULL;
+                dispatch_round_append(flow);
+            }
+            kc_unlock(queueMutex);
+            if (release) dispatch_flow_free(flow);
         } else {
-            lck_mtx_unlock(queueMutex);
-            IOSleep(10);
+            // dispatch_push and dispatch_finalize wake us early
+            uint64_t deadline;
+            clock_interval_to_deadline(KC_DISPATCH_IDLE_TICK, kMillisecondScale, &deadline);
+            queueIdle = TRUE;
+            kc_lock_sleep_deadline(queueMutex, &dispatchesCount, deadline);
+            queueIdle = FALSE;
+            kc_unlock(queueMutex);
         }
     }
 }
+
+static KCDispatchFlow * dispatch_flow_alloc(uint32_t identifier, uint32_t weight) {
+    KCDispatchFlow * flow = (KCDispatchFlow *)OSMalloc(sizeof(KCDispatchFlow), general_malloc_tag());
+    if (!flow) return NULL;
+    bzero(flow, sizeof(KCDispatchFlow));
+    flow->jobs = (KCDispatchCB *)OSMalloc(sizeof(KCDispatchCB) * 2, general_malloc_tag());
+    if (!flow->jobs) {
+        OSFree(flow, sizeof(KCDispatchFlow), general_malloc_tag());
+        return NULL;
+    }
+    flow->jobsAlloc = 2;
+    flow->identifier = identifier;
+    flow->weight = weight;
+    return flow;
+}
+
+static void dispatch_flow_free(KCDispatchFlow * flow) {
+    OSFree(flow->jobs, (uint32_t)sizeof(KCDispatchCB) * flow->jobsAlloc, general_malloc_tag());
+    OSFree(flow, sizeof(KCDispatchFlow), general_malloc_tag());
+}
+
+static int32_t dispatch_flow_index(uint32_t identifier) {
+    uint32_t low = 0, high = flowsCount;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (flows[middle]->identifier < identifier) low = middle + 1;
+        else high = middle;
+    }
+    if (low < flowsCount && flows[low]->identifier == identifier) return (int32_t)low;
+    return -1;
+}
+
+static void dispatch_round_append(KCDispatchFlow * flow) {
+    flow->next = NULL;
+    if (roundTail) roundTail->next = flow;
+    else roundHead = flow;
+    roundTail = flow;
+}
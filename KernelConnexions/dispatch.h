@@ -11,17 +11,69 @@
 
 #include <mach/mach_types.h>
 #include <IOKit/IOLib.h>
+#include <sys/systm.h> // gives wakeup()
+#include <kern/thread.h> // gives current_thread()
 #include "general.h"
 #include "debug.h"
+#include "lockprof.h"
+#include "trace.h"
+
+#define KC_DISPATCH_IDLE_TICK 10 // milliseconds between timer wheel ticks when there is nothing to do
+
+// flows take turns, each doing up to quantum * weight bytes of work per turn
+#define KC_DISPATCH_DEFAULT_QUANTUM 16384
+#define KC_DISPATCH_MIN_QUANTUM 1024
+#define KC_DISPATCH_MAX_QUANTUM (1024 * 1024)
+#define KC_DISPATCH_JOB_COST 256 // what a job that moves no data is charged
+#define KC_DISPATCH_MAX_WEIGHT 64
+#define KC_DISPATCH_DEFAULT_FLOW 0 // work that belongs to no connection
 
 typedef struct {
     void (*call)(void * data);
     void * data;
+    uint64_t enqueued; // mach_absolute_time() at push
 } KCDispatchCB;
 
+typedef struct KCDispatchFlow {
+    uint32_t identifier;
+    uint32_t weight;
+    int64_t deficit; // bytes left in its turn; negative after an overrun
+    KCDispatchCB * jobs; // a ring of jobsAlloc entries
+    uint32_t jobsHead;
+    uint32_t jobsCount;
+    uint32_t jobsAlloc;
+    boolean_t scheduled; // waiting for a turn, or having one
+    boolean_t closed; // its owner is gone; freed once its jobs have run
+    struct KCDispatchFlow * next;
+} KCDispatchFlow;
+
 kern_return_t dispatch_initialize();
 void dispatch_finalize();
 
-errno_t dispatch_push(void (*call)(void * data), void * data);
+/**
+ * Jobs are queued per flow, and the dispatch thread serves flows by deficit
+ * round robin, so a connection with a lot to do can't hold up the others
+ * for longer than its turn. Within a flow, jobs run in order.
+ */
+uint32_t dispatch_flow_create(uint32_t weight); // 0 on failure
+void dispatch_flow_destroy(uint32_t flow);
+errno_t dispatch_flow_set_weight(uint32_t flow, uint32_t weight);
+uint32_t dispatch_flow_get_weight(uint32_t flow);
+
+errno_t dispatch_push(void (*call)(void * data), void * data); // KC_DISPATCH_DEFAULT_FLOW
+errno_t dispatch_push_flow(uint32_t flow, void (*call)(void * data), void * data);
+
+/**
+ * Called by jobs to charge the bytes they moved to their flow's turn.
+ * dispatch_turn_remaining() is what's left of it; jobs that can keep going
+ * should queue themselves again once it reaches 0. Off the dispatch thread
+ * nothing is charged and the turn never ends.
+ */
+void dispatch_charge(size_t bytes);
+int64_t dispatch_turn_remaining();
+
+uint32_t dispatch_get_quantum();
+errno_t dispatch_set_quantum(uint32_t quantum);
+void dispatch_get_stats(uint32_t * depth, uint32_t * highWater);
 
 #endif
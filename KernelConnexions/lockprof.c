@@ -0,0 +1,145 @@
+//
+//  lockprof.c
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/14/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "lockprof.h"
+
+#ifdef KC_LOCK_PROFILING
+
+static const char * groupNames[KC_LOCK_GROUP_COUNT] = {
+    "connections", "connection", "controls", "control", "queue"
+};
+
+static KCLockSite * volatile sites = NULL;
+
+static void kc_lockprof_register(KCLockSite * site);
+static void kc_lockprof_max(volatile SInt64 * max, int64_t value);
+static int64_t kc_lockprof_usec(int64_t absolute);
+
+#pragma mark - Locks -
+
+__private_extern__
+KCLock * kc_lock_alloc(lck_grp_t * grp, uint32_t group) {
+    KCLock * lock = (KCLock *)OSMalloc(sizeof(KCLock), general_malloc_tag());
+    if (!lock) return NULL;
+    lock->mutex = lck_mtx_alloc_init(grp, LCK_ATTR_NULL);
+    if (!lock->mutex) {
+        OSFree(lock, sizeof(KCLock), general_malloc_tag());
+        return NULL;
+    }
+    lock->group = group;
+    lock->holder = NULL;
+    lock->acquired = 0;
+    return lock;
+}
+
+__private_extern__
+void kc_lock_free(KCLock * lock, lck_grp_t * grp) {
+    lck_mtx_free(lock->mutex, grp);
+    OSFree(lock, sizeof(KCLock), general_malloc_tag());
+}
+
+__private_extern__
+void kc_lock_at(KCLock * lock, KCLockSite * site) {
+    if (!site->registered) kc_lockprof_register(site);
+    KCLockStats * stats = &site->stats[lock->group];
+    uint64_t acquired;
+    if (lck_mtx_try_lock(lock->mutex)) {
+        acquired = mach_absolute_time();
+    } else {
+        uint64_t start = mach_absolute_time();
+        lck_mtx_lock(lock->mutex);
+        acquired = mach_absolute_time();
+        OSIncrementAtomic64(&stats->contended);
+        OSAddAtomic64(acquired - start, &stats->waitTime);
+        kc_lockprof_max(&stats->waitMax, acquired - start);
+    }
+    OSIncrementAtomic64(&stats->acquisitions);
+    lock->holder = site;
+    lock->acquired = acquired;
+}
+
+__private_extern__
+void kc_unlock(KCLock * lock) {
+    KCLockStats * stats = &lock->holder->stats[lock->group];
+    int64_t held = mach_absolute_time() - lock->acquired;
+    lck_mtx_unlock(lock->mutex);
+    OSAddAtomic64(held, &stats->holdTime);
+    kc_lockprof_max(&stats->holdMax, held);
+}
+
+__private_extern__
+wait_result_t kc_lock_sleep_deadline(KCLock * lock, void * event, uint64_t deadline) {
+    KCLockSite * site = lock->holder;
+    KCLockStats * stats = &site->stats[lock->group];
+    int64_t held = mach_absolute_time() - lock->acquired;
+    OSAddAtomic64(held, &stats->holdTime);
+    kc_lockprof_max(&stats->holdMax, held);
+    wait_result_t result = lck_mtx_sleep_deadline(lock->mutex, LCK_SLEEP_DEFAULT, (event_t)event, THREAD_UNINT, deadline);
+    // whoever took the lock meanwhile overwrote these
+    lock->holder = site;
+    lock->acquired = mach_absolute_time();
+    return result;
+}
+
+#pragma mark - Reports -
+
+__private_extern__
+int kc_lockprof_copyout(struct sysctl_req * req) {
+    char line[256];
+    int length = snprintf(line, sizeof(line), "group site acquisitions contended wait_us wait_max_us hold_us hold_max_us\n");
+    int error = SYSCTL_OUT(req, line, length);
+    for (KCLockSite * site = sites; site && !error; site = site->next) {
+        for (uint32_t i = 0; i < KC_LOCK_GROUP_COUNT && !error; i++) {
+            KCLockStats * stats = &site->stats[i];
+            if (!stats->acquisitions) continue;
+            length = snprintf(line, sizeof(line), "%s %s:%u %lld %lld %lld %lld %lld %lld\n",
+                              groupNames[i], site->function, site->line,
+                              (long long)stats->acquisitions, (long long)stats->contended,
+                              (long long)kc_lockprof_usec(stats->waitTime), (long long)kc_lockprof_usec(stats->waitMax),
+                              (long long)kc_lockprof_usec(stats->holdTime), (long long)kc_lockprof_usec(stats->holdMax));
+            error = SYSCTL_OUT(req, line, length);
+        }
+    }
+    if (!error) error = SYSCTL_OUT(req, "", 1);
+    return error;
+}
+
+__private_extern__
+void kc_lockprof_reset() {
+    // racing acquisitions may survive the reset; that's fine for a profile
+    for (KCLockSite * site = sites; site; site = site->next) {
+        bzero(site->stats, sizeof(site->stats));
+    }
+}
+
+#pragma mark - Private -
+
+static void kc_lockprof_register(KCLockSite * site) {
+    if (!OSCompareAndSwap(0, 1, &site->registered)) return;
+    KCLockSite * head;
+    do {
+        head = sites;
+        site->next = head;
+    } while (!OSCompareAndSwapPtr(head, site, (void * volatile *)&sites));
+}
+
+static void kc_lockprof_max(volatile SInt64 * max, int64_t value) {
+    int64_t current;
+    do {
+        current = *max;
+        if (value <= current) return;
+    } while (!OSCompareAndSwap64((UInt64)current, (UInt64)value, (volatile UInt64 *)max));
+}
+
+static int64_t kc_lockprof_usec(int64_t absolute) {
+    uint64_t nanoseconds;
+    absolutetime_to_nanoseconds(absolute, &nanoseconds);
+    return (int64_t)(nanoseconds / NSEC_PER_USEC);
+}
+
+#endif
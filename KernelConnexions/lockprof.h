@@ -0,0 +1,103 @@
+//
+//  lockprof.h
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/14/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef KernelConnexions_lockprof_h
+#define KernelConnexions_lockprof_h
+
+#include <mach/mach_types.h>
+#include <kern/locks.h>
+#include <kern/clock.h>
+#include <sys/sysctl.h>
+#include <libkern/OSAtomic.h>
+#include "general.h"
+#include "debug.h"
+
+/**
+ * The locks on the connection, control and dispatch paths go through
+ * kc_lock()/kc_unlock(). Normally those are plain lck_mtx calls. Build with
+ * KC_LOCK_PROFILING defined and every acquisition is timed instead, with
+ * acquisitions, time spent waiting and time spent holding the lock added up
+ * per lock group and per call site. The results show up as
+ * net.kernelconnexions.lock_profile.
+ */
+
+#define KC_LOCK_GROUP_CONNECTIONS 0 // connection.c's listMutex
+#define KC_LOCK_GROUP_CONNECTION 1 // each KCConnection
+#define KC_LOCK_GROUP_CONTROLS 2 // control.c's listMutex
+#define KC_LOCK_GROUP_CONTROL 3 // each KCControl
+#define KC_LOCK_GROUP_QUEUE 4 // dispatch.c's queueMutex
+#define KC_LOCK_GROUP_COUNT 5
+
+typedef struct {
+    volatile SInt64 acquisitions;
+    volatile SInt64 contended; // the lock was taken when we got there
+    volatile SInt64 waitTime; // absolute time units
+    volatile SInt64 waitMax;
+    volatile SInt64 holdTime; // charged to the site that took the lock
+    volatile SInt64 holdMax;
+} KCLockStats;
+
+typedef struct KCLockSite {
+    const char * function;
+    uint32_t line;
+    volatile UInt32 registered;
+    struct KCLockSite * next;
+    KCLockStats stats[KC_LOCK_GROUP_COUNT];
+} KCLockSite;
+
+#ifdef KC_LOCK_PROFILING
+
+typedef struct {
+    lck_mtx_t * mutex;
+    uint32_t group;
+    KCLockSite * holder; // only touched with the mutex held
+    uint64_t acquired;
+} KCLock;
+
+// a site record private to wherever the macro is expanded
+#define KC_LOCK_SITE ({ static KCLockSite kcLockSite = {__FUNCTION__, __LINE__}; &kcLockSite; })
+
+KCLock * kc_lock_alloc(lck_grp_t * grp, uint32_t group);
+void kc_lock_free(KCLock * lock, lck_grp_t * grp);
+void kc_lock_at(KCLock * lock, KCLockSite * site);
+void kc_unlock(KCLock * lock);
+wait_result_t kc_lock_sleep_deadline(KCLock * lock, void * event, uint64_t deadline);
+
+#else
+
+typedef lck_mtx_t KCLock;
+
+#define KC_LOCK_SITE NULL
+#define kc_lock_alloc(grp, group) lck_mtx_alloc_init((grp), LCK_ATTR_NULL)
+#define kc_lock_free(lock, grp) lck_mtx_free((lock), (grp))
+#define kc_lock_at(lock, site) lck_mtx_lock(lock)
+#define kc_unlock(lock) lck_mtx_unlock(lock)
+#define kc_lock_sleep_deadline(lock, event, deadline) \
+    lck_mtx_sleep_deadline((lock), LCK_SLEEP_DEFAULT, (event_t)(event), THREAD_UNINT, (deadline))
+
+#endif
+
+#define kc_lock(lock) kc_lock_at((lock), KC_LOCK_SITE)
+
+/**
+ * kc_lock_sleep_deadline(lock, event, deadline) drops a held lock, sleeps
+ * until somebody calls wakeup() on event or the absolute deadline passes (0
+ * waits forever), and takes the lock back before returning. Time asleep is
+ * not counted as holding the lock.
+ */
+
+#ifdef KC_LOCK_PROFILING
+/**
+ * A header line, then one line per call site and lock group that has been
+ * used, with times in microseconds.
+ */
+int kc_lockprof_copyout(struct sysctl_req * req);
+void kc_lockprof_reset();
+#endif
+
+#endif
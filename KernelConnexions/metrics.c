@@ -0,0 +1,354 @@
+//
+//  metrics.c
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/10/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "metrics.h"
+#include "dispatch.h"
+#include "pool.h"
+#include "budget.h"
+#include "connection.h"
+#include "control.h"
+#include "capture.h"
+#include "lockprof.h"
+
+#define KC_METRICS_DEPTH 0
+#define KC_METRICS_HIGH_WATER 1
+
+#define KC_METRICS_BUDGET_USED 0
+#define KC_METRICS_BUDGET_REFUSALS 1
+#define KC_METRICS_BUDGET_CONNECT_REFUSALS 2
+#define KC_METRICS_BUDGET_TRIMS 3
+
+#define KC_METRICS_COALESCE_BYTES 0
+#define KC_METRICS_COALESCE_DELAY 1
+
+#define KC_METRICS_CAPTURE_COUNT 0
+#define KC_METRICS_CAPTURE_DROPPED 1
+
+typedef struct {
+    volatile SInt64 counters[KC_METRIC_COUNT];
+} __attribute__((aligned(64))) KCMetricsSlot;
+
+static KCMetricsSlot slots[KC_METRICS_CPU_COUNT];
+
+static int kc_metrics_sysctl_counter(SYSCTL_HANDLER_ARGS);
+static int kc_metrics_sysctl_dispatch(SYSCTL_HANDLER_ARGS);
+static int kc_metrics_sysctl_dispatch_quantum(SYSCTL_HANDLER_ARGS);
+static int kc_metrics_sysctl_latency(SYSCTL_HANDLER_ARGS);
+static int kc_metrics_sysctl_pool(SYSCTL_HANDLER_ARGS);
+static int kc_metrics_sysctl_pool_bytes(SYSCTL_HANDLER_ARGS);
+static int kc_metrics_sysctl_budget(SYSCTL_HANDLER_ARGS);
+static int kc_metrics_sysctl_budget_limit(SYSCTL_HANDLER_ARGS);
+static int kc_metrics_sysctl_coalesce(SYSCTL_HANDLER_ARGS);
+static int kc_metrics_sysctl_drain_timeout(SYSCTL_HANDLER_ARGS);
+static int kc_metrics_sysctl_capture_records(SYSCTL_HANDLER_ARGS);
+static int kc_metrics_sysctl_capture_stats(SYSCTL_HANDLER_ARGS);
+static int kc_metrics_sysctl_capture(SYSCTL_HANDLER_ARGS);
+#ifdef KC_LOCK_PROFILING
+static int kc_metrics_sysctl_lock_profile(SYSCTL_HANDLER_ARGS);
+static int kc_metrics_sysctl_lock_profile_reset(SYSCTL_HANDLER_ARGS);
+#endif
+
+#pragma mark - Tree -
+
+SYSCTL_NODE(_net, OID_AUTO, kernelconnexions, CTLFLAG_RW | CTLFLAG_LOCKED, 0, "KernelConnexions");
+
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, controls, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_CONTROLS, kc_metrics_sysctl_counter, "Q", "open control sockets");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, connections, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_CONNECTIONS, kc_metrics_sysctl_counter, "Q", "live connections");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, write_buffer_bytes, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_WRITE_BUFFER_BYTES, kc_metrics_sysctl_counter, "Q", "bytes waiting to be sent");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, client_bytes_in, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_CLIENT_BYTES_IN, kc_metrics_sysctl_counter, "Q", "bytes written by clients");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, client_frames_in, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_CLIENT_FRAMES_IN, kc_metrics_sysctl_counter, "Q", "frames processed from clients");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, client_bytes_out, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_CLIENT_BYTES_OUT, kc_metrics_sysctl_counter, "Q", "bytes enqueued to clients");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, client_frames_out, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_CLIENT_FRAMES_OUT, kc_metrics_sysctl_counter, "Q", "frames enqueued to clients");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, enqueue_failures, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_ENQUEUE_FAILURES, kc_metrics_sysctl_counter, "Q", "failed ctl_enqueuedata calls");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, net_bytes_in, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_NET_BYTES_IN, kc_metrics_sysctl_counter, "Q", "bytes received from the network");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, net_bytes_out, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_NET_BYTES_OUT, kc_metrics_sysctl_counter, "Q", "bytes sent to the network");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, rx_coalesced_reads, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_RX_COALESCED_READS, kc_metrics_sysctl_counter, "Q", "socket reads merged into a held frame");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, rx_flush_size, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_RX_FLUSH_SIZE, kc_metrics_sysctl_counter, "Q", "held frames sent at the size threshold");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, rx_flush_deadline, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_RX_FLUSH_DEADLINE, kc_metrics_sysctl_counter, "Q", "held frames sent at the deadline");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, rx_flush_pass, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_RX_FLUSH_PASS, kc_metrics_sysctl_counter, "Q", "held frames sent when the socket ran dry");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, rx_coalesce_bytes, CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+            0, KC_METRICS_COALESCE_BYTES, kc_metrics_sysctl_coalesce, "IU", "receive coalescing threshold for new connections");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, rx_coalesce_usec, CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+            0, KC_METRICS_COALESCE_DELAY, kc_metrics_sysctl_coalesce, "IU", "receive coalescing deadline for new connections");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, drain_timeout_ms, CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+            0, 0, kc_metrics_sysctl_drain_timeout, "IU", "how long unloading waits for writes to flush and clients to leave");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, capture_records, CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+            0, 0, kc_metrics_sysctl_capture_records, "IU", "frames to capture; writing starts over, 0 stops");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, capture_count, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRICS_CAPTURE_COUNT, kc_metrics_sysctl_capture_stats, "Q", "frames captured so far");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, capture_dropped, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRICS_CAPTURE_DROPPED, kc_metrics_sysctl_capture_stats, "Q", "frames missed after the capture filled up");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, capture, CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, 0, kc_metrics_sysctl_capture, "S,KCCaptureRecord", "captured frame headers");
+#ifdef KC_LOCK_PROFILING
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, lock_profile, CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, 0, kc_metrics_sysctl_lock_profile, "A", "lock acquisitions, waits and holds per group and call site");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, lock_profile_reset, CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+            0, 0, kc_metrics_sysctl_lock_profile_reset, "I", "write 1 to zero the lock profile");
+#endif
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, dispatch_depth, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRICS_DEPTH, kc_metrics_sysctl_dispatch, "Q", "callbacks waiting in the dispatch queue");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, dispatch_high_water, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRICS_HIGH_WATER, kc_metrics_sysctl_dispatch, "Q", "deepest the dispatch queue has been");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, dispatch_latency, CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, 0, kc_metrics_sysctl_latency, "A", "queue-to-run latency histogram, microseconds");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, dispatch_quantum, CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+            0, 0, kc_metrics_sysctl_dispatch_quantum, "IU", "bytes of work a connection gets per turn, times its weight");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, dispatch_yields, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRIC_DISPATCH_YIELDS, kc_metrics_sysctl_counter, "Q", "socket passes cut short at the end of a turn");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, pool_allocations, CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, 0, kc_metrics_sysctl_pool, "A", "allocations per size class");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, pool_bytes_held, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, 0, kc_metrics_sysctl_pool_bytes, "Q", "bytes taken from OSMalloc by the pools");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, budget_used, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRICS_BUDGET_USED, kc_metrics_sysctl_budget, "Q", "bytes charged against the memory budget");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, budget_refusals, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRICS_BUDGET_REFUSALS, kc_metrics_sysctl_budget, "Q", "writes refused with ENOBUFS");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, budget_connect_refusals, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRICS_BUDGET_CONNECT_REFUSALS, kc_metrics_sysctl_budget, "Q", "controls refused with ENOBUFS");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, budget_trims, CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+            0, KC_METRICS_BUDGET_TRIMS, kc_metrics_sysctl_budget, "Q", "pool trims caused by memory pressure");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, budget_limit, CTLTYPE_QUAD | CTLFLAG_RW | CTLFLAG_LOCKED,
+            0, KC_BUDGET_LIMIT_GLOBAL, kc_metrics_sysctl_budget_limit, "Q", "bytes all clients may hold");
+SYSCTL_PROC(_net_kernelconnexions, OID_AUTO, budget_control_limit, CTLTYPE_QUAD | CTLFLAG_RW | CTLFLAG_LOCKED,
+            0, KC_BUDGET_LIMIT_CONTROL, kc_metrics_sysctl_budget_limit, "Q", "bytes one client may hold");
+
+static struct sysctl_oid * metricOids[] = {
+    &sysctl__net_kernelconnexions,
+    &sysctl__net_kernelconnexions_controls,
+    &sysctl__net_kernelconnexions_connections,
+    &sysctl__net_kernelconnexions_write_buffer_bytes,
+    &sysctl__net_kernelconnexions_client_bytes_in,
+    &sysctl__net_kernelconnexions_client_frames_in,
+    &sysctl__net_kernelconnexions_client_bytes_out,
+    &sysctl__net_kernelconnexions_client_frames_out,
+    &sysctl__net_kernelconnexions_enqueue_failures,
+    &sysctl__net_kernelconnexions_net_bytes_in,
+    &sysctl__net_kernelconnexions_net_bytes_out,
+    &sysctl__net_kernelconnexions_rx_coalesced_reads,
+    &sysctl__net_kernelconnexions_rx_flush_size,
+    &sysctl__net_kernelconnexions_rx_flush_deadline,
+    &sysctl__net_kernelconnexions_rx_flush_pass,
+    &sysctl__net_kernelconnexions_rx_coalesce_bytes,
+    &sysctl__net_kernelconnexions_rx_coalesce_usec,
+    &sysctl__net_kernelconnexions_drain_timeout_ms,
+    &sysctl__net_kernelconnexions_capture_records,
+    &sysctl__net_kernelconnexions_capture_count,
+    &sysctl__net_kernelconnexions_capture_dropped,
+    &sysctl__net_kernelconnexions_capture,
+#ifdef KC_LOCK_PROFILING
+    &sysctl__net_kernelconnexions_lock_profile,
+    &sysctl__net_kernelconnexions_lock_profile_reset,
+#endif
+    &sysctl__net_kernelconnexions_dispatch_depth,
+    &sysctl__net_kernelconnexions_dispatch_high_water,
+    &sysctl__net_kernelconnexions_dispatch_latency,
+    &sysctl__net_kernelconnexions_dispatch_quantum,
+    &sysctl__net_kernelconnexions_dispatch_yields,
+    &sysctl__net_kernelconnexions_pool_allocations,
+    &sysctl__net_kernelconnexions_pool_bytes_held,
+    &sysctl__net_kernelconnexions_budget_used,
+    &sysctl__net_kernelconnexions_budget_refusals,
+    &sysctl__net_kernelconnexions_budget_connect_refusals,
+    &sysctl__net_kernelconnexions_budget_trims,
+    &sysctl__net_kernelconnexions_budget_limit,
+    &sysctl__net_kernelconnexions_budget_control_limit
+};
+
+#define KC_METRICS_OID_COUNT (sizeof(metricOids) / sizeof(metricOids[0]))
+
+__private_extern__
+kern_return_t metrics_initialize() {
+    // the node goes first so its children have somewhere to hang
+    for (uint32_t i = 0; i < KC_METRICS_OID_COUNT; i++) {
+        sysctl_register_oid(metricOids[i]);
+    }
+    return KERN_SUCCESS;
+}
+
+__private_extern__
+void metrics_finalize() {
+    for (uint32_t i = KC_METRICS_OID_COUNT; i > 0; i--) {
+        sysctl_unregister_oid(metricOids[i - 1]);
+    }
+}
+
+#pragma mark - Counters -
+
+__private_extern__
+void kc_metrics_add(uint32_t metric, int64_t delta) {
+    KCMetricsSlot * slot = &slots[cpu_number() % KC_METRICS_CPU_COUNT];
+    OSAddAtomic64(delta, &slot->counters[metric]);
+}
+
+__private_extern__
+int64_t kc_metrics_read(uint32_t metric) {
+    int64_t total = 0;
+    for (int i = 0; i < KC_METRICS_CPU_COUNT; i++) {
+        total += slots[i].counters[metric];
+    }
+    return total;
+}
+
+__private_extern__
+void kc_metrics_record_latency(uint64_t nanoseconds) {
+    uint64_t microseconds = nanoseconds / NSEC_PER_USEC;
+    uint32_t bucket = 0;
+    while (microseconds > 1 && bucket + 1 < KC_METRICS_LATENCY_BUCKETS) {
+        microseconds >>= 1;
+        bucket++;
+    }
+    kc_metrics_add(KC_METRIC_DISPATCH_LATENCY + bucket, 1);
+}
+
+#pragma mark - Handlers -
+
+static int kc_metrics_sysctl_counter(SYSCTL_HANDLER_ARGS) {
+    int64_t value = kc_metrics_read((uint32_t)arg2);
+    return SYSCTL_OUT(req, &value, sizeof(value));
+}
+
+static int kc_metrics_sysctl_dispatch(SYSCTL_HANDLER_ARGS) {
+    uint32_t depth, highWater;
+    dispatch_get_stats(&depth, &highWater);
+    int64_t value = arg2 == KC_METRICS_DEPTH ? depth : highWater;
+    return SYSCTL_OUT(req, &value, sizeof(value));
+}
+
+static int kc_metrics_sysctl_dispatch_quantum(SYSCTL_HANDLER_ARGS) {
+    int value = (int)dispatch_get_quantum();
+    int error = sysctl_handle_int(oidp, &value, 0, req);
+    if (error || !req->newptr) return error;
+    if (value < 0) return EINVAL;
+    return dispatch_set_quantum((uint32_t)value);
+}
+
+static int kc_metrics_sysctl_latency(SYSCTL_HANDLER_ARGS) {
+    // "<2:n <4:n ... >=32768:n"; bucket i counts [2^i, 2^(i+1)), and the
+    // first also takes anything under a microsecond
+    char buffer[KC_METRICS_LATENCY_BUCKETS * 32];
+    size_t length = 0;
+    for (uint32_t i = 0; i < KC_METRICS_LATENCY_BUCKETS; i++) {
+        int64_t count = kc_metrics_read(KC_METRIC_DISPATCH_LATENCY + i);
+        if (i + 1 < KC_METRICS_LATENCY_BUCKETS) {
+            length += snprintf(&buffer[length], sizeof(buffer) - length, "%s<%u:%lld",
+                               i ? " " : "", 2u << i, (long long)count);
+        } else {
+            length += snprintf(&buffer[length], sizeof(buffer) - length, " >=%u:%lld",
+                               1u << i, (long long)count);
+        }
+    }
+    return SYSCTL_OUT(req, buffer, length + 1);
+}
+
+static int kc_metrics_sysctl_pool(SYSCTL_HANDLER_ARGS) {
+    // "64:n 256:n ... oversized:n"
+    char buffer[(KC_POOL_CLASS_COUNT + 1) * 40];
+    size_t length = 0;
+    for (uint32_t i = 0; i < KC_POOL_CLASS_COUNT; i++) {
+        length += snprintf(&buffer[length], sizeof(buffer) - length, "%s%u:%llu", i ? " " : "",
+                           kc_pool_class_size(i), (unsigned long long)kc_pool_class_allocations(i));
+    }
+    length += snprintf(&buffer[length], sizeof(buffer) - length, " oversized:%llu",
+                       (unsigned long long)kc_pool_oversized_allocations());
+    return SYSCTL_OUT(req, buffer, length + 1);
+}
+
+static int kc_metrics_sysctl_pool_bytes(SYSCTL_HANDLER_ARGS) {
+    KCPoolStats stats;
+    kc_pool_get_stats(&stats);
+    int64_t value = (int64_t)stats.bytesHeld;
+    return SYSCTL_OUT(req, &value, sizeof(value));
+}
+
+static int kc_metrics_sysctl_budget(SYSCTL_HANDLER_ARGS) {
+    KCBudgetStats stats;
+    kc_budget_get_stats(&stats);
+    int64_t value;
+    if (arg2 == KC_METRICS_BUDGET_USED) value = stats.used;
+    else if (arg2 == KC_METRICS_BUDGET_REFUSALS) value = (int64_t)stats.refusals;
+    else if (arg2 == KC_METRICS_BUDGET_CONNECT_REFUSALS) value = (int64_t)stats.connectRefusals;
+    else value = (int64_t)stats.trims;
+    return SYSCTL_OUT(req, &value, sizeof(value));
+}
+
+static int kc_metrics_sysctl_budget_limit(SYSCTL_HANDLER_ARGS) {
+    int64_t value = kc_budget_get_limit(arg2);
+    int error = sysctl_handle_quad(oidp, &value, 0, req);
+    if (error || !req->newptr) return error;
+    return kc_budget_set_limit(arg2, value);
+}
+
+static int kc_metrics_sysctl_coalesce(SYSCTL_HANDLER_ARGS) {
+    KCConnectionCoalescing coalescing;
+    kc_connection_get_default_coalescing(&coalescing);
+    uint32_t * field = arg2 == KC_METRICS_COALESCE_BYTES ? &coalescing.bytes : &coalescing.delay;
+    int value = (int)*field;
+    int error = sysctl_handle_int(oidp, &value, 0, req);
+    if (error || !req->newptr) return error;
+    if (value < 0) return EINVAL;
+    *field = (uint32_t)value;
+    return kc_connection_set_default_coalescing(&coalescing);
+}
+
+static int kc_metrics_sysctl_drain_timeout(SYSCTL_HANDLER_ARGS) {
+    int value = (int)kc_control_get_drain_timeout();
+    int error = sysctl_handle_int(oidp, &value, 0, req);
+    if (error || !req->newptr) return error;
+    if (value < 0) return EINVAL;
+    return kc_control_set_drain_timeout((uint32_t)value);
+}
+
+static int kc_metrics_sysctl_capture_records(SYSCTL_HANDLER_ARGS) {
+    KCCaptureStats stats;
+    kc_capture_get_stats(&stats);
+    int value = (int)stats.capacity;
+    int error = sysctl_handle_int(oidp, &value, 0, req);
+    if (error || !req->newptr) return error;
+    if (value < 0) return EINVAL;
+    return kc_capture_start((uint32_t)value);
+}
+
+static int kc_metrics_sysctl_capture_stats(SYSCTL_HANDLER_ARGS) {
+    KCCaptureStats stats;
+    kc_capture_get_stats(&stats);
+    int64_t value = arg2 == KC_METRICS_CAPTURE_COUNT ? stats.count : (int64_t)stats.dropped;
+    return SYSCTL_OUT(req, &value, sizeof(value));
+}
+
+static int kc_metrics_sysctl_capture(SYSCTL_HANDLER_ARGS) {
+    return kc_capture_copyout(req);
+}
+
+#ifdef KC_LOCK_PROFILING
+static int kc_metrics_sysctl_lock_profile(SYSCTL_HANDLER_ARGS) {
+    return kc_lockprof_copyout(req);
+}
+
+static int kc_metrics_sysctl_lock_profile_reset(SYSCTL_HANDLER_ARGS) {
+    int value = 0;
+    int error = sysctl_handle_int(oidp, &value, 0, req);
+    if (error || !req->newptr) return error;
+    if (value) kc_lockprof_reset();
+    return 0;
+}
+#endif
@@ -0,0 +1,59 @@
+//
+//  metrics.h
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/10/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef KernelConnexions_metrics_h
+#define KernelConnexions_metrics_h
+
+#include <mach/mach_types.h>
+#include <sys/sysctl.h>
+#include <kern/cpu_number.h>
+#include <libkern/OSAtomic.h>
+#include "general.h"
+#include "debug.h"
+
+#define KC_METRICS_CPU_COUNT 16 // per-CPU slots; CPUs beyond this share
+#define KC_METRICS_LATENCY_BUCKETS 16 // powers of two in microseconds, the last is open-ended
+
+// gauges
+#define KC_METRIC_CONTROLS 0
+#define KC_METRIC_CONNECTIONS 1
+#define KC_METRIC_WRITE_BUFFER_BYTES 2 // bytes queued for the network but not yet sent
+
+// counters
+#define KC_METRIC_CLIENT_BYTES_IN 3 // written by clients into the control socket
+#define KC_METRIC_CLIENT_FRAMES_IN 4
+#define KC_METRIC_CLIENT_BYTES_OUT 5 // handed to ctl_enqueuedata
+#define KC_METRIC_CLIENT_FRAMES_OUT 6
+#define KC_METRIC_ENQUEUE_FAILURES 7
+#define KC_METRIC_NET_BYTES_IN 8
+#define KC_METRIC_NET_BYTES_OUT 9
+#define KC_METRIC_RX_COALESCED_READS 10 // socket reads folded into a frame that was already being held
+#define KC_METRIC_RX_FLUSH_SIZE 11 // held data sent because it reached the size threshold
+#define KC_METRIC_RX_FLUSH_DEADLINE 12 // ... because the oldest byte waited long enough
+#define KC_METRIC_RX_FLUSH_PASS 13 // ... because the socket ran dry with no deadline set, or closed
+#define KC_METRIC_DISPATCH_YIELDS 14 // socket passes cut short to give other connections a turn
+#define KC_METRIC_DISPATCH_LATENCY 15 // the first of KC_METRICS_LATENCY_BUCKETS
+
+#define KC_METRIC_COUNT (KC_METRIC_DISPATCH_LATENCY + KC_METRICS_LATENCY_BUCKETS)
+
+/**
+ * Registers net.kernelconnexions. Call after everything the tree reads from
+ * is initialized, and finalize before any of it goes away.
+ */
+kern_return_t metrics_initialize();
+void metrics_finalize();
+
+/**
+ * Counters are split per CPU so the hot paths never share a cache line, and
+ * are only summed when somebody reads them.
+ */
+void kc_metrics_add(uint32_t metric, int64_t delta);
+int64_t kc_metrics_read(uint32_t metric);
+void kc_metrics_record_latency(uint64_t nanoseconds);
+
+#endif
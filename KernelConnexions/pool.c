@@ -0,0 +1,359 @@
+//
+//  pool.c
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/2/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "pool.h"
+
+#define KC_POOL_MAX_CACHES 16
+
+// covers control packets, DATA frames (65535 + 3) and socket reads
+static const uint32_t classSizes[KC_POOL_CLASS_COUNT] = {64, 256, 1024, 4096, 16384, 65600};
+
+static lck_grp_t * poolGroup = NULL;
+static lck_mtx_t * cachesMutex = NULL;
+static KCPoolCache * caches[KC_POOL_MAX_CACHES];
+static uint32_t cachesCount = 0;
+static KCPoolCache * classCaches[KC_POOL_CLASS_COUNT];
+
+static volatile SInt64 oversizedCount = 0;
+static volatile SInt64 oversizedFrees = 0;
+static volatile SInt64 oversizedBytes = 0;
+static volatile SInt64 packetCount = 0;
+
+static KCPoolCache * kc_pool_class_for_size(uint32_t size);
+static void * kc_pool_backing_alloc(KCPoolCache * cache);
+static void kc_pool_backing_free(KCPoolCache * cache, void * object);
+
+__private_extern__
+kern_return_t pool_initialize() {
+    poolGroup = lck_grp_alloc_init("pool", LCK_GRP_ATTR_NULL);
+    if (!poolGroup) return KERN_FAILURE;
+    cachesMutex = lck_mtx_alloc_init(poolGroup, LCK_ATTR_NULL);
+    if (!cachesMutex) {
+        lck_grp_free(poolGroup);
+        return KERN_FAILURE;
+    }
+    for (int i = 0; i < KC_POOL_CLASS_COUNT; i++) {
+        classCaches[i] = kc_pool_cache_create("class", classSizes[i], NULL, NULL);
+        if (!classCaches[i]) {
+            for (int j = 0; j < i; j++) {
+                kc_pool_cache_destroy(classCaches[j]);
+            }
+            lck_mtx_free(cachesMutex, poolGroup);
+            lck_grp_free(poolGroup);
+            return KERN_FAILURE;
+        }
+        classCaches[i]->aligned = FALSE; // callers only need byte buffers
+    }
+    return KERN_SUCCESS;
+}
+
+__private_extern__
+void pool_finalize() {
+    for (int i = 0; i < KC_POOL_CLASS_COUNT; i++) {
+        kc_pool_cache_destroy(classCaches[i]);
+        classCaches[i] = NULL;
+    }
+    lck_mtx_free(cachesMutex, poolGroup);
+    lck_grp_free(poolGroup);
+}
+
+#pragma mark - Size Classes -
+
+__private_extern__
+void * kc_pool_alloc(uint32_t size) {
+    KCPoolCache * cache = kc_pool_class_for_size(size);
+    if (!cache) {
+        void * buffer = OSMalloc(size, general_malloc_tag());
+        if (buffer) {
+            OSIncrementAtomic64(&oversizedCount);
+            OSAddAtomic64(size, &oversizedBytes);
+        }
+        return buffer;
+    }
+    return kc_pool_cache_alloc(cache);
+}
+
+__private_extern__
+void kc_pool_free(void * buffer, uint32_t size) {
+    KCPoolCache * cache = kc_pool_class_for_size(size);
+    if (!cache) {
+        OSIncrementAtomic64(&oversizedFrees);
+        OSAddAtomic64(-(SInt64)size, &oversizedBytes);
+        OSFree(buffer, size, general_malloc_tag());
+        return;
+    }
+    kc_pool_cache_free(cache, buffer);
+}
+
+#pragma mark - Object Caches -
+
+__private_extern__
+KCPoolCache * kc_pool_cache_create(const char * name, uint32_t size, kc_pool_construct construct, kc_pool_destruct destruct) {
+    // the magazines are cache line aligned, so the cache has to be as well
+    char * raw = (char *)OSMalloc(sizeof(KCPoolCache) + KC_POOL_CACHE_LINE, general_malloc_tag());
+    if (!raw) return NULL;
+    uintptr_t aligned = ((uintptr_t)raw + KC_POOL_CACHE_LINE - 1) & ~((uintptr_t)KC_POOL_CACHE_LINE - 1);
+    KCPoolCache * cache = (KCPoolCache *)aligned;
+    bzero(cache, sizeof(KCPoolCache));
+    cache->raw = raw;
+    cache->name = name;
+    cache->objectSize = size;
+    cache->aligned = TRUE;
+    cache->construct = construct;
+    cache->destruct = destruct;
+
+    cache->depotLock = lck_mtx_alloc_init(poolGroup, LCK_ATTR_NULL);
+    if (!cache->depotLock) {
+        OSFree(raw, sizeof(KCPoolCache) + KC_POOL_CACHE_LINE, general_malloc_tag());
+        return NULL;
+    }
+    for (int i = 0; i < KC_POOL_CPU_COUNT; i++) {
+        cache->magazines[i].lock = lck_spin_alloc_init(poolGroup, LCK_ATTR_NULL);
+        if (!cache->magazines[i].lock) {
+            for (int j = 0; j < i; j++) {
+                lck_spin_free(cache->magazines[j].lock, poolGroup);
+            }
+            lck_mtx_free(cache->depotLock, poolGroup);
+            OSFree(raw, sizeof(KCPoolCache) + KC_POOL_CACHE_LINE, general_malloc_tag());
+            return NULL;
+        }
+    }
+
+    lck_mtx_lock(cachesMutex);
+    if (cachesCount < KC_POOL_MAX_CACHES) {
+        caches[cachesCount++] = cache;
+    } else {
+        debugf("kc_pool_cache_create: %s will not show up in stats", name);
+    }
+    lck_mtx_unlock(cachesMutex);
+    return cache;
+}
+
+__private_extern__
+void kc_pool_cache_destroy(KCPoolCache * cache) {
+    lck_mtx_lock(cachesMutex);
+    for (uint32_t i = 0; i < cachesCount; i++) {
+        if (caches[i] == cache) {
+            caches[i] = caches[--cachesCount];
+            break;
+        }
+    }
+    lck_mtx_unlock(cachesMutex);
+
+    for (int i = 0; i < KC_POOL_CPU_COUNT; i++) {
+        KCPoolMagazine * magazine = &cache->magazines[i];
+        while (magazine->count > 0) {
+            kc_pool_backing_free(cache, magazine->objects[--magazine->count]);
+        }
+        lck_spin_free(magazine->lock, poolGroup);
+    }
+    while (cache->depotCount > 0) {
+        kc_pool_backing_free(cache, cache->depot[--cache->depotCount]);
+    }
+    if (cache->backingAllocations != cache->backingFrees) {
+        debugf("kc_pool_cache_destroy: %s leaked %d objects", cache->name,
+               (int)(cache->backingAllocations - cache->backingFrees));
+    }
+    lck_mtx_free(cache->depotLock, poolGroup);
+    OSFree(cache->raw, sizeof(KCPoolCache) + KC_POOL_CACHE_LINE, general_malloc_tag());
+}
+
+__private_extern__
+void * kc_pool_cache_alloc(KCPoolCache * cache) {
+    void * object = NULL;
+    KCPoolMagazine * magazine = &cache->magazines[cpu_number() % KC_POOL_CPU_COUNT];
+    lck_spin_lock(magazine->lock);
+    magazine->allocations++;
+    if (magazine->count > 0) {
+        object = magazine->objects[--magazine->count];
+        magazine->hits++;
+    }
+    lck_spin_unlock(magazine->lock);
+    if (object) return object;
+
+    lck_mtx_lock(cache->depotLock);
+    if (cache->depotCount > 0) {
+        object = cache->depot[--cache->depotCount];
+        cache->depotHits++;
+    }
+    lck_mtx_unlock(cache->depotLock);
+    if (object) return object;
+
+    return kc_pool_backing_alloc(cache);
+}
+
+__private_extern__
+void kc_pool_cache_free(KCPoolCache * cache, void * object) {
+    KCPoolMagazine * magazine = &cache->magazines[cpu_number() % KC_POOL_CPU_COUNT];
+    lck_spin_lock(magazine->lock);
+    magazine->frees++;
+    if (magazine->count < KC_POOL_MAGAZINE_SIZE) {
+        magazine->objects[magazine->count++] = object;
+        object = NULL;
+    }
+    lck_spin_unlock(magazine->lock);
+    if (!object) return;
+
+    lck_mtx_lock(cache->depotLock);
+    if (cache->depotCount < KC_POOL_DEPOT_SIZE) {
+        cache->depot[cache->depotCount++] = object;
+        object = NULL;
+    }
+    lck_mtx_unlock(cache->depotLock);
+    if (!object) return;
+
+    kc_pool_backing_free(cache, object);
+}
+
+__private_extern__
+uint32_t kc_pool_trim() {
+    void * objects[KC_POOL_DEPOT_SIZE];
+    uint32_t released = 0;
+    // holding cachesMutex keeps kc_pool_cache_destroy from running underneath us
+    lck_mtx_lock(cachesMutex);
+    for (uint32_t i = 0; i < cachesCount; i++) {
+        KCPoolCache * cache = caches[i];
+        for (int j = 0; j < KC_POOL_CPU_COUNT; j++) {
+            KCPoolMagazine * magazine = &cache->magazines[j];
+            uint32_t count = 0;
+            lck_spin_lock(magazine->lock);
+            while (magazine->count > 0) {
+                objects[count++] = magazine->objects[--magazine->count];
+            }
+            lck_spin_unlock(magazine->lock);
+            for (uint32_t k = 0; k < count; k++) {
+                kc_pool_backing_free(cache, objects[k]);
+            }
+            released += count;
+        }
+        lck_mtx_lock(cache->depotLock);
+        uint32_t count = cache->depotCount;
+        memcpy(objects, cache->depot, sizeof(void *) * count);
+        cache->depotCount = 0;
+        lck_mtx_unlock(cache->depotLock);
+        for (uint32_t k = 0; k < count; k++) {
+            kc_pool_backing_free(cache, objects[k]);
+        }
+        released += count;
+    }
+    lck_mtx_unlock(cachesMutex);
+    return released;
+}
+
+#pragma mark - Stats -
+
+__private_extern__
+void kc_pool_count_packet() {
+    OSIncrementAtomic64(&packetCount);
+}
+
+__private_extern__
+void kc_pool_get_stats(KCPoolStats * stats) {
+    bzero(stats, sizeof(KCPoolStats));
+    lck_mtx_lock(cachesMutex);
+    for (uint32_t i = 0; i < cachesCount; i++) {
+        KCPoolCache * cache = caches[i];
+        for (int j = 0; j < KC_POOL_CPU_COUNT; j++) {
+            KCPoolMagazine * magazine = &cache->magazines[j];
+            lck_spin_lock(magazine->lock);
+            stats->allocations += magazine->allocations;
+            stats->frees += magazine->frees;
+            stats->cpuHits += magazine->hits;
+            lck_spin_unlock(magazine->lock);
+        }
+        lck_mtx_lock(cache->depotLock);
+        stats->depotHits += cache->depotHits;
+        stats->backingAllocations += cache->backingAllocations;
+        stats->backingFrees += cache->backingFrees;
+        stats->bytesHeld += cache->bytesHeld;
+        lck_mtx_unlock(cache->depotLock);
+    }
+    lck_mtx_unlock(cachesMutex);
+
+    stats->oversized = (uint64_t)oversizedCount;
+    stats->allocations += (uint64_t)oversizedCount;
+    stats->backingAllocations += (uint64_t)oversizedCount;
+    stats->frees += (uint64_t)oversizedFrees;
+    stats->backingFrees += (uint64_t)oversizedFrees;
+    stats->bytesHeld += (uint64_t)oversizedBytes;
+    stats->packets = (uint64_t)packetCount;
+}
+
+__private_extern__
+uint32_t kc_pool_class_size(uint32_t index) {
+    return index < KC_POOL_CLASS_COUNT ? classSizes[index] : 0;
+}
+
+__private_extern__
+uint64_t kc_pool_class_allocations(uint32_t index) {
+    if (index >= KC_POOL_CLASS_COUNT) return 0;
+    KCPoolCache * cache = classCaches[index];
+    uint64_t allocations = 0;
+    for (int i = 0; i < KC_POOL_CPU_COUNT; i++) {
+        KCPoolMagazine * magazine = &cache->magazines[i];
+        lck_spin_lock(magazine->lock);
+        allocations += magazine->allocations;
+        lck_spin_unlock(magazine->lock);
+    }
+    return allocations;
+}
+
+__private_extern__
+uint64_t kc_pool_oversized_allocations() {
+    return (uint64_t)oversizedCount;
+}
+
+#pragma mark - Private -
+
+static KCPoolCache * kc_pool_class_for_size(uint32_t size) {
+    for (int i = 0; i < KC_POOL_CLASS_COUNT; i++) {
+        if (size <= classSizes[i]) return classCaches[i];
+    }
+    return NULL;
+}
+
+static void * kc_pool_backing_alloc(KCPoolCache * cache) {
+    // aligned objects get a cache line of slack; the raw pointer is kept
+    // just in front of the object so it can be freed later
+    uint32_t allocSize = cache->objectSize;
+    if (cache->aligned) allocSize += KC_POOL_CACHE_LINE;
+    char * raw = (char *)OSMalloc(allocSize, general_malloc_tag());
+    if (!raw) return NULL;
+    void * object = raw;
+    if (cache->aligned) {
+        uintptr_t aligned = ((uintptr_t)raw + KC_POOL_CACHE_LINE) & ~((uintptr_t)KC_POOL_CACHE_LINE - 1);
+        object = (void *)aligned;
+        ((void **)object)[-1] = raw;
+    }
+    if (cache->construct) {
+        if (cache->construct(object)) {
+            OSFree(raw, allocSize, general_malloc_tag());
+            return NULL;
+        }
+    }
+    lck_mtx_lock(cache->depotLock);
+    cache->backingAllocations++;
+    cache->bytesHeld += allocSize;
+    lck_mtx_unlock(cache->depotLock);
+    return object;
+}
+
+static void kc_pool_backing_free(KCPoolCache * cache, void * object) {
+    if (cache->destruct) cache->destruct(object);
+    uint32_t allocSize = cache->objectSize;
+    void * raw = object;
+    if (cache->aligned) {
+        allocSize += KC_POOL_CACHE_LINE;
+        raw = ((void **)object)[-1];
+    }
+    OSFree(raw, allocSize, general_malloc_tag());
+    lck_mtx_lock(cache->depotLock);
+    cache->backingFrees++;
+    cache->bytesHeld -= allocSize;
+    lck_mtx_unlock(cache->depotLock);
+}
@@ -0,0 +1,97 @@
+//
+//  pool.h
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/2/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef KernelConnexions_pool_h
+#define KernelConnexions_pool_h
+
+#include <mach/mach_types.h>
+#include <kern/locks.h>
+#include <kern/cpu_number.h>
+#include <libkern/OSAtomic.h>
+#include "general.h"
+#include "debug.h"
+
+#define KC_POOL_CACHE_LINE 64
+#define KC_POOL_CPU_COUNT 16 // per-CPU caches; CPUs beyond this share
+#define KC_POOL_MAGAZINE_SIZE 16 // objects held by each per-CPU cache
+#define KC_POOL_DEPOT_SIZE 128 // objects held by the shared depot
+#define KC_POOL_CLASS_COUNT 6
+
+typedef errno_t (*kc_pool_construct)(void * object);
+typedef void (*kc_pool_destruct)(void * object);
+
+typedef struct {
+    uint64_t allocations; // every kc_pool_alloc/kc_pool_cache_alloc
+    uint64_t frees;
+    uint64_t cpuHits; // allocations satisfied by a per-CPU cache
+    uint64_t depotHits; // allocations satisfied by the shared depot
+    uint64_t backingAllocations; // allocations that reached OSMalloc
+    uint64_t backingFrees;
+    uint64_t oversized; // requests too large for any size class
+    uint64_t packets; // frames processed, for allocations-per-packet
+    uint64_t bytesHeld; // bytes currently taken from OSMalloc, cached or not
+} KCPoolStats;
+
+typedef struct {
+    lck_spin_t * lock;
+    uint32_t count;
+    void * objects[KC_POOL_MAGAZINE_SIZE];
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t hits;
+} __attribute__((aligned(KC_POOL_CACHE_LINE))) KCPoolMagazine;
+
+typedef struct {
+    KCPoolMagazine magazines[KC_POOL_CPU_COUNT];
+    void * raw; // what OSMalloc actually returned
+    const char * name;
+    uint32_t objectSize;
+    boolean_t aligned; // objects start on a cache line
+    kc_pool_construct construct;
+    kc_pool_destruct destruct;
+    lck_mtx_t * depotLock;
+    void * depot[KC_POOL_DEPOT_SIZE];
+    uint32_t depotCount;
+    uint64_t depotHits;
+    uint64_t backingAllocations;
+    uint64_t backingFrees;
+    uint64_t bytesHeld;
+} KCPoolCache;
+
+kern_return_t pool_initialize();
+void pool_finalize();
+
+/**
+ * Allocate from the size-class pools. Freeing requires the same size, just
+ * like OSMalloc/OSFree.
+ */
+void * kc_pool_alloc(uint32_t size);
+void kc_pool_free(void * buffer, uint32_t size);
+
+/**
+ * Object caches hand out cache-line aligned objects which keep whatever the
+ * constructor set up (e.g. a mutex) for as long as they live in the cache.
+ */
+KCPoolCache * kc_pool_cache_create(const char * name, uint32_t size, kc_pool_construct construct, kc_pool_destruct destruct);
+void kc_pool_cache_destroy(KCPoolCache * cache);
+void * kc_pool_cache_alloc(KCPoolCache * cache);
+void kc_pool_cache_free(KCPoolCache * cache, void * object);
+
+/**
+ * Hand every cached object back to OSMalloc. Used when memory is tight; the
+ * caches refill themselves as traffic picks up again.
+ */
+uint32_t kc_pool_trim();
+
+void kc_pool_count_packet();
+void kc_pool_get_stats(KCPoolStats * stats);
+uint32_t kc_pool_class_size(uint32_t index);
+uint64_t kc_pool_class_allocations(uint32_t index);
+uint64_t kc_pool_oversized_allocations();
+
+#endif
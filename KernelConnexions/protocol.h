@@ -0,0 +1,220 @@
+//
+//  protocol.h
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/18/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef KernelConnexions_protocol_h
+#define KernelConnexions_protocol_h
+
+// shared by the kext, the client libraries and connexionsd, so only plain C
+// in here; C++ includes it too
+#ifdef KERNEL
+#include <sys/types.h>
+#include <string.h>
+#else
+#include <stdint.h>
+#include <string.h>
+#endif
+
+// client packets
+#define CONTROL_PACKET_CONNECT 0x1 // port, then a 4 or 16 byte address
+#define CONTROL_PACKET_CLOSE 0x3
+#define CONTROL_PACKET_SEND 0x5
+#define CONTROL_PACKET_CONNECT_MULTI 0x7 // port, stagger, then (family, address) candidates
+#define CONTROL_PACKET_SEND_STAMPED 0xC // a host-order mach_absolute_time(), then the data
+#define CONTROL_PACKET_CONNECT_DATA 0xE // port, family, address, then data to send once connected
+
+// control packets
+#define CONTROL_PACKET_CONNECTED 0x2
+#define CONTROL_PACKET_ERROR 0x4 // an errno
+#define CONTROL_PACKET_DATA 0x6
+#define CONTROL_PACKET_HUNGUP 0x8 // empty, or the errno a connect failed with
+#define CONTROL_PACKET_TIMEOUT 0xA // one byte: which timeout expired
+#define CONTROL_PACKET_UNLOADING 0xB // the kext is going away; close the control socket
+#define CONTROL_PACKET_STAMPS 0xD // KCFrameStamps
+
+// both ways, once rings are attached: look at the rings again
+#define CONTROL_PACKET_DOORBELL 0x9
+
+// getsockopt() options
+#define CONTROL_OPT_POOL_STATS 0x1 // KCPoolStats
+#define CONTROL_OPT_UPCALL_STATS 0x2 // KCConnectionStats
+
+// getsockopt() and setsockopt() options
+#define CONTROL_OPT_TIMEOUTS 0x3 // KCConnectionTimeouts
+#define CONTROL_OPT_RING 0x4 // set a uint32_t ring size, then get KCRingAddresses
+#define CONTROL_OPT_COALESCE 0x5 // KCConnectionCoalescing
+#define CONTROL_OPT_TIMESTAMPS 0x6 // uint32_t, nonzero to get STAMPS frames
+#define CONTROL_OPT_WEIGHT 0x7 // uint32_t dispatch weight, 1 to KC_DISPATCH_MAX_WEIGHT
+
+// every frame is a type byte and a big endian body length, then the body
+#define KC_FRAME_HEADER_SIZE 3
+#define KC_FRAME_MAX_BODY 0xFFFF
+
+// fixed body sizes
+#define KC_CONNECT_IPV4_SIZE 6
+#define KC_CONNECT_IPV6_SIZE 18
+#define KC_CONNECT_MULTI_MIN_SIZE 4 // with no candidates, which is refused
+#define KC_CONNECT_DATA_IPV4_SIZE 7 // in front of a CONNECT_DATA payload
+#define KC_CONNECT_DATA_IPV6_SIZE 19
+#define KC_CANDIDATE_MAX_SIZE 17
+#define KC_STATUS_SIZE 4 // ERROR, or HUNGUP after a failed connect
+#define KC_STAMP_SIZE 8 // in front of a SEND_STAMPED body
+#define KC_TIMEOUT_SIZE 1
+
+/**
+ * Multi-byte fields are big endian and sit at odd offsets, so they are
+ * assembled a byte at a time. Compilers turn each of these into a single
+ * unaligned load or store and a byte swap.
+ */
+static inline uint16_t kc_get_be16(const void * field) {
+    const uint8_t * bytes = (const uint8_t *)field;
+    return (uint16_t)((bytes[0] << 8) | bytes[1]);
+}
+
+static inline uint32_t kc_get_be32(const void * field) {
+    const uint8_t * bytes = (const uint8_t *)field;
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+static inline void kc_put_be16(void * field, uint16_t value) {
+    uint8_t * bytes = (uint8_t *)field;
+    bytes[0] = (uint8_t)(value >> 8);
+    bytes[1] = (uint8_t)value;
+}
+
+static inline void kc_put_be32(void * field, uint32_t value) {
+    uint8_t * bytes = (uint8_t *)field;
+    bytes[0] = (uint8_t)(value >> 24);
+    bytes[1] = (uint8_t)(value >> 16);
+    bytes[2] = (uint8_t)(value >> 8);
+    bytes[3] = (uint8_t)value;
+}
+
+#pragma mark - Headers -
+
+static inline void kc_frame_put_header(void * frame, uint8_t type, uint16_t length) {
+    ((uint8_t *)frame)[0] = type;
+    kc_put_be16(&((uint8_t *)frame)[1], length);
+}
+
+static inline uint8_t kc_frame_type(const void * frame) {
+    return ((const uint8_t *)frame)[0];
+}
+
+static inline uint16_t kc_frame_length(const void * frame) {
+    return kc_get_be16(&((const uint8_t *)frame)[1]);
+}
+
+#pragma mark - Bodies -
+
+/**
+ * Write a CONNECT body. The port is in host byte order.
+ * @return The body length, KC_CONNECT_IPV4_SIZE or KC_CONNECT_IPV6_SIZE
+ */
+static inline uint16_t kc_connect_encode(void * body, uint16_t port, const void * address, int isIpv6) {
+    uint16_t addressLength = isIpv6 ? 16 : 4;
+    kc_put_be16(body, port);
+    memcpy(&((uint8_t *)body)[2], address, addressLength);
+    return 2 + addressLength;
+}
+
+/**
+ * Read a CONNECT body in place.
+ * @return 4 or 6 for the address family, or 0 if the length fits neither
+ */
+static inline int kc_connect_decode(const void * body, uint16_t length, uint16_t * port, const void ** address) {
+    if (length != KC_CONNECT_IPV4_SIZE && length != KC_CONNECT_IPV6_SIZE) return 0;
+    *port = kc_get_be16(body);
+    *address = &((const uint8_t *)body)[2];
+    return length == KC_CONNECT_IPV6_SIZE ? 6 : 4;
+}
+
+/**
+ * Write the start of a CONNECT_MULTI body; candidates follow with
+ * kc_candidate_encode().
+ * @return KC_CONNECT_MULTI_MIN_SIZE
+ */
+static inline uint16_t kc_connect_multi_encode(void * body, uint16_t port, uint16_t stagger) {
+    kc_put_be16(body, port);
+    kc_put_be16(&((uint8_t *)body)[2], stagger);
+    return KC_CONNECT_MULTI_MIN_SIZE;
+}
+
+static inline void kc_connect_multi_decode(const void * body, uint16_t * port, uint16_t * stagger) {
+    *port = kc_get_be16(body);
+    *stagger = kc_get_be16(&((const uint8_t *)body)[2]);
+}
+
+/**
+ * Append a CONNECT_MULTI candidate at offset.
+ * @param version 4 or 6
+ * @return The offset just past it
+ */
+static inline uint16_t kc_candidate_encode(void * body, uint16_t offset, int version, const void * address) {
+    uint8_t * bytes = (uint8_t *)body;
+    uint16_t addressLength = version == 6 ? 16 : 4;
+    bytes[offset] = (uint8_t)version;
+    memcpy(&bytes[offset + 1], address, addressLength);
+    return offset + 1 + addressLength;
+}
+
+/**
+ * Read the CONNECT_MULTI candidate at *offset and move past it.
+ * @return 4 or 6, or 0 when there are no more well-formed candidates
+ */
+static inline int kc_candidate_decode(const void * body, uint16_t length, uint16_t * offset, const void ** address) {
+    const uint8_t * bytes = (const uint8_t *)body;
+    if (*offset >= length) return 0;
+    int version = bytes[*offset];
+    uint16_t addressLength = version == 6 ? 16 : (version == 4 ? 4 : 0);
+    if (!addressLength || *offset + 1 + addressLength > length) return 0;
+    *address = &bytes[*offset + 1];
+    *offset += 1 + addressLength;
+    return version;
+}
+
+/**
+ * Write the part of a CONNECT_DATA body in front of the payload.
+ * @return The payload's offset, KC_CONNECT_DATA_IPV4_SIZE or KC_CONNECT_DATA_IPV6_SIZE
+ */
+static inline uint16_t kc_connect_data_encode(void * body, uint16_t port, const void * address, int isIpv6) {
+    uint8_t * bytes = (uint8_t *)body;
+    kc_put_be16(bytes, port);
+    bytes[2] = isIpv6 ? 6 : 4;
+    memcpy(&bytes[3], address, isIpv6 ? 16 : 4);
+    return isIpv6 ? KC_CONNECT_DATA_IPV6_SIZE : KC_CONNECT_DATA_IPV4_SIZE;
+}
+
+/**
+ * Read a CONNECT_DATA body in place. The payload may be empty.
+ * @return 4 or 6, or 0 if the family is unknown or the address is cut off
+ */
+static inline int kc_connect_data_decode(const void * body, uint16_t length, uint16_t * port,
+                                         const void ** address, uint16_t * payloadOffset) {
+    const uint8_t * bytes = (const uint8_t *)body;
+    if (length < KC_CONNECT_DATA_IPV4_SIZE) return 0;
+    int version = bytes[2];
+    uint16_t offset = version == 6 ? KC_CONNECT_DATA_IPV6_SIZE : (version == 4 ? KC_CONNECT_DATA_IPV4_SIZE : 0);
+    if (!offset || length < offset) return 0;
+    *port = kc_get_be16(bytes);
+    *address = &bytes[3];
+    *payloadOffset = offset;
+    return version;
+}
+
+static inline void kc_status_encode(void * body, uint32_t error) {
+    kc_put_be32(body, error);
+}
+
+/**
+ * @return The errno in an ERROR or HUNGUP body, or 0 if it has none
+ */
+static inline uint32_t kc_status_decode(const void * body, uint16_t length) {
+    return length >= KC_STATUS_SIZE ? kc_get_be32(body) : 0;
+}
+
+#endif
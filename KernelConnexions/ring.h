@@ -0,0 +1,259 @@
+//
+//  ring.h
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/12/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef KernelConnexions_ring_h
+#define KernelConnexions_ring_h
+
+// shared by the kext and the client library, so only plain C in here
+#ifdef KERNEL
+#include <sys/types.h>
+#include <string.h>
+#else
+#include <stdint.h>
+#include <string.h>
+#endif
+
+#define KC_RING_MAGIC 0x4b43524e // "KCRN"
+#define KC_RING_MIN_SIZE (128 * 1024) // room for the largest frame twice over
+#define KC_RING_MAX_SIZE (16 * 1024 * 1024)
+#define KC_RING_DEFAULT_SIZE (1024 * 1024)
+#define KC_RING_RECORD_WRAP 0xFF // skip to the start of the ring
+
+/**
+ * A single-producer, single-consumer ring of frames. Both indexes run freely
+ * and are masked on use, so head == tail means empty and no slot has to be
+ * kept free. Frames never straddle the end; a wrap record fills the gap.
+ *
+ * The waiting flags implement doorbells: a side that runs out of work sets
+ * its flag, checks again, and sleeps until the other side clears the flag
+ * and rings.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t size; // bytes of record space after the header; a power of two
+    uint8_t reserved0[56];
+    volatile uint32_t head; // bytes ever produced
+    volatile uint32_t producerWaiting; // the producer wants to hear when space frees up
+    uint8_t reserved1[56];
+    volatile uint32_t tail; // bytes ever consumed
+    volatile uint32_t consumerWaiting; // the consumer wants to hear about new records
+    uint8_t reserved2[56];
+} KCRingHeader;
+
+typedef struct {
+    uint8_t type; // a CONTROL_PACKET_* or KC_RING_RECORD_WRAP
+    uint8_t reserved;
+    uint16_t length; // host byte order; both sides are on the same machine
+} KCRingRecord;
+
+/**
+ * One side's view of a ring. The size and this side's own index are kept
+ * here rather than read back from the shared header, so the kext never
+ * trusts anything the other side could scribble over.
+ */
+typedef struct {
+    KCRingHeader * header;
+    uint8_t * records;
+    uint32_t size;
+    uint32_t head; // producer only
+    uint32_t tail; // consumer only
+    int corrupt; // the consumer saw a record that can't be right
+} KCRing;
+
+/**
+ * Where a client finds its rings once they are attached. Each mapping holds
+ * a KCRingHeader followed by the records, and is mappedSize bytes long.
+ */
+typedef struct {
+    uint64_t sendAddress; // client to kext
+    uint64_t receiveAddress; // kext to client
+    uint32_t mappedSize;
+    uint32_t reserved;
+} KCRingAddresses;
+
+#define kc_ring_load(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define kc_ring_store(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define kc_ring_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static inline uint32_t kc_ring_record_size(uint32_t length) {
+    return (uint32_t)(sizeof(KCRingRecord) + length + 3) & ~3u;
+}
+
+static inline uint32_t kc_ring_total_size(uint32_t size) {
+    return (uint32_t)sizeof(KCRingHeader) + size;
+}
+
+static inline int kc_ring_valid_size(uint32_t size) {
+    return size >= KC_RING_MIN_SIZE && size <= KC_RING_MAX_SIZE && !(size & (size - 1));
+}
+
+/**
+ * Lay out a fresh ring in kc_ring_total_size(size) bytes and attach to it.
+ */
+static inline void kc_ring_format(KCRing * ring, void * memory, uint32_t size) {
+    KCRingHeader * header = (KCRingHeader *)memory;
+    memset(header, 0, sizeof(KCRingHeader));
+    header->size = size;
+    header->consumerWaiting = 1; // the consumer starts out asleep
+    kc_ring_store(header->magic, KC_RING_MAGIC);
+    ring->header = header;
+    ring->records = (uint8_t *)memory + sizeof(KCRingHeader);
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->corrupt = 0;
+}
+
+/**
+ * Attach to a ring somebody else formatted. Returns 0 if the memory doesn't
+ * hold one.
+ */
+static inline int kc_ring_open(KCRing * ring, void * memory, uint32_t totalSize) {
+    KCRingHeader * header = (KCRingHeader *)memory;
+    if (kc_ring_load(header->magic) != KC_RING_MAGIC) return 0;
+    uint32_t size = header->size;
+    if (!kc_ring_valid_size(size) || kc_ring_total_size(size) > totalSize) return 0;
+    ring->header = header;
+    ring->records = (uint8_t *)memory + sizeof(KCRingHeader);
+    ring->size = size;
+    ring->head = kc_ring_load(header->head);
+    ring->tail = kc_ring_load(header->tail);
+    ring->corrupt = 0;
+    return 1;
+}
+
+#pragma mark - Producer -
+
+static inline uint32_t kc_ring_space_needed(KCRing * ring, uint32_t head, uint16_t length) {
+    uint32_t need = kc_ring_record_size(length);
+    uint32_t contiguous = ring->size - (head & (ring->size - 1));
+    return need > contiguous ? contiguous + need : need;
+}
+
+/**
+ * Reserve space for a frame of length bytes and return where its body goes,
+ * or NULL if the ring is too full. Nothing is visible to the consumer until
+ * kc_ring_commit.
+ */
+static inline void * kc_ring_reserve(KCRing * ring, uint8_t type, uint16_t length) {
+    uint32_t size = ring->size;
+    uint32_t head = ring->head;
+    uint32_t tail = kc_ring_load(ring->header->tail);
+    uint32_t offset = head & (size - 1);
+    uint32_t need = kc_ring_record_size(length);
+    uint32_t total = kc_ring_space_needed(ring, head, length);
+    if (head - tail > size || total > size - (head - tail)) return NULL;
+    if (total != need) {
+        KCRingRecord * wrap = (KCRingRecord *)&ring->records[offset];
+        wrap->type = KC_RING_RECORD_WRAP;
+        wrap->length = 0;
+        offset = 0;
+    }
+    KCRingRecord * record = (KCRingRecord *)&ring->records[offset];
+    record->type = type;
+    record->reserved = 0;
+    record->length = length;
+    ring->head = head + total;
+    return &record[1];
+}
+
+/**
+ * Publish everything reserved so far. Returns 1 if the consumer is asleep
+ * and needs a doorbell.
+ */
+static inline int kc_ring_commit(KCRing * ring) {
+    kc_ring_store(ring->header->head, ring->head);
+    kc_ring_fence();
+    if (kc_ring_load(ring->header->consumerWaiting)) {
+        kc_ring_store(ring->header->consumerWaiting, 0);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Call after kc_ring_reserve fails. Returns 0 if space showed up meanwhile;
+ * otherwise 1, and the consumer will ring once it frees something.
+ */
+static inline int kc_ring_producer_wait(KCRing * ring, uint16_t length) {
+    KCRingHeader * header = ring->header;
+    kc_ring_store(header->producerWaiting, 1);
+    kc_ring_fence();
+    uint32_t used = ring->head - kc_ring_load(header->tail);
+    if (used <= ring->size && kc_ring_space_needed(ring, ring->head, length) <= ring->size - used) {
+        kc_ring_store(header->producerWaiting, 0);
+        return 0;
+    }
+    return 1;
+}
+
+#pragma mark - Consumer -
+
+/**
+ * The body of the oldest unconsumed frame, or NULL if there is none. The
+ * type and length are copied out, so a producer on the other side of the
+ * boundary can't change them after they were checked. The body stays put
+ * until kc_ring_release.
+ */
+static inline void * kc_ring_peek(KCRing * ring, uint8_t * type, uint16_t * length) {
+    uint32_t size = ring->size;
+    uint32_t head = kc_ring_load(ring->header->head);
+    while (ring->tail != head) {
+        uint32_t offset = ring->tail & (size - 1);
+        KCRingRecord record = *(volatile KCRingRecord *)&ring->records[offset];
+        if (head - ring->tail > size) {
+            ring->corrupt = 1;
+            return NULL;
+        }
+        if (record.type == KC_RING_RECORD_WRAP) {
+            ring->tail += size - offset;
+            kc_ring_store(ring->header->tail, ring->tail);
+            continue;
+        }
+        if (offset + kc_ring_record_size(record.length) > size ||
+            kc_ring_record_size(record.length) > head - ring->tail) {
+            ring->corrupt = 1;
+            return NULL;
+        }
+        *type = record.type;
+        *length = record.length;
+        return &ring->records[offset + sizeof(KCRingRecord)];
+    }
+    return NULL;
+}
+
+/**
+ * Consume the frame kc_ring_peek returned. Returns 1 if the producer is
+ * waiting for space and needs a doorbell.
+ */
+static inline int kc_ring_release(KCRing * ring, uint16_t length) {
+    ring->tail += kc_ring_record_size(length);
+    kc_ring_store(ring->header->tail, ring->tail);
+    kc_ring_fence();
+    if (kc_ring_load(ring->header->producerWaiting)) {
+        kc_ring_store(ring->header->producerWaiting, 0);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Call after kc_ring_peek comes back empty. Returns 0 if a frame arrived
+ * meanwhile; otherwise 1, and the producer will ring on its next commit.
+ */
+static inline int kc_ring_consumer_wait(KCRing * ring) {
+    kc_ring_store(ring->header->consumerWaiting, 1);
+    kc_ring_fence();
+    if (kc_ring_load(ring->header->head) != ring->tail) {
+        kc_ring_store(ring->header->consumerWaiting, 0);
+        return 0;
+    }
+    return 1;
+}
+
+#endif
@@ -0,0 +1,54 @@
+//
+//  ringmap.cpp
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/12/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOLib.h>
+#include "ringmap.h"
+
+__private_extern__
+errno_t kc_ringmap_create(uint32_t size, KCRingMap * map) {
+    bzero(map, sizeof(KCRingMap));
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    IOBufferMemoryDescriptor * buffer;
+    buffer = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                   size, PAGE_SIZE);
+    if (!buffer) return ENOMEM;
+    if (buffer->prepare() != kIOReturnSuccess) {
+        buffer->release();
+        return ENOMEM;
+    }
+    bzero(buffer->getBytesNoCopy(), size);
+    
+    IOMemoryMap * userMap = buffer->createMappingInTask(current_task(), 0, kIOMapAnywhere);
+    if (!userMap) {
+        buffer->complete();
+        buffer->release();
+        return ENOMEM;
+    }
+    
+    map->buffer = buffer;
+    map->map = userMap;
+    map->kernelAddress = buffer->getBytesNoCopy();
+    map->userAddress = userMap->getAddress();
+    map->size = size;
+    return 0;
+}
+
+__private_extern__
+void kc_ringmap_destroy(KCRingMap * map) {
+    if (map->map) {
+        // unmaps it from the client, if the client is still around
+        ((IOMemoryMap *)map->map)->release();
+    }
+    if (map->buffer) {
+        IOBufferMemoryDescriptor * buffer = (IOBufferMemoryDescriptor *)map->buffer;
+        buffer->complete();
+        buffer->release();
+    }
+    bzero(map, sizeof(KCRingMap));
+}
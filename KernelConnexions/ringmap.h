@@ -0,0 +1,42 @@
+//
+//  ringmap.h
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/12/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef KernelConnexions_ringmap_h
+#define KernelConnexions_ringmap_h
+
+#include <mach/mach_types.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Wired memory shared between the kext and one client task. The IOKit
+ * objects behind it are C++, so they stay opaque out here.
+ */
+typedef struct {
+    void * buffer; // IOBufferMemoryDescriptor
+    void * map; // IOMemoryMap in the client task
+    void * kernelAddress;
+    uint64_t userAddress;
+    uint32_t size;
+} KCRingMap;
+
+/**
+ * Allocate size bytes and map them into the calling task, so this has to run
+ * in the client's context (e.g. from a setopt handler).
+ */
+errno_t kc_ringmap_create(uint32_t size, KCRingMap * map);
+void kc_ringmap_destroy(KCRingMap * map);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
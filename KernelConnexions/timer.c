@@ -0,0 +1,183 @@
+//
+//  timer.c
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/9/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "timer.h"
+
+#define KC_TIMER_ROOT_SIZE (1 << KC_TIMER_ROOT_BITS)
+#define KC_TIMER_LEVEL_SIZE (1 << KC_TIMER_LEVEL_BITS)
+#define KC_TIMER_MAX_TICKS ((1ull << (KC_TIMER_ROOT_BITS + KC_TIMER_LEVELS * KC_TIMER_LEVEL_BITS)) - 1)
+#define KC_TIMER_BATCH 32 // callbacks gathered before the lock is dropped to run them
+
+typedef struct {
+    kc_timer_callback callback;
+    void * data;
+} KCTimerFiring;
+
+static lck_grp_t * timerGroup = NULL;
+static lck_mtx_t * timerMutex = NULL;
+static KCTimer * rootWheel[KC_TIMER_ROOT_SIZE];
+static KCTimer * levelWheels[KC_TIMER_LEVELS][KC_TIMER_LEVEL_SIZE];
+static uint64_t currentTick = 0; // the next tick to process
+static uint64_t baseTime = 0;
+
+static uint64_t timer_now_ticks();
+static void timer_insert(KCTimer * timer);
+static void timer_unlink(KCTimer * timer);
+static void timer_cascade(int level, uint32_t index);
+
+__private_extern__
+kern_return_t timer_initialize() {
+    timerGroup = lck_grp_alloc_init("timer", LCK_GRP_ATTR_NULL);
+    if (!timerGroup) return KERN_FAILURE;
+    timerMutex = lck_mtx_alloc_init(timerGroup, LCK_ATTR_NULL);
+    if (!timerMutex) {
+        lck_grp_free(timerGroup);
+        return KERN_FAILURE;
+    }
+    bzero(rootWheel, sizeof(rootWheel));
+    bzero(levelWheels, sizeof(levelWheels));
+    baseTime = mach_absolute_time();
+    currentTick = 0;
+    return KERN_SUCCESS;
+}
+
+__private_extern__
+void timer_finalize() {
+    // every owner cancels its timers before it goes away
+    lck_mtx_free(timerMutex, timerGroup);
+    lck_grp_free(timerGroup);
+}
+
+__private_extern__
+void timer_advance() {
+    uint64_t now = timer_now_ticks();
+    KCTimerFiring firing[KC_TIMER_BATCH];
+    uint32_t firingCount = 0;
+
+    lck_mtx_lock(timerMutex);
+    while (currentTick <= now) {
+        uint32_t index = (uint32_t)(currentTick & (KC_TIMER_ROOT_SIZE - 1));
+        if (index == 0) {
+            // the root wrapped; pull the next slot of each level down
+            for (int level = 0; level < KC_TIMER_LEVELS; level++) {
+                uint32_t shift = KC_TIMER_ROOT_BITS + level * KC_TIMER_LEVEL_BITS;
+                uint32_t levelIndex = (uint32_t)((currentTick >> shift) & (KC_TIMER_LEVEL_SIZE - 1));
+                timer_cascade(level, levelIndex);
+                if (levelIndex != 0) break;
+            }
+        }
+        while (rootWheel[index]) {
+            KCTimer * timer = rootWheel[index];
+            timer_unlink(timer);
+            firing[firingCount].callback = timer->callback;
+            firing[firingCount].data = timer->data;
+            firingCount++;
+            if (firingCount == KC_TIMER_BATCH) {
+                lck_mtx_unlock(timerMutex);
+                for (uint32_t i = 0; i < firingCount; i++) {
+                    firing[i].callback(firing[i].data);
+                }
+                firingCount = 0;
+                lck_mtx_lock(timerMutex);
+            }
+        }
+        currentTick++;
+    }
+    lck_mtx_unlock(timerMutex);
+
+    for (uint32_t i = 0; i < firingCount; i++) {
+        firing[i].callback(firing[i].data);
+    }
+}
+
+__private_extern__
+void kc_timer_setup(KCTimer * timer, kc_timer_callback callback, void * data) {
+    timer->next = NULL;
+    timer->prevNext = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+__private_extern__
+void kc_timer_arm(KCTimer * timer, uint32_t milliseconds) {
+    uint64_t ticks = (milliseconds + KC_TIMER_TICK - 1) / KC_TIMER_TICK;
+    if (ticks == 0) ticks = 1;
+    lck_mtx_lock(timerMutex);
+    if (timer->prevNext) timer_unlink(timer);
+    timer->expires = currentTick + ticks;
+    timer_insert(timer);
+    lck_mtx_unlock(timerMutex);
+}
+
+__private_extern__
+void kc_timer_cancel(KCTimer * timer) {
+    lck_mtx_lock(timerMutex);
+    if (timer->prevNext) timer_unlink(timer);
+    lck_mtx_unlock(timerMutex);
+}
+
+__private_extern__
+boolean_t kc_timer_is_armed(KCTimer * timer) {
+    lck_mtx_lock(timerMutex);
+    boolean_t armed = timer->prevNext != NULL;
+    lck_mtx_unlock(timerMutex);
+    return armed;
+}
+
+#pragma mark - Private -
+
+static uint64_t timer_now_ticks() {
+    uint64_t nanoseconds;
+    absolutetime_to_nanoseconds(mach_absolute_time() - baseTime, &nanoseconds);
+    return nanoseconds / (KC_TIMER_TICK * NSEC_PER_MSEC);
+}
+
+static void timer_insert(KCTimer * timer) {
+    KCTimer ** slot;
+    uint64_t delta = timer->expires > currentTick ? timer->expires - currentTick : 0;
+    if (delta > KC_TIMER_MAX_TICKS) {
+        delta = KC_TIMER_MAX_TICKS;
+        timer->expires = currentTick + delta;
+    }
+    if (delta < KC_TIMER_ROOT_SIZE) {
+        uint64_t expires = delta ? timer->expires : currentTick;
+        slot = &rootWheel[expires & (KC_TIMER_ROOT_SIZE - 1)];
+    } else {
+        int level = 0;
+        while (level + 1 < KC_TIMER_LEVELS &&
+               delta >= (1ull << (KC_TIMER_ROOT_BITS + (level + 1) * KC_TIMER_LEVEL_BITS))) {
+            level++;
+        }
+        uint32_t shift = KC_TIMER_ROOT_BITS + level * KC_TIMER_LEVEL_BITS;
+        slot = &levelWheels[level][(timer->expires >> shift) & (KC_TIMER_LEVEL_SIZE - 1)];
+    }
+    timer->next = *slot;
+    if (timer->next) timer->next->prevNext = &timer->next;
+    timer->prevNext = slot;
+    *slot = timer;
+}
+
+static void timer_unlink(KCTimer * timer) {
+    *timer->prevNext = timer->next;
+    if (timer->next) timer->next->prevNext = timer->prevNext;
+    timer->next = NULL;
+    timer->prevNext = NULL;
+}
+
+static void timer_cascade(int level, uint32_t index) {
+    KCTimer * timer = levelWheels[level][index];
+    levelWheels[level][index] = NULL;
+    while (timer) {
+        KCTimer * next = timer->next;
+        timer->next = NULL;
+        timer->prevNext = NULL;
+        timer_insert(timer);
+        timer = next;
+    }
+}
@@ -0,0 +1,52 @@
+//
+//  timer.h
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/9/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef KernelConnexions_timer_h
+#define KernelConnexions_timer_h
+
+#include <mach/mach_types.h>
+#include <kern/locks.h>
+#include <kern/clock.h>
+#include "general.h"
+#include "debug.h"
+
+#define KC_TIMER_TICK 10 // milliseconds; the dispatch thread's polling interval
+#define KC_TIMER_ROOT_BITS 8
+#define KC_TIMER_LEVEL_BITS 6
+#define KC_TIMER_LEVELS 3 // above the root; covers 2^26 ticks, about 7.7 days
+
+typedef void (*kc_timer_callback)(void * data);
+
+/**
+ * Embed one of these in whatever owns the timer. Callbacks run on the
+ * dispatch thread after the timer has been unlinked, and the timer itself is
+ * never touched again, so data should be an identifier to look up rather
+ * than a pointer to the owner.
+ */
+typedef struct KCTimer {
+    struct KCTimer * next;
+    struct KCTimer ** prevNext; // NULL while not armed
+    uint64_t expires; // in ticks
+    kc_timer_callback callback;
+    void * data;
+} KCTimer;
+
+kern_return_t timer_initialize();
+void timer_finalize();
+
+/**
+ * Fire everything that has expired. Called by the dispatch thread.
+ */
+void timer_advance();
+
+void kc_timer_setup(KCTimer * timer, kc_timer_callback callback, void * data);
+void kc_timer_arm(KCTimer * timer, uint32_t milliseconds); // re-arms if already armed
+void kc_timer_cancel(KCTimer * timer);
+boolean_t kc_timer_is_armed(KCTimer * timer);
+
+#endif
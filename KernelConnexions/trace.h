@@ -0,0 +1,55 @@
+//
+//  trace.h
+//  KernelConnexions
+//
+//  Created by Alex Nichol on 12/21/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef KernelConnexions_trace_h
+#define KernelConnexions_trace_h
+
+#include <sys/kdebug.h>
+
+/**
+ * Static tracepoints at each stage of the pipeline, recorded with kdebug so
+ * that they can be turned on in a loaded kext. While nobody is tracing, a
+ * tracepoint is a test of kdebug_enable; its arguments are not evaluated.
+ *
+ * The first argument says what an event belongs to: a control identifier,
+ * a connection identifier, or for the dispatch events the job's data
+ * pointer. Scripts/kctrace.py pairs events up by it. The trace tools read
+ * the names from Scripts/KernelConnexions.codes, which has to be kept in
+ * step with this file.
+ */
+
+#define KC_TRACE_SUBCLASS 0x4B // 'K', under DBG_DRIVERS
+#define KC_TRACE_CODE(code) KDBG_CODE(DBG_DRIVERS, KC_TRACE_SUBCLASS, code)
+
+// control sockets: the control identifier first
+#define KC_TRACE_CONTROL_SEND KC_TRACE_CODE(1) // bytes from the client, error
+#define KC_TRACE_PROCESS KC_TRACE_CODE(2) // START/END around kc_process_packet(); END: error
+#define KC_TRACE_FRAME KC_TRACE_CODE(3) // type, body length
+#define KC_TRACE_WRITE KC_TRACE_CODE(4) // connection, bytes, kc_connection_write() result
+
+// dispatch queue: the job's data pointer first
+#define KC_TRACE_DISPATCH_PUSH KC_TRACE_CODE(16) // flow, jobs queued on the flow, error
+#define KC_TRACE_DISPATCH_RUN KC_TRACE_CODE(17) // START/END around the job; START: flow, nanoseconds queued
+
+// sockets: the connection identifier first
+#define KC_TRACE_UPCALL KC_TRACE_CODE(32) // 0 if a pass was queued, EALREADY if one was, or the error
+#define KC_TRACE_UPCALL_PASS KC_TRACE_CODE(33) // the queued pass starts
+#define KC_TRACE_SOCK_SEND KC_TRACE_CODE(34) // bytes buffered, bytes sent, error
+#define KC_TRACE_SOCK_RECEIVE KC_TRACE_CODE(35) // bytes received, error
+
+// KCConnectionCallbacks: the connection, then its control
+#define KC_TRACE_OPENED KC_TRACE_CODE(48)
+#define KC_TRACE_CLOSED KC_TRACE_CODE(49)
+#define KC_TRACE_FAILED KC_TRACE_CODE(50) // error
+#define KC_TRACE_NEWDATA KC_TRACE_CODE(51) // START/END; START: bytes; END: error delivering them
+#define KC_TRACE_TIMEDOUT KC_TRACE_CODE(52) // reason
+
+// kdebug fills in the fifth argument with the thread
+#define KC_TRACE(code, a, b, c, d) KERNEL_DEBUG_CONSTANT((code), (a), (b), (c), (d), 0)
+
+#endif
@@ -0,0 +1,365 @@
+#!/usr/bin/env python
+#
+#  kctrace.py
+#  KernelConnexions
+#
+#  Created by Alex Nichol on 12/21/12.
+#  Copyright (c) 2012 Alex Nichol. All rights reserved.
+#
+# Turns on the kext's kdebug tracepoints (KernelConnexions/trace.h) for a
+# while, then pairs the events up and prints a latency histogram for each
+# stage of the pipeline. Tracing needs root; -w also saves the raw events,
+# and -r reads them back later without tracing again.
+#
+#   sudo Scripts/kctrace.py -t 10
+#   sudo Scripts/kctrace.py -t 30 -w run.kctrace
+#   Scripts/kctrace.py -r run.kctrace -s dispatch_wait -s upcall_wait
+#
+
+from __future__ import print_function
+
+import argparse
+import ctypes
+import ctypes.util
+import struct
+import sys
+import time
+
+# sys/sysctl.h and sys/kdebug.h
+CTL_KERN = 1
+KERN_KDEBUG = 24
+KERN_KDENABLE = 3
+KERN_KDSETBUF = 4
+KERN_KDGETBUF = 5
+KERN_KDSETUP = 6
+KERN_KDREMOVE = 7
+KERN_KDSETREG = 8
+KERN_KDREADTR = 10
+KDBG_SUBCLSTYPE = 0x20000
+KDBG_WRAPPED = 0x008
+DBG_DRIVERS = 6
+DBG_FUNC_START = 1
+DBG_FUNC_END = 2
+
+# trace.h
+KC_TRACE_SUBCLASS = 0x4B
+KC_CONTROL_SEND = 1
+KC_PROCESS = 2
+KC_FRAME = 3
+KC_WRITE = 4
+KC_DISPATCH_PUSH = 16
+KC_DISPATCH_RUN = 17
+KC_UPCALL = 32
+KC_UPCALL_PASS = 33
+KC_SOCK_SEND = 34
+KC_SOCK_RECEIVE = 35
+KC_OPENED = 48
+KC_CLOSED = 49
+KC_FAILED = 50
+KC_NEWDATA = 51
+KC_TIMEDOUT = 52
+
+EVENT_NAMES = {
+    KC_CONTROL_SEND: "control_send", KC_PROCESS: "process_packet", KC_FRAME: "frame",
+    KC_WRITE: "write", KC_DISPATCH_PUSH: "dispatch_push", KC_DISPATCH_RUN: "dispatch_run",
+    KC_UPCALL: "upcall", KC_UPCALL_PASS: "upcall_pass", KC_SOCK_SEND: "sock_sendmbuf",
+    KC_SOCK_RECEIVE: "sock_receivembuf", KC_OPENED: "opened", KC_CLOSED: "closed",
+    KC_FAILED: "failed", KC_NEWDATA: "newdata", KC_TIMEDOUT: "timedout"
+}
+
+# where each event keeps its error, if it has one
+ERROR_ARGS = {
+    KC_CONTROL_SEND: 2, KC_WRITE: 3, KC_DISPATCH_PUSH: 3, KC_UPCALL: 1,
+    KC_SOCK_SEND: 3, KC_SOCK_RECEIVE: 2, KC_FAILED: 2
+}
+
+EALREADY = 37
+EINPROGRESS = 36
+EWOULDBLOCK = 35
+CONNECT_TYPES = (0x1, 0x7, 0xE) # CONNECT, CONNECT_MULTI and CONNECT_DATA
+
+KD_BUF = struct.Struct("=Q5QIIQ") # kd_buf on LP64: the fifth argument is the thread
+FILE_HEADER = struct.Struct("=4sII") # magic, then the timebase the events were stamped with
+FILE_MAGIC = b"KCTR"
+
+
+class Event(object):
+    __slots__ = ("time", "code", "func", "args", "thread", "cpu")
+
+    def __init__(self, time, debugid, args, thread, cpu):
+        self.time = time
+        self.code = (debugid >> 2) & 0x3fff
+        self.func = debugid & 0x3
+        self.args = args
+        self.thread = thread
+        self.cpu = cpu
+
+
+class Match(object):
+    """One end of a stage: an event, which argument keys it, and a filter."""
+
+    def __init__(self, code, func=0, key=0, accept=None):
+        self.code = code
+        self.func = func
+        self.key = key
+        self.accept = accept
+
+    def __call__(self, event):
+        if event.code != self.code or event.func != self.func:
+            return None
+        if self.accept and not self.accept(event.args):
+            return None
+        return event.args[self.key]
+
+
+class Stage(object):
+    """
+    Time from a start event to the end event with the same key. Stages that
+    are "fifo" pair starts and ends one to one; the others measure from the
+    oldest start still waiting and drop the rest, for stages where one end
+    covers any number of starts (bytes that arrive in pieces and go out in
+    one, say).
+    """
+
+    def __init__(self, name, description, start, end, fifo):
+        self.name = name
+        self.description = description
+        self.start = start
+        self.end = end
+        self.fifo = fifo
+        self.samples = []
+        self.pending = {}
+
+    def feed(self, event):
+        key = self.end(event)
+        if key is not None and key in self.pending:
+            waiting = self.pending[key]
+            self.samples.append(event.time - waiting.pop(0))
+            if not self.fifo or not waiting:
+                del self.pending[key]
+        key = self.start(event)
+        if key is not None:
+            self.pending.setdefault(key, []).append(event.time)
+
+
+def make_stages():
+    return [
+        Stage("client_to_frame", "client bytes arriving to the next frame being handled",
+              Match(KC_CONTROL_SEND, accept=lambda a: not a[2]),
+              Match(KC_FRAME), False),
+        Stage("dispatch_wait", "a job being queued to it starting",
+              Match(KC_DISPATCH_PUSH, accept=lambda a: not a[3]),
+              Match(KC_DISPATCH_RUN, DBG_FUNC_START), True),
+        Stage("dispatch_run", "a job starting to it returning",
+              Match(KC_DISPATCH_RUN, DBG_FUNC_START),
+              Match(KC_DISPATCH_RUN, DBG_FUNC_END), True),
+        Stage("process_packet", "kc_process_packet()",
+              Match(KC_PROCESS, DBG_FUNC_START),
+              Match(KC_PROCESS, DBG_FUNC_END), True),
+        Stage("connect", "a connect frame to the opened callback",
+              Match(KC_FRAME, accept=lambda a: a[1] in CONNECT_TYPES),
+              Match(KC_OPENED, key=1), True),
+        Stage("frame_to_wire", "a SEND frame being written to sock_sendmbuf() taking the first of it",
+              Match(KC_WRITE, key=1, accept=lambda a: a[3] in (0, EINPROGRESS)),
+              Match(KC_SOCK_SEND, accept=lambda a: a[2] > 0), False),
+        Stage("upcall_wait", "a socket upcall to the pass it queued starting",
+              Match(KC_UPCALL, accept=lambda a: not a[1]),
+              Match(KC_UPCALL_PASS), True),
+        Stage("wire_to_client", "sock_receivembuf() returning data to the client having it",
+              Match(KC_SOCK_RECEIVE, accept=lambda a: a[1] > 0),
+              Match(KC_NEWDATA, DBG_FUNC_END), False),
+        Stage("newdata", "the newdata callback framing and delivering",
+              Match(KC_NEWDATA, DBG_FUNC_START),
+              Match(KC_NEWDATA, DBG_FUNC_END), True),
+    ]
+
+
+# Tracing
+
+def libc():
+    return ctypes.CDLL(ctypes.util.find_library("c"), use_errno=True)
+
+
+def timebase():
+    class TimebaseInfo(ctypes.Structure):
+        _fields_ = [("numer", ctypes.c_uint32), ("denom", ctypes.c_uint32)]
+    info = TimebaseInfo()
+    libc().mach_timebase_info(ctypes.byref(info))
+    return info.numer, info.denom
+
+
+def kdebug(lib, op, value=None, old=None, oldLength=0):
+    mib = [CTL_KERN, KERN_KDEBUG, op] + ([value] if value is not None else [])
+    name = (ctypes.c_int * len(mib))(*mib)
+    length = ctypes.c_size_t(oldLength)
+    if lib.sysctl(name, len(mib), old, ctypes.byref(length), None, 0):
+        error = ctypes.get_errno()
+        raise OSError(error, "kdebug sysctl %d failed" % op)
+    return length.value
+
+
+def trace(seconds, buffers, interval=0.1):
+    """Return the raw kd_bufs traced over the next so many seconds."""
+    lib = libc()
+    try:
+        kdebug(lib, KERN_KDREMOVE)
+    except OSError:
+        pass # nothing was set up
+    kdebug(lib, KERN_KDSETBUF, buffers)
+    kdebug(lib, KERN_KDSETUP)
+    regtype = (ctypes.c_uint * 5)(KDBG_SUBCLSTYPE, DBG_DRIVERS, KC_TRACE_SUBCLASS, 0, 0)
+    kdebug(lib, KERN_KDSETREG, old=regtype, oldLength=ctypes.sizeof(regtype))
+
+    chunks = []
+    wrapped = False
+    buffer = ctypes.create_string_buffer(buffers * KD_BUF.size)
+    kdebug(lib, KERN_KDENABLE, 1)
+    try:
+        end = time.time() + seconds
+        while True:
+            done = time.time() >= end
+            if not done:
+                time.sleep(interval)
+            # the kernel writes an event count back, not a length
+            count = kdebug(lib, KERN_KDREADTR, old=buffer, oldLength=len(buffer))
+            chunks.append(buffer.raw[:count * KD_BUF.size])
+            info = (ctypes.c_int * 5)()
+            kdebug(lib, KERN_KDGETBUF, old=info, oldLength=ctypes.sizeof(info))
+            wrapped = wrapped or bool(info[2] & KDBG_WRAPPED)
+            if done:
+                break
+    finally:
+        kdebug(lib, KERN_KDENABLE, 0)
+        kdebug(lib, KERN_KDREMOVE)
+    if wrapped:
+        print("warning: the trace buffer wrapped and events were lost; try a bigger -b", file=sys.stderr)
+    return b"".join(chunks)
+
+
+def parse(raw, numer, denom):
+    events = []
+    subclass = (DBG_DRIVERS << 8) | KC_TRACE_SUBCLASS
+    for offset in range(0, len(raw) - KD_BUF.size + 1, KD_BUF.size):
+        fields = KD_BUF.unpack_from(raw, offset)
+        debugid = fields[6]
+        if debugid >> 16 != subclass:
+            continue
+        events.append(Event(fields[0] * numer // denom, debugid, fields[1:5], fields[5], fields[7]))
+    # per-CPU buffers come back merged, but not always in order
+    events.sort(key=lambda event: event.time)
+    return events
+
+
+# Output
+
+def percentile(sorted_samples, fraction):
+    return sorted_samples[min(len(sorted_samples) - 1, int(fraction * len(sorted_samples)))]
+
+
+def print_histogram(stage):
+    samples = sorted(stage.samples)
+    print("%s: %s" % (stage.name, stage.description))
+    if not samples:
+        print("  no samples\n")
+        return
+    print("  %d samples, p50 %.1fus, p99 %.1fus, max %.1fus" % (len(samples),
+          percentile(samples, 0.5) / 1000.0, percentile(samples, 0.99) / 1000.0, samples[-1] / 1000.0))
+
+    # power of two buckets in microseconds, like DTrace's quantize()
+    buckets = {}
+    for sample in samples:
+        bucket = 0
+        while (1 << bucket) * 1000 <= sample:
+            bucket += 1
+        buckets[bucket] = buckets.get(bucket, 0) + 1
+    top = max(buckets.values())
+    print("  %12s  %-40s %s" % ("us", "", "count"))
+    for bucket in range(min(buckets), max(buckets) + 1):
+        count = buckets.get(bucket, 0)
+        label = "< 1" if bucket == 0 else "%d" % (1 << (bucket - 1))
+        print("  %12s |%-40s %d" % (label, "@" * int(round(40.0 * count / top)), count))
+    print("")
+
+
+def event_error(event):
+    if event.func == DBG_FUNC_END:
+        index = {KC_PROCESS: 1, KC_NEWDATA: 2}.get(event.code)
+    else:
+        index = ERROR_ARGS.get(event.code)
+    return event.args[index] if index is not None else 0
+
+
+def print_counts(events):
+    counts = {}
+    errors = {}
+    for event in events:
+        name = EVENT_NAMES.get(event.code, "code %d" % event.code)
+        if event.func != DBG_FUNC_END:
+            counts[name] = counts.get(name, 0) + 1
+        error = event_error(event)
+        # a coalesced upcall or a full socket buffer is business as usual
+        if error and not (event.code == KC_UPCALL and error == EALREADY) and error != EWOULDBLOCK:
+            errors.setdefault(name, {})
+            errors[name][error] = errors[name].get(error, 0) + 1
+    print("events:")
+    for name in sorted(counts):
+        detail = ", ".join("errno %d x%d" % item for item in sorted(errors.get(name, {}).items()))
+        print("  %-18s %10d%s" % (name, counts[name], "  (" + detail + ")" if detail else ""))
+    print("")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Latency histograms from the KernelConnexions tracepoints")
+    parser.add_argument("-t", dest="seconds", type=float, default=10, help="seconds to trace for")
+    parser.add_argument("-b", dest="buffers", type=int, default=1000000, help="kdebug buffer, in events")
+    parser.add_argument("-w", dest="write", help="also save the raw events to this file")
+    parser.add_argument("-r", dest="read", help="read events saved with -w instead of tracing")
+    parser.add_argument("-s", dest="stages", action="append", help="only this stage; may be repeated")
+    parser.add_argument("-l", dest="list", action="store_true", help="list the stages and exit")
+    options = parser.parse_args()
+
+    stages = make_stages()
+    if options.list:
+        for stage in stages:
+            print("%-16s %s" % (stage.name, stage.description))
+        return 0
+    if options.stages:
+        unknown = set(options.stages) - set(stage.name for stage in stages)
+        if unknown:
+            parser.error("unknown stage: %s" % ", ".join(sorted(unknown)))
+        stages = [stage for stage in stages if stage.name in options.stages]
+
+    if options.read:
+        with open(options.read, "rb") as source:
+            magic, numer, denom = FILE_HEADER.unpack(source.read(FILE_HEADER.size))
+            if magic != FILE_MAGIC:
+                print("%s was not written by kctrace.py -w" % options.read, file=sys.stderr)
+                return 1
+            raw = source.read()
+    else:
+        numer, denom = timebase()
+        try:
+            raw = trace(options.seconds, options.buffers)
+        except OSError as error:
+            print("tracing failed: %s (run as root; is another trace tool running?)" % error, file=sys.stderr)
+            return 1
+        if options.write:
+            with open(options.write, "wb") as sink:
+                sink.write(FILE_HEADER.pack(FILE_MAGIC, numer, denom))
+                sink.write(raw)
+
+    events = parse(raw, numer, denom)
+    if not events:
+        print("no KernelConnexions events; is the kext loaded and busy?", file=sys.stderr)
+        return 1
+    print_counts(events)
+    for event in events:
+        for stage in stages:
+            stage.feed(event)
+    for stage in stages:
+        print_histogram(stage)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,248 @@
+//
+//  ksocket_test.cpp
+//  Tests
+//
+//  Created by Alex Nichol on 12/22/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "KSocket.hpp"
+extern "C" {
+#include "test.h"
+#include "../BenchConnexions/bench.h"
+}
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// KSocket.hpp through connexionsd (or the kext) to loopback servers: connects
+// that succeed, are refused and are pipelined; a full duplex echo; a peer that
+// hangs up; an idle timeout where the other end supports one; and, through
+// a connexionsd of its own, a ksocket_read() that is waiting when the daemon dies
+
+#define KSOCKET_TEST_ECHO_BYTES (1024 * 1024)
+#define KSOCKET_TEST_PIPELINED_BYTES 4096
+#define KSOCKET_TEST_IDLE_TIMEOUT 200 // milliseconds
+#define KSOCKET_TEST_DAEMON_ENV "KSOCKET_TEST_DAEMON" // the connexionsd to start and kill
+#define KSOCKET_TEST_KILL_DELAY 200 // milliseconds, so the read is already blocked
+#define KSOCKET_TEST_WATCHDOG 5 // seconds before a read that never gives up fails the test
+
+struct TestServers {
+    bench_server_t echo;
+    bench_server_t hold;
+    uint16_t refusedPort;
+    bool finished; // the executor also stops if every socket is stuck
+};
+
+static uint8_t ksocket_test_byte(size_t offset) {
+    return (uint8_t)(offset * 131 + (offset >> 8));
+}
+
+static kc::Task<void> ksocket_test_write(kc::KSocket & socket, size_t length, int * result) {
+    uint8_t buffer[16384];
+    for (size_t offset = 0; offset < length && !*result; offset += sizeof(buffer)) {
+        size_t count = length - offset < sizeof(buffer) ? length - offset : sizeof(buffer);
+        for (size_t i = 0; i < count; i++) buffer[i] = ksocket_test_byte(offset + i);
+        *result = co_await socket.write_all(buffer, count);
+    }
+    if (!*result) *result = 1;
+}
+
+static kc::Task<size_t> ksocket_test_read(kc::KSocket & socket, size_t length) {
+    // the number of bytes that came back right before the first wrong one
+    uint8_t buffer[16384];
+    size_t got = 0;
+    while (got < length) {
+        ssize_t res = co_await socket.read_some(buffer, sizeof(buffer));
+        if (res <= 0) {
+            fprintf(stderr, "ksocket_test: read returned %zd after %zu bytes\n", res, got);
+            break;
+        }
+        for (ssize_t i = 0; i < res; i++) {
+            if (buffer[i] != ksocket_test_byte(got + i)) co_return got + i;
+        }
+        got += res;
+    }
+    co_return got;
+}
+
+static void ksocket_test_watchdog(int signal) {
+    static const char message[] = "ksocket_test: ksocket_read() still hadn't returned after the daemon died\n";
+    write(STDERR_FILENO, message, sizeof(message) - 1);
+    _exit(1);
+}
+
+static void * ksocket_test_killer_main(void * arg) {
+    test_sleep_ms(KSOCKET_TEST_KILL_DELAY);
+    kill(*(pid_t *)arg, SIGKILL); // nothing gets to say goodbye
+    return NULL;
+}
+
+static void ksocket_test_daemon_dies(TestServers & servers) {
+    const char * daemon = getenv(KSOCKET_TEST_DAEMON_ENV);
+    if (!daemon || !*daemon) {
+        fprintf(stderr, "daemon dies: %s not set, skipped\n", KSOCKET_TEST_DAEMON_ENV);
+        return;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/ksocket_test.%d.sock", (int)getpid());
+    unlink(path);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("ksocket_test: fork");
+        testFailures++;
+        return;
+    }
+    if (pid == 0) {
+        execl(daemon, daemon, "-s", path, (char *)NULL);
+        perror("ksocket_test: connexionsd");
+        _exit(127);
+    }
+    struct stat st;
+    for (int tries = 0; tries < 50 && (stat(path, &st) || !S_ISSOCK(st.st_mode)); tries++) {
+        test_sleep_ms(100);
+    }
+
+    // ksocket_init() looks the daemon up every time
+    const char * shared = getenv(KSOCKET_DAEMON_PATH_ENV);
+    char * saved = shared ? strdup(shared) : NULL;
+    setenv(KSOCKET_DAEMON_PATH_ENV, path, 1);
+    int fd = ksocket_init();
+    if (saved) {
+        setenv(KSOCKET_DAEMON_PATH_ENV, saved, 1);
+        free(saved);
+    } else {
+        unsetenv(KSOCKET_DAEMON_PATH_ENV);
+    }
+    TEST_CHECK(fd >= 0);
+    in_addr loopback;
+    loopback.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd >= 0 && ksocket_connect_ipv4(fd, &loopback, servers.echo.port) == 0) {
+        // the echo server has nothing to say, so the read waits until the daemon goes
+        pthread_t killer;
+        pthread_create(&killer, NULL, ksocket_test_killer_main, &pid);
+        signal(SIGALRM, ksocket_test_watchdog);
+        alarm(KSOCKET_TEST_WATCHDOG);
+        void * buffer = NULL;
+        int res = ksocket_read(fd, &buffer);
+        int error = errno;
+        alarm(0);
+        pthread_join(killer, NULL);
+        TEST_CHECK(res == -1);
+        TEST_CHECK(error == ECONNRESET);
+        fprintf(stderr, "daemon dies: read returned %d (%s)\n", res, strerror(error));
+    } else {
+        TEST_CHECK(!"connect through the private daemon");
+        kill(pid, SIGKILL);
+    }
+    if (fd >= 0) ksocket_close(fd);
+    waitpid(pid, NULL, 0);
+    unlink(path);
+}
+
+static kc::Task<void> ksocket_test_run(kc::Executor & executor, TestServers & servers) {
+    in_addr loopback;
+    loopback.s_addr = htonl(INADDR_LOOPBACK);
+
+    // a port that is bound but not listening refuses the connect
+    kc::KSocket refused = kc::KSocket::open(executor);
+    TEST_CHECK(refused);
+    int error = co_await refused.connect_ipv4(&loopback, servers.refusedPort);
+    TEST_CHECK(error == -ECONNREFUSED);
+    refused.reset();
+
+    // a writer coroutine and a reader share one socket
+    kc::KSocket echo = kc::KSocket::open(executor);
+    error = co_await echo.connect_ipv4(&loopback, servers.echo.port);
+    TEST_CHECK(error == 0);
+    if (error) co_return; // nothing past here could finish
+    int written = 0;
+    uint64_t start = bench_now_ns();
+    kc::spawn(ksocket_test_write(echo, KSOCKET_TEST_ECHO_BYTES, &written));
+    size_t echoed = co_await ksocket_test_read(echo, KSOCKET_TEST_ECHO_BYTES);
+    double seconds = (double)(bench_now_ns() - start) / 1e9;
+    TEST_CHECK(echoed == KSOCKET_TEST_ECHO_BYTES);
+    TEST_CHECK(written == 1);
+    TEST_CHECK(co_await echo.close() == 0);
+    TEST_CHECK(!echo);
+    fprintf(stderr, "echo: %zu bytes back in %.3fs (%.1f MB/s)\n", echoed, seconds,
+            echoed / (1024.0 * 1024.0) / seconds);
+
+    // writes right behind the CONNECT, before it has been answered
+    kc::KSocket pipelined = kc::KSocket::open(executor);
+    TEST_CHECK(co_await pipelined.start_connect_ipv4(&loopback, servers.echo.port) == 0);
+    written = 0;
+    co_await ksocket_test_write(pipelined, KSOCKET_TEST_PIPELINED_BYTES, &written);
+    TEST_CHECK(written == 1);
+    TEST_CHECK(co_await ksocket_test_read(pipelined, KSOCKET_TEST_PIPELINED_BYTES) == KSOCKET_TEST_PIPELINED_BYTES);
+    TEST_CHECK(co_await pipelined.close() == 0);
+
+    // a peer that says nothing; connexionsd has no timeouts, the kext does
+    kc::KSocket idle = kc::KSocket::open(executor);
+    TEST_CHECK(co_await idle.connect_ipv4(&loopback, servers.hold.port) == 0);
+    ksocket_timeouts_t timeouts = {0, KSOCKET_TEST_IDLE_TIMEOUT, 0};
+    char buffer[64];
+    if (ksocket_set_timeouts(idle.fd(), &timeouts) == 0) {
+        start = bench_now_ns();
+        TEST_CHECK(co_await idle.read_some(buffer, sizeof(buffer)) == -ETIMEDOUT);
+        uint64_t elapsed = (bench_now_ns() - start) / 1000000;
+        TEST_CHECK(elapsed >= KSOCKET_TEST_IDLE_TIMEOUT / 2); // the clock started at the connect
+        fprintf(stderr, "idle timeout: read failed with ETIMEDOUT after %llums\n", (unsigned long long)elapsed);
+    } else {
+        TEST_CHECK(errno == ENOPROTOOPT);
+        fprintf(stderr, "idle timeout: not supported here (%s), skipped\n", strerror(errno));
+    }
+    idle.reset();
+
+    // the peer hanging up reads as 0
+    kc::KSocket hungUp = kc::KSocket::open(executor);
+    TEST_CHECK(co_await hungUp.connect_ipv4(&loopback, servers.hold.port) == 0);
+    bench_server_stop(&servers.hold);
+    TEST_CHECK(co_await hungUp.read_some(buffer, sizeof(buffer)) == 0);
+    TEST_CHECK(co_await hungUp.close() == 0);
+    servers.finished = true;
+}
+
+int main(int argc, const char * argv[]) {
+    TestServers servers;
+    servers.finished = false;
+    if (bench_server_start(&servers.echo, BENCH_SERVER_ECHO) || bench_server_start(&servers.hold, BENCH_SERVER_HOLD)) {
+        perror("ksocket_test: bench_server_start");
+        return 1;
+    }
+    int refusing = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if (refusing < 0 || bind(refusing, (struct sockaddr *)&addr, sizeof(addr)) ||
+        getsockname(refusing, (struct sockaddr *)&addr, &addrLen)) {
+        perror("ksocket_test: bind");
+        return 1;
+    }
+    servers.refusedPort = ntohs(addr.sin_port);
+
+    kc::Executor executor;
+    if (!executor.valid()) {
+        perror("ksocket_test: executor");
+        return 1;
+    }
+    int probe = ksocket_init();
+    if (probe < 0) {
+        fprintf(stderr, "ksocket_test: can't open a ksocket; is connexionsd running? (%s)\n", strerror(errno));
+        return 1;
+    }
+    ksocket_close(probe);
+
+    kc::spawn(ksocket_test_run(executor, servers));
+    executor.run();
+    TEST_CHECK(servers.finished);
+    ksocket_test_daemon_dies(servers);
+
+    close(refusing);
+    bench_server_stop(&servers.echo);
+    return test_finish("ksocket_test");
+}
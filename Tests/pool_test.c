@@ -0,0 +1,124 @@
+//
+//  pool_test.c
+//  Tests
+//
+//  Created by Alex Nichol on 12/22/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "test.h"
+#include "../BenchConnexions/bench.h"
+#include "kspool.h"
+#include <poll.h>
+#include <arpa/inet.h>
+
+// kspool through connexionsd (or the kext) to loopback servers that accept
+// and hold connections; checks reuse, the per-destination maximum, idle
+// eviction and ksockets that died while idle
+
+#define POOL_MAX_IDLE 2
+#define POOL_IDLE_TIMEOUT 1 // seconds
+
+static void pool_expect(kspool_t * pool, uint64_t hits, uint64_t misses, uint64_t evictions, uint64_t discarded,
+                        uint64_t idle, uint64_t borrowed, int line);
+static void pool_report(kspool_t * pool);
+
+int main(int argc, const char * argv[]) {
+    bench_server_t serverA, serverB;
+    if (bench_server_start(&serverA, BENCH_SERVER_HOLD) || bench_server_start(&serverB, BENCH_SERVER_HOLD)) {
+        perror("pool_test: bench_server_start");
+        return 1;
+    }
+    struct in_addr loopback;
+    loopback.s_addr = htonl(INADDR_LOOPBACK);
+    kspool_t * pool = kspool_create(POOL_MAX_IDLE, POOL_IDLE_TIMEOUT);
+
+    // nothing to reuse yet
+    int fds[POOL_MAX_IDLE + 1];
+    for (int i = 0; i < POOL_MAX_IDLE + 1; i++) {
+        fds[i] = kspool_acquire(pool, AF_INET, &loopback, serverA.port);
+        TEST_CHECK(fds[i] >= 0);
+    }
+    if (fds[0] < 0) {
+        fprintf(stderr, "pool_test: can't connect; is connexionsd running? (%s)\n", strerror(errno));
+        return 1;
+    }
+    pool_expect(pool, 0, 3, 0, 0, 0, 3, __LINE__);
+
+    // one more than the maximum comes back, so one is closed
+    for (int i = 0; i < POOL_MAX_IDLE + 1; i++) {
+        kspool_release(pool, fds[i], 1);
+    }
+    pool_expect(pool, 0, 3, 0, 1, 2, 0, __LINE__);
+
+    // both idle ksockets get reused, the most recently released first
+    int first = kspool_acquire(pool, AF_INET, &loopback, serverA.port);
+    int second = kspool_acquire(pool, AF_INET, &loopback, serverA.port);
+    TEST_CHECK(first == fds[1] && second == fds[0]);
+    pool_expect(pool, 2, 3, 0, 1, 0, 2, __LINE__);
+    kspool_release(pool, first, 1);
+    kspool_release(pool, second, 1);
+
+    // the maximum is per destination
+    int other = kspool_acquire(pool, AF_INET, &loopback, serverB.port);
+    TEST_CHECK(other >= 0);
+    kspool_release(pool, other, 1);
+    pool_expect(pool, 2, 4, 0, 1, 3, 0, __LINE__);
+    TEST_CHECK(kspool_hit_rate(pool) == 2.0 / 6.0);
+
+    // a ksocket given back as not reusable is closed, not counted as discarded
+    int broken = kspool_acquire(pool, AF_INET, &loopback, serverB.port);
+    kspool_release(pool, broken, 0);
+    pool_expect(pool, 3, 4, 0, 1, 2, 0, __LINE__);
+
+    // nothing goes before the timeout, everything after it
+    kspool_evict_idle(pool);
+    pool_expect(pool, 3, 4, 0, 1, 2, 0, __LINE__);
+    test_sleep_ms(POOL_IDLE_TIMEOUT * 1000 + 100);
+    kspool_evict_idle(pool);
+    pool_expect(pool, 3, 4, 2, 1, 0, 0, __LINE__);
+
+    // an idle ksocket whose peer went away is found dead and thrown out; the
+    // fresh connect then fails, since nothing listens any more
+    int doomed = kspool_acquire(pool, AF_INET, &loopback, serverA.port);
+    kspool_release(pool, doomed, 1);
+    bench_server_stop(&serverA);
+    struct pollfd pfd;
+    pfd.fd = doomed;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    TEST_CHECK(poll(&pfd, 1, 2000) == 1);
+    TEST_CHECK(kspool_acquire(pool, AF_INET, &loopback, serverA.port) < 0);
+    pool_expect(pool, 3, 6, 2, 2, 0, 0, __LINE__);
+
+    pool_report(pool);
+    kspool_destroy(pool);
+    bench_server_stop(&serverB);
+    return test_finish("pool_test");
+}
+
+#pragma mark - Private -
+
+static void pool_expect(kspool_t * pool, uint64_t hits, uint64_t misses, uint64_t evictions, uint64_t discarded,
+                        uint64_t idle, uint64_t borrowed, int line) {
+    kspool_stats_t stats;
+    kspool_get_stats(pool, &stats);
+    if (stats.hits == hits && stats.misses == misses && stats.evictions == evictions &&
+        stats.discarded == discarded && stats.idle == idle && stats.borrowed == borrowed) {
+        return;
+    }
+    fprintf(stderr, "%s:%d: expected hits=%llu misses=%llu evictions=%llu discarded=%llu idle=%llu borrowed=%llu\n",
+            __FILE__, line, (unsigned long long)hits, (unsigned long long)misses, (unsigned long long)evictions,
+            (unsigned long long)discarded, (unsigned long long)idle, (unsigned long long)borrowed);
+    pool_report(pool);
+    testFailures++;
+}
+
+static void pool_report(kspool_t * pool) {
+    kspool_stats_t stats;
+    kspool_get_stats(pool, &stats);
+    fprintf(stderr, "pool hits=%llu misses=%llu (%.0f%% hit rate) evictions=%llu discarded=%llu idle=%llu borrowed=%llu\n",
+            (unsigned long long)stats.hits, (unsigned long long)stats.misses, kspool_hit_rate(pool) * 100,
+            (unsigned long long)stats.evictions, (unsigned long long)stats.discarded,
+            (unsigned long long)stats.idle, (unsigned long long)stats.borrowed);
+}
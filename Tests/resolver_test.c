@@ -0,0 +1,218 @@
+//
+//  resolver_test.c
+//  Tests
+//
+//  Created by Alex Nichol on 12/22/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#include "test.h"
+#include "ksresolver.h"
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+// ksresolver against a stub lookup that reads a private hosts file, so it
+// never touches DNS; the stub counts how often the resolver really looks up
+
+#define RESOLVER_POSITIVE_TTL 2 // seconds
+#define RESOLVER_NEGATIVE_TTL 1
+#define RESOLVER_CALLERS 16
+
+typedef struct {
+    char path[64];
+    volatile int calls;
+    int delay; // milliseconds each lookup takes
+} resolver_stub_t;
+
+typedef struct {
+    ksresolver_t * resolver;
+    pthread_barrier_t * barrier;
+    int error;
+    ksresolver_result_t result;
+} resolver_caller_t;
+
+static int resolver_stub_lookup(const char * host, ksresolver_result_t * result, void * context);
+static int resolver_stub_create(resolver_stub_t * stub);
+static ksresolver_t * resolver_create(resolver_stub_t * stub, int delay);
+static void * resolver_caller_main(void * arg);
+static int resolver_has(const ksresolver_result_t * result, int family, const char * literal);
+static void resolver_test_merging(resolver_stub_t * stub);
+static void resolver_test_expiry(resolver_stub_t * stub);
+static void resolver_test_concurrent(resolver_stub_t * stub);
+static void resolver_report(const char * name, ksresolver_t * resolver);
+
+int main(int argc, const char * argv[]) {
+    resolver_stub_t stub;
+    if (resolver_stub_create(&stub)) {
+        perror("resolver_test: hosts file");
+        return 1;
+    }
+    resolver_test_merging(&stub);
+    resolver_test_expiry(&stub);
+    resolver_test_concurrent(&stub);
+    unlink(stub.path);
+    return test_finish("resolver_test");
+}
+
+#pragma mark - Tests -
+
+static void resolver_test_merging(resolver_stub_t * stub) {
+    ksresolver_t * resolver = resolver_create(stub, 0);
+    ksresolver_result_t result;
+    // one name on an IPv4 line and an IPv6 line comes back as both
+    TEST_CHECK(ksresolver_resolve(resolver, "dual.test", &result) == 0);
+    TEST_CHECK(result.count == 2);
+    TEST_CHECK(resolver_has(&result, AF_INET, "10.0.0.2"));
+    TEST_CHECK(resolver_has(&result, AF_INET6, "fd00::2"));
+    TEST_CHECK(ksresolver_resolve(resolver, "v4.test", &result) == 0);
+    TEST_CHECK(result.count == 1 && resolver_has(&result, AF_INET, "10.0.0.1"));
+    // names are case insensitive, in the cache as well as the file
+    int calls = stub->calls;
+    TEST_CHECK(ksresolver_resolve(resolver, "DUAL.Test", &result) == 0);
+    TEST_CHECK(result.count == 2);
+    TEST_CHECK(stub->calls == calls);
+    // literals never reach the file
+    TEST_CHECK(ksresolver_resolve(resolver, "192.0.2.7", &result) == 0);
+    TEST_CHECK(result.count == 1 && resolver_has(&result, AF_INET, "192.0.2.7"));
+    resolver_report("merging", resolver);
+    ksresolver_destroy(resolver);
+}
+
+static void resolver_test_expiry(resolver_stub_t * stub) {
+    ksresolver_t * resolver = resolver_create(stub, 0);
+    ksresolver_result_t result;
+    TEST_CHECK(ksresolver_resolve(resolver, "v4.test", &result) == 0);
+    TEST_CHECK(ksresolver_resolve(resolver, "missing.test", &result) == EAI_NONAME);
+    TEST_CHECK(stub->calls == 2);
+
+    // both are cached, the failure included
+    TEST_CHECK(ksresolver_resolve(resolver, "v4.test", &result) == 0);
+    TEST_CHECK(ksresolver_resolve(resolver, "missing.test", &result) == EAI_NONAME);
+    TEST_CHECK(stub->calls == 2);
+    ksresolver_stats_t stats;
+    ksresolver_get_stats(resolver, &stats);
+    TEST_CHECK(stats.hits == 2 && stats.negativeHits == 1);
+
+    // the negative TTL runs out first
+    test_sleep_ms(RESOLVER_NEGATIVE_TTL * 1000 + 100);
+    TEST_CHECK(ksresolver_resolve(resolver, "missing.test", &result) == EAI_NONAME);
+    TEST_CHECK(stub->calls == 3);
+    TEST_CHECK(ksresolver_resolve(resolver, "v4.test", &result) == 0);
+    TEST_CHECK(stub->calls == 3);
+
+    test_sleep_ms((RESOLVER_POSITIVE_TTL - RESOLVER_NEGATIVE_TTL) * 1000);
+    TEST_CHECK(ksresolver_resolve(resolver, "v4.test", &result) == 0);
+    TEST_CHECK(result.count == 1);
+    TEST_CHECK(stub->calls == 4);
+
+    ksresolver_flush(resolver);
+    TEST_CHECK(ksresolver_resolve(resolver, "v4.test", &result) == 0);
+    TEST_CHECK(stub->calls == 5);
+    resolver_report("expiry", resolver);
+    ksresolver_destroy(resolver);
+}
+
+static void resolver_test_concurrent(resolver_stub_t * stub) {
+    // the lookup is slow enough that every caller arrives while it runs
+    ksresolver_t * resolver = resolver_create(stub, 200);
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, RESOLVER_CALLERS);
+    resolver_caller_t callers[RESOLVER_CALLERS];
+    pthread_t threads[RESOLVER_CALLERS];
+    for (int i = 0; i < RESOLVER_CALLERS; i++) {
+        callers[i].resolver = resolver;
+        callers[i].barrier = &barrier;
+        pthread_create(&threads[i], NULL, resolver_caller_main, &callers[i]);
+    }
+    for (int i = 0; i < RESOLVER_CALLERS; i++) {
+        pthread_join(threads[i], NULL);
+        TEST_CHECK(callers[i].error == 0);
+        TEST_CHECK(callers[i].result.count == 2);
+    }
+    pthread_barrier_destroy(&barrier);
+
+    TEST_CHECK(stub->calls == 1);
+    ksresolver_stats_t stats;
+    ksresolver_get_stats(resolver, &stats);
+    TEST_CHECK(stats.lookups == 1);
+    TEST_CHECK(stats.requests == RESOLVER_CALLERS);
+    TEST_CHECK(stats.joined + stats.hits == RESOLVER_CALLERS - 1);
+    TEST_CHECK(stats.latencyMax >= 200000);
+    resolver_report("concurrent", resolver);
+    ksresolver_destroy(resolver);
+}
+
+#pragma mark - Private -
+
+static int resolver_stub_lookup(const char * host, ksresolver_result_t * result, void * context) {
+    resolver_stub_t * stub = (resolver_stub_t *)context;
+    __sync_fetch_and_add(&stub->calls, 1);
+    if (stub->delay) test_sleep_ms(stub->delay);
+    return ksresolver_hosts_lookup(host, result, stub->path);
+}
+
+static int resolver_stub_create(resolver_stub_t * stub) {
+    bzero(stub, sizeof(resolver_stub_t));
+    strcpy(stub->path, "/tmp/resolver_test.XXXXXX");
+    int fd = mkstemp(stub->path);
+    if (fd < 0) return -1;
+    FILE * fp = fdopen(fd, "w");
+    if (!fp) {
+        close(fd);
+        unlink(stub->path);
+        return -1;
+    }
+    fprintf(fp, "# a test hosts file\n"
+            "10.0.0.1 v4.test\n"
+            "10.0.0.2 dual.test dual-alias.test\n"
+            "fd00::2 dual.test # the AAAA half\n"
+            "10.0.0.3 other.test\n");
+    fclose(fp);
+    return 0;
+}
+
+static ksresolver_t * resolver_create(resolver_stub_t * stub, int delay) {
+    ksresolver_t * resolver = ksresolver_create(4, RESOLVER_POSITIVE_TTL, RESOLVER_NEGATIVE_TTL);
+    if (!resolver) {
+        fprintf(stderr, "resolver_test: ksresolver_create failed\n");
+        exit(1);
+    }
+    stub->calls = 0;
+    stub->delay = delay;
+    ksresolver_set_lookup(resolver, resolver_stub_lookup, stub);
+    return resolver;
+}
+
+static void * resolver_caller_main(void * arg) {
+    resolver_caller_t * caller = (resolver_caller_t *)arg;
+    pthread_barrier_wait(caller->barrier);
+    caller->error = ksresolver_resolve(caller->resolver, "dual.test", &caller->result);
+    return NULL;
+}
+
+static int resolver_has(const ksresolver_result_t * result, int family, const char * literal) {
+    uint8_t addr[16];
+    if (inet_pton(family, literal, addr) != 1) return 0;
+    for (int i = 0; i < result->count; i++) {
+        if (result->addrs[i].family != family) continue;
+        if (!memcmp(result->addrs[i].addr, addr, family == AF_INET ? 4 : 16)) return 1;
+    }
+    return 0;
+}
+
+static void resolver_report(const char * name, ksresolver_t * resolver) {
+    ksresolver_stats_t stats;
+    ksresolver_get_stats(resolver, &stats);
+    fprintf(stderr, "%-10s requests=%llu hits=%llu (%.0f%%) negative_hits=%llu joined=%llu lookups=%llu failures=%llu "
+            "latency mean=%lluus max=%lluus",
+            name, (unsigned long long)stats.requests, (unsigned long long)stats.hits,
+            ksresolver_hit_rate(resolver) * 100, (unsigned long long)stats.negativeHits,
+            (unsigned long long)stats.joined, (unsigned long long)stats.lookups, (unsigned long long)stats.failures,
+            (unsigned long long)(stats.lookups ? stats.latencyTotal / stats.lookups : 0),
+            (unsigned long long)stats.latencyMax);
+    for (int i = 0; i < KSRESOLVER_LATENCY_BUCKETS; i++) {
+        if (stats.latency[i]) fprintf(stderr, " <%lluus:%llu", 64ull << i, (unsigned long long)stats.latency[i]);
+    }
+    fprintf(stderr, "\n");
+}
@@ -0,0 +1,51 @@
+//
+//  test.h
+//  Tests
+//
+//  Created by Alex Nichol on 12/22/12.
+//  Copyright (c) 2012 Alex Nichol. All rights reserved.
+//
+
+#ifndef Tests_test_h
+#define Tests_test_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+// each test is its own program; a failed check is reported and the rest
+// still run, and the exit status says whether any failed
+
+static int testFailures = 0;
+
+#define TEST_CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        testFailures++; \
+    } \
+} while (0)
+
+static inline uint64_t test_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void test_sleep_ms(int milliseconds) {
+    struct timespec ts;
+    ts.tv_sec = milliseconds / 1000;
+    ts.tv_nsec = (long)(milliseconds % 1000) * 1000000;
+    while (nanosleep(&ts, &ts) && errno == EINTR) {
+    }
+}
+
+static inline int test_finish(const char * name) {
+    fprintf(stderr, "%s: %s\n", name, testFailures ? "FAILED" : "ok");
+    return testFailures ? 1 : 0;
+}
+
+#endif